@@ -1,3 +1,4 @@
+import os
 import numpy as np
 cimport numpy as np
 cimport cython
@@ -8,6 +9,8 @@ from libcpp.string cimport string
 from cython.operator cimport dereference as deref
 from cpython.ref cimport PyObject
 
+np.import_array()
+
 
 ##### Wrapper API declarations #####
 # These must go first before Pachi imports, because they use extern "C" on Pachi headers
@@ -49,11 +52,13 @@ cdef extern from "goutil.hpp":
     void GetLegalMoves(PachiBoardPtr b, stone color, bint filter_suicides, vector[coord_t]* out)
     bint IsTerminal(PachiBoardPtr)
     float FastScore(PachiBoardPtr)
-    float OfficialScore(PachiBoardPtr)
+    float OfficialScore(PachiBoardPtr, int playouts, int threads) nogil
+    void ScoreBoards(const vector[PachiBoardPtr]& boards, bint official, int playouts, int threads, float* scores, float* ownership) nogil
     string ToString(PachiBoardPtr)
     void PlayInPlace(PachiBoardPtr b, const move& m) except +raise_py_error
     PachiBoardPtr Play(PachiBoardPtr, const move&) except +raise_py_error
     PachiBoardPtr PlayRandom(PachiBoardPtr b, stone color, coord_t *coord)
+    void RateMoves(PachiBoardPtr b, stone color, vector[coord_t]* coords, vector[float]* probs) except +raise_py_error
 
 
     # Coordinate representation conversion
@@ -66,11 +71,35 @@ cdef extern from "goutil.hpp":
     int i_from_coord(board* b, coord_t c)
     int j_from_coord(board* b, coord_t c)
 
+    cppclass OwnershipEstimator:
+        OwnershipEstimator(PachiBoardPtr b)
+        void add_playouts(int playouts, int threads) nogil
+        int playouts()
+        void ownership(float* out) except +raise_py_error
+        int* counts()
+
+    cppclass LatencyHistogram:
+        int size() const
+        const long* counts() const
+        @staticmethod
+        double edge(int i)
+        double percentile(double p) const
+
     cppclass PachiEngine:
         PachiEngine(PachiBoardPtr b, const string& engine_type, string arg) except +raise_py_error
         PachiBoardPtr get_curr_board()
-        coord_t genmove(stone curr_color, const string& timestr) except +raise_py_error
+        coord_t genmove(stone curr_color, const string& timestr, double deadline) except +raise_py_error
         void notify(coord_t move_coord, stone move_color)
+        void ownership(float* out) except +raise_py_error
+        const LatencyHistogram& latency()
+        void clear_latency()
+        double last_overshoot()
+        long deadline_misses()
+
+    cppclass LocalSlaves:
+        LocalSlaves(const string& binary, const string& port, int n, const string& arg) except +raise_py_error
+        int size()
+        void stop()
 
 
 ##### Pachi API declarations #####
@@ -156,6 +185,11 @@ cdef void encode_board(board* b, np.ndarray[np.int_t, ndim=3] out_x):
 cdef PyPachiBoard wrap_board(PachiBoardPtr b):
     return PyPachiBoard()._set(b)
 
+# Checks the out argument of the ownership() methods.
+cdef check_ownership_out(np.ndarray out, int size):
+    if out.shape[0] != size or out.shape[1] != size or not out.flags.c_contiguous:
+        raise ValueError('out must be a C-contiguous [%d, %d] float32 array' % (size, size))
+
 cdef class PyPachiBoard:
     cdef PachiBoardPtr _bptr
     cdef PachiBoard* _b # for convenience. set to self._bptr.get()
@@ -174,7 +208,7 @@ cdef class PyPachiBoard:
         return wrap_board(self._bptr.get().clone())
 
     def get_stones(self, stone color):
-        cdef np.ndarray[np.int_t, ndim=2] stones = np.empty((self._size*self._size, 2), dtype=np.int)
+        cdef np.ndarray[np.int_t, ndim=2] stones = np.empty((self._size*self._size, 2), dtype=np.int_)
         cdef int i, j
         cdef unsigned int num_stones = 0
         for i in range(self._size):
@@ -190,6 +224,25 @@ cdef class PyPachiBoard:
         GetLegalMoves(self._bptr, color, filter_suicides, &legal_coords)
         return legal_coords
 
+    def rate_moves(self, stone color):
+        """Rates valid moves of color by the pattern probability table
+        (patterns.spat and patterns.prob in the current directory).
+        Returns arrays of coords and their normalized probabilities,
+        most probable first; moves with unknown patterns are left out."""
+        cdef vector[coord_t] coords
+        cdef vector[float] probs
+        RateMoves(self._bptr, color, &coords, &probs)
+        return np.array(coords, dtype=np.int32), np.array(probs, dtype=np.float32)
+
+    def ownership(self, int playouts=500, int threads=1):
+        """Estimated owner of each point, 1 for black to -1 for white,
+        as a float32 [size, size] array, from the final positions of
+        the given number of random playouts from this position. See
+        PyOwnershipEstimator to refine an estimate incrementally."""
+        est = PyOwnershipEstimator(self)
+        est.add_playouts(playouts, threads)
+        return est.ownership()
+
     def encode(self, np.ndarray[np.int_t, ndim=3] out_x=None):
         if out_x is None:
             out_x = np.zeros((NUM_FEATURE_CHANNELS, self._size, self._size), dtype=int)
@@ -244,7 +297,17 @@ cdef class PyPachiBoard:
             return FastScore(self._bptr)
     property official_score:
         def __get__(self):
-            return OfficialScore(self._bptr)
+            return OfficialScore(self._bptr, 0, 1)
+
+    def official_score_mc(self, int playouts=500, int threads=1):
+        """Like official_score, but the dead groups are judged from the
+        final positions of the given number of random playouts from
+        this position, played in parallel by the given number of
+        threads, instead of from this position alone."""
+        cdef float score
+        with nogil:
+            score = OfficialScore(self._bptr, playouts, threads)
+        return score
 
     def __richcmp__(PyPachiBoard self, PyPachiBoard other, int op):
         # TODO: use the C++ operator==
@@ -317,12 +380,140 @@ cdef class PyPachiEngine:
     def curr_board(self):
         return wrap_board(self._engine.get_curr_board())
 
-    def genmove(self, stone curr_color, const string& timestr):
-        return self._engine.genmove(curr_color, timestr)
+    def genmove(self, stone curr_color, const string& timestr=b'', double deadline=0):
+        """Generates a move with the given time settings (b'' for the
+        engine default). With a deadline, an absolute time as by
+        time.time(), the move is returned by then (see last_overshoot);
+        without time settings, the engine thinks until it."""
+        return self._engine.genmove(curr_color, timestr, deadline)
+
+    property last_overshoot:
+        """Seconds by which the last genmove with a deadline returned
+        after it, negative if before."""
+        def __get__(self):
+            return self._engine.last_overshoot()
+
+    property deadline_misses:
+        """Number of genmoves that returned after their deadline."""
+        def __get__(self):
+            return self._engine.deadline_misses()
+
+    def latency_histogram(self):
+        """Histogram of genmove latencies like np.histogram(): counts of
+        latencies (in seconds) in [edges[i], edges[i+1]), with edges on a
+        log scale from 100us up and edges[-1] inf."""
+        cdef const long* c = self._engine.latency().counts()
+        cdef int i, n = self._engine.latency().size()
+        counts = np.empty(n, dtype=np.int64)
+        edges = np.empty(n + 1, dtype=np.float64)
+        for i in range(n):
+            counts[i] = c[i]
+            edges[i] = LatencyHistogram.edge(i)
+        edges[n] = LatencyHistogram.edge(n)
+        return counts, edges
+
+    def latency_percentile(self, double q):
+        """Upper bound of the q-th percentile (0..100) of the genmove
+        latencies, at the resolution of latency_histogram()."""
+        return self._engine.latency().percentile(q / 100)
+
+    def clear_latency(self):
+        self._engine.clear_latency()
 
     def notify(self, coord_t move_coord, stone move_color):
         self._engine.notify(move_coord, move_color)
 
+    def ownership(self, np.ndarray[np.float32_t, ndim=2] out=None):
+        """Estimated owner of each point, 1 for black to -1 for white,
+        as a float32 [size, size] array (written to out if given), from
+        the playouts of the last genmove search. uct engine only."""
+        cdef int size = self._engine.get_curr_board().get().size()
+        if out is None:
+            out = np.empty((size, size), dtype=np.float32)
+        check_ownership_out(out, size)
+        self._engine.ownership(<float*> out.data)
+        return out
+
+
+cdef class PyOwnershipEstimator:
+    """Ownership estimate of a board position, refined by each call of
+    add_playouts(), e.g.
+
+        est = PyOwnershipEstimator(board)
+        est.add_playouts(200, threads=4)
+        est.add_playouts(200, threads=4)
+        owners = est.ownership() # from 400 playouts
+
+    The playouts are played with the GIL released."""
+    cdef OwnershipEstimator* _est
+    cdef PyPachiBoard _board
+
+    def __cinit__(self, PyPachiBoard b):
+        self._est = new OwnershipEstimator(b._bptr)
+        self._board = b
+
+    def __dealloc__(self):
+        del self._est
+
+    def add_playouts(self, int playouts, int threads=1):
+        with nogil:
+            self._est.add_playouts(playouts, threads)
+
+    property playouts:
+        def __get__(self):
+            return self._est.playouts()
+
+    def ownership(self, np.ndarray[np.float32_t, ndim=2] out=None):
+        """Estimated owner of each point, 1 for black to -1 for white,
+        as a float32 [size, size] array (written to out if given)."""
+        cdef int size = self._board.size
+        if out is None:
+            out = np.empty((size, size), dtype=np.float32)
+        check_ownership_out(out, size)
+        self._est.ownership(<float*> out.data)
+        return out
+
+    property counts:
+        """Zero-copy read-only int32 view [size+2, size+2, S_MAX] of the
+        number of playouts ending with each owner (by stone color, S_NONE
+        for dame) of each point, by Pachi y/x coordinates including the
+        board edge (y counts from the bottom). It is updated by
+        add_playouts() and keeps the estimator alive."""
+        def __get__(self):
+            cdef np.npy_intp shape[3]
+            shape[0] = shape[1] = self._board.size + 2
+            shape[2] = S_MAX
+            cdef np.ndarray view = np.PyArray_SimpleNewFromData(3, shape, np.NPY_INT, self._est.counts())
+            np.set_array_base(view, self)
+            view.setflags(write=False)
+            return view
+
+
+cdef class PyLocalSlaves:
+    """Local uct slave processes for a 'distributed' PyPachiEngine, e.g.
+
+        slaves = PyLocalSlaves('12345', 4, 'threads=2')
+        engine = PyPachiEngine(board, 'distributed', 'slave_port=12345')
+
+    The slaves are pachi-slave processes (installed next to this module
+    unless binary says otherwise); they connect to the master on
+    127.0.0.1:port and are killed by stop() or when this object goes away."""
+    cdef LocalSlaves* _slaves
+
+    def __cinit__(self, const string& port, int n, const string& arg=b'', binary=None):
+        if binary is None:
+            binary = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'pachi-slave')
+        self._slaves = new LocalSlaves(os.fsencode(binary), port, n, arg)
+
+    def __dealloc__(self):
+        del self._slaves
+
+    def __len__(self):
+        return self._slaves.size()
+
+    def stop(self):
+        self._slaves.stop()
+
 
 ##### Exposed constants #####
 NUM_FEATURE_CHANNELS = _NUM_FEATURE_CHANNELS
@@ -337,6 +528,33 @@ RESIGN_COORD = resign_coord
 cpdef PyPachiBoard CreateBoard(int size):
     return wrap_board(CreatePachiBoard(size))
 
+def score_boards(boards, bint official=True, int playouts=0, int threads=1, bint ownership=False):
+    """Scores a list of boards like official_score_mc (or fast_score if
+    official is False), spreading them over the given number of threads
+    with the GIL released. Returns a float32 array of the scores and,
+    with ownership, a float32 array [len(boards), size, size] of the
+    estimated owner of each point, 1 for black to -1 for white (the
+    boards must then have the same size)."""
+    cdef vector[PachiBoardPtr] bptrs
+    cdef PyPachiBoard b
+    for b in boards:
+        bptrs.push_back(b._bptr)
+    cdef int n = bptrs.size()
+    cdef np.ndarray[np.float32_t, ndim=1] scores = np.zeros(n, dtype=np.float32)
+    cdef np.ndarray[np.float32_t, ndim=3] owners = None
+    cdef float* owners_data = NULL
+    if ownership:
+        size = boards[0].size if n else 0
+        if any(b.size != size for b in boards):
+            raise ValueError('Ownership needs boards of the same size')
+        owners = np.zeros((n, size, size), dtype=np.float32)
+        owners_data = <float*> owners.data
+    with nogil:
+        ScoreBoards(bptrs, official, playouts, threads, <float*> scores.data, owners_data)
+    if ownership:
+        return scores, owners
+    return scores
+
 def pachi_srand(unsigned long seed):
     fast_srandom(seed)
 
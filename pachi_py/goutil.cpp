@@ -3,8 +3,23 @@
 
 #include <sstream>
 #include <stdexcept>
+#include <system_error>
 #include <iostream>
 #include <algorithm>
+#include <cmath>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#endif
 
 extern "C" {
 #include "stone.h"
@@ -16,8 +31,14 @@ extern "C" {
 #include "timeinfo.h"
 #include "fbook.h"
 #include "playout.h"
+#include "playout/moggy.h"
 #include "ownermap.h"
 #include "mq.h"
+#include "pattern.h"
+#include "patternprob.h"
+#include "distributed/distributed.h"
+#include "uct/ensemble.h"
+#include "modeldata.h"
 }
 
 void GetLegalMoves(PachiBoardPtr b, stone color, bool filter_suicides, std::vector<coord_t>* out) {
@@ -47,42 +68,164 @@ bool IsTerminal(PachiBoardPtr b) {
     return false;
 }
 
-// RAII for board_ownermap
+// RAII for board_ownermap, with room for boards of up to bsize2 points.
 struct OwnerMap {
     board_ownermap ownermap;
-    OwnerMap(board *b) {
-        ownermap.map = (sig_atomic_t (*)[S_MAX]) malloc(board_size2(b) * sizeof(ownermap.map[0]));
-        memset(ownermap.map, 0, board_size2(b) * sizeof(ownermap.map[0]));
-        board_ownermap_fill(&ownermap, b);
+    explicit OwnerMap(int bsize2) {
+        ownermap.map = (sig_atomic_t (*)[S_MAX]) malloc(bsize2 * sizeof(ownermap.map[0]));
+        clear(bsize2);
     }
     ~OwnerMap() { free(ownermap.map); }
+    void clear(int bsize2) {
+        ownermap.playouts = 0;
+        memset(ownermap.map, 0, bsize2 * sizeof(ownermap.map[0]));
+    }
 };
-typedef ptr<OwnerMap> OwnerMapPtr;
 
-/* How big proportion of ownermap counts must be of one color to consider
- * the point sure. */
-static move_queue GetDeadGroups(board *b, OwnerMapPtr ownermap) {
-    /* Make sure enough playouts are simulated to get a reasonable dead group list. */
-    // while (u->ownermap.playouts < GJ_MINGAMES)
-    //     uct_playout(u, b, color, u->t);
-    if (!ownermap) {
-        ownermap.reset(new OwnerMap(b));
+// Scratch buffers for scoring, reused for all boards of up to the size
+// they were allocated for.
+struct ScoreScratch {
+    OwnerMap ownermap;
+    std::vector<gj_state> gs;
+    explicit ScoreScratch(int bsize2) : ownermap(bsize2), gs(bsize2) {}
+};
+
+// Playout policy for scoring playouts, one per board size class (moggy
+// tunes itself for large boards); shared by all threads.
+static playout_policy* ScoringPolicy(board *b) {
+    static std::mutex lock;
+    static playout_policy* policies[2];
+    std::lock_guard<std::mutex> guard(lock);
+    int large = board_large(b);
+    if (!policies[large]) {
+        policies[large] = playout_moggy_init(NULL, b, NULL);
+    }
+    return policies[large];
+}
+
+// Fills the ownermap of b: with playouts random games played from b in
+// the given number of threads, or with the position itself if playouts
+// is 0.
+static void FillOwnerMap(board *b, OwnerMap *ownermap, int playouts, int threads) {
+    ownermap->clear(board_size2(b));
+    if (playouts <= 0) {
+        board_ownermap_fill(&ownermap->ownermap, b);
+        return;
     }
+    playout_setup ps = { .gamelen = MAX_GAMELEN };
+    stone color = b->last_move.color == S_NONE ? S_BLACK : stone_other(b->last_move.color);
+    playout_ownermap(&ps, b, color, &ownermap->ownermap, ScoringPolicy(b), playouts, threads);
+}
 
+/* How big proportion of ownermap counts must be of one color to consider
+ * the point sure. */
+static move_queue GetDeadGroups(board *b, ScoreScratch *s) {
     move_queue mq = { .moves = 0 };
-    gj_state gs_array[board_size2(b)];
-    struct group_judgement gj = { .thres = GJ_THRES, .gs = gs_array };
-    board_ownermap_judge_groups(b, &ownermap->ownermap, &gj);
+    struct group_judgement gj = { .thres = GJ_THRES, .gs = s->gs.data() };
+    board_ownermap_judge_groups(b, &s->ownermap.ownermap, &gj);
     groups_of_status(b, &gj, GS_DEAD, &mq);
-
     return mq;
 }
 
-float OfficialScore(PachiBoardPtr b) {
-    move_queue mq = GetDeadGroups(b->pachiboard(), OwnerMapPtr());
-    return board_official_score(b->pachiboard(), &mq);
+// Stores the estimated owner of each point of b from ownermap, 1 for
+// black to -1 for white, to out[size*size] in i/j order.
+static void GetOwnership(board *b, board_ownermap *ownermap, float *out) {
+    int size = board_size(b) - 2;
+    foreach_point(b) {
+        if (board_at(b, c) == S_OFFBOARD) continue;
+        out[i_from_coord(b, c) * size + j_from_coord(b, c)] = board_ownermap_estimate_point(ownermap, c);
+    } foreach_point_end;
+}
+
+// Scores b by the official (see OfficialScore) or fast score. With
+// ownership, also stores the ownership estimate (see GetOwnership) from
+// the ownermap.
+static float ScoreBoard(board *b, bool official, int playouts, int threads, ScoreScratch *s, float *ownership) {
+    if (official || ownership) {
+        FillOwnerMap(b, &s->ownermap, playouts, threads);
+    }
+    if (ownership) {
+        GetOwnership(b, &s->ownermap.ownermap, ownership);
+    }
+    if (!official) {
+        return board_fast_score(b);
+    }
+    move_queue mq = GetDeadGroups(b, s);
+    return board_official_score(b, &mq);
+}
+
+float OfficialScore(PachiBoardPtr b, int playouts, int threads) {
+    ScoreScratch s(board_size2(b->pachiboard()));
+    return ScoreBoard(b->pachiboard(), true, playouts, threads, &s, NULL);
+}
+
+void ScoreBoards(const std::vector<PachiBoardPtr>& boards, bool official, int playouts, int threads, float* scores, float* ownership) {
+    int n = boards.size();
+    if (!n) return;
+    int bsize2 = 0;
+    for (const PachiBoardPtr& b : boards) {
+        bsize2 = std::max(bsize2, board_size2(b->pachiboard()));
+    }
+    int stride = (board_size(boards[0]->pachiboard()) - 2) * (board_size(boards[0]->pachiboard()) - 2);
+    // Seeding each board by its index keeps the results independent of
+    // the thread that happens to score it.
+    std::vector<unsigned long> seeds(n);
+    for (unsigned long& seed : seeds) {
+        seed = fast_irandom(1 << 30) + 1;
+    }
+
+    std::atomic<int> next(0);
+    auto work = [&]() {
+        ScoreScratch s(bsize2);
+        for (int i; (i = next++) < n; ) {
+            fast_srandom(seeds[i]);
+            scores[i] = ScoreBoard(boards[i]->pachiboard(), official, playouts, 1, &s,
+                                   ownership ? ownership + i * stride : NULL);
+        }
+    };
+    // The thread count comes from Python: more threads than cores buys
+    // nothing, and if the system runs out of threads the ones we have
+    // (at least the calling one) score the rest.
+    int cores = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> pool;
+    for (int t = 1; t < std::min({threads, n, cores}); t++) {
+        try {
+            pool.emplace_back(work);
+        } catch (const std::system_error&) {
+            break;
+        }
+    }
+    work();
+    for (std::thread& t : pool) {
+        t.join();
+    }
+}
+
+
+OwnershipEstimator::OwnershipEstimator(PachiBoardPtr b)
+    : m_board(b), m_ownermap(new OwnerMap(board_size2(b->pachiboard()))) {}
+
+OwnershipEstimator::~OwnershipEstimator() { delete m_ownermap; }
+
+void OwnershipEstimator::add_playouts(int playouts, int threads) {
+    board* b = m_board->pachiboard();
+    playout_setup ps = { .gamelen = MAX_GAMELEN };
+    stone color = b->last_move.color == S_NONE ? S_BLACK : stone_other(b->last_move.color);
+    playout_ownermap(&ps, b, color, &m_ownermap->ownermap, ScoringPolicy(b), playouts, threads);
+}
+
+int OwnershipEstimator::playouts() { return m_ownermap->ownermap.playouts; }
+
+void OwnershipEstimator::ownership(float* out) {
+    if (!playouts()) {
+        throw PachiEngineError("no playouts to estimate ownership from");
+    }
+    GetOwnership(m_board->pachiboard(), &m_ownermap->ownermap, out);
 }
 
+static_assert(sizeof(sig_atomic_t) == sizeof(int), "ownermap counts are exported as int");
+int* OwnershipEstimator::counts() { return (int*) m_ownermap->ownermap.map; }
+
 
 static std::string trim(const std::string &s) {
     auto notspace = [](char c){ return !std::isspace(c); };
@@ -130,8 +273,84 @@ PachiBoardPtr PlayRandom(PachiBoardPtr b, stone color, coord_t *coord) {
     return new_state;
 }
 
+// Pattern setup shared by all RateMoves() calls, in all threads; the
+// dictionaries are loaded on first use (and cached by Pachi). They are
+// looked up in the current directory, until a call finds them there;
+// from then on that setup is used regardless of the directory.
+static pattern_setup* GetPatterns() {
+    static std::mutex lock;
+    static pattern_setup pat;
+    std::lock_guard<std::mutex> guard(lock);
+    if (!pat.pd) {
+        patterns_init(&pat, NULL, false, true);
+    }
+    if (!pat.pd) {
+        throw PachiEngineError("Pattern probability table not available (patterns.spat and patterns.prob are needed)");
+    }
+    return &pat;
+}
+
+void RateMoves(PachiBoardPtr b, stone color, std::vector<coord_t>* coords, std::vector<float>* probs) {
+    coords->clear(); probs->clear();
+    board* pb = b->pachiboard();
+    std::vector<pattern> pats(pb->flen);
+    std::vector<floating_t> p(pb->flen);
+    floating_t total = pattern_rate_moves(GetPatterns(), pb, color, pats.data(), p.data());
+
+    std::vector<int> order;
+    for (int f = 0; f < pb->flen; f++) {
+        if (!std::isnan(p[f])) { order.push_back(f); }
+    }
+    std::stable_sort(order.begin(), order.end(), [&p](int a, int b) { return p[a] > p[b]; });
+    for (int f : order) {
+        coords->push_back(pb->f[f]);
+        probs->push_back(total > 0 ? p[f] / total : 0);
+    }
+}
+
 
-PachiEngine::PachiEngine(PachiBoardPtr bptr, const std::string& engine_type, std::string arg) : m_engine_type(engine_type), m_board(bptr) {
+// The distributed master keeps its slave threads and port for the
+// lifetime of the process, so it can only be created once.
+static bool distributed_created = false;
+
+// Engines alive; the shared model data they leave unreferenced is freed
+// with the last one, so that a process done playing gets it back.
+static std::atomic<int> live_engines(0);
+
+void LatencyHistogram::record(double seconds) {
+    int i = 0;
+    if (seconds >= MIN) {
+        i = 1 + (int) std::floor(std::log10(seconds / MIN) * BUCKETS_PER_DECADE);
+        i = std::min(i, size() - 1);
+    }
+    m_counts[i]++;
+    m_count++;
+    m_sum += seconds;
+    m_max = std::max(m_max, seconds);
+}
+
+void LatencyHistogram::clear() {
+    std::fill(m_counts.begin(), m_counts.end(), 0);
+    m_count = 0;
+    m_sum = m_max = 0;
+}
+
+double LatencyHistogram::edge(int i) {
+    if (i == 0) { return 0; }
+    if (i > BUCKETS_PER_DECADE * DECADES + 1) { return INFINITY; }
+    return MIN * std::pow(10.0, (double) (i - 1) / BUCKETS_PER_DECADE);
+}
+
+double LatencyHistogram::percentile(double p) const {
+    long rank = std::max(1L, (long) std::ceil(p * m_count)), seen = 0;
+    for (int i = 0; i < size(); i++) {
+        seen += m_counts[i];
+        if (seen >= rank) { return std::min(edge(i + 1), m_max); }
+    }
+    return m_max;
+}
+
+PachiEngine::PachiEngine(PachiBoardPtr bptr, const std::string& engine_type, std::string arg) : m_engine_type(engine_type), m_board(bptr), m_last_overshoot(0), m_deadline_misses(0) {
     auto engine_init_fn = engine_random_init;
     if (engine_type == "random") {
         engine_init_fn = engine_random_init;
@@ -142,6 +361,18 @@ PachiEngine::PachiEngine(PachiBoardPtr bptr, const std::string& engine_type, std
         // seems to leak memory when pondering is on
         if (arg != "") { arg += ","; }
         arg += "pondering=0";
+    } else if (engine_type == "ensemble") {
+        engine_init_fn = engine_ensemble_init;
+    } else if (engine_type == "distributed") {
+        engine_init_fn = engine_distributed_init;
+        // Pachi exits on these, check them first
+        if (distributed_created) {
+            throw PachiEngineError("only one distributed engine can be created per process");
+        }
+        if (arg.find("slave_port=") == std::string::npos) {
+            throw PachiEngineError("distributed engine needs slave_port=PORT");
+        }
+        distributed_created = true;
     } else {
         throw PachiEngineError("engine not supported: " + engine_type);
     }
@@ -149,12 +380,15 @@ PachiEngine::PachiEngine(PachiBoardPtr bptr, const std::string& engine_type, std
     char* tmp_arg = arg == "" ? nullptr : strdup(arg.c_str());
     m_engine = engine_init_fn(tmp_arg, m_board->pachiboard());
     if (tmp_arg != nullptr) { free(tmp_arg); }
+    live_engines++;
 }
 
-coord_t PachiEngine::genmove(stone curr_color, const std::string& timestr) {
+coord_t PachiEngine::genmove(stone curr_color, const std::string& timestr, double deadline) {
+    double start = time_now();
     // Set pachi timing options (max sims, etc.)
-    time_info ti;
+    time_info ti = {};
     ti.period = time_info::TT_NULL;
+    ti.deadline = deadline;
     if (timestr != "" && !time_parse(&ti, const_cast<char*>(timestr.c_str()))) {
         std::stringstream ss;
         ss << "Invalid timekeeping specification for Pachi: " << timestr << '\n';
@@ -164,23 +398,178 @@ coord_t PachiEngine::genmove(stone curr_color, const std::string& timestr) {
         ss << "*   _NUM - number of seconds to spend per game\n";
         throw PachiEngineError(ss.str());
     }
+    if (ti.period != time_info::TT_NULL && ti.dim == time_info::TD_WALLTIME) {
+        time_start_timer(&ti);
+    }
 
     // Play
-    coord_t* c = m_engine->genmove(m_engine, m_board->pachiboard(), &ti, curr_color, false);
+    board* b = m_board->pachiboard();
+    if (m_engine_type == "distributed") {
+        sync_slaves();
+        b = m_sync->pachiboard();
+    }
+    coord_t* c = m_engine->genmove(m_engine, b, &ti, curr_color, false);
     coord_t out = *c;
     coord_done(c);
+    if (m_engine_type == "distributed" && !is_resign(out)) {
+        // The master has already told the slaves to play it
+        move m = { out, curr_color };
+        board_play(b, &m);
+    }
+
+    double now = time_now();
+    m_latency.record(now - start);
+    if (deadline) {
+        m_last_overshoot = now - deadline;
+        if (m_last_overshoot > 0) { m_deadline_misses++; }
+    }
     return out;
 }
 
+// Sends a gtp command to the distributed slaves. args is a single line
+// without the trailing newline, or empty.
+void PachiEngine::notify_slaves(const char* cmd, const std::string& args) {
+    std::string line = args.empty() ? args : args + "\n";
+    char* reply;
+    m_engine->notify(m_engine, m_sync->pachiboard(), -1, const_cast<char*>(cmd), const_cast<char*>(line.c_str()), &reply);
+}
+
+static std::string play_args(board* b, const move& m) {
+    char buf[4];
+    return std::string(stone2str(m.color)) + " " + coord2bstr(buf, m.coord, b);
+}
+
+// Brings the distributed slaves to the position of the current board.
+// If the board has only moved on by its last one or two moves since the
+// last sync, these are replayed; otherwise the position is set up again
+// from scratch, which loses the ko state.
+void PachiEngine::sync_slaves() {
+    board* b = m_board->pachiboard();
+    if (m_sync) {
+        board* s = m_sync->pachiboard();
+        if (board_size(s) == board_size(b) && s->komi == b->komi) {
+            if (*m_sync == *m_board) { return; }
+            move last[2] = { b->last_move2, b->last_move };
+            for (int n = 1; n <= 2; n++) {
+                PachiBoard next(s, true);
+                bool ok = true;
+                for (int i = 2 - n; i < 2 && ok; i++) {
+                    ok = last[i].color != S_NONE && board_play(next.pachiboard(), &last[i]) >= 0;
+                }
+                if (!ok || !(next == *m_board)) { continue; }
+                for (int i = 2 - n; i < 2; i++) {
+                    notify_slaves("play", play_args(s, last[i]));
+                    board_play(s, &last[i]);
+                }
+                return;
+            }
+        }
+    }
+
+    // The master waits a second for late slaves on each command at move 0,
+    // so only send what changed.
+    bool resize = !m_sync || m_sync->size() != m_board->size();
+    bool komi = !m_sync || m_sync->pachiboard()->komi != b->komi;
+    m_sync.reset(new PachiBoard(m_board->size()));
+    board* s = m_sync->pachiboard();
+    s->komi = b->komi;
+    if (resize) { notify_slaves("boardsize", std::to_string(m_board->size())); }
+    notify_slaves("clear_board", "");
+    if (komi) { notify_slaves("komi", std::to_string(b->komi)); }
+
+    // Set up the stones group by group, each grown from a stone next to
+    // one of its liberties, so that no stone is a suicide or captures.
+    std::vector<bool> queued(board_size2(b));
+    std::vector<coord_t> queue;
+    foreach_point(b) {
+        if ((board_at(b, c) == S_BLACK || board_at(b, c) == S_WHITE) && immediate_liberty_count(b, c) > 0) {
+            queued[c] = true;
+            queue.push_back(c);
+        }
+    } foreach_point_end;
+    for (size_t i = 0; i < queue.size(); i++) {
+        move m = { queue[i], board_at(b, queue[i]) };
+        notify_slaves("play", play_args(s, m));
+        board_play(s, &m);
+        foreach_neighbor(b, m.coord, {
+            if (board_at(b, c) == m.color && !queued[c]) {
+                queued[c] = true;
+                queue.push_back(c);
+            }
+        });
+    }
+}
+
 void PachiEngine::notify(coord_t move_coord, stone move_color) {
     if (!m_engine->notify_play) { return; }
     move m = { move_coord, move_color };
     m_engine->notify_play(m_engine, m_board->pachiboard(), &m, NULL);
 }
 
+static void done_engine(engine* e) {
+    if (e->done) { e->done(e); }
+    if (e->data) { free(e->data); }
+    free(e);
+}
+
+void PachiEngine::ownership(float* out) {
+    if (m_engine_type != "uct") {
+        throw PachiEngineError("ownership is only kept by the uct engine");
+    }
+    uct* u = (uct*) m_engine->data;
+    board_ownermap* ownermap = uct_ownermap(u);
+    if (!ownermap->playouts) {
+        throw PachiEngineError("no search to estimate ownership from, call genmove first");
+    }
+    GetOwnership(m_board->pachiboard(), ownermap, out);
+}
+
 PachiEngine::~PachiEngine() {
     if (m_engine->stop) { m_engine->stop(m_engine); }
-    if (m_engine->done) { m_engine->done(m_engine); }
-    if (m_engine->data) { free(m_engine->data); }
-    free(m_engine);
+    done_engine(m_engine);
+    if (--live_engines == 0) { modeldata_flush(); }
+}
+
+
+LocalSlaves::LocalSlaves(const std::string& binary, const std::string& port, int n, const std::string& arg) {
+    // The slaves run in a fresh process image: a forked copy of this one
+    // would inherit the interpreter and our threads mid-flight.
+    if (access(binary.c_str(), X_OK) < 0) {
+        throw PachiEngineError("slave binary " + binary + ": " + strerror(errno));
+    }
+    std::string master = "127.0.0.1:" + port;
+    std::vector<char*> argv = { const_cast<char*>(binary.c_str()),
+                                const_cast<char*>(master.c_str()),
+                                const_cast<char*>(arg.c_str()), NULL };
+    rlimit nofile;
+    int maxfd = getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur != RLIM_INFINITY
+        ? std::min<rlim_t>(nofile.rlim_cur, 1 << 16) : 1024;
+    pid_t parent = getpid();
+
+    // Do not let the children flush our pending output to the master
+    fflush(stdout); fflush(stderr);
+    for (int i = 0; i < n; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            stop();
+            throw PachiEngineError(std::string("fork: ") + strerror(errno));
+        }
+        if (pid == 0) {
+            // Only async-signal-safe calls until the exec.
+#ifdef __linux__
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if (getppid() != parent) { _exit(1); }
+#endif
+            for (int fd = 3; fd < maxfd; fd++) { close(fd); }
+            execv(argv[0], argv.data());
+            _exit(127);
+        }
+        m_pids.push_back(pid);
+    }
+}
+
+void LocalSlaves::stop() {
+    for (pid_t pid : m_pids) { kill(pid, SIGTERM); }
+    for (pid_t pid : m_pids) { waitpid(pid, NULL, 0); }
+    m_pids.clear();
 }
@@ -4,6 +4,7 @@
 using smart::ptr;
 
 #include <stdio.h>
+#include <sys/types.h>
 #include <vector>
 #include <string>
 #include <map>
@@ -71,7 +72,19 @@ inline std::vector<coord_t> GetLegalMoves(PachiBoardPtr b, stone color, bool fil
 }
 bool IsTerminal(PachiBoardPtr b);
 inline float FastScore(PachiBoardPtr b) { return board_fast_score(b->pachiboard()); }
-float OfficialScore(PachiBoardPtr b);
+// Scores b by Chinese rules after removing the groups judged dead from
+// an ownermap: of playouts random games played to the end from b, spread
+// over threads, or of the position alone if playouts is 0.
+float OfficialScore(PachiBoardPtr b, int playouts = 0, int threads = 1);
+// Scores many boards, by the official score (with playouts as above) or
+// the fast score, to scores[boards.size()]. The boards are spread over a
+// pool of threads (at most one per core, fewer if they cannot be created),
+// each reusing its scratch buffers. If ownership is not
+// NULL, the boards must have the same size and the estimated owner of each
+// point, 1 for black to -1 for white, is stored to ownership[boards.size()]
+// [size][size]; these come from the playouts even for the fast score.
+// Does not touch Python objects, so it may run with the GIL released.
+void ScoreBoards(const std::vector<PachiBoardPtr>& boards, bool official, int playouts, int threads, float* scores, float* ownership);
 std::string ToString(PachiBoardPtr b);
 void PlayInPlace(PachiBoardPtr b, const move& m);
 PachiBoardPtr Play(PachiBoardPtr b, const move& m);
@@ -80,6 +93,32 @@ inline PachiBoardPtr Play(PachiBoardPtr b, coord_t coord, stone color) {
     return Play(b, m);
 }
 PachiBoardPtr PlayRandom(PachiBoardPtr b, stone color, coord_t *coord);
+// Rates valid moves by the pattern probability table (patterns.spat and
+// patterns.prob in the current directory). Moves with a known pattern are
+// returned in decreasing order of their normalized probability.
+void RateMoves(PachiBoardPtr b, stone color, std::vector<coord_t>* coords, std::vector<float>* probs);
+
+// Ownership estimate of a position, accumulated over the playouts of
+// successive add_playouts() calls (which do not touch Python objects).
+struct OwnerMap;
+class OwnershipEstimator {
+    PachiBoardPtr m_board;
+    OwnerMap* m_ownermap;
+
+public:
+    explicit OwnershipEstimator(PachiBoardPtr b);
+    OwnershipEstimator(const OwnershipEstimator&) = delete;
+    ~OwnershipEstimator();
+
+    void add_playouts(int playouts, int threads);
+    int playouts();
+    // Estimated owner of each point, 1 for black to -1 for white, to
+    // out[size*size] in i/j order.
+    void ownership(float* out);
+    // The final owner counts, [board_size2][S_MAX] by Pachi coordinates;
+    // valid as long as the estimator.
+    int* counts();
+};
 
 inline int i_from_xy(board* b, int x, int y) { return board_size(b)-2-y; }
 inline int j_from_xy(board* b, int x, int y) { return x-1; }
@@ -88,17 +127,84 @@ inline int coord_ij(board* b, int i, int j) { return coord_xy(b, j+1, board_size
 inline int i_from_coord(board* b, coord_t c) { return i_from_xy(b, coord_x(c, b), coord_y(c, b)); }
 inline int j_from_coord(board* b, coord_t c) { return j_from_xy(b, coord_x(c, b), coord_y(c, b)); }
 
+// Histogram of latencies (in seconds) on a log scale: bucket 0 counts
+// those under MIN, then BUCKETS_PER_DECADE buckets per decade up to
+// MIN * 10^DECADES, and the last bucket anything longer.
+class LatencyHistogram {
+    std::vector<long> m_counts;
+    long m_count;
+    double m_sum, m_max;
+
+public:
+    static constexpr double MIN = 1e-4;
+    static const int BUCKETS_PER_DECADE = 10, DECADES = 6;
+
+    LatencyHistogram() : m_counts(BUCKETS_PER_DECADE * DECADES + 2) { clear(); }
+
+    void record(double seconds);
+    void clear();
+    int size() const { return m_counts.size(); }
+    const long* counts() const { return m_counts.data(); }
+    // Lower bound of bucket i; edge(size()) is infinity.
+    static double edge(int i);
+    long count() const { return m_count; }
+    double mean() const { return m_count ? m_sum / m_count : 0; }
+    double max() const { return m_max; }
+    // Upper bound of the latency of the given fraction (0..1) of the
+    // recorded ones: the upper edge of its bucket, at most max().
+    double percentile(double p) const;
+};
+
 // Wrapper for Pachi engines. Frees engine when destroyed.
+// The distributed engine can only be created once per process (its slave
+// threads and listening socket outlive it); its slaves are kept in sync
+// with the current board before each genmove.
 class PachiEngine {
     engine* m_engine;
     const std::string m_engine_type;
     PachiBoardPtr m_board; // Stores the current board for the game. Must stay alive during the lifetime of the engine.
+    PachiBoardPtr m_sync; // distributed: position the slaves were last sent, null until the first genmove
+    LatencyHistogram m_latency; // of genmove
+    double m_last_overshoot;
+    long m_deadline_misses;
+
+    void notify_slaves(const char* cmd, const std::string& args);
+    void sync_slaves();
 
 public:
     PachiEngine(PachiBoardPtr b, const std::string& engine_type, std::string arg);
     ~PachiEngine();
 
     PachiBoardPtr get_curr_board() { return m_board; }
-    coord_t genmove(stone curr_color, const std::string& timestr);
+    // Plays with the given time settings (empty for the engine default)
+    // and, if deadline is not 0, returns by that absolute time (as by
+    // time_now(), i.e. Python's time.time()). With just a deadline, the
+    // engine thinks until it. The time is counted from the call.
+    coord_t genmove(stone curr_color, const std::string& timestr, double deadline = 0);
+    const LatencyHistogram& latency() const { return m_latency; }
+    void clear_latency() { m_latency.clear(); m_deadline_misses = 0; }
+    // How late the last genmove with a deadline returned (negative if
+    // early), and how many returned late.
+    double last_overshoot() const { return m_last_overshoot; }
+    long deadline_misses() const { return m_deadline_misses; }
     void notify(coord_t move_coord, stone move_color);
+    // Ownership estimate (see OwnershipEstimator::ownership) from the
+    // playouts of the last genmove search; uct engine only.
+    void ownership(float* out);
+};
+
+// Local slaves for the distributed engine: spawns n processes of the
+// pachi-slave binary, running the uct engine in slave mode with the given
+// engine arguments and connecting to the master at 127.0.0.1:port (they
+// keep retrying until the master listens). The slaves are killed when this
+// object is destroyed, or when the process dies (Linux).
+class LocalSlaves {
+    std::vector<pid_t> m_pids;
+
+public:
+    LocalSlaves(const std::string& binary, const std::string& port, int n, const std::string& arg);
+    ~LocalSlaves() { stop(); }
+
+    int size() { return m_pids.size(); }
+    void stop();
 };
@@ -13,6 +13,9 @@
 
 #ifdef BOARD_SPATHASH
 #include "patternsp.h"
+#if BOARD_SPATHASH_MAXD > MAX_PATTERN_DIST
+#error BOARD_SPATHASH_MAXD must not exceed MAX_PATTERN_DIST
+#endif
 #endif
 #ifdef BOARD_PAT3
 #include "pattern3.h"
@@ -75,11 +78,6 @@ board_alloc(struct board *board)
 #else
 	int csize = 0;
 #endif
-#ifdef BOARD_SPATHASH
-	int ssize = board_size2(board) * sizeof(*board->spathash);
-#else
-	int ssize = 0;
-#endif
 #ifdef BOARD_PAT3
 	int p3size = board_size2(board) * sizeof(*board->pat3);
 #else
@@ -92,9 +90,19 @@ board_alloc(struct board *board)
 	int tsize = 0;
 	int tqsize = 0;
 #endif
+#ifdef BOARD_PLAYABLE
+	int pfsize = board_size2(board) * sizeof(*board->pf[0]);
+	int pfisize = board_size2(board) * sizeof(*board->pfi[0]);
+	int inpfsize = board_size2(board) * sizeof(*board->inpf);
+#else
+	int pfsize = 0;
+	int pfisize = 0;
+	int inpfsize = 0;
+#endif
+	int fisize = board_size2(board) * sizeof(*board->fi);
 	int cdsize = board_size2(board) * sizeof(*board->coord);
 
-	size_t size = bsize + gsize + fsize + psize + nsize + hsize + gisize + csize + ssize + p3size + tsize + tqsize + cdsize;
+	size_t size = bsize + gsize + fsize + psize + nsize + hsize + gisize + csize + p3size + tsize + tqsize + 2 * (pfsize + pfisize) + inpfsize + fisize + cdsize;
 	void *x = malloc2(size);
 
 	/* board->b must come first */
@@ -108,9 +116,6 @@ board_alloc(struct board *board)
 #ifdef WANT_BOARD_C
 	board->c = x; x += csize;
 #endif
-#ifdef BOARD_SPATHASH
-	board->spathash = x; x += ssize;
-#endif
 #ifdef BOARD_PAT3
 	board->pat3 = x; x += p3size;
 #endif
@@ -118,6 +123,14 @@ board_alloc(struct board *board)
 	board->t = x; x += tsize;
 	board->tq = x; x += tqsize;
 #endif
+#ifdef BOARD_PLAYABLE
+	for (int i = 0; i < 2; i++) {
+		board->pf[i] = x; x += pfsize;
+		board->pfi[i] = x; x += pfisize;
+	}
+	board->inpf = x; x += inpfsize;
+#endif
+	board->fi = x; x += fisize;
 	board->coord = x; x += cdsize;
 
 	return size;
@@ -130,6 +143,16 @@ board_copy(struct board *b2, struct board *b1)
 
 	size_t size = board_alloc(b2);
 	memcpy(b2->b, b1->b, size);
+#ifdef BOARD_SPATHASH
+	/* Only a board with spathash_on owns the array. */
+	if (b1->spathash_on) {
+		size_t ssize = board_size2(b1) * sizeof(*b1->spathash);
+		b2->spathash = malloc2(ssize);
+		memcpy(b2->spathash, b1->spathash, ssize);
+	} else {
+		b2->spathash = NULL;
+	}
+#endif
 
 	// XXX: Special semantics.
 	b2->fbook = NULL;
@@ -142,6 +165,11 @@ board_done_noalloc(struct board *board)
 {
 	if (board->b) free(board->b);
 	if (board->fbook) fbook_done(board->fbook);
+#ifdef BOARD_SPATHASH
+	if (board->spathash) free(board->spathash);
+	board->spathash = NULL;
+	board->spathash_on = false;
+#endif
 }
 
 void
@@ -166,6 +194,12 @@ board_resize(struct board *board, int size)
 
 	if (board->b)
 		free(board->b);
+#ifdef BOARD_SPATHASH
+	if (board->spathash)
+		free(board->spathash);
+	board->spathash = NULL;
+	board->spathash_on = false;
+#endif
 
 	size_t asize = board_alloc(board);
 	memset(board->b, 0, asize);
@@ -233,8 +267,21 @@ board_init_data(struct board *board)
 
 	/* All positions are free! Except the margin. */
 	for (i = board_size(board); i < (board_size(board) - 1) * board_size(board); i++)
-		if (i % board_size(board) != 0 && i % board_size(board) != board_size(board) - 1)
+		if (i % board_size(board) != 0 && i % board_size(board) != board_size(board) - 1) {
+			board->fi[i] = board->flen;
 			board->f[board->flen++] = i;
+		}
+#ifdef BOARD_PLAYABLE
+	/* ...and playable by both colors. */
+	for (int i = 0; i < 2; i++) {
+		memcpy(board->pf[i], board->f, board->flen * sizeof(*board->f));
+		memcpy(board->pfi[i], board->fi, board_size2(board) * sizeof(*board->fi));
+		board->pflen[i] = board->flen;
+	}
+	foreach_free_point(board) {
+		board->inpf[c] = 3;
+	} foreach_free_point_end;
+#endif
 
 	/* Initialize zobrist hashtable. */
 	/* We will need these to be stable across Pachi runs for
@@ -251,20 +298,6 @@ board_init_data(struct board *board)
 			board->h[c * 2 + 1] = 1;
 	} foreach_point_end;
 
-#ifdef BOARD_SPATHASH
-	/* Initialize spatial hashes. */
-	foreach_point(board) {
-		for (int d = 1; d <= BOARD_SPATHASH_MAXD; d++) {
-			for (int j = ptind[d]; j < ptind[d + 1]; j++) {
-				ptcoords_at(x, y, c, board, j);
-				board->spathash[coord_xy(board, x, y)][d - 1][0] ^=
-					pthashes[0][j][board_at(board, c)];
-				board->spathash[coord_xy(board, x, y)][d - 1][1] ^=
-					pthashes[0][j][stone_other(board_at(board, c))];
-			}
-		}
-	} foreach_point_end;
-#endif
 #ifdef BOARD_PAT3
 	/* Initialize 3x3 pattern codes. */
 	foreach_point(board) {
@@ -282,6 +315,14 @@ board_init_data(struct board *board)
 #ifdef BOARD_TRAIT_SAFE
 		trait_at(board, c, S_BLACK).safe = true;
 		trait_at(board, c, S_WHITE).safe = true;
+#endif
+#ifdef BOARD_TRAIT_LEGAL
+		trait_at(board, c, S_BLACK).eye = false;
+		trait_at(board, c, S_WHITE).eye = false;
+		trait_at(board, c, S_BLACK).valid = true;
+		trait_at(board, c, S_WHITE).valid = true;
+		trait_at(board, c, S_BLACK).nosuicide = true;
+		trait_at(board, c, S_WHITE).nosuicide = true;
 #endif
 	} foreach_point_end;
 #endif
@@ -294,6 +335,9 @@ board_clear(struct board *board)
 	floating_t komi = board->komi;
 	char *fbookfile = board->fbookfile;
 	enum go_ruleset rules = board->rules;
+#ifdef BOARD_SPATHASH
+	bool spathash_on = board->spathash_on;
+#endif
 
 	board_done_noalloc(board);
 
@@ -309,12 +353,71 @@ board_clear(struct board *board)
 	board->komi = komi;
 	board->fbookfile = fbookfile;
 	board->rules = rules;
+#ifdef BOARD_SPATHASH
+	if (spathash_on)
+		board_spathash_enable(board);
+#endif
 
 	if (board->fbookfile) {
 		board->fbook = fbook_init(board->fbookfile, board);
 	}
 }
 
+#ifdef BOARD_SPATHASH
+/* Compute spatial hashes of all circles around @coord from scratch,
+ * the same way pattern_match_spatial_outer() does. */
+static void
+board_spathash_compute(struct board *board, coord_t coord, uint32_t (*h)[2])
+{
+	for (int d = 2; d <= BOARD_SPATHASH_MAXD; d++) {
+		h[d - 2][0] = h[d - 2][1] = 0;
+		for (unsigned int j = ptind[d]; j < ptind[d + 1]; j++) {
+			ptcoords_at(x, y, coord, board, j);
+			enum stone s = board_atxy(board, x, y);
+			h[d - 2][0] ^= pthashes[0][j][s];
+			h[d - 2][1] ^= pthashes[0][j][stone_other(s)];
+		}
+	}
+}
+
+void
+board_spathash_enable(struct board *board)
+{
+	/* Allocated lazily, most boards never need it. */
+	if (!board->spathash)
+		board->spathash = malloc2(board_size2(board) * sizeof(*board->spathash));
+	foreach_point(board) {
+		if (board_at(board, c) != S_OFFBOARD)
+			board_spathash_compute(board, c, board->spathash[c]);
+	} foreach_point_end;
+	board->spathash_on = true;
+}
+
+bool
+board_spathash_verify(struct board *board)
+{
+	if (!board->spathash_on)
+		return true;
+	foreach_point(board) {
+		if (board_at(board, c) == S_OFFBOARD)
+			continue;
+		uint32_t h[BOARD_SPATHASH_MAXD - 1][2];
+		board_spathash_compute(board, c, h);
+		for (int d = 2; d <= BOARD_SPATHASH_MAXD; d++) {
+			if (h[d - 2][0] == board->spathash[c][d - 2][0]
+			    && h[d - 2][1] == board->spathash[c][d - 2][1])
+				continue;
+			fprintf(stderr, "%s spathash d=%d stored %x,%x != computed %x,%x\n",
+				coord2sstr(c, board), d,
+				board->spathash[c][d - 2][0], board->spathash[c][d - 2][1],
+				h[d - 2][0], h[d - 2][1]);
+			return false;
+		}
+	} foreach_point_end;
+	return true;
+}
+#endif
+
 static char *
 board_print_top(struct board *board, char *s, char *end, int c)
 {
@@ -421,6 +524,48 @@ board_trait_safe(struct board *board, coord_t coord, enum stone color)
 }
 #endif
 
+#ifdef BOARD_TRAIT_LEGAL
+/* The uncached versions of board_is_one_point_eye(), board_is_valid_play()
+ * and board_is_valid_play_no_suicide(), ko aside. */
+static bool
+board_trait_eye(struct board *board, coord_t coord, enum stone color)
+{
+	return board_is_eyelike(board, coord, color)
+		&& !board_is_false_eyelike(board, coord, color);
+}
+
+static bool
+board_trait_valid(struct board *board, coord_t coord, enum stone color)
+{
+	return !board_is_eyelike(board, coord, stone_other(color))
+		|| trait_at(board, coord, color).cap > 0;
+}
+
+static bool
+board_trait_nosuicide(struct board *board, coord_t coord, enum stone color)
+{
+	if (immediate_liberty_count(board, coord) > 0
+	    || trait_at(board, coord, color).cap > 0)
+		return true;
+	foreach_neighbor(board, coord, {
+		if (board_at(board, c) == color
+		    && board_group_info(board, group_at(board, c)).libs > 1)
+			return true;
+	});
+	return false;
+}
+
+static void
+board_trait_legal_recompute(struct board *board, coord_t coord)
+{
+	for (enum stone color = S_BLACK; color <= S_WHITE; color++) {
+		trait_at(board, coord, color).eye = board_trait_eye(board, coord, color);
+		trait_at(board, coord, color).valid = board_trait_valid(board, coord, color);
+		trait_at(board, coord, color).nosuicide = board_trait_nosuicide(board, coord, color);
+	}
+}
+#endif
+
 static void
 board_trait_recompute(struct board *board, coord_t coord)
 {
@@ -444,6 +589,13 @@ static void
 board_traits_recompute(struct board *board)
 {
 #ifdef BOARD_TRAITS
+#ifdef BOARD_TRAIT_LEGAL
+	/* Do these first, safety checks below may look them up
+	 * at other dirty points. */
+	for (int i = 0; i < board->tqlen; i++)
+		if (board_at(board, board->tq[i]) == S_NONE)
+			board_trait_legal_recompute(board, board->tq[i]);
+#endif
 	for (int i = 0; i < board->tqlen; i++) {
 		coord_t coord = board->tq[i];
 		trait_at(board, coord, S_BLACK).dirty = false;
@@ -468,6 +620,116 @@ board_trait_queue(struct board *board, coord_t coord)
 }
 
 
+#ifdef BOARD_SPATHASH
+/* Update spatial hashes after a stone of given color has been placed
+ * or removed at @coord. Kept out of line so that it does not bloat
+ * board_play_f(). */
+static void __attribute__((noinline))
+board_spathash_update(struct board *board, coord_t coord, enum stone color)
+{
+	/* The pattern centered at c - ptcoords[j] sees us as its
+	 * point j; we need to update only on-board centers. */
+	int cx = coord_x(coord, board), cy = coord_y(coord, board);
+	int smax = board_size(board) - 2;
+	for (int d = 2; d <= BOARD_SPATHASH_MAXD; d++) {
+		for (unsigned int j = ptind[d]; j < ptind[d + 1]; j++) {
+			int x = cx - ptcoords[j].x, y = cy - ptcoords[j].y;
+			if (x < 1 || x > smax || y < 1 || y > smax)
+				continue;
+			/* We either changed from S_NONE to color
+			 * or vice versa; doesn't matter. */
+			uint32_t *h = board->spathash[coord_xy(board, x, y)][d - 2];
+			h[0] ^= pthashes[0][j][color] ^ pthashes[0][j][S_NONE];
+			h[1] ^= pthashes[0][j][stone_other(color)] ^ pthashes[0][j][S_NONE];
+		}
+	}
+}
+#endif
+
+#ifdef BOARD_PLAYABLE
+/* Whether board_play_random() may pick given point for given color:
+ * a free point that is not our one-point eye nor an invalid play, ko
+ * aside (ko is temporary, we must not prune the point for it). */
+static inline bool
+board_playable(struct board *board, coord_t coord, enum stone color)
+{
+	if (board_at(board, coord) != S_NONE)
+		return false;
+	if (likely(immediate_liberty_count(board, coord) > 0))
+		return true;
+	return !board_is_one_point_eye(board, coord, color)
+		&& (!board_is_eyelike(board, coord, stone_other(color))
+		    || board_get_atari_neighbor(board, coord, stone_other(color)));
+}
+
+/* Make given position a candidate of color index i, unless it is one. */
+static inline void
+board_playable_add(struct board *board, coord_t coord, int i)
+{
+	if (board->inpf[coord] & (1 << i))
+		return;
+	board->inpf[coord] |= 1 << i;
+	board->pfi[i][coord] = board->pflen[i];
+	board->pf[i][board->pflen[i]++] = coord;
+}
+
+static inline void
+board_playable_rm(struct board *board, coord_t coord, int i)
+{
+	board->inpf[coord] &= ~(1 << i);
+	int p = board->pfi[i][coord];
+	coord_t last = board->pf[i][--board->pflen[i]];
+	board->pf[i][p] = last;
+	board->pfi[i][last] = p;
+}
+
+/* Forming eyes only ever makes candidates stale, those are left for
+ * board_play_random() to prune. The hooks below catch the few ways
+ * a point can become playable again. */
+
+/* Atari status of a group next to given liberty changed; playing
+ * there may capture now. */
+static inline void
+board_playable_lib(struct board *board, coord_t lib)
+{
+	board_playable_add(board, lib, 0);
+	board_playable_add(board, lib, 1);
+}
+
+/* A stone was placed at given point; it is no candidate anymore, and
+ * the opponent's eyes diagonal to it may have become false. */
+static inline void
+board_playable_place(struct board *board, coord_t coord, enum stone color)
+{
+	if (board->inpf[coord] & 1)
+		board_playable_rm(board, coord, 0);
+	if (board->inpf[coord] & 2)
+		board_playable_rm(board, coord, 1);
+	int i = stone_other(color) - 1;
+	foreach_diag_neighbor(board, coord) {
+		if (board_at(board, c) == S_NONE)
+			board_playable_add(board, c, i);
+	} foreach_diag_neighbor_end;
+}
+
+/* A stone was removed from given point; the point is free now and its
+ * neighbors gained a liberty. Captures are rare; this is kept out of
+ * line as board_play_f() inlines everything else. */
+static void __attribute__((noinline))
+board_playable_free(struct board *board, coord_t coord)
+{
+	board_playable_lib(board, coord);
+	foreach_neighbor(board, coord, {
+		if (board_at(board, c) == S_NONE)
+			board_playable_lib(board, c);
+	});
+}
+#else
+static inline void board_playable_lib(struct board *board, coord_t lib) {}
+static inline void board_playable_place(struct board *board, coord_t coord, enum stone color) {}
+static inline void board_playable_free(struct board *board, coord_t coord) {}
+#endif
+
 /* Update board hash with given coordinate. */
 static void profiling_noinline
 board_hash_update(struct board *board, coord_t coord, enum stone color)
@@ -478,19 +740,8 @@ board_hash_update(struct board *board, coord_t coord, enum stone color)
 		fprintf(stderr, "board_hash_update(%d,%d,%d) ^ %"PRIhash" -> %"PRIhash"\n", color, coord_x(coord, board), coord_y(coord, board), hash_at(board, coord, color), board->hash);
 
 #ifdef BOARD_SPATHASH
-	/* Gridcular metric is reflective, so we update all hashes
-	 * of appropriate ditance in OUR circle. */
-	for (int d = 1; d <= BOARD_SPATHASH_MAXD; d++) {
-		for (int j = ptind[d]; j < ptind[d + 1]; j++) {
-			ptcoords_at(x, y, coord, board, j);
-			/* We either changed from S_NONE to color
-			 * or vice versa; doesn't matter. */
-			board->spathash[coord_xy(board, x, y)][d - 1][0] ^=
-				pthashes[0][j][color] ^ pthashes[0][j][S_NONE];
-			board->spathash[coord_xy(board, x, y)][d - 1][1] ^=
-				pthashes[0][j][stone_other(color)] ^ pthashes[0][j][S_NONE];
-		}
-	}
+	if (board->spathash_on)
+		board_spathash_update(board, coord, color);
 #endif
 
 #if defined(BOARD_PAT3)
@@ -704,6 +955,57 @@ check_pat3_consistency(struct board *board, coord_t coord)
 #endif
 }
 
+static void
+check_free_consistency(struct board *board)
+{
+#ifdef DEBUG
+	for (int f = 0; f < board->flen; f++)
+		assert(board_at(board, board->f[f]) == S_NONE && board->fi[board->f[f]] == f);
+#ifdef BOARD_PLAYABLE
+	for (int i = 0; i < 2; i++) {
+		int inpf = 0;
+		foreach_point(board) {
+			bool in_pf = board->inpf[c] & (1 << i);
+			if (board_playable(board, c, i + 1) && !in_pf) {
+				board_print(board, stderr);
+				fprintf(stderr, "%s %s playable but not in pf\n", coord2sstr(c, board), stone2str(i + 1));
+				assert(0);
+			}
+			inpf += in_pf;
+		} foreach_point_end;
+		assert(inpf == board->pflen[i]);
+		for (int p = 0; p < board->pflen[i]; p++)
+			assert(board_at(board, board->pf[i][p]) == S_NONE
+			       && board->inpf[board->pf[i][p]] & (1 << i)
+			       && board->pfi[i][board->pf[i][p]] == p);
+	}
+#endif
+#ifdef BOARD_TRAIT_LEGAL
+	foreach_free_point(board) {
+		for (enum stone color = S_BLACK; color <= S_WHITE; color++) {
+			struct btraits *t = &trait_at(board, c, color);
+			if (t->eye == board_trait_eye(board, c, color)
+			    && t->valid == board_trait_valid(board, c, color)
+			    && t->nosuicide == board_trait_nosuicide(board, c, color))
+				continue;
+			board_print(board, stderr);
+			fprintf(stderr, "%s %s traits eye=%d valid=%d nosuicide=%d != computed %d %d %d\n",
+				coord2sstr(c, board), stone2str(color), t->eye, t->valid, t->nosuicide,
+				board_trait_eye(board, c, color), board_trait_valid(board, c, color),
+				board_trait_nosuicide(board, c, color));
+			assert(0);
+		}
+	} foreach_free_point_end;
+#endif
+#ifdef BOARD_SPATHASH
+	if (!board_spathash_verify(board)) {
+		board_print(board, stderr);
+		assert(0);
+	}
+#endif
+#endif
+}
+
 static void
 board_capturable_add(struct board *board, group_t group, coord_t lib, bool onestone)
 {
@@ -728,6 +1030,7 @@ board_capturable_add(struct board *board, group_t group, coord_t lib, bool onest
 		fn__i++;
 	});
 #endif
+	board_playable_lib(board, lib);
 
 #ifdef WANT_BOARD_C
 	/* Update the list of capturable groups. */
@@ -941,7 +1244,9 @@ board_remove_stone(struct board *board, group_t group, coord_t c)
 
 	if (DEBUGL(6))
 		fprintf(stderr, "pushing free move [%d]: %d,%d\n", board->flen, coord_x(c, board), coord_y(c, board));
+	board->fi[c] = board->flen;
 	board->f[board->flen++] = c;
+	board_playable_free(board, c);
 }
 
 static int profiling_noinline
@@ -1195,6 +1500,7 @@ board_play_outside(struct board *board, struct move *m, int f)
 	group_t group = 0;
 
 	board->f[f] = board->f[--board->flen];
+	board->fi[board->f[f]] = f;
 	if (DEBUGL(6))
 		fprintf(stderr, "popping free move [%d->%d]: %d\n", board->flen, f, board->f[f]);
 
@@ -1228,6 +1534,7 @@ board_play_outside(struct board *board, struct move *m, int f)
 	board->last_move = *m;
 	board->moves++;
 	board_hash_update(board, coord, color);
+	board_playable_place(board, coord, color);
 	board_symmetry_update(board, &board->symmetry, coord);
 	struct move ko = { pass, S_NONE };
 	board->ko = ko;
@@ -1285,6 +1592,7 @@ board_play_in_eye(struct board *board, struct move *m, int f)
 #endif
 
 	board->f[f] = board->f[--board->flen];
+	board->fi[board->f[f]] = f;
 	if (DEBUGL(6))
 		fprintf(stderr, "popping free move [%d->%d]: %d\n", board->flen, f, board->f[f]);
 
@@ -1329,12 +1637,14 @@ board_play_in_eye(struct board *board, struct move *m, int f)
 	board->last_move = *m;
 	board->moves++;
 	board_hash_update(board, coord, color);
+	board_playable_place(board, coord, color);
 	board_hash_commit(board);
 	board_traits_recompute(board);
 	board_symmetry_update(board, &board->symmetry, coord);
 	board->ko = ko;
 
 	check_pat3_consistency(board, coord);
+	check_free_consistency(board);
 
 	return !!group;
 }
@@ -1355,6 +1665,7 @@ board_play_f(struct board *board, struct move *m, int f)
 		}
 		board_hash_commit(board);
 		board_traits_recompute(board);
+		check_free_consistency(board);
 		return 0;
 	} else {
 		return board_play_in_eye(board, m, f);
@@ -1379,10 +1690,8 @@ board_play(struct board *board, struct move *m)
 		return 0;
 	}
 
-	int f;
-	for (f = 0; f < board->flen; f++)
-		if (board->f[f] == m->coord)
-			return board_play_f(board, m, f);
+	if (board_at(board, m->coord) == S_NONE)
+		return board_play_f(board, m, board->fi[m->coord]);
 
 	if (DEBUGL(7))
 		fprintf(stderr, "board_check: stone exists\n");
@@ -1409,18 +1718,23 @@ int board_undo(struct board *board)
 }
 
 static inline bool
-board_try_random_move(struct board *b, enum stone color, coord_t *coord, int f, ppr_permit permit, void *permit_data)
+board_try_random_move(struct board *b, enum stone color, coord_t *coord, coord_t c, ppr_permit permit, void *permit_data)
 {
-	*coord = b->f[f];
+	*coord = c;
 	struct move m = { *coord, color };
 	if (DEBUGL(6))
-		fprintf(stderr, "trying random move %d: %d,%d %s %d\n", f, coord_x(*coord, b), coord_y(*coord, b), coord2sstr(*coord, b), board_is_valid_move(b, &m));
+		fprintf(stderr, "trying random move %d: %d,%d %s %d\n", b->fi[c], coord_x(*coord, b), coord_y(*coord, b), coord2sstr(*coord, b), board_is_valid_move(b, &m));
+#ifdef BOARD_PLAYABLE
+	if (!board_playable(b, c, color)
+		|| unlikely(c == b->ko.coord && color == b->ko.color)
+#else
 	if (unlikely(board_is_one_point_eye(b, *coord, color)) /* bad idea to play into one, usually */
 		|| !board_is_valid_move(b, &m)
+#endif
 		|| (permit && !permit(permit_data, b, &m)))
 		return false;
 	if (m.coord == *coord) {
-		return likely(board_play_f(b, &m, f) >= 0);
+		return likely(board_play_f(b, &m, b->fi[c]) >= 0);
 	} else {
 		*coord = m.coord; // permit modified the coordinate
 		return likely(board_play(b, &m) >= 0);
@@ -1430,15 +1744,36 @@ board_try_random_move(struct board *b, enum stone color, coord_t *coord, int f,
 void
 board_play_random(struct board *b, enum stone color, coord_t *coord, ppr_permit permit, void *permit_data)
 {
-	if (unlikely(b->flen == 0))
+#ifdef BOARD_PLAYABLE
+	/* Sample our candidates rather than all free points, pruning the
+	 * stale ones we hit; filled-up endgame boards full of eyes thus
+	 * cost no more than open ones. The first playable pick is uniform
+	 * among all playable points. */
+	int base, c = color - 1;
+	do {
+		if (unlikely(b->pflen[c] == 0))
+			goto pass;
+		base = fast_random(b->pflen[c]);
+		if (likely(board_playable(b, b->pf[c][base], color)))
+			break;
+		board_playable_rm(b, b->pf[c][base], c);
+	} while (true);
+	coord_t *f = b->pf[c];
+	int flen = b->pflen[c];
+#else
+	coord_t *f = b->f;
+	int flen = b->flen;
+	if (unlikely(flen == 0))
 		goto pass;
+	int base = fast_random(flen);
+#endif
 
-	int base = fast_random(b->flen), f;
-	for (f = base; f < b->flen; f++)
-		if (board_try_random_move(b, color, coord, f, permit, permit_data))
+	int i;
+	for (i = base; i < flen; i++)
+		if (board_try_random_move(b, color, coord, f[i], permit, permit_data))
 			return;
-	for (f = 0; f < base; f++)
-		if (board_try_random_move(b, color, coord, f, permit, permit_data))
+	for (i = 0; i < base; i++)
+		if (board_try_random_move(b, color, coord, f[i], permit, permit_data))
 			return;
 
 pass:
@@ -1469,6 +1804,10 @@ board_is_false_eyelike(struct board *board, coord_t coord, enum stone eye_color)
 bool
 board_is_one_point_eye(struct board *board, coord_t coord, enum stone eye_color)
 {
+#ifdef BOARD_TRAIT_LEGAL
+	if (board_at(board, coord) == S_NONE)
+		return trait_at(board, coord, eye_color).eye;
+#endif
 	return board_is_eyelike(board, coord, eye_color)
 		&& !board_is_false_eyelike(board, coord, eye_color);
 }
@@ -27,14 +27,17 @@ struct fbook;
 
 //#define BOARD_SIZE 9 // constant board size, allows better optimization
 
-//#define BOARD_SPATHASH // incremental patternsp.h hashes
-#define BOARD_SPATHASH_MAXD 3 // maximal diameter
+#define BOARD_SPATHASH // incremental patternsp.h hashes (maintained only when enabled at runtime, see board_spathash_enable())
+#define BOARD_SPATHASH_MAXD 7 // maximal diameter (at most MAX_PATTERN_DIST)
 
 #define BOARD_PAT3 // incremental 3x3 pattern codes
 
 //#define BOARD_TRAITS 1 // incremental point traits (see struct btraits)
 //#define BOARD_TRAIT_SAFE 1 // include btraits.safe (rather expensive, unused)
 //#define BOARD_TRAIT_SAFE 2 // include btraits.safe based on full is_bad_selfatari()
+//#define BOARD_TRAIT_LEGAL // include btraits.eye, .valid, .nosuicide; legality checks become lookups
+
+#define BOARD_PLAYABLE // per-color candidate sets board_play_random() samples from
 
 
 #define BOARD_MAX_MOVES (BOARD_MAX_SIZE * BOARD_MAX_SIZE)
@@ -113,6 +116,17 @@ struct btraits {
 	 * of "safety" is not perfect here, but it's the cheapest
 	 * reasonable thing we can do.) */
 	bool safe:1;
+#endif
+#ifdef BOARD_TRAIT_LEGAL
+	/* Whether this is our one-point eye; cached result of
+	 * board_is_one_point_eye(). */
+	bool eye:1;
+	/* Whether we may play here, ko aside; cached result of
+	 * board_is_valid_play() (group suicide allowed). */
+	bool valid:1;
+	/* Whether we may play here without suicide, ko aside; cached
+	 * result of board_is_valid_play_no_suicide(). */
+	bool nosuicide:1;
 #endif
 	/* Whether we need to re-compute this coordinate; used to
 	 * weed out duplicates. Maintained only for S_BLACK. */
@@ -189,12 +203,18 @@ struct board {
 	/* Zobrist hash for each position */
 	hash_t *h;
 #ifdef BOARD_SPATHASH
-	/* For spatial hashes, we use only 24 bits. */
-	/* [0] is d==1, we don't keep hash for d==0. */
+	/* For spatial hashes, we use only the low 32 bits (spatial
+	 * dictionary lookup needs just spatial_hash_bits). Each entry is
+	 * the hash of a single gridcular circle (not cumulative). */
+	/* [0] is d==2, we don't keep hash for the center point (d==1). */
 	/* We keep hashes for black-to-play ([][0]) and white-to-play
 	 * ([][1], reversed stone colors since we match all patterns as
 	 * black-to-play). */
-	uint32_t (*spathash)[BOARD_SPATHASH_MAXD][2];
+	/* Allocated by board_spathash_enable(), NULL until then; board
+	 * copies get their own array only if spathash_on. */
+	uint32_t (*spathash)[BOARD_SPATHASH_MAXD - 1][2];
+	/* Whether spathash[] is maintained. */
+	bool spathash_on;
 #endif
 #ifdef BOARD_PAT3
 	/* 3x3 pattern code for each position; see pattern3.h for encoding
@@ -217,6 +237,8 @@ struct board {
 	/* Note that free position here is any valid move; including single-point eyes!
 	 * However, pass is not included. */
 	coord_t *f; int flen;
+	/* Position of each free position in f[] (undefined for others) */
+	int16_t *fi;
 
 #ifdef WANT_BOARD_C
 	/* Queue of capturable groups */
@@ -228,6 +250,18 @@ struct board {
 	coord_t *tq; int tqlen;
 #endif
 
+#ifdef BOARD_PLAYABLE
+	/* Candidate moves of board_play_random(), per color (index color - 1):
+	 * free positions, save for some that are own one-point eyes or invalid
+	 * plays. Eyes and invalid plays are pruned only as they get sampled.
+	 * Queue (not map), like f[]. */
+	coord_t *pf[2]; int pflen[2];
+	/* Position of each candidate in pf[] */
+	int16_t *pfi[2];
+	/* Membership of positions in pf[], bit 1 << (color - 1) */
+	uint8_t *inpf;
+#endif
+
 	/* Symmetry information */
 	struct board_symmetry symmetry;
 
@@ -334,6 +368,19 @@ typedef char *(*board_cprint)(struct board *b, coord_t c, char *s, char *end);
 char *board_print(struct board *board, FILE *f);
 char *board_print_custom(struct board *board, FILE *f, board_cprint cprint);
 
+#ifdef BOARD_SPATHASH
+/* Start maintaining incremental spatial hashes (recomputing them
+ * from scratch); they stay enabled in board copies. Only worthwhile for
+ * boards that are going to be pattern-matched a lot, e.g. the tree
+ * descent boards of UCT with pattern priors. */
+void board_spathash_enable(struct board *board);
+/* Stop maintaining spatial hashes (this is cheap). */
+static void board_spathash_disable(struct board *board);
+/* Check incremental spatial hashes against recomputed ones; returns
+ * false (and describes the first mismatch on stderr) if they differ. */
+bool board_spathash_verify(struct board *board);
+#endif
+
 /* Place given handicap on the board; coordinates are printed to f. */
 void board_handicap(struct board *board, int stones, FILE *f);
 
@@ -461,6 +508,14 @@ bool board_set_rules(struct board *board, char *name);
 	} while (0)
 
 
+#ifdef BOARD_SPATHASH
+static inline void
+board_spathash_disable(struct board *board)
+{
+	board->spathash_on = false;
+}
+#endif
+
 static inline bool
 board_is_eyelike(struct board *board, coord_t coord, enum stone eye_color)
 {
@@ -474,6 +529,11 @@ board_is_valid_play(struct board *board, enum stone color, coord_t coord)
 {
 	if (board_at(board, coord) != S_NONE)
 		return false;
+#ifdef BOARD_TRAIT_LEGAL
+	/* Ko point is always eyelike for the other color. */
+	return trait_at(board, coord, color).valid
+		&& !(board->ko.coord == coord && board->ko.color == color);
+#endif
 	if (!board_is_eyelike(board, coord, stone_other(color)))
 		return true;
 	/* Play within {true,false} eye-ish formation */
@@ -498,6 +558,10 @@ board_is_valid_play_no_suicide(struct board *board, enum stone color, coord_t co
 {
 	if (board_at(board, coord) != S_NONE)
 		return false;
+#ifdef BOARD_TRAIT_LEGAL
+	return trait_at(board, coord, color).nosuicide
+		&& !(board->ko.coord == coord && board->ko.color == color);
+#endif
 	if (immediate_liberty_count(board, coord) >= 1)
 		return true;
 	if (board_is_eyelike(board, coord, stone_other(color)) &&
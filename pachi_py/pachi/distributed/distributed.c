@@ -46,7 +46,15 @@
  * max_slaves=MAX_SLAVES     default 24
  * shared_nodes=SHARED_NODES default 10K
  * stats_hbits=STATS_HBITS   default 21. 2^stats_bits = hash table size
+ * merge_threads=THREADS     threads merging the stats of large configurations, default 4;
+ *                           with epoll, also the number of threads preparing
+ *                           the stats sent to the slaves.
  * slaves_quit=0|1           quit gtp command also sent to slaves, default false.
+ * epoll=0|1                 serve the sockets of all slaves from a single epoll thread (Linux),
+ *                           default true; otherwise one blocking thread per slave.
+ * stats_format=raw|compact|lz  wire format of the shared stats, default compact.
+ *                           Slaves reply in the format they receive; use raw
+ *                           with slaves older than the compact format.
  * proxy_port=PROXY_PORT     slaves optionally send their logs to this port.
  *    Warning: with proxy_port, the master stderr mixes the logs of all
  *    machines but you can separate them again:
@@ -86,6 +94,7 @@
 #include "chat.h"
 #include "distributed/distributed.h"
 #include "distributed/merge.h"
+#include "distributed/wire.h"
 
 /* Internal engine state. */
 struct distributed {
@@ -94,7 +103,11 @@ struct distributed {
 	int max_slaves;
 	int shared_nodes;
 	int stats_hbits;
+	int merge_threads;
 	bool slaves_quit;
+	bool epoll;
+	int wire_version;
+	bool wire_compress;
 	struct move my_last_move;
 	struct move_stats my_last_stats;
 	int slaves;
@@ -125,6 +138,10 @@ static const struct time_info default_ti = {
  * ensure that most slaves have replied at least once. */
 #define MIN_EARLY_STOP_WAIT 0.3 /* 300 ms */
 
+/* Time reserved before a hard deadline (see time_info) for telling
+ * the slaves the selected move. */
+#define DEADLINE_RESERVE 0.01 /* 10 ms */
+
 /* Display a path as leaf<parent<grandparent...
  * Returns the path string in a static buffer; it is NOT safe for
  * anything but debugging - in particular, it is NOT thread-safe! */
@@ -211,9 +228,10 @@ large_stats_add_result(struct large_stats *s, floating_t result, long playouts)
 
 /* genmoves returns "=id played_own total_playouts threads keep_looking @size"
  * then a list of lines "coord playouts value" with absolute counts for
- * children of the root node, then a binary array of incr_stats structs.
- * To simplify the code, we assume that master and slave have the same architecture
- * (store values identically).
+ * children of the root node, then a binary array of incr_stats structs,
+ * or the same stats in compact wire format if @size ends with :version
+ * (see wire.h). For the raw array we assume that master and slave have
+ * the same architecture (store values identically).
  * Return the move with most playouts, and additional stats.
  * keep_looking is set from a majority vote of the slaves seen so far for this
  * move but should not be trusted if too few slaves have been seen.
@@ -275,7 +293,7 @@ select_best_move(struct board *b, struct large_stats *stats, int *played,
  * slave_lock is held on entry and on return but we don't
  * rely on the lock here. */
 static void
-genmoves_args(char *args, enum stone color, int played,
+genmoves_args(char *args, struct distributed *dist, enum stone color, int played,
 	      struct time_info *ti, bool binary_args)
 {
 	char *end = args + CMDS_SIZE;
@@ -286,7 +304,11 @@ genmoves_args(char *args, enum stone color, int played,
 			      ti->len.t.main_time, ti->len.t.byoyomi_time,
 			      ti->len.t.byoyomi_periods, ti->len.t.byoyomi_stones);
 	}
-	s += snprintf(s, end - s, binary_args ? " @0\n" : "\n");
+	if (binary_args) {
+		s += snprintf(s, end - s, " ");
+		s += wire_tag(s, end - s, 0, dist->wire_version, dist->wire_compress);
+	}
+	s += snprintf(s, end - s, "\n");
 }
 
 /* Time control is mostly done by the slaves, so we use default values here. */
@@ -310,7 +332,9 @@ distributed_genmove(struct engine *e, struct board *b, struct time_info *ti,
 	coord_t best;
 	int played, playouts, threads;
 
+	double deadline = ti->deadline;
 	if (ti->period == TT_NULL) *ti = default_ti;
+	ti->deadline = deadline;
 	struct time_stop stop;
 	time_stop_conditions(ti, b, FUSEKI_END, YOSE_START, MAX_MAINTIME_RATIO, &stop);
 	struct time_info saved_ti = *ti;
@@ -324,7 +348,7 @@ distributed_genmove(struct engine *e, struct board *b, struct time_info *ti,
 	clear_receive_queue();
 
 	/* Send the first genmoves without stats. */
-	genmoves_args(args, color, 0, ti, false);
+	genmoves_args(args, dist, color, 0, ti, false);
 	new_cmd(b, cmd, args);
 
 	/* Loop until most slaves want to quit or time elapsed. */
@@ -333,7 +357,10 @@ distributed_genmove(struct engine *e, struct board *b, struct time_info *ti,
 		double start = now;
 		/* Wait for just one slave to get stats as fresh as possible,
 		 * or at most 100ms to check if we run out of time. */
-		get_replies(now + MAX_GENMOVES_WAIT, 1);
+		double wait_until = now + MAX_GENMOVES_WAIT;
+		if (deadline && wait_until > deadline - DEADLINE_RESERVE)
+			wait_until = deadline - DEADLINE_RESERVE;
+		get_replies(wait_until, 1);
 		now = time_now();
 		if (ti->dim == TD_WALLTIME)
 			time_sub(ti, now - start, false);
@@ -341,6 +368,7 @@ distributed_genmove(struct engine *e, struct board *b, struct time_info *ti,
 		bool keep_looking;
 		best = select_best_move(b, stats, &played, &playouts, &threads, &keep_looking);
 
+		if (deadline && now >= deadline - DEADLINE_RESERVE) break;
 		if (ti->dim == TD_WALLTIME) {
 			if (now - ti->len.t.timer_start >= stop.worst.time) break;
 			if (!keep_looking && now - first >= MIN_EARLY_STOP_WAIT) break;
@@ -358,7 +386,7 @@ distributed_genmove(struct engine *e, struct board *b, struct time_info *ti,
 		}
 		/* Send the command with the same gtp id, to avoid discarding
 		 * a reply to a previous genmoves at the same move. */
-		genmoves_args(args, color, played, ti, true);
+		genmoves_args(args, dist, color, played, ti, true);
 		update_cmd(b, cmd, args, false);
 	}
 	int replies = reply_count;
@@ -460,6 +488,9 @@ distributed_state_init(char *arg, struct board *b)
 	dist->stats_hbits = DEFAULT_STATS_HBITS;
 	dist->max_slaves = DEFAULT_MAX_SLAVES;
 	dist->shared_nodes = DEFAULT_SHARED_NODES;
+	dist->merge_threads = DEFAULT_MERGE_THREADS;
+	dist->epoll = true;
+	dist->wire_version = STATS_WIRE_VERSION;
 	if (arg) {
 		char *optspec, *next = arg;
 		while (*next) {
@@ -484,8 +515,23 @@ distributed_state_init(char *arg, struct board *b)
 			} else if (!strcasecmp(optname, "stats_hbits") && optval) {
                                 /* Set hash table size to 2^stats_hbits for the shared stats. */
 				dist->stats_hbits = atoi(optval);
+			} else if (!strcasecmp(optname, "merge_threads") && optval) {
+				/* Merge the stats of other slaves in this many threads. */
+				dist->merge_threads = atoi(optval);
 			} else if (!strcasecmp(optname, "slaves_quit")) {
 				dist->slaves_quit = !optval || atoi(optval);
+			} else if (!strcasecmp(optname, "epoll")) {
+				dist->epoll = !optval || atoi(optval);
+			} else if (!strcasecmp(optname, "stats_format") && optval) {
+				/* Wire format of the stats shared with the slaves. */
+				if (!strcasecmp(optval, "raw")) {
+					dist->wire_version = 0;
+				} else if (!strcasecmp(optval, "compact") || !strcasecmp(optval, "lz")) {
+					dist->wire_version = STATS_WIRE_VERSION;
+					dist->wire_compress = !strcasecmp(optval, "lz");
+				} else {
+					fprintf(stderr, "distributed: Invalid stats_format %s\n", optval);
+				}
 			} else {
 				fprintf(stderr, "distributed: Invalid engine argument %s or missing value\n", optname);
 			}
@@ -499,8 +545,10 @@ distributed_state_init(char *arg, struct board *b)
 		exit(1);
 	}
 
-	merge_init(&default_sstate, dist->shared_nodes, dist->stats_hbits, dist->max_slaves);
-	protocol_init(dist->slave_port, dist->proxy_port, dist->max_slaves);
+	merge_init(&default_sstate, dist->shared_nodes, dist->stats_hbits, dist->max_slaves,
+		   dist->merge_threads, dist->wire_version, dist->wire_compress);
+	protocol_init(dist->slave_port, dist->proxy_port, dist->max_slaves, dist->epoll,
+		      dist->merge_threads);
 
 	return dist;
 }
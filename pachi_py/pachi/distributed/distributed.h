@@ -89,6 +89,11 @@ struct incr_stats {
  * the number of slaves and the hash table size. */
 #define DEFAULT_SHARED_NODES 10240
 
+/* With 64 slaves the master merges up to 630K nodes for each genmoves
+ * of each slave. Merges of more than 8K nodes are split across this
+ * many threads, including the slave thread. */
+#define DEFAULT_MERGE_THREADS 4
+
 
 /* Maximum game length. Power of 10 jut to ease debugging. */
 #define DIST_GAMELEN 1000
@@ -5,7 +5,9 @@
  * and the hash tables are cleared at each new move. */
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 #include <limits.h>
 
 #define DEBUG
@@ -14,10 +16,15 @@
 #include "timeinfo.h"
 #include "distributed/distributed.h"
 #include "distributed/merge.h"
+#include "distributed/wire.h"
 
 /* We merge together debug stats for all hash tables. */
 static struct hash_counts h_counts;
 
+/* Time spent in get_new_stats() and number of merges, for all slaves. */
+static double total_merge_time;
+static long total_merges;
+
 /* Display and reset hash statistics. For debugging only. */
 void
 merge_print_stats(int total_hnodes)
@@ -34,6 +41,15 @@ merge_print_stats(int total_hnodes)
 	if (DEBUG_MODE) h_counts.occupied = 0;
 }
 
+void
+merge_time_stats(double *time, long *merges)
+{
+	protocol_lock();
+	*time = total_merge_time;
+	*merges = total_merges;
+	protocol_unlock();
+}
+
 /* We maintain counts per bucket to avoid sorting large arrays.
  * All nodes with n updates since last send go to bucket n.
  * We have at most max_merged_nodes = (max_slaves-1) * shared_nodes
@@ -46,6 +62,9 @@ merge_print_stats(int total_hnodes)
 
 /* Update the hash table for the given increment stats,
  * and increment the bucket count. Return the hash index.
+ * Several threads may tally disjoint paths into the same table
+ * (see merge_part()), so a new entry is claimed with a CAS on
+ * its coord path; its stats are only seen by the claiming thread.
  * The slave lock is not held on either entry or exit of this function */
 static inline int
 stats_tally(struct incr_stats *s, struct slave_state *sstate, int *bucket_count)
@@ -53,12 +72,17 @@ stats_tally(struct incr_stats *s, struct slave_state *sstate, int *bucket_count)
 	int h;
 	bool found;
 	struct incr_stats *stats_htable = sstate->stats_htable;
-	find_hash(h, stats_htable, sstate->stats_hbits, s->coord_path, found, h_counts);
+	for (;;) {
+		find_hash(h, stats_htable, sstate->stats_hbits, s->coord_path, found, h_counts);
+		if (found || __sync_bool_compare_and_swap(&stats_htable[h].coord_path,
+							  0, s->coord_path))
+			break;
+	}
 	if (found) {
 		assert(stats_htable[h].incr.playouts > 0);
 		stats_add_result(&stats_htable[h].incr, s->incr.value, s->incr.playouts);
 	} else {
-		stats_htable[h] = *s;
+		stats_htable[h].incr = s->incr;
 		if (DEBUG_MODE) h_counts.inserts++, h_counts.occupied++;
 	}
 
@@ -70,133 +94,316 @@ stats_tally(struct incr_stats *s, struct slave_state *sstate, int *bucket_count)
 
 static struct incr_stats terminator = { .coord_path = INT64_MAX };
 
-/* Initialize the next pointers (see merge_new_stats()).
- * Exclude invalid buffers and my own buffers by setting their next pointer
- * to a terminator value. Update min if there are too many nodes to merge,
- * so that merge time remains reasonable and the merge buffer doesn't overflow.
+/* Initialize the start pointers and lengths (see merge_new_stats()).
+ * Exclude invalid buffers and my own buffers by setting their start
+ * pointer to a terminator value. Update min if there are too many
+ * nodes to merge, so that merge time remains reasonable and the merge
+ * buffer doesn't overflow.
  * (We skip the oldest buffers if the slave thread is too much behind. It is
  * more important to get frequent incomplete updates than late complete updates.)
  * Return the total number of nodes to be merged.
  * The slave lock is not held on either entry or exit of this function. */
 static int
-filter_buffers(struct slave_state *sstate, struct incr_stats **next,
+filter_buffers(struct slave_state *sstate, struct incr_stats **start, int *len,
 	       int *min, int max)
 {
 	int size = 0;
 	int max_size = sstate->max_merged_nodes * sizeof(struct incr_stats);
  
 	for (int q = max; q >= *min; q--) {
-		if (!receive_queue[q] || receive_queue[q]->owner == sstate->thread_id) {
-			next[q] = &terminator;
-		} else if (size + receive_queue[q]->size > max_size) {
+		struct buf_state *b = receive_queue[q];
+		if (!b || b->owner == sstate->thread_id) {
+			start[q] = &terminator;
+			len[q] = 0;
+		} else if (size + b->size > max_size) {
 			*min = q + 1;
 			assert(*min <= max);
 			break;
 		} else {
-			next[q] = (struct incr_stats *)receive_queue[q]->buf;
-			size += receive_queue[q]->size;
+			start[q] = (struct incr_stats *)b->buf;
+			len[q] = b->size / sizeof(struct incr_stats);
+			size += b->size;
 		}
 	}
 	return size / sizeof(struct incr_stats);
 }
 
-/* Return the minimum coord path of next[min..max].
- * This implementation is optimized for small values of max - min,
- * which is the case if slaves are not too much behind.
- * A heap (priority queue) could be used otherwise.
- * The returned value might be come from a buffer that has
- * been invalidated, the caller must check for this; in this
- * case the returned value is < the correct value. */
-static inline path_t
-min_coord(struct incr_stats **next, int min, int max)
+/* Return the index of the first node of stats[0..len-1]
+ * with coord path >= path. */
+static int
+lower_bound(struct incr_stats *stats, int len, path_t path)
 {
-	path_t min_c = next[min]->coord_path;
-	for (int q = min + 1; q <= max; q++) {
-		if (next[q]->coord_path < min_c)
-			min_c = next[q]->coord_path;
+	int lo = 0, hi = len;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (stats[mid].coord_path < path) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
-	return min_c;
+	return lo;
 }
 
-/* Merge all valid incremental stats in receive_queue[min..max],
- * update the hash table, set the bucket counts, and save the
- * list of updated hash table entries. The input buffers and
- * the output buffer are all sorted by increasing coord path.
- * The input buffers end with a terminator value INT64_MAX.
- * Return the number of updated hash table entries. */
+/* One slice of a merge: the coord paths in [lo, hi) of all the
+ * buffers in receive_queue[min..max]. Slices are merged in parallel
+ * by the merge threads and the calling slave thread. */
+struct merge_part {
+	struct slave_state *sstate;
+	int min, max;
+	path_t lo, hi;
+	struct incr_stats **next; // first node >= lo in each buffer
+	int last_queue_age;
+
+	/* Output: hash indices of the merged nodes, in order. */
+	int *merged;
+	int merge_count;
+	int max_count;
+	bool stale;
+	int bucket_count[MAX_BUCKETS];
+
+	volatile bool done;
+};
+
+/* Min-heap of the next coord path of each buffer. */
+struct heap_entry {
+	path_t path;
+	int q;
+};
+
+static inline void
+heap_sift_down(struct heap_entry *heap, int n, int i)
+{
+	struct heap_entry e = heap[i];
+	for (int child; (child = 2 * i + 1) < n; i = child) {
+		if (child + 1 < n && heap[child + 1].path < heap[child].path) child++;
+		if (e.path <= heap[child].path) break;
+		heap[i] = heap[child];
+	}
+	heap[i] = e;
+}
+
+/* Merge all valid incremental stats of the given slice, update the
+ * hash table, set the bucket counts, and save the list of updated
+ * hash table entries. The input buffers and the output list are
+ * all sorted by increasing coord path. Buffers end with a terminator
+ * value INT64_MAX, which is >= any hi.
+ * The heap makes this O(log k) per node read for k buffers instead
+ * of O(k) for a linear scan of the buffers. */
 
 /* The slave lock is not held on either entry or exit of this function,
  * so receive_queue entries may be invalidated while we scan them.
  * The receive queue might grow while we scan it but we ignore
  * entries above max, they will be processed at the next call.
  * This function does not modify the receive queue. */
-static int
-merge_new_stats(struct slave_state *sstate, int min, int max,
-		int *bucket_count, int *nodes_read, int last_queue_age)
+static void
+merge_part(struct merge_part *p)
 {
-	*nodes_read = 0;
-	if (max < min) return 0;
-
-	/* next[q] is the next value to be checked in receive_queue[q]->buf */
-	struct incr_stats *next_[max - min + 1];
-	struct incr_stats **next = next_ - min;
-	*nodes_read = filter_buffers(sstate, next, &min, max);
+	struct slave_state *sstate = p->sstate;
+	struct incr_stats **next = p->next;
+	struct heap_entry heap[p->max - p->min + 1];
+	int n = 0;
+	for (int q = p->min; q <= p->max; q++) {
+		if (next[q]->coord_path < p->hi)
+			heap[n++] = (struct heap_entry){ next[q]->coord_path, q };
+	}
+	for (int i = n / 2 - 1; i >= 0; i--)
+		heap_sift_down(heap, n, i);
 
 	/* prev_min_c is only used for debugging. */
 	path_t prev_min_c = 0;
 
-	/* Do N-way merge, processing one coord path per iteration.
-	 * If the minimum coord is INT64_MAX, either all buffers are
-	 * invalidated, or at least one is valid and we are at the
-	 * end of all valid buffers. In both cases we're done. */
-	int merge_count = 0;
-	path_t min_c;
-	while ((min_c = min_coord(next, min, max)) != INT64_MAX) {
-
+	/* Do N-way merge, processing one coord path per iteration. */
+	while (n) {
+		path_t min_c = heap[0].path;
 		struct incr_stats sum = { .coord_path = min_c,
 					  .incr = { .playouts = 0, .value = 0.0 }};
-		for (int q = min; q <= max; q++) {
+		while (n && heap[0].path == min_c) {
+			int q = heap[0].q;
 			struct incr_stats s = *(next[q]);
 
-			/* If s.coord_path != min_c, we must skip s.coord_path for now.
-			 * If min_c is invalid, a future iteration will get a stable
-			 * value since the call of min_coord(), so at some point we will
-			 * get s.coord_path == min_c and we will not loop forever. */
-			 if (s.coord_path != min_c) continue;
-
-			/* We check the buffer validity after s.coord has been checked
-			 * to avoid a race condition, and also to avoid multiple useless
-			 * checks for the same coord_path. */
-			if (unlikely(!receive_queue[q])) {
-				next[q] = &terminator;
+			/* We check the buffer validity after s has been read
+			 * to avoid a race condition. A buffer recycled since
+			 * it was pushed on the heap is dropped. */
+			if (unlikely(!receive_queue[q] || s.coord_path != min_c)) {
+				heap[0] = heap[--n];
+				heap_sift_down(heap, n, 0);
 				continue;
 			}
 
 			/* Stop if we have a new move. If queue_age is incremented
 			 * after this check, the merged output will be discarded. */
-			if (unlikely(queue_age > last_queue_age)) return 0;
+			if (unlikely(queue_age > p->last_queue_age)) {
+				p->stale = true;
+				return;
+			}
 
-			/* s.coord_path is valid here, so min_c is valid too.
-			 * (An invalid min_c would be < s.coord_path.) */
 			assert(min_c > prev_min_c);
-
 			assert(s.coord_path && s.incr.playouts);
 			stats_add_result(&sum.incr, s.incr.value, s.incr.playouts);
-			next[q]++;
+
+			path_t c = (++next[q])->coord_path;
+			if (c < p->hi) {
+				heap[0].path = c;
+			} else {
+				heap[0] = heap[--n];
+			}
+			heap_sift_down(heap, n, 0);
 		}
-		/* All the buffers containing min_c may have been invalidated
-		 * so sum may still be zero. But in this case the next[q] which
-		 * contained min_c have been reset to &terminator so we will
-		 * not loop forever. */
+		/* All the buffers containing min_c may have been
+		 * invalidated so sum may still be zero. */
 		if (!sum.incr.playouts) continue;
 
-		assert(min_c > prev_min_c);
 		if (DEBUG_MODE) prev_min_c = min_c;
 
+		/* More nodes than read can only come from a new move. */
+		if (unlikely(p->merge_count == p->max_count)) {
+			p->stale = true;
+			return;
+		}
+
 		/* At this point sum contains only valid increments,
 		 * so we can add it to the hash table. */
-		assert(merge_count < sstate->max_merged_nodes);
-		sstate->merged[merge_count++] = stats_tally(&sum, sstate, bucket_count);
+		p->merged[p->merge_count++] = stats_tally(&sum, sstate, p->bucket_count);
+	}
+}
+
+
+/* Threads helping the slave threads with large merges. Slices are
+ * queued in part_queue; the slave thread merges its first slice
+ * itself then works on queued slices until all its slices are done. */
+static int merge_threads;
+static struct merge_part **part_queue;
+static int part_queue_length;
+static pthread_mutex_t part_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t part_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+/* Merge one queued slice. part_lock is held on entry and on return. */
+static void
+run_queued_part(void)
+{
+	struct merge_part *p = part_queue[--part_queue_length];
+	pthread_mutex_unlock(&part_lock);
+	merge_part(p);
+	pthread_mutex_lock(&part_lock);
+	p->done = true;
+	pthread_cond_broadcast(&done_cond);
+}
+
+static void * __attribute__((noreturn))
+merge_thread(void *arg)
+{
+	pthread_mutex_lock(&part_lock);
+	for (;;) {
+		while (!part_queue_length)
+			pthread_cond_wait(&part_cond, &part_lock);
+		run_queued_part();
+	}
+}
+
+/* Slices smaller than this are not worth a thread. */
+#define MIN_PART_NODES 8192
+
+/* Merge all valid incremental stats in receive_queue[min..max],
+ * update the hash table, set the bucket counts, and save the
+ * list of updated hash table entries in sstate->merged, sorted
+ * by increasing coord path. Large merges are split in slices of
+ * the path space, merged in parallel. The boundaries of the slices
+ * are taken from the largest buffer: slaves explore similar trees
+ * so the slices get similar numbers of nodes.
+ * Return the number of updated hash table entries, 0 if stale.
+ * The slave lock is not held on either entry or exit of this function. */
+static int
+merge_new_stats(struct slave_state *sstate, int min, int max,
+		int *bucket_count, int *nodes_read, int last_queue_age)
+{
+	*nodes_read = 0;
+	if (max < min) return 0;
+
+	struct incr_stats *start_[max - min + 1];
+	struct incr_stats **start = start_ - min;
+	int len_[max - min + 1];
+	int *len = len_ - min;
+	*nodes_read = filter_buffers(sstate, start, len, &min, max);
+
+	int nparts = *nodes_read / MIN_PART_NODES;
+	if (nparts > merge_threads) nparts = merge_threads;
+	if (nparts < 1) nparts = 1;
+
+	int big = min;
+	for (int q = min; q <= max; q++)
+		if (len[q] > len[big]) big = q;
+	path_t bound[nparts + 1];
+	bound[0] = 0;
+	bound[nparts] = PATH_T_MAX;
+	for (int i = 1; i < nparts; i++) {
+		bound[i] = start[big][(long)i * len[big] / nparts].coord_path;
+		/* The buffer may be recycled under us. */
+		if (bound[i] < bound[i-1]) bound[i] = bound[i-1];
+	}
+
+	struct merge_part parts[nparts];
+	struct incr_stats *next_[nparts][max - min + 1];
+	int offset = 0;
+	for (int i = 0; i < nparts; i++) {
+		struct merge_part *p = &parts[i];
+		p->sstate = sstate;
+		p->min = min;
+		p->max = max;
+		p->lo = bound[i];
+		p->hi = bound[i+1];
+		p->next = next_[i] - min;
+		p->last_queue_age = last_queue_age;
+		p->merged = sstate->merged + offset;
+		p->merge_count = 0;
+		p->stale = false;
+		p->done = false;
+		memset(p->bucket_count, 0, sizeof(p->bucket_count));
+
+		/* A slice outputs at most the nodes it reads. */
+		for (int q = min; q <= max; q++) {
+			int first = i ? lower_bound(start[q], len[q], p->lo) : 0;
+			int last = i < nparts - 1 ? lower_bound(start[q], len[q], p->hi) : len[q];
+			if (last < first) last = first;
+			p->next[q] = start[q] + first;
+			offset += last - first;
+		}
+		p->max_count = sstate->merged + offset - p->merged;
+	}
+	assert(offset <= sstate->max_merged_nodes);
+
+	if (nparts > 1) {
+		pthread_mutex_lock(&part_lock);
+		for (int i = 1; i < nparts; i++)
+			part_queue[part_queue_length++] = &parts[i];
+		pthread_cond_broadcast(&part_cond);
+		pthread_mutex_unlock(&part_lock);
+	}
+	merge_part(&parts[0]);
+	if (nparts > 1) {
+		pthread_mutex_lock(&part_lock);
+		for (int i = 1; i < nparts; i++) {
+			while (!parts[i].done) {
+				if (part_queue_length) {
+					run_queued_part();
+				} else {
+					pthread_cond_wait(&done_cond, &part_lock);
+				}
+			}
+		}
+		pthread_mutex_unlock(&part_lock);
+	}
+
+	/* Join the slices. */
+	int merge_count = 0;
+	for (int i = 0; i < nparts; i++) {
+		struct merge_part *p = &parts[i];
+		if (p->stale) return 0;
+		memmove(sstate->merged + merge_count, p->merged, p->merge_count * sizeof(int));
+		merge_count += p->merge_count;
+		for (int b = 0; b < MAX_BUCKETS; b++)
+			bucket_count[b] += p->bucket_count[b];
 	}
 	return merge_count;
 }
@@ -290,48 +497,82 @@ get_new_stats(struct incr_stats *buf, struct slave_state *sstate, int cmd_id)
 
 	/* Put the best increments in the output buffer. */
 	int output_nodes = output_stats(buf, sstate, bucket_count, merge_count);
+	int output_size = output_nodes * sizeof(*buf);
+	if (sstate->wire_version && output_nodes) {
+		output_size = stats_encode(buf, output_nodes, sstate->wire_stats,
+					   sstate->wire_scratch, sstate->wire_compress);
+		memcpy(buf, sstate->wire_stats, output_size);
+	}
 
+	double merge_time = time_now() - start;
 	if (DEBUGVV(2)) {
 		char b[1024];
 		snprintf(b, sizeof(b), "merged %d..%d missed %d %d/%d nodes,"
-			 " output %d/%d nodes in %.3fms (clear %.3fms)\n",
+			 " output %d/%d nodes %d bytes in %.3fms (clear %.3fms)\n",
 			 min, max, missed, merge_count, nodes_read, output_nodes,
-			 sstate->max_buf_size / (int)sizeof(*buf),
-			 (time_now() - start)*1000, clear_time*1000);
+			 sstate->max_buf_size / (int)sizeof(*buf), output_size,
+			 merge_time*1000, clear_time*1000);
 		logline(&sstate->client, "= ", b);
 	}
 
 	protocol_lock();
+	total_merge_time += merge_time;
+	total_merges++;
 
-	return output_nodes * sizeof(*buf);
+	return output_size;
 }
 
 /* Allocate the buffers in the merge specific part of the slave sate,
- * and reserve space for a terminator value (see merge_insert_hook). */
+ * and reserve space for a terminator value (see merge_insert_hook).
+ * Encoded stats always fit in the buffers of raw stats. */
 static void
 merge_state_alloc(struct slave_state *sstate)
 {
 	sstate->stats_htable = calloc2(1 << sstate->stats_hbits, sizeof(struct incr_stats));
 	sstate->merged = malloc2(sstate->max_merged_nodes * sizeof(int));
+	sstate->wire_stats = malloc2(sstate->max_buf_size);
+	sstate->wire_scratch = malloc2(sstate->max_buf_size);
 	sstate->max_buf_size -= sizeof(struct incr_stats);
 }
 
-/* Append a terminator value to make merge_new_stats() more
- * efficient. merge_state_alloc() has reserved enough space. */
-static void
-merge_insert_hook(struct incr_stats *buf, int size)
+/* Decode the stats received in the compact wire format, then append
+ * a terminator value to make merge_new_stats() more efficient.
+ * merge_state_alloc() has reserved enough space.
+ * The slave lock is held on both entry and exit of this function,
+ * decoding is linear and much faster than the merge. */
+static int
+merge_insert_hook(struct incr_stats *buf, int size, char *reply, struct slave_state *sstate)
 {
-	int nodes = size / sizeof(*buf);
+	int version;
+	bool compress;
+	wire_size(reply, &version, &compress);
+
+	int nodes;
+	if (version) {
+		int max_nodes = sstate->max_buf_size / sizeof(*buf);
+		nodes = stats_decode(buf, size, sstate->wire_stats, max_nodes, sstate->wire_scratch);
+		if (nodes < 0) return -1;
+		memcpy(buf, sstate->wire_stats, nodes * sizeof(*buf));
+	} else {
+		if (size % sizeof(*buf)) return -1;
+		nodes = size / sizeof(*buf);
+	}
 	buf[nodes].coord_path = INT64_MAX;
+	return nodes * sizeof(*buf);
 }
 
-/* Initiliaze merge-related fields of the default slave state. */
+/* Initiliaze merge-related fields of the default slave state, and
+ * start threads - 1 merge threads.
+ * Stats are sent in the given wire format, 0 for raw incr_stats. */
 void
-merge_init(struct slave_state *sstate, int shared_nodes, int stats_hbits, int max_slaves)
+merge_init(struct slave_state *sstate, int shared_nodes, int stats_hbits, int max_slaves,
+	   int threads, int wire_version, bool wire_compress)
 {
 	/* See merge_state_alloc() for shared_nodes + 1 */
 	sstate->max_buf_size = (shared_nodes + 1) * sizeof(struct incr_stats);
 	sstate->stats_hbits = stats_hbits;
+	sstate->wire_version = wire_version;
+	sstate->wire_compress = wire_compress;
 
 	sstate->insert_hook = (buffer_hook)merge_insert_hook;
 	sstate->alloc_hook = merge_state_alloc;
@@ -344,4 +585,13 @@ merge_init(struct slave_state *sstate, int shared_nodes, int stats_hbits, int ma
 	 * Restricting the maximum number of merged nodes to the latter avoids
 	 * spending excessive time on the merge. */
 	sstate->max_merged_nodes = shared_nodes * (max_slaves - 1);
+
+	/* Each slave thread queues at most threads - 1 slices. */
+	merge_threads = threads > 1 ? threads : 1;
+	part_queue = malloc2(max_slaves * merge_threads * sizeof(*part_queue));
+	for (int i = 1; i < merge_threads; i++) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, merge_thread, NULL);
+		pthread_detach(thread);
+	}
 }
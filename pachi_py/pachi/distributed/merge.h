@@ -4,6 +4,9 @@
 #include "distributed/protocol.h"
 
 void merge_print_stats(int total_hnodes);
-void merge_init(struct slave_state *sstate, int shared_nodes, int stats_hbits, int max_slaves);
+/* Total time spent merging stats and number of merges so far. */
+void merge_time_stats(double *time, long *merges);
+void merge_init(struct slave_state *sstate, int shared_nodes, int stats_hbits, int max_slaves,
+		int threads, int wire_version, bool wire_compress);
 
 #endif
@@ -14,7 +14,15 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <errno.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#define HAVE_EPOLL
+#endif
 
 #define DEBUG
 
@@ -25,6 +33,7 @@
 #include "debug.h"
 #include "distributed/distributed.h"
 #include "distributed/protocol.h"
+#include "distributed/wire.h"
 
 /* All gtp commands for current game separated by \n */
 static char gtp_cmds[CMDS_SIZE];
@@ -318,7 +327,7 @@ get_free_buf(struct slave_state *sstate)
  * recent buffer allocated by the calling thread.
  * slave_lock is held on both entry and exit of this function. */
 static void
-insert_buf(struct slave_state *sstate, void *buf, int size)
+insert_buf(struct slave_state *sstate, void *buf, int size, char *reply)
 {
 	assert(queue_length < queue_max_length);
 
@@ -327,7 +336,11 @@ insert_buf(struct slave_state *sstate, void *buf, int size)
 
 	/* Update the buffer if necessary before making it
 	 * available to other threads. */
-	if (sstate->insert_hook) sstate->insert_hook(buf, size);
+	if (sstate->insert_hook) size = sstate->insert_hook(buf, size, reply, sstate);
+	if (size < 0) {
+		logline(&sstate->client, "? ", "bad binary reply\n");
+		return;
+	}
 
 	if (DEBUGVV(7)) {
 		char b[1024];
@@ -390,7 +403,7 @@ process_reply(int reply_id, char *reply, char *reply_buf,
 		*reply_slot = reply_count++;
 	gtp_replies[*reply_slot] = reply_buf;
 
-	if (bin_size) insert_buf(sstate, bin_reply, bin_size);
+	if (bin_size) insert_buf(sstate, bin_reply, bin_size, reply);
 
 	pthread_cond_signal(&reply_cond);
 	*last_reply_id = reply_id;
@@ -422,12 +435,16 @@ get_binary_arg(struct slave_state *sstate, char *cmd, int cmd_size, int *bin_siz
 	/* Check that the command is still valid. */
 	if (atoi(gtp_cmd) != cmd_id) return NULL;
 
-	/* Set the correct binary size for this slave.
-	 * cmd may have been overwritten with new parameters. */
+	/* Set the correct binary size for this slave, keeping the
+	 * wire format. cmd may have been overwritten with new parameters. */
 	*bin_size = size;
 	s = strchr(cmd, '@');
 	assert(s);
-	snprintf(s, cmd + cmd_size - s, "@%d\n", size);
+	int version;
+	bool compress;
+	wire_size(s, &version, &compress);
+	s += wire_tag(s, cmd + cmd_size - s, size, version, compress);
+	snprintf(s, cmd + cmd_size - s, "\n");
 	return buf;
 }
 
@@ -548,6 +565,500 @@ slave_thread(void *arg)
 	pthread_exit(NULL);
 }
 
+#ifdef HAVE_EPOLL
+
+/* Event-driven transport: instead of one slave_thread per slave doing
+ * blocking stdio, a single io_thread multiplexes all slave connections
+ * with epoll on non-blocking sockets. Each connection slot keeps the
+ * state slave_loop() keeps on its stack, plus buffers for the partial
+ * command being written and the partial reply being read. The wire
+ * format does not change: a reply is framed by its empty line, and its
+ * binary part (if any) by the @size in its first line.
+ * The io thread holds slave_lock while it processes events, but never
+ * while it waits for them. It does socket I/O only: the binary args of
+ * a genmoves (the stats merged from the other slaves, which take most
+ * of the time) are prepared by args threads, which then start sending
+ * the command themselves. */
+
+enum conn_phase {
+	CONN_FREE,  // slot available for a new connection
+	CONN_NAME,  // identity check sent, waiting for the reply
+	CONN_IDLE,  // in sync, waiting for a new gtp command
+	CONN_ARGS,  // binary args of the next command queued or being prepared
+	CONN_BUSY,  // command being sent or reply being received
+	CONN_CLOSED, // closed while in CONN_ARGS, freed by the args thread
+};
+
+struct slave_conn {
+	int fd;
+	enum conn_phase phase;
+	bool used;   // had an active slave before: buffers allocated, resend history
+	bool resend;
+	int last_cmd_count;
+	int last_reply_id;
+	int reply_slot;
+	struct slave_state sstate;
+
+	/* Command being sent: cmd[out_pos..cmd_len) then the binary
+	 * args, which the binary reply overwrites afterwards. */
+	char cmd[CMDS_SIZE];
+	int cmd_len;
+	int out_pos;
+	void *bin_buf;
+	int bin_size;
+
+	/* Reply being received: the ascii part up to its empty line
+	 * (reply_len bytes, scanned up to scan_pos), then bin_read out
+	 * of bin_expected bytes read straight into bin_buf. */
+	char reply[CMDS_SIZE];
+	int reply_len;
+	int scan_pos;
+	int header_len;
+	int bin_expected;
+	int bin_read;
+	double start;
+
+	/* Last complete reply, pointed to by gtp_replies. */
+	char reply_buf[CMDS_SIZE];
+};
+
+static void __attribute__((noreturn))
+io_die(char *msg)
+{
+	perror(msg);
+	exit(42);
+}
+
+static struct slave_conn *conns;
+static int max_conns;
+static int epoll_fd = -1;
+static int wake_fd = -1;
+static bool listening;
+
+/* Connections waiting for an args thread, at most one entry each. */
+static struct slave_conn **args_queue;
+static int args_head, args_count;
+static pthread_cond_t args_cond = PTHREAD_COND_INITIALIZER;
+
+/* epoll data for the listening socket and the wake up eventfd;
+ * connections use their slave_conn. */
+static char listen_tag, wake_tag;
+
+static void
+conn_epoll(struct slave_conn *c, int op, bool want_write)
+{
+	struct epoll_event ev = { .events = EPOLLIN | (want_write ? EPOLLOUT : 0),
+				  .data.ptr = c };
+	if (epoll_ctl(epoll_fd, op, c->fd, &ev) == -1)
+		io_die("epoll_ctl");
+}
+
+static void
+listen_epoll(int op)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listen_tag };
+	if (epoll_ctl(epoll_fd, op, default_sstate.slave_sock, &ev) == -1)
+		io_die("epoll_ctl");
+	listening = op == EPOLL_CTL_ADD;
+}
+
+/* Close the connection and free its slot. If the slave was active,
+ * the next connection in this slot gets the command history.
+ * slave_lock is held on both entry and exit of this function. */
+static void
+conn_close(struct slave_conn *c)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	if (c->phase == CONN_IDLE || c->phase == CONN_ARGS || c->phase == CONN_BUSY) {
+		assert(active_slaves > 0);
+		active_slaves--;
+		// Unblock main thread if it was waiting for this slave.
+		pthread_cond_signal(&reply_cond);
+		c->used = true;
+		if (DEBUGL(2))
+			logline(&c->sstate.client, "= ", "lost slave\n");
+	}
+	/* An args thread may still be using the slave state. */
+	if (c->phase == CONN_ARGS) {
+		c->phase = CONN_CLOSED;
+		return;
+	}
+	c->phase = CONN_FREE;
+	if (!listening) listen_epoll(EPOLL_CTL_ADD);
+}
+
+/* Write as much pending output as the socket takes. The command and
+ * its binary args go out in a single call, so that Nagle's algorithm
+ * does not hold back the binary part.
+ * Return false if the connection is broken. */
+static bool
+conn_write(struct slave_conn *c)
+{
+	int total = c->cmd_len + c->bin_size;
+	while (c->out_pos < total) {
+		struct iovec iov[2];
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 0 };
+		if (c->out_pos < c->cmd_len) {
+			iov[msg.msg_iovlen].iov_base = c->cmd + c->out_pos;
+			iov[msg.msg_iovlen++].iov_len = c->cmd_len - c->out_pos;
+		}
+		if (c->bin_size) {
+			int bin_pos = c->out_pos > c->cmd_len ? c->out_pos - c->cmd_len : 0;
+			iov[msg.msg_iovlen].iov_base = (char *)c->bin_buf + bin_pos;
+			iov[msg.msg_iovlen++].iov_len = c->bin_size - bin_pos;
+		}
+		ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return false;
+		}
+		c->out_pos += n;
+	}
+	conn_epoll(c, EPOLL_CTL_MOD, c->out_pos < total);
+	return true;
+}
+
+/* Start sending the given command, with bin_size bytes of binary args
+ * in bin_buf, and prepare for the reply. */
+static bool
+conn_send(struct slave_conn *c, char *to_send, void *bin_buf, int bin_size)
+{
+	c->cmd_len = strnlen(to_send, CMDS_SIZE - 1);
+	memcpy(c->cmd, to_send, c->cmd_len);
+	c->cmd[c->cmd_len] = '\0';
+	c->out_pos = 0;
+	c->bin_buf = bin_buf;
+	c->bin_size = bin_size;
+	c->start = time_now();
+
+	if (DEBUGV(strchr(c->cmd, '@'), 2)) {
+		char buf[CMDS_SIZE];
+		strcpy(buf, c->cmd);
+		if (!DEBUGL(3)) {
+			char *s = strchr(buf, '\n');
+			if (s) s[1] = '\0';
+		}
+		logline(&c->sstate.client, ">>", buf);
+	}
+	return conn_write(c);
+}
+
+/* Send the next command to an idle slave, or the history if it is out
+ * of sync, getting binary arguments first if necessary. This is the
+ * event-driven equivalent of the top of the slave_loop() loop. If the
+ * command takes binary args, queue the connection for an args thread
+ * instead, unless called from one (@in_args_thread).
+ * Return false if the connection is broken.
+ * slave_lock is held on both entry and exit of this function. */
+static bool
+conn_next_command(struct slave_conn *c, bool in_args_thread)
+{
+	for (;;) {
+		if (!c->resend && c->last_cmd_count == cmd_count) {
+			c->phase = CONN_IDLE;
+			return true;
+		}
+		/* Several commands may have been issued since the last
+		 * reply, while the slave was idle or queued. */
+		if (!c->resend && c->last_reply_id != atoi(gtp_cmd)
+		    && next_command(c->last_reply_id) != gtp_cmd)
+			c->resend = true;
+		if (!in_args_thread && c->sstate.args_hook && strchr(gtp_cmd, '@')) {
+			c->phase = CONN_ARGS;
+			args_queue[(args_head + args_count++) % max_conns] = c;
+			pthread_cond_signal(&args_cond);
+			return true;
+		}
+		char *to_send = c->resend ? next_command(c->last_reply_id) : gtp_cmd;
+
+		if (DEBUGL(1) && to_send != gtp_cmd)
+			logline(&c->sstate.client, "? ",
+				to_send == gtp_cmds ? "resend all\n" : "partial resend\n");
+
+		int bin_size = 0;
+		void *bin_buf = get_binary_arg(&c->sstate, gtp_cmd,
+					       gtp_cmds + CMDS_SIZE - gtp_cmd,
+					       &bin_size);
+		/* get_binary_arg() may have released slave_lock. */
+		if (c->phase == CONN_CLOSED) return false;
+		/* Check that the command is still valid. */
+		c->resend = true;
+		if (!bin_buf) continue;
+
+		c->last_cmd_count = cmd_count;
+		c->phase = CONN_BUSY;
+		return conn_send(c, to_send, bin_buf, bin_size);
+	}
+}
+
+/* Accept new slaves while there are free slots, and send them the
+ * identity check. Stop listening when all slots are used.
+ * slave_lock is held on both entry and exit of this function. */
+static void
+accept_slaves(void)
+{
+	for (;;) {
+		struct slave_conn *c = NULL;
+		for (int i = 0; i < max_conns && !c; i++)
+			if (conns[i].phase == CONN_FREE) c = &conns[i];
+		if (!c) {
+			listen_epoll(EPOLL_CTL_DEL);
+			return;
+		}
+		struct in_addr client;
+		int fd = try_server_connection(default_sstate.slave_sock, &client);
+		if (fd < 0) return;
+
+		c->fd = fd;
+		c->sstate.client = client;
+		c->phase = CONN_NAME;
+		c->reply_len = c->scan_pos = c->header_len = 0;
+		c->bin_expected = c->bin_read = 0;
+		conn_epoll(c, EPOLL_CTL_ADD, false);
+		if (DEBUGL(2)) {
+			char buf[128];
+			snprintf(buf, sizeof(buf), "new slave, id %d\n", c->sstate.thread_id);
+			logline(&client, "= ", buf);
+		}
+		if (!conn_send(c, "name\n", NULL, 0)) conn_close(c);
+	}
+}
+
+/* Minimimal check of slave identity, then set up the command loop.
+ * Return false if the connection must be closed. */
+static bool
+conn_activate(struct slave_conn *c)
+{
+	/* A single line "= Pachi..." and the empty line. */
+	char *eol = strchr(c->reply, '\n');
+	if (strncasecmp(c->reply, "= Pachi", 7) || eol != c->reply + c->header_len - 2) {
+		logline(&c->sstate.client, "? ", "bad slave\n");
+		return false;
+	}
+	if (!c->used) slave_state_alloc(&c->sstate);
+	c->resend = c->used;
+	c->last_cmd_count = 0;
+	c->last_reply_id = -1;
+	c->reply_slot = -1;
+	c->phase = CONN_IDLE;
+	active_slaves++;
+	return true;
+}
+
+/* Process the complete reply in c->reply (and c->bin_buf), then send
+ * the next command. This is the bottom of the slave_loop() loop.
+ * Return false if the connection must be closed.
+ * slave_lock is held on both entry and exit of this function. */
+static bool
+conn_reply(struct slave_conn *c)
+{
+	int len = c->header_len;
+	char saved = c->reply[len];
+	c->reply[len] = '\0';
+
+	bool ok;
+	if (c->phase == CONN_NAME) {
+		ok = conn_activate(c);
+	} else {
+		int reply_id = -1;
+		if ((*c->reply == '=' || *c->reply == '?') && isdigit(c->reply[1]))
+			reply_id = atoi(c->reply + 1);
+		if (DEBUGV(c->bin_expected, 2))
+			logline(&c->sstate.client, "<<", c->reply);
+		if (c->bin_expected && DEBUGVV(2)) {
+			char buf[1024];
+			snprintf(buf, sizeof(buf), "sent cmd %d+%d bytes, reply %d+%d bytes in %.4fms\n",
+				 c->cmd_len, c->bin_size, len, c->bin_expected,
+				 (time_now() - c->start)*1000);
+			logline(&c->sstate.client, "= ", buf);
+		}
+		ok = reply_id != -1;
+		if (ok) {
+			c->resend = process_reply(reply_id, c->reply, c->reply_buf,
+						  c->bin_buf, c->bin_expected, &c->last_reply_id,
+						  &c->reply_slot, &c->sstate);
+		}
+	}
+
+	/* Keep any bytes past the reply for the next one. */
+	c->reply[len] = saved;
+	c->reply_len -= len;
+	memmove(c->reply, c->reply + len, c->reply_len);
+	c->scan_pos = 0;
+	c->header_len = 0;
+	c->bin_expected = c->bin_read = 0;
+
+	return ok && conn_next_command(c, false);
+}
+
+/* Read what is available and process the replies completed.
+ * Return false if the connection must be closed. */
+static bool
+conn_read(struct slave_conn *c)
+{
+	for (;;) {
+		if (c->header_len && c->bin_read < c->bin_expected) {
+			/* Binary part, straight into the reply buffer. */
+			ssize_t n = recv(c->fd, (char *)c->bin_buf + c->bin_read,
+					 c->bin_expected - c->bin_read, 0);
+			if (n == 0) return false;
+			if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+			c->bin_read += n;
+		} else if (!c->header_len) {
+			/* Keep room for the terminating null. */
+			int room = CMDS_SIZE - 1 - c->reply_len;
+			if (room <= 0) return false;
+			ssize_t n = recv(c->fd, c->reply + c->reply_len, room, 0);
+			if (n == 0) return false;
+			if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+			c->reply_len += n;
+		}
+
+		/* Find the empty line ending the ascii part. */
+		if (!c->header_len) {
+			int from = c->scan_pos > 0 ? c->scan_pos - 1 : 0;
+			char *end = memmem(c->reply + from, c->reply_len - from, "\n\n", 2);
+			c->scan_pos = c->reply_len;
+			if (!end) continue;
+			if (c->phase != CONN_NAME && c->phase != CONN_BUSY) return false;
+			c->header_len = end + 2 - c->reply;
+
+			/* The binary size is the last parameter of the first line. */
+			char *eol = memchr(c->reply, '\n', c->header_len);
+			char *at = memchr(c->reply, '@', eol - c->reply);
+			c->bin_expected = at && c->bin_buf ? atoi(at + 1) : 0;
+			if (c->bin_expected < 0 || c->bin_expected > c->sstate.max_buf_size)
+				return false;
+
+			/* Binary bytes already read with the ascii part. */
+			int extra = c->reply_len - c->header_len;
+			c->bin_read = extra < c->bin_expected ? extra : c->bin_expected;
+			if (c->bin_read)
+				memcpy(c->bin_buf, c->reply + c->header_len, c->bin_read);
+			memmove(c->reply + c->header_len, c->reply + c->header_len + c->bin_read,
+				extra - c->bin_read);
+			c->reply_len -= c->bin_read;
+		}
+		if (c->bin_read < c->bin_expected) continue;
+		if (!conn_reply(c)) return false;
+	}
+}
+
+/* Thread serving all slave connections. */
+static void * __attribute__((noreturn))
+io_thread(void *arg)
+{
+	struct epoll_event events[64];
+	for (;;) {
+		int n = epoll_wait(epoll_fd, events, 64, -1);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			io_die("epoll_wait");
+		}
+		pthread_mutex_lock(&slave_lock);
+		for (int i = 0; i < n; i++) {
+			void *p = events[i].data.ptr;
+			if (p == &listen_tag) {
+				if (listening) accept_slaves();
+			} else if (p == &wake_tag) {
+				uint64_t count;
+				if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+					io_die("read");
+				for (int k = 0; k < max_conns; k++) {
+					if (conns[k].phase == CONN_IDLE && !conn_next_command(&conns[k], false))
+						conn_close(&conns[k]);
+				}
+			} else {
+				struct slave_conn *c = p;
+				/* The slot may have been closed by an earlier event. */
+				if (c->phase == CONN_FREE || c->phase == CONN_CLOSED) continue;
+				bool ok = true;
+				if (events[i].events & EPOLLOUT)
+					ok = conn_write(c);
+				if (ok && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+					ok = conn_read(c);
+				if (!ok) conn_close(c);
+			}
+		}
+		pthread_mutex_unlock(&slave_lock);
+	}
+	pthread_exit(NULL);
+}
+
+/* Thread preparing the binary args of the connections queued by
+ * conn_next_command(), and starting to send their command. */
+static void * __attribute__((noreturn))
+args_thread(void *arg)
+{
+	pthread_mutex_lock(&slave_lock);
+	for (;;) {
+		while (!args_count)
+			pthread_cond_wait(&args_cond, &slave_lock);
+		struct slave_conn *c = args_queue[args_head];
+		args_head = (args_head + 1) % max_conns;
+		args_count--;
+
+		if (c->phase != CONN_CLOSED && conn_next_command(c, true))
+			continue;
+		if (c->phase == CONN_CLOSED) {
+			/* Closed by the io thread meanwhile. */
+			c->phase = CONN_FREE;
+			if (!listening) listen_epoll(EPOLL_CTL_ADD);
+		} else {
+			conn_close(c);
+		}
+	}
+}
+
+/* Set up the connection slots and start the io thread, and
+ * @args_threads threads preparing binary args. */
+static void
+io_init(int max_slaves, int args_threads)
+{
+	max_conns = max_slaves;
+	/* Zeroed pages: the buffers of unused slots cost no memory. */
+	conns = calloc2(max_conns, sizeof(*conns));
+	for (int id = 0; id < max_conns; id++) {
+		conns[id].sstate = default_sstate;
+		conns[id].sstate.thread_id = id;
+	}
+
+	int sock = default_sstate.slave_sock;
+	if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == -1)
+		io_die("fcntl");
+	epoll_fd = epoll_create1(0);
+	wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (epoll_fd == -1 || wake_fd == -1)
+		io_die("epoll");
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &wake_tag };
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) == -1)
+		io_die("epoll_ctl");
+	listen_epoll(EPOLL_CTL_ADD);
+
+	args_queue = calloc2(max_conns, sizeof(*args_queue));
+	pthread_t thread;
+	for (int i = 0; i < args_threads; i++)
+		pthread_create(&thread, NULL, args_thread, NULL);
+	pthread_create(&thread, NULL, io_thread, NULL);
+}
+
+/* Wake up the io thread to send a new command to idle slaves.
+ * slave_lock is held on both entry and exit of this function. */
+static void
+io_wake(void)
+{
+	if (wake_fd < 0) return;
+	uint64_t one = 1;
+	if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		io_die("write");
+}
+
+#else
+static void io_wake(void) { }
+#endif /* HAVE_EPOLL */
+
 /* Create a new gtp command for all slaves. The slave lock is held
  * upon entry and upon return, so the command will actually be
  * sent when the lock is released. The last command is overwritten
@@ -585,6 +1096,7 @@ update_cmd(struct board *b, char *cmd, char *args, bool new_id)
 	}
 	// Notify the slave threads about the new command.
 	pthread_cond_broadcast(&cmd_cond);
+	io_wake();
 }
 
 /* Update the command history, then create a new gtp command
@@ -654,11 +1166,13 @@ get_replies(double time_limit, int min_replies)
  * 300*200=60000 genmoves per slave. */
 #define MAX_GENMOVES_PER_SLAVE 60000
 
-/* Allocate the receive queue, and create the slave and proxy threads.
+/* Allocate the receive queue, and create the slave and proxy threads,
+ * or with use_epoll (where available) a single io thread for all slaves
+ * and args_threads threads preparing their binary args.
  * max_buf_size and the merge-related fields of default_sstate must
  * already be initialized. */
 void
-protocol_init(char *slave_port, char *proxy_port, int max_slaves)
+protocol_init(char *slave_port, char *proxy_port, int max_slaves, bool use_epoll, int args_threads)
 {
 	start_time = time_now();
 
@@ -673,6 +1187,11 @@ protocol_init(char *slave_port, char *proxy_port, int max_slaves)
 	}
 
 	pthread_t thread;
+#ifdef HAVE_EPOLL
+	if (use_epoll) {
+		io_init(max_slaves, args_threads > 0 ? args_threads : 1);
+	} else
+#endif
 	for (int id = 0; id < max_slaves; id++) {
 		pthread_create(&thread, NULL, slave_thread, (void *)(intptr_t)id);
 	}
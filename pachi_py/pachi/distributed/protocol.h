@@ -20,7 +20,9 @@
 #define BUFFERS_PER_SLAVE (1 << BUFFERS_PER_SLAVE_BITS)
 
 struct slave_state;
-typedef void (*buffer_hook)(void *buf, int size);
+/* Prepare a received binary reply for the receive queue, given the
+ * ascii reply. Return its new size, or -1 to drop it. */
+typedef int (*buffer_hook)(void *buf, int size, char *reply, struct slave_state *sstate);
 typedef void (*state_alloc_hook)(struct slave_state *sstate);
 typedef int (*getargs_hook)(void *buf, struct slave_state *sstate, int cmd_id);
 
@@ -62,6 +64,13 @@ struct slave_state {
 	/* Hash indices updated by stats merge. */
 	int *merged;
 	int max_merged_nodes;
+
+	/* Wire format of the stats sent, see wire.h, and the
+	 * buffers to encode and decode them. */
+	int wire_version;
+	bool wire_compress;
+	struct incr_stats *wire_stats;
+	void *wire_scratch;
 };
 extern struct slave_state default_sstate;
 
@@ -74,7 +83,7 @@ void clear_receive_queue(void);
 void update_cmd(struct board *b, char *cmd, char *args, bool new_id);
 void new_cmd(struct board *b, char *cmd, char *args);
 void get_replies(double time_limit, int min_replies);
-void protocol_init(char *slave_port, char *proxy_port, int max_slaves);
+void protocol_init(char *slave_port, char *proxy_port, int max_slaves, bool use_epoll, int args_threads);
 
 extern int reply_count;
 extern char **gtp_replies;
@@ -0,0 +1,303 @@
+/* Compact encoding of the incremental stats exchanged between master
+ * and slaves, see wire.h. An encoded buffer is:
+ *   version    1 byte, STATS_WIRE_VERSION
+ *   flags      1 byte, STATS_WIRE_LZ or 0
+ *   nodes      varint
+ *   body_len   varint, only if compressed
+ *   body       LZ compressed if STATS_WIRE_LZ
+ * The body has for each node, by increasing coord path:
+ *   path       varint, difference with the previous path (or 0)
+ *   playouts   varint
+ *   value      2 bytes little endian, value quantized to 1/65535
+ * Paths are sorted and most nodes share their parent with the
+ * previous node, so most deltas fit in one or two bytes. A typical
+ * node takes 5 bytes instead of 16 or 24. */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "distributed/wire.h"
+
+#define VALUE_SCALE 65535
+
+int
+wire_size(char *line, int *version, bool *compress)
+{
+	*version = 0;
+	*compress = false;
+	char *s = strchr(line, '@');
+	if (!s) return 0;
+	int size = atoi(s + 1);
+	s += 1 + strspn(s + 1, "0123456789");
+	if (*s == ':') {
+		*version = atoi(s + 1);
+		s += 1 + strspn(s + 1, "0123456789");
+		*compress = *s == 'z';
+	}
+	return size;
+}
+
+int
+wire_tag(char *s, int n, int size, int version, bool compress)
+{
+	if (!version) return snprintf(s, n, "@%d", size);
+	return snprintf(s, n, "@%d:%d%s", size, version, compress ? "z" : "");
+}
+
+
+static inline unsigned char *
+put_varint(unsigned char *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/* Return NULL if the varint is truncated or too long. */
+static inline unsigned char *
+get_varint(unsigned char *p, unsigned char *end, uint64_t *v)
+{
+	*v = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) return p;
+	}
+	return NULL;
+}
+
+
+/* LZ4-style block compression: a sequence of tokens, each a run of
+ * literals followed by a match of at least LZ_MINMATCH bytes at a
+ * 16-bit backward offset. The token byte holds both lengths in
+ * 4 bits, longer lengths continue with bytes of 255 plus the rest.
+ * The last token has literals only. */
+#define LZ_MINMATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+static inline uint32_t
+read32(unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline unsigned char *
+lz_put_length(unsigned char *op, unsigned char *oend, int len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op >= oend) return NULL;
+		*op++ = 255;
+	}
+	if (op >= oend) return NULL;
+	*op++ = len;
+	return op;
+}
+
+/* Emit literals [anchor, ip) and, unless match_len is 0, a match.
+ * Return NULL on overflow of the output. */
+static unsigned char *
+lz_sequence(unsigned char *op, unsigned char *oend, unsigned char *anchor,
+	    int lit_len, int offset, int match_len)
+{
+	if (op >= oend) return NULL;
+	int ml = match_len ? match_len - LZ_MINMATCH : 0;
+	unsigned char *token = op++;
+	*token = (lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15);
+	if (lit_len >= 15 && !(op = lz_put_length(op, oend, lit_len - 15))) return NULL;
+	if (oend - op < lit_len) return NULL;
+	memcpy(op, anchor, lit_len);
+	op += lit_len;
+	if (!match_len) return op;
+
+	if (oend - op < 2) return NULL;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	if (ml >= 15 && !(op = lz_put_length(op, oend, ml - 15))) return NULL;
+	return op;
+}
+
+/* Compress in[0..len-1] into out. Return the compressed size,
+ * or -1 if it would exceed max_out bytes. */
+static int
+lz_compress(unsigned char *in, int len, unsigned char *out, int max_out)
+{
+	int table[1 << LZ_HASH_BITS];
+	memset(table, -1, sizeof(table));
+
+	unsigned char *ip = in, *anchor = in, *iend = in + len;
+	unsigned char *op = out, *oend = out + max_out;
+	while (iend - ip >= LZ_MINMATCH) {
+		uint32_t seq = read32(ip);
+		int h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+		int ref = table[h];
+		table[h] = ip - in;
+		if (ref < 0 || ip - in - ref > LZ_MAX_OFFSET || read32(in + ref) != seq) {
+			ip++;
+			continue;
+		}
+		unsigned char *match = in + ref;
+		int match_len = LZ_MINMATCH;
+		while (ip + match_len < iend && match[match_len] == ip[match_len])
+			match_len++;
+
+		op = lz_sequence(op, oend, anchor, ip - anchor, ip - match, match_len);
+		if (!op) return -1;
+		ip += match_len;
+		anchor = ip;
+	}
+	op = lz_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	return op ? op - out : -1;
+}
+
+static inline unsigned char *
+lz_get_length(unsigned char *ip, unsigned char *iend, int *len)
+{
+	unsigned char b;
+	do {
+		if (ip >= iend) return NULL;
+		b = *ip++;
+		*len += b;
+	} while (b == 255 && *len < INT_MAX / 2);
+	return b == 255 ? NULL : ip;
+}
+
+/* Decompress in[0..len-1] into exactly out_len bytes of out.
+ * Return false if the input is invalid. */
+static bool
+lz_decompress(unsigned char *in, int len, unsigned char *out, int out_len)
+{
+	unsigned char *ip = in, *iend = in + len;
+	unsigned char *op = out, *oend = out + out_len;
+	while (ip < iend) {
+		int token = *ip++;
+		int lit_len = token >> 4;
+		if (lit_len == 15 && !(ip = lz_get_length(ip, iend, &lit_len))) return false;
+		if (iend - ip < lit_len || oend - op < lit_len) return false;
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+		if (ip == iend) break;
+
+		if (iend - ip < 2) return false;
+		int offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		int match_len = token & 15;
+		if (match_len == 15 && !(ip = lz_get_length(ip, iend, &match_len))) return false;
+		match_len += LZ_MINMATCH;
+		if (!offset || offset > op - out || oend - op < match_len) return false;
+		/* Byte by byte: the match may overlap the output. */
+		for (unsigned char *match = op - offset; match_len--; )
+			*op++ = *match++;
+	}
+	return op == oend;
+}
+
+
+int
+stats_encode(struct incr_stats *stats, int nodes, void *out, void *scratch, bool compress)
+{
+	unsigned char *o = out;
+	*o++ = STATS_WIRE_VERSION;
+	*o++ = 0;
+	o = put_varint(o, nodes);
+
+	/* Without compression the body goes straight to the output. */
+	unsigned char *body = compress ? scratch : o;
+	unsigned char *p = body;
+	path_t prev = 0;
+	for (int n = 0; n < nodes; n++) {
+		assert(stats[n].coord_path > prev && stats[n].incr.playouts > 0);
+		p = put_varint(p, stats[n].coord_path - prev);
+		prev = stats[n].coord_path;
+		p = put_varint(p, stats[n].incr.playouts);
+
+		floating_t v = stats[n].incr.value;
+		int q = v <= 0 ? 0 : v >= 1 ? VALUE_SCALE : (int)(v * VALUE_SCALE + 0.5);
+		*p++ = q & 0xff;
+		*p++ = q >> 8;
+	}
+	int body_len = p - body;
+	if (!compress) return o + body_len - (unsigned char *)out;
+
+	/* Keep the compressed body only if it is smaller. */
+	unsigned char *header_end = o;
+	((unsigned char *)out)[1] = STATS_WIRE_LZ;
+	o = put_varint(o, body_len);
+	int lz_len = lz_compress(body, body_len, o, body_len - (o - header_end) - 1);
+	if (lz_len >= 0) return o + lz_len - (unsigned char *)out;
+
+	((unsigned char *)out)[1] = 0;
+	memcpy(header_end, body, body_len);
+	return header_end + body_len - (unsigned char *)out;
+}
+
+/* Parse the header. Return the start of the (maybe compressed) body,
+ * or NULL if the header is invalid. */
+static unsigned char *
+parse_header(unsigned char *in, int size, int *flags, int *nodes, int *body_len)
+{
+	unsigned char *end = in + size;
+	if (size < 3 || in[0] != STATS_WIRE_VERSION || (in[1] & ~STATS_WIRE_LZ))
+		return NULL;
+	*flags = in[1];
+	uint64_t v;
+	unsigned char *p = get_varint(in + 2, end, &v);
+	if (!p || v > INT_MAX / 16) return NULL;
+	*nodes = v;
+	*body_len = end - p;
+	if (*flags & STATS_WIRE_LZ) {
+		if (!(p = get_varint(p, end, &v)) || v > (uint64_t)16 * *nodes)
+			return NULL;
+		*body_len = v;
+	}
+	return p;
+}
+
+int
+stats_wire_nodes(void *in, int size)
+{
+	int flags, nodes, body_len;
+	return parse_header(in, size, &flags, &nodes, &body_len) ? nodes : -1;
+}
+
+int
+stats_decode(void *in, int size, struct incr_stats *stats, int max_nodes, void *scratch)
+{
+	int flags, nodes, body_len;
+	unsigned char *p = parse_header(in, size, &flags, &nodes, &body_len);
+	if (!p || nodes > max_nodes) return -1;
+
+	if (flags & STATS_WIRE_LZ) {
+		unsigned char *end = (unsigned char *)in + size;
+		if (!lz_decompress(p, end - p, scratch, body_len)) return -1;
+		p = scratch;
+	}
+	unsigned char *end = p + body_len;
+
+	path_t prev = 0;
+	for (int n = 0; n < nodes; n++) {
+		uint64_t delta, playouts;
+		if (!(p = get_varint(p, end, &delta)) || !delta || delta > (uint64_t)(PATH_T_MAX - prev))
+			return -1;
+		if (!(p = get_varint(p, end, &playouts)) || !playouts || playouts > INT_MAX)
+			return -1;
+		if (end - p < 2) return -1;
+		int q = p[0] | p[1] << 8;
+		p += 2;
+
+		prev += delta;
+		stats[n].coord_path = prev;
+		stats[n].incr.playouts = playouts;
+		stats[n].incr.value = (floating_t)q / VALUE_SCALE;
+	}
+	return p == end ? nodes : -1;
+}
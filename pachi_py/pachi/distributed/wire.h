@@ -0,0 +1,49 @@
+#ifndef PACHI_DISTRIBUTED_WIRE_H
+#define PACHI_DISTRIBUTED_WIRE_H
+
+#include <stdbool.h>
+
+#include "distributed/distributed.h"
+
+/* Compact wire format for the incr_stats exchanged between master
+ * and slaves. The binary size of a command or reply is given by
+ * "@size" at the end of its first line; "@size:1" marks a buffer
+ * in version 1 of the compact format instead of a raw array of
+ * incr_stats, and "@size:1z" also asks the peer to compress its
+ * own stats. The peer replies in the format of the command it got,
+ * so raw and compact slaves can mix. */
+#define STATS_WIRE_VERSION 1
+
+/* Header flag: the body is LZ compressed. */
+#define STATS_WIRE_LZ 1
+
+/* Upper bound of the encoded size of the given number of nodes:
+ * 2 bytes + 2 varints of header, then at most 9 bytes for the path
+ * delta, 5 for the playouts and 2 for the value per node. This is
+ * always less than the raw size plus one terminator. */
+#define stats_wire_max(nodes) (12 + 16 * (nodes))
+
+/* Parse "@size[:version[z]]" in line. Return the size, 0 if none.
+ * Set *version to 0 for raw incr_stats, and *compress if the
+ * peer asks for compressed stats. */
+int wire_size(char *line, int *version, bool *compress);
+
+/* Write "@size[:version[z]]" in s, of length n. Return the length. */
+int wire_tag(char *s, int n, int size, int version, bool compress);
+
+/* Encode stats[0..nodes-1], sorted by increasing coord path, in out
+ * which must have stats_wire_max(nodes) bytes. If compress is set,
+ * scratch must have the same size. Return the encoded size. */
+int stats_encode(struct incr_stats *stats, int nodes, void *out, void *scratch, bool compress);
+
+/* Return the number of nodes in the encoded buffer, or -1 if the
+ * buffer is invalid or of an unknown version. */
+int stats_wire_nodes(void *in, int size);
+
+/* Decode in[0..size-1] into stats, which must have room for
+ * max_nodes nodes. scratch must have stats_wire_max(max_nodes)
+ * bytes to decode compressed buffers. Return the number of nodes,
+ * or -1 if the buffer is invalid. */
+int stats_decode(void *in, int size, struct incr_stats *stats, int max_nodes, void *scratch);
+
+#endif
@@ -8,6 +8,7 @@
 #include "board.h"
 #include "debug.h"
 #include "fbook.h"
+#include "modeldata.h"
 #include "random.h"
 
 
@@ -59,15 +60,17 @@ fbook_check(struct board *board)
 	return cf;
 }
 
-static struct fbook *fbcache;
+struct fbook_load_arg {
+	char *filename;
+	struct board *b;
+};
 
-struct fbook *
-fbook_init(char *filename, struct board *b)
+static void *
+fbook_load(const char *key, void *arg)
 {
-	if (fbcache && fbcache->bsize == board_size(b)
-	    && fbcache->handicap == b->handicap)
-		return fbcache;
-
+	struct fbook_load_arg *la = arg;
+	char *filename = la->filename;
+	struct board *b = la->b;
 	FILE *f = fopen(filename, "r");
 	if (!f) {
 		perror(filename);
@@ -181,20 +184,26 @@ fbook_init(char *filename, struct board *b)
 
 	if (!fbook->movecnt) {
 		/* Empty book is not worth the hassle. */
-		fbook_done(fbook);
+		free(fbook);
 		return NULL;
 	}
 
-	struct fbook *fbold = fbcache;
-	fbcache = fbook;
-	if (fbold)
-		fbook_done(fbold);
-
 	return fbook;
 }
 
+struct fbook *
+fbook_init(char *filename, struct board *b)
+{
+	/* The book is loaded once per board size and handicap and shared
+	 * by all the boards; the candidate moves are thus picked once
+	 * per process too. */
+	char key[1100];
+	snprintf(key, sizeof(key), "fbook %s %d/%d", filename, board_size(b) - 2, b->handicap);
+	struct fbook_load_arg la = { .filename = filename, .b = b };
+	return modeldata_get(key, fbook_load, &la, free);
+}
+
 void fbook_done(struct fbook *fbook)
 {
-	if (fbook != fbcache)
-		free(fbook);
+	modeldata_put(fbook);
 }
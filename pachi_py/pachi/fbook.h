@@ -22,6 +22,8 @@ struct fbook {
 };
 
 coord_t fbook_check(struct board *board);
+/* Get the book for the board size and handicap of b; it is shared
+ * read-only model data (see modeldata.h), released by fbook_done(). */
 struct fbook *fbook_init(char *filename, struct board *b);
 void fbook_done(struct fbook *fbook);
 
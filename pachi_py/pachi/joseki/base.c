@@ -1,35 +1,130 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #define DEBUG
 #include "board.h"
 #include "debug.h"
+#include "modeldata.h"
 #include "move.h"
 #include "joseki/base.h"
 
 
-struct joseki_dict *
-joseki_init(int bsize)
+/* Compiled dictionary file format, in native byte order: header,
+ * index[1 << hash_bits] at index_offset and moves[nmoves] at
+ * moves_offset. Bump JOSEKI_CACHE_VERSION on any layout change. */
+
+#define JOSEKI_CACHE_MAGIC "PACHIJSK"
+#define JOSEKI_CACHE_VERSION 1
+#define JOSEKI_CACHE_BYTE_ORDER 0x01020304
+
+struct joseki_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t header_size;
+	uint32_t coord_size;
+	uint32_t hash_bits;
+	uint32_t bsize;
+	uint32_t nmoves;
+	uint32_t reserved;
+	uint64_t index_offset, moves_offset;
+	uint64_t size;
+};
+
+static void
+joseki_cache_layout(struct joseki_cache_header *h)
 {
-	struct joseki_dict *jd = calloc(1, sizeof(*jd));
+	h->index_offset = (sizeof(*h) + 7) & ~7ULL;
+	h->moves_offset = h->index_offset + (sizeof(uint32_t) * 2 << joseki_hash_bits);
+	h->size = h->moves_offset + (uint64_t) h->nmoves * sizeof(coord_t);
+}
+
+static void
+joseki_cache_save(struct joseki_dict *jd, char *cachename)
+{
+	struct joseki_cache_header h = {
+		.magic = JOSEKI_CACHE_MAGIC, .version = JOSEKI_CACHE_VERSION,
+		.byte_order = JOSEKI_CACHE_BYTE_ORDER, .header_size = sizeof(h),
+		.coord_size = sizeof(coord_t), .hash_bits = joseki_hash_bits,
+		.bsize = jd->bsize, .nmoves = jd->nmoves,
+	};
+	joseki_cache_layout(&h);
+
+	/* Write a new file and rename it over the old one,
+	 * which other processes may have mapped. */
+	char tmpname[1100];
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", cachename);
+	FILE *f = fopen(tmpname, "wb");
+	if (!f) {
+		if (DEBUGL(2))
+			perror(tmpname);
+		return;
+	}
+	static const char zeros[8];
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1
+		  && fwrite(zeros, h.index_offset - sizeof(h), 1, f) <= 1
+		  && fwrite(jd->index, sizeof(jd->index[0]), 1 << joseki_hash_bits, f) == 1 << joseki_hash_bits
+		  && fwrite(jd->moves, sizeof(coord_t), jd->nmoves, f) == jd->nmoves;
+	ok = !fclose(f) && ok;
+	if (!ok || rename(tmpname, cachename)) {
+		if (DEBUGL(2))
+			perror(tmpname);
+		remove(tmpname);
+	}
+}
+
+/* Map the compiled dictionary if it is up to date. Like the pattern
+ * cache, it is only used while the text dictionary is there. */
+static struct joseki_dict *
+joseki_cache_load(char *cachename, char *filename, int bsize)
+{
+	if (access(filename, R_OK) || modeldata_file_older(cachename, filename))
+		return NULL;
+	size_t size;
+	void *map = modeldata_map(cachename, sizeof(struct joseki_cache_header), &size);
+	if (!map) return NULL;
+
+	struct joseki_cache_header *h = map, l = *h;
+	joseki_cache_layout(&l);
+	if (memcmp(h->magic, JOSEKI_CACHE_MAGIC, sizeof(h->magic)) || h->version != JOSEKI_CACHE_VERSION
+	    || h->byte_order != JOSEKI_CACHE_BYTE_ORDER || h->header_size != sizeof(*h)
+	    || h->coord_size != sizeof(coord_t) || h->hash_bits != joseki_hash_bits
+	    || h->bsize != (uint32_t) bsize || !h->nmoves
+	    || memcmp(h, &l, sizeof(l)) || h->size > size) {
+		if (DEBUGL(2))
+			fprintf(stderr, "%s: stale or invalid joseki dictionary cache, ignored.\n", cachename);
+		modeldata_unmap(map, size);
+		return NULL;
+	}
+
+	struct joseki_dict *jd = calloc2(1, sizeof(*jd));
 	jd->bsize = bsize;
-	jd->patterns = calloc(1 << joseki_hash_bits, sizeof(jd->patterns[0]));
+	jd->index = map + h->index_offset;
+	jd->moves = map + h->moves_offset;
+	jd->nmoves = h->nmoves;
+	jd->map = map;
+	jd->map_size = size;
 	return jd;
 }
 
-struct joseki_dict *
-joseki_load(int bsize)
+static struct joseki_dict *
+joseki_load_text(char *filename, int bsize)
 {
-	char fname[1024];
-	snprintf(fname, 1024, "joseki%d.pdict", bsize - 2);
-	FILE *f = fopen(fname, "r");
+	FILE *f = fopen(filename, "r");
 	if (!f) {
 		if (DEBUGL(3))
-			perror(fname);
+			perror(filename);
 		return NULL;
 	}
-	struct joseki_dict *jd = joseki_init(bsize);
+	struct joseki_dict *jd = calloc2(1, sizeof(*jd));
+	jd->bsize = bsize;
+	jd->index = calloc2(1 << joseki_hash_bits, sizeof(jd->index[0]));
+	unsigned int nalloc = 1024;
+	jd->moves = malloc2(nalloc * sizeof(coord_t));
+	jd->moves[jd->nmoves++] = pass;
 
 	char linebuf[1024];
 	while (fgets(linebuf, 1024, f)) {
@@ -47,36 +142,79 @@ joseki_load(int bsize)
 		char *cs = strrchr(line, ' '); assert(cs);
 		*cs++ = 0;
 		int count = atoi(cs);
-		
-		coord_t **ccp = &jd->patterns[h].moves[color - 1];
-		assert(!*ccp);
-		*ccp = calloc2(count + 1, sizeof(coord_t));
-		coord_t *cc = *ccp;
+
+		uint32_t *ip = &jd->index[h & joseki_hash_mask][color - 1];
+		assert(!*ip);
+		while (jd->nmoves + count + 1 > nalloc) {
+			nalloc *= 2;
+			jd->moves = realloc(jd->moves, nalloc * sizeof(coord_t));
+			if (!jd->moves) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		*ip = jd->nmoves;
+		coord_t *cc = &jd->moves[*ip];
 		while (*line) {
-			assert(cc - *ccp < count);
+			assert(cc - &jd->moves[*ip] < count);
 			coord_t *c = str2coord(line, bsize);
 			*cc++ = *c;
 			coord_done(c);
 			line += strcspn(line, " ");
 			line += strspn(line, " ");
 		}
-		*cc = pass;
+		*cc++ = pass;
+		jd->nmoves = cc - jd->moves;
 	}
 
 	fclose(f);
+	return jd;
+}
+
+static void *
+joseki_load_shared(const char *key, void *arg)
+{
+	int bsize = *(int *) arg;
+	char fname[1000], cachename[1024];
+	snprintf(fname, sizeof(fname), "joseki%d.pdict", bsize - 2);
+	snprintf(cachename, sizeof(cachename), "%s.cache", fname);
+
+	struct joseki_dict *jd = joseki_cache_load(cachename, fname, bsize);
+	if (!jd) {
+		jd = joseki_load_text(fname, bsize);
+		if (!jd)
+			return NULL;
+		joseki_cache_save(jd, cachename);
+	}
 	if (DEBUGL(2))
-		fprintf(stderr, "Joseki dictionary for board size %d loaded.\n", bsize - 2);
+		fprintf(stderr, "Joseki dictionary for board size %d loaded%s.\n",
+			bsize - 2, jd->map ? " from cache" : "");
 	return jd;
 }
 
-void
-joseki_done(struct joseki_dict *jd)
+static void
+joseki_free(void *data)
 {
-	if (!jd) return;
-	for( unsigned long pid = 0; pid < 1<<joseki_hash_bits ; pid++){
-		free(jd->patterns[pid].moves[0]);
-		free(jd->patterns[pid].moves[1]);
+	struct joseki_dict *jd = data;
+	if (jd->map) {
+		modeldata_unmap(jd->map, jd->map_size);
+	} else {
+		free(jd->index);
+		free(jd->moves);
 	}
-	free(jd->patterns);
 	free(jd);
 }
+
+struct joseki_dict *
+joseki_load(int bsize)
+{
+	char key[64];
+	snprintf(key, sizeof(key), "joseki %d", bsize - 2);
+	return modeldata_get(key, joseki_load_shared, &bsize, joseki_free);
+}
+
+void
+joseki_done(struct joseki_dict *jd)
+{
+	modeldata_put(jd);
+}
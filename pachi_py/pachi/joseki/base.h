@@ -3,23 +3,43 @@
 
 #include "board.h"
 
-/* Single joseki situation - moves for S_BLACK-1, S_WHITE-1. */
-struct joseki_pattern {
-	/* moves[] is a pass-terminated list or NULL */
-	coord_t *moves[2];
-};
-
-/* The joseki dictionary for given board size. */
+/* The joseki dictionary for given board size. It is shared read-only
+ * model data (see modeldata.h): loaded once for all engines, and kept
+ * in a compiled file (joseki19.pdict.cache) mapped by all processes. */
 struct joseki_dict {
 	int bsize;
 
-#define joseki_hash_bits 20 // 8M w/ 32-bit pointers
+#define joseki_hash_bits 20 // 8M w/ 32-bit offsets
 #define joseki_hash_mask ((1 << joseki_hash_bits) - 1)
-	struct joseki_pattern *patterns;
+	/* Moves for S_BLACK-1, S_WHITE-1 in a quadrant position with
+	 * given hash are the pass-terminated list at moves[index[h][c]],
+	 * or there are none if the index is 0. */
+	uint32_t (*index)[2];
+	coord_t *moves; /* [nmoves], moves[0] is a dummy pass */
+	unsigned int nmoves;
+
+	/* Set if loaded from the compiled file; the arrays are
+	 * in a read-only mapping of it. */
+	void *map;
+	size_t map_size;
 };
 
-struct joseki_dict *joseki_init(int bsize);
+/* Load the dictionary joseki<size>.pdict, or get the already loaded
+ * one. Returns NULL if there is none. */
 struct joseki_dict *joseki_load(int bsize);
+/* Release the dictionary. */
 void joseki_done(struct joseki_dict *);
 
+/* Return the pass-terminated list of joseki followups for color
+ * in a quadrant position with given hash, or NULL. */
+static coord_t *joseki_moves(struct joseki_dict *jd, hash_t h, enum stone color);
+
+
+static inline coord_t *
+joseki_moves(struct joseki_dict *jd, hash_t h, enum stone color)
+{
+	uint32_t i = jd->index[h & joseki_hash_mask][color - 1];
+	return i ? &jd->moves[i] : NULL;
+}
+
 #endif
@@ -10,19 +10,25 @@
 #include "joseki/base.h"
 
 
+/* Single joseki situation - moves for S_BLACK-1, S_WHITE-1. */
+struct joseki_pattern {
+	/* moves[] is a pass-terminated list or NULL */
+	coord_t *moves[2];
+};
+
 /* Internal engine state. */
 struct joseki_engine {
 	int debug_level;
 	bool discard;
 
 	int size;
-	struct joseki_dict *jdict;
+	struct joseki_pattern *patterns;
 
 	struct board *b[16]; // boards with reversed color, mirrored and rotated
 };
 
 /* We will record the joseki positions into incrementally-built
- * jdict->patterns[]. */
+ * patterns[], written out in the joseki dictionary format in the end. */
 
 
 static char *
@@ -32,11 +38,11 @@ joseki_play(struct engine *e, struct board *b, struct move *m, char *enginearg)
 
 	if (!b->moves) {
 		/* New game, reset state. */
-		j->size = board_size(b);
-		if (j->jdict)
-			assert(j->size == j->jdict->bsize);
+		if (j->patterns)
+			assert(j->size == board_size(b));
 		else
-			j->jdict = joseki_init(j->size);
+			j->patterns = calloc2(1 << joseki_hash_bits, sizeof(j->patterns[0]));
+		j->size = board_size(b);
 		j->discard = false;
 		for (int i = 0; i < 16; i++) {
 			board_resize(j->b[i], j->size - 2);
@@ -93,7 +99,7 @@ joseki_play(struct engine *e, struct board *b, struct move *m, char *enginearg)
 		if (i & HASH_OCOLOR)
 			color = stone_other(color);
 
-		coord_t **ccp = &j->jdict->patterns[j->b[i]->qhash[quadrant] & joseki_hash_mask].moves[color - 1];
+		coord_t **ccp = &j->patterns[j->b[i]->qhash[quadrant] & joseki_hash_mask].moves[color - 1];
 
 		int count = 1;
 		if (*ccp) {
@@ -131,6 +137,8 @@ void
 engine_joseki_done(struct engine *e)
 {
 	struct joseki_engine *j = e->data;
+	if (!j->patterns)
+		return;
 	struct board *b = board_init(NULL);
 	board_resize(b, j->size - 2);
 	board_clear(b);
@@ -138,10 +146,10 @@ engine_joseki_done(struct engine *e)
 	for (hash_t i = 0; i < 1 << joseki_hash_bits; i++) {
 		for (int s = 0; s < 2; s++) {
 			static const char cs[] = "bw";
-			if (!j->jdict->patterns[i].moves[s])
+			if (!j->patterns[i].moves[s])
 				continue;
 			printf("%" PRIhash " %c", i, cs[s]);
-			coord_t *cc = j->jdict->patterns[i].moves[s];
+			coord_t *cc = j->patterns[i].moves[s];
 			int count = 0;
 			while (!is_pass(*cc)) {
 				printf(" %s", coord2sstr(*cc, b));
@@ -153,7 +161,11 @@ engine_joseki_done(struct engine *e)
 
 	board_done(b);
 
-	joseki_done(j->jdict);
+	for (hash_t i = 0; i < 1 << joseki_hash_bits; i++) {
+		free(j->patterns[i].moves[0]);
+		free(j->patterns[i].moves[1]);
+	}
+	free(j->patterns);
 }
 
 
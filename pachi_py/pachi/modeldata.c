@@ -0,0 +1,165 @@
+#define DEBUG
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "debug.h"
+#include "modeldata.h"
+#include "util.h"
+
+struct modeldata {
+	char *key;
+	void *data;
+	modeldata_free_fn free;
+	int refs;
+	struct modeldata *next;
+};
+
+/* The registry is small (a few entries per board size), a list will
+ * do. The lock is recursive since loaders may get other data, and
+ * it is held during loading so that everything is loaded once. */
+static struct modeldata *registry;
+static pthread_mutex_t registry_lock;
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+
+static void
+registry_init(void)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&registry_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+static void
+registry_lock_get(void)
+{
+	pthread_once(&registry_once, registry_init);
+	pthread_mutex_lock(&registry_lock);
+}
+
+void *
+modeldata_get(const char *key, modeldata_load_fn load, void *arg, modeldata_free_fn free)
+{
+	registry_lock_get();
+	struct modeldata *md;
+	for (md = registry; md; md = md->next)
+		if (!strcmp(md->key, key))
+			break;
+	if (!md) {
+		md = calloc2(1, sizeof(*md));
+		md->key = strdup(key);
+		md->data = load(key, arg);
+		md->free = free;
+		md->next = registry;
+		registry = md;
+		if (DEBUGL(3))
+			fprintf(stderr, "modeldata: loaded %s%s\n", key, md->data ? "" : " (none)");
+	}
+	md->refs++;
+	void *data = md->data;
+	pthread_mutex_unlock(&registry_lock);
+	return data;
+}
+
+static struct modeldata *
+registry_find(void *data)
+{
+	for (struct modeldata *md = registry; md; md = md->next)
+		if (md->data == data)
+			return md;
+	return NULL;
+}
+
+bool
+modeldata_put(void *data)
+{
+	if (!data)
+		return false;
+	registry_lock_get();
+	struct modeldata *md = registry_find(data);
+	if (md) {
+		assert(md->refs > 0);
+		md->refs--;
+	}
+	pthread_mutex_unlock(&registry_lock);
+	return md;
+}
+
+void
+modeldata_flush(void)
+{
+	registry_lock_get();
+	/* Freeing data may drop the references it held to other data,
+	 * so repeat until nothing more is freed. */
+	bool freed;
+	do {
+		freed = false;
+		for (struct modeldata **mdp = &registry; *mdp; ) {
+			struct modeldata *md = *mdp;
+			if (md->refs) {
+				mdp = &md->next;
+				continue;
+			}
+			*mdp = md->next;
+			if (md->data && md->free)
+				md->free(md->data);
+			free(md->key);
+			free(md);
+			freed = true;
+		}
+	} while (freed);
+	pthread_mutex_unlock(&registry_lock);
+}
+
+
+bool
+modeldata_file_older(const char *a, const char *b)
+{
+	struct stat sa, sb;
+	return !stat(a, &sa) && !stat(b, &sb) && sa.st_mtime < sb.st_mtime;
+}
+
+void *
+modeldata_map(const char *filename, size_t min_size, size_t *size)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f) return NULL;
+	struct stat st;
+	if (fstat(fileno(f), &st) || st.st_size < (off_t) min_size) {
+		fclose(f);
+		return NULL;
+	}
+	*size = st.st_size;
+#ifndef _WIN32
+	void *map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fileno(f), 0);
+	fclose(f);
+	if (map == MAP_FAILED) return NULL;
+#else
+	void *map = malloc2(*size);
+	bool ok = fread(map, *size, 1, f) == 1;
+	fclose(f);
+	if (!ok) {
+		free(map);
+		return NULL;
+	}
+#endif
+	return map;
+}
+
+void
+modeldata_unmap(void *map, size_t size)
+{
+#ifndef _WIN32
+	munmap(map, size);
+#else
+	free(map);
+#endif
+}
@@ -0,0 +1,44 @@
+#ifndef PACHI_MODELDATA_H
+#define PACHI_MODELDATA_H
+
+/* Shared read-only model data: the pattern dictionaries, joseki
+ * dictionaries and opening books. Each is loaded once per process
+ * and shared by all engines through the registry below; the larger
+ * ones are also compiled to files mapped read-only, so that all
+ * processes on a host share a single copy in the page cache. */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Loader of data for a key; may return NULL if there is none
+ * (which is remembered as well). It may itself get other data. */
+typedef void *(*modeldata_load_fn)(const char *key, void *arg);
+typedef void (*modeldata_free_fn)(void *data);
+
+/* Return the data registered under key, loading it with load(key, arg)
+ * the first time. Takes a reference, to be dropped by modeldata_put().
+ * Concurrent callers wait for a load in progress instead of repeating
+ * it. The data must not be modified once loaded. */
+void *modeldata_get(const char *key, modeldata_load_fn load, void *arg, modeldata_free_fn free);
+
+/* Drop a reference. Unreferenced data stays loaded for reuse until
+ * modeldata_flush(); data not in the registry (or NULL) is ignored.
+ * Return false in the latter case. */
+bool modeldata_put(void *data);
+
+/* Free all unreferenced data. */
+void modeldata_flush(void);
+
+
+/* Helpers for the compiled files. */
+
+/* Is file a older than file b? Missing files are not. */
+bool modeldata_file_older(const char *a, const char *b);
+
+/* Map the whole file read-only (or read it where mmap() is not
+ * available). Return NULL if it does not exist, has less than
+ * min_size bytes or cannot be mapped; else set *size. */
+void *modeldata_map(const char *filename, size_t min_size, size_t *size);
+void modeldata_unmap(void *map, size_t size);
+
+#endif
@@ -8,6 +8,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <sys/types.h>
 
@@ -52,7 +53,7 @@ port_listen(char *port, int max_connections)
 	server_addr.sin_port = htons(atoi(port));     
 	server_addr.sin_addr.s_addr = INADDR_ANY; 
 
-	const char val = 1;
+	const int val = 1;
 	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)))
 		die("setsockopt");
 	if (bind(sock, (struct sockaddr *)&server_addr, sizeof(struct sockaddr)) == -1)
@@ -62,11 +63,13 @@ port_listen(char *port, int max_connections)
 	return sock;
 }
 
-/* Returns true if in private address range: 10.0.0.0/8 172.16.0.0/12 192.168.0.0/16 */
+/* Returns true if in private address range: 10.0.0.0/8 172.16.0.0/12 192.168.0.0/16
+ * or loopback 127.0.0.0/8 (slaves running on the master host). */
 static bool
 is_private(struct in_addr *in)
 {
 	return (ntohl(in->s_addr) & 0xff000000) >> 24 == 10
+	    || (ntohl(in->s_addr) & 0xff000000) >> 24 == 127
 	    || (ntohl(in->s_addr) & 0xfff00000) >> 16 == 172 * 256 + 16
 	    || (ntohl(in->s_addr) & 0xffff0000) >> 16 == 192 * 256 + 168;
 }
@@ -95,6 +98,39 @@ open_server_connection(int socket, struct in_addr *client)
 	}
 }
 
+/* Accepts a pending connection on the given non-blocking socket and
+ * returns its file descriptor, also non-blocking, or -1 if there is
+ * no pending connection. Updates the client address if it is not null.
+ * Connections from outside the private network are closed, as in
+ * open_server_connection(). */
+#ifndef _WIN32
+int
+try_server_connection(int socket, struct in_addr *client)
+{
+	assert(socket >= 0);
+	for (;;) {
+		struct sockaddr_in client_addr;
+		socklen_t sin_size = sizeof(struct sockaddr_in);
+		int fd = accept(socket, (struct sockaddr *)&client_addr, &sin_size);
+		if (fd == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+			    || errno == ECONNABORTED)
+				return -1;
+			die("accept");
+		}
+		if (!is_private(&client_addr.sin_addr)) {
+			close(fd);
+			continue;
+		}
+		if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+			die("fcntl");
+		if (client)
+			*client = client_addr.sin_addr;
+		return fd;
+	}
+}
+#endif
+
 /* Opens a new connection to the given port name, which must
  * contain a host name. Returns the open file descriptor,
  * or -1 if the open fails. */
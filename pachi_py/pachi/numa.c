@@ -0,0 +1,204 @@
+#define DEBUG
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "debug.h"
+#include "numa.h"
+#include "util.h"
+
+#ifdef __linux__
+
+#define NUMA_MAX_NODES 64
+
+/* Memory policies of mbind(2), we do not depend on libnuma. */
+#define MPOL_PREFERRED 1
+#define MPOL_INTERLEAVE 3
+
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+static int nodes;
+static int node_ids[NUMA_MAX_NODES]; // kernel node numbers
+static cpu_set_t node_cpus[NUMA_MAX_NODES];
+static int cpus; // total, over all nodes
+static short cpu_node[CPU_SETSIZE];
+
+/* Node the calling thread was pinned to, -1 if not pinned. */
+static __thread int thread_node = -1;
+
+/* Parse a cpu list like "0-3,8-11". */
+static void
+parse_cpulist(char *s, cpu_set_t *cpus)
+{
+	CPU_ZERO(cpus);
+	while (*s && *s != '\n') {
+		char *end;
+		long first = strtol(s, &end, 10), last = first;
+		if (end == s) break;
+		if (*end == '-') last = strtol(end + 1, &end, 10);
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, cpus);
+		s = end + (*end == ',');
+	}
+}
+
+static void
+numa_init(void)
+{
+	/* Node numbers may have holes, keep only nodes with cpus. */
+	for (int n = 0; n < NUMA_MAX_NODES; n++) {
+		char path[64], buf[1024];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+		FILE *f = fopen(path, "r");
+		if (!f) continue;
+		if (fgets(buf, sizeof(buf), f)) {
+			parse_cpulist(buf, &node_cpus[nodes]);
+			node_ids[nodes] = n;
+			if (CPU_COUNT(&node_cpus[nodes])) nodes++;
+		}
+		fclose(f);
+	}
+	if (!nodes) {
+		nodes = 1;
+		if (sched_getaffinity(0, sizeof(node_cpus[0]), &node_cpus[0]))
+			CPU_ZERO(&node_cpus[0]);
+		node_ids[0] = -1;
+	}
+	for (int n = 0; n < nodes; n++)
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &node_cpus[n])) {
+				cpu_node[cpu] = n;
+				cpus++;
+			}
+	if (DEBUGL(3))
+		fprintf(stderr, "numa: %d nodes, %d cpus\n", nodes, cpus);
+}
+
+int
+numa_node_count(void)
+{
+	pthread_once(&numa_once, numa_init);
+	return nodes;
+}
+
+bool
+numa_pin_thread(int node)
+{
+	cpu_set_t *cpus = &node_cpus[node % numa_node_count()];
+	if (!CPU_COUNT(cpus)) return false;
+	if (pthread_setaffinity_np(pthread_self(), sizeof(*cpus), cpus))
+		return false;
+	thread_node = node % nodes;
+	return true;
+}
+
+bool
+numa_pin_cpu(int index)
+{
+	if (!numa_node_count() || !cpus) return false;
+	index %= cpus;
+	/* Cpus are numbered node by node, so that consecutive
+	 * indices share a node as long as possible. */
+	for (int n = 0; n < nodes; n++) {
+		int count = CPU_COUNT(&node_cpus[n]);
+		if (index >= count) {
+			index -= count;
+			continue;
+		}
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (!CPU_ISSET(cpu, &node_cpus[n]) || index--) continue;
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+				return false;
+			thread_node = n;
+			return true;
+		}
+	}
+	return false;
+}
+
+int
+numa_thread_node(void)
+{
+	if (thread_node >= 0) return thread_node;
+	if (numa_node_count() == 1) return 0;
+	int cpu = sched_getcpu();
+	return cpu >= 0 && cpu < CPU_SETSIZE ? cpu_node[cpu] : 0;
+}
+
+static bool
+numa_mbind(void *addr, size_t len, int mode, int node)
+{
+	unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(long))] = { 0 };
+	int last = 0;
+	for (int n = 0; n < nodes; n++) {
+		if (node >= 0 && n != node) continue;
+		if (node_ids[n] < 0) return false;
+		mask[node_ids[n] / (8 * sizeof(long))] |= 1UL << (node_ids[n] % (8 * sizeof(long)));
+		if (node_ids[n] > last) last = node_ids[n];
+	}
+	/* maxnode counts bits, and the kernel ignores the last one. */
+	return !syscall(SYS_mbind, addr, len, mode, mask, last + 2, 0);
+}
+
+bool
+numa_interleave(void *addr, size_t len)
+{
+	if (numa_node_count() == 1) return false;
+	return numa_mbind(addr, len, MPOL_INTERLEAVE, -1);
+}
+
+bool
+numa_prefer(void *addr, size_t len, int node)
+{
+	if (numa_node_count() == 1) return false;
+	return numa_mbind(addr, len, MPOL_PREFERRED, node % nodes);
+}
+
+#else
+
+int
+numa_node_count(void)
+{
+	return 1;
+}
+
+bool
+numa_pin_thread(int node)
+{
+	return false;
+}
+
+bool
+numa_pin_cpu(int index)
+{
+	return false;
+}
+
+int
+numa_thread_node(void)
+{
+	return 0;
+}
+
+bool
+numa_interleave(void *addr, size_t len)
+{
+	return false;
+}
+
+bool
+numa_prefer(void *addr, size_t len, int node)
+{
+	return false;
+}
+
+#endif
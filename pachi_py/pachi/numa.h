@@ -0,0 +1,33 @@
+#ifndef PACHI_NUMA_H
+#define PACHI_NUMA_H
+
+/* NUMA topology and placement of threads and memory. The topology is
+ * read from /sys on Linux; elsewhere, or if it is not available, all cpus
+ * are in a single node and pinning does nothing. Nodes are numbered
+ * 0..numa_node_count()-1, which need not match the kernel numbering. */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Number of NUMA nodes with cpus, at least 1. */
+int numa_node_count(void);
+
+/* Pin the calling thread to the cpus of node (modulo the number of
+ * nodes). Return false if the thread could not be pinned. */
+bool numa_pin_thread(int node);
+
+/* Pin the calling thread to a single cpu; cpus are counted node after
+ * node, modulo the number of cpus. Return false on failure. */
+bool numa_pin_cpu(int index);
+
+/* Node of the calling thread: the one it was pinned to, or else
+ * the node of the cpu it is currently running on. */
+int numa_thread_node(void);
+
+/* Set the memory policy of a page-aligned range that is not touched
+ * yet: interleave its pages over all nodes, or prefer the given node.
+ * Return false if the policy could not be set (or there is one node). */
+bool numa_interleave(void *addr, size_t len);
+bool numa_prefer(void *addr, size_t len, int node);
+
+#endif
@@ -1,6 +1,8 @@
 #include <assert.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "board.h"
 #include "debug.h"
@@ -30,6 +32,65 @@ board_ownermap_merge(int bsize2, struct board_ownermap *dst, struct board_ownerm
 			dst->map[i][j] += src->map[i][j];
 }
 
+
+void
+board_ownermap_shards_init(struct board_ownermap_shards *s, int bsize2, int nshards)
+{
+	assert(nshards > 0);
+	size_t mapsize = (bsize2 * sizeof(s->shard[0].ownermap.map[0]) + 63) & ~(size_t) 63;
+	s->bsize2 = bsize2;
+	s->nshards = nshards;
+	/* One block for everything, aligned to cache lines by hand. */
+	s->mem = calloc2(1, 64 + nshards * (sizeof(s->shard[0]) + mapsize));
+	char *p = (char *) (((uintptr_t) s->mem + 63) & ~(uintptr_t) 63);
+	s->shard = (struct ownermap_shard *) p;
+	p += nshards * sizeof(s->shard[0]);
+	for (int i = 0; i < nshards; i++)
+		s->shard[i].ownermap.map = (void *) (p + i * mapsize);
+}
+
+void
+board_ownermap_shards_done(struct board_ownermap_shards *s)
+{
+	free(s->mem);
+	s->mem = NULL;
+	s->shard = NULL;
+	s->nshards = 0;
+}
+
+void
+board_ownermap_shards_clear(struct board_ownermap_shards *s)
+{
+	for (int i = 0; i < s->nshards; i++) {
+		struct board_ownermap *o = &s->shard[i].ownermap;
+		o->playouts = 0;
+		memset(o->map, 0, s->bsize2 * sizeof(o->map[0]));
+	}
+}
+
+int
+board_ownermap_shards_playouts(struct board_ownermap_shards *s)
+{
+	int playouts = 0;
+	for (int i = 0; i < s->nshards; i++)
+		playouts += s->shard[i].ownermap.playouts;
+	return playouts;
+}
+
+void
+board_ownermap_shards_merge(struct board_ownermap_shards *s, struct board_ownermap *dst)
+{
+	int playouts = board_ownermap_shards_playouts(s);
+	if (dst->playouts == playouts)
+		return;
+	memcpy(dst->map, s->shard[0].ownermap.map, s->bsize2 * sizeof(dst->map[0]));
+	for (int i = 1; i < s->nshards; i++)
+		for (int c = 0; c < s->bsize2; c++)
+			for (int j = 0; j < S_MAX; j++)
+				dst->map[c][j] += s->shard[i].ownermap.map[c][j];
+	dst->playouts = playouts;
+}
+
 float
 board_ownermap_estimate_point(struct board_ownermap *ownermap, coord_t c)
 {
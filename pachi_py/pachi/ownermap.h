@@ -8,9 +8,8 @@
 
 struct board_ownermap {
 	/* Map of final owners of all intersections on the board. */
-	/* This may be shared between multiple threads! */
-	/* XXX: We assume sig_atomic_t is thread-atomic. This may not
-	 * be true in pathological cases. */
+	/* The counters are not updated atomically; a map filled by
+	 * several threads should be sharded, see below. */
 	sig_atomic_t playouts;
 	/* At the final board position, for each coordinate increase the
 	 * counter of appropriate color. */
@@ -21,6 +20,31 @@ void board_ownermap_fill(struct board_ownermap *ownermap, struct board *b);
 void board_ownermap_merge(int bsize2, struct board_ownermap *dst, struct board_ownermap *src);
 
 
+/* Ownermap filled by several threads at once: each thread fills only
+ * its own shard, so no updates are lost and the playouts do not bounce
+ * cache lines between cores; the shards are summed up when the map is
+ * read. Each shard (and its map) is on cache lines of its own. */
+struct ownermap_shard {
+	struct board_ownermap ownermap;
+} __attribute__((aligned(64)));
+
+struct board_ownermap_shards {
+	int bsize2, nshards;
+	struct ownermap_shard *shard; // [nshards]
+	void *mem;
+};
+
+void board_ownermap_shards_init(struct board_ownermap_shards *s, int bsize2, int nshards);
+void board_ownermap_shards_done(struct board_ownermap_shards *s);
+void board_ownermap_shards_clear(struct board_ownermap_shards *s);
+/* Total number of playouts in all shards. */
+int board_ownermap_shards_playouts(struct board_ownermap_shards *s);
+/* Sum the shards into dst, unless it already has all their playouts
+ * (so dst must be cleared along with the shards). The sum is exact
+ * once the threads filling the shards have stopped. */
+void board_ownermap_shards_merge(struct board_ownermap_shards *s, struct board_ownermap *dst);
+
+
 /* Estimate coord ownership based on ownermap stats. */
 enum point_judgement {
 	PJ_DAME = S_NONE,
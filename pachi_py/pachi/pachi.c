@@ -18,6 +18,7 @@
 #include "joseki/joseki.h"
 #include "t-unit/test.h"
 #include "uct/uct.h"
+#include "uct/ensemble.h"
 #include "distributed/distributed.h"
 #include "gtp.h"
 #include "chat.h"
@@ -42,6 +43,7 @@ enum engine_id {
 	E_UCT,
 	E_DISTRIBUTED,
 	E_JOSEKI,
+	E_ENSEMBLE,
 	E_MAX,
 };
 
@@ -54,6 +56,7 @@ static struct engine *(*engine_init[E_MAX])(char *arg, struct board *b) = {
 	engine_uct_init,
 	engine_distributed_init,
 	engine_joseki_init,
+	engine_ensemble_init,
 };
 
 static struct engine *init_engine(enum engine_id engine, char *e_arg, struct board *b)
@@ -75,7 +78,7 @@ static void done_engine(struct engine *e)
 static void usage(char *name)
 {
 	fprintf(stderr, "Pachi version %s\n", PACHI_VERSION);
-	fprintf(stderr, "Usage: %s [-e random|replay|montecarlo|uct|distributed]\n"
+	fprintf(stderr, "Usage: %s [-e random|replay|montecarlo|uct|distributed|ensemble]\n"
 		" [-d DEBUG_LEVEL] [-D] [-r RULESET] [-s RANDOM_SEED] [-t TIME_SETTINGS] [-u TEST_FILENAME]\n"
 		" [-g [HOST:]GTP_PORT] [-l [HOST:]LOG_PORT] [-f FBOOKFILE] [ENGINE_ARGS]\n", name);
 }
@@ -111,6 +114,8 @@ int main(int argc, char *argv[])
 					engine = E_UCT;
 				} else if (!strcasecmp(optarg, "distributed")) {
 					engine = E_DISTRIBUTED;
+				} else if (!strcasecmp(optarg, "ensemble")) {
+					engine = E_ENSEMBLE;
 				} else if (!strcasecmp(optarg, "patternscan")) {
 					engine = E_PATTERNSCAN;
 				} else if (!strcasecmp(optarg, "patternplay")) {
@@ -4,6 +4,7 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "board.h"
 #include "debug.h"
@@ -112,7 +113,6 @@ patterns_init(struct pattern_setup *pat, char *arg, bool will_append, bool load_
 	memset(pat, 0, sizeof(*pat));
 
 	pat->pc = DEFAULT_PATTERN_CONFIG;
-	pat->pc.spat_dict = spatial_dict_init(will_append, !load_prob);
 
 	memcpy(&pat->ps, PATTERN_SPEC_MATCH_DEFAULT, sizeof(pattern_spec));
 
@@ -149,9 +149,21 @@ patterns_init(struct pattern_setup *pat, char *arg, bool will_append, bool load_
 		}
 	}
 
-	if (load_prob && pat->pc.spat_dict) {
+	/* The probtable comes with its own spatial dictionary. */
+	if (load_prob)
 		pat->pd = pattern_pdict_init(pdict_file, &pat->pc);
-	}
+	if (!pat->pd)
+		pat->pc.spat_dict = spatial_dict_init(will_append, !load_prob);
+}
+
+void
+patterns_done(struct pattern_setup *pat)
+{
+	if (!pat->pd)
+		spatial_dict_done(pat->pc.spat_dict);
+	pattern_pdict_done(pat->pd);
+	pat->pd = NULL;
+	pat->pc.spat_dict = NULL;
 }
 
 
@@ -159,21 +171,108 @@ patterns_init(struct pattern_setup *pat, char *arg, bool will_append, bool load_
 #define PS_ANY(F) (ps[FEAT_ ## F] & (1 << PF_MATCH))
 #define PS_PF(F, P) (ps[FEAT_ ## F] & (1 << PF_ ## F ## _ ## P))
 
+/* Payload bits of features we can answer from board traits alone. */
+#ifdef BOARD_TRAIT_SAFE
+#define TRAIT_PF(P) (1 << PF_ ## P)
+#else
+#define TRAIT_PF(P) 0
+#endif
+
+/* Information about groups with at most two liberties, shared by all
+ * moves matched within a single pattern_match_moves() call; indexed
+ * by group id. Each value is computed on first use, -1 means unknown.
+ * Without the cache (@gc NULL), everything is computed on the spot. */
+struct pattern_gcache {
+	/* 1-lib groups: is_ladder() when played at the liberty. */
+	signed char ladder;
+	/* 1-lib groups: an opponent group in atari is adjacent. */
+	signed char atarinei;
+	/* 1-lib groups: number of stones, up to CAPTURE_COUNTSTONES_MAX. */
+	signed char stones;
+	/* 2-lib groups: wouldbe_ladder() when playing at lib[i]. */
+	signed char wladder[2];
+};
+
+/* Which tactical features may match; in batch mode, this is known
+ * beforehand for each point from its neighboring groups. */
+#define PT_CAPTURE	1
+#define PT_AESCAPE	2
+#define PT_ATARI	4
+#define PT_ALL		(PT_CAPTURE | PT_AESCAPE | PT_ATARI)
+
+static bool
+gcache_ladder(struct pattern_gcache *gc, struct board *b, coord_t coord, group_t g)
+{
+	if (!gc)
+		return is_ladder(b, coord, g, true);
+	if (gc[g].ladder < 0)
+		gc[g].ladder = is_ladder(b, coord, g, true);
+	return gc[g].ladder;
+}
+
+static bool
+gcache_atarinei(struct pattern_gcache *gc, struct board *b, group_t g)
+{
+	if (gc && gc[g].atarinei >= 0)
+		return gc[g].atarinei;
+	enum stone color = stone_other(board_at(b, g));
+	bool atarinei = false;
+	foreach_in_group(b, g) {
+		foreach_neighbor(b, c, {
+			if (board_at(b, c) != color)
+				continue;
+			group_t g = group_at(b, c);
+			if (!g || board_group_info(b, g).libs != 1)
+				continue;
+			/* A neighboring group of ours is in atari. */
+			atarinei = true;
+		});
+	} foreach_in_group_end;
+	if (gc)
+		gc[g].atarinei = atarinei;
+	return atarinei;
+}
+
+static int
+gcache_stones(struct pattern_gcache *gc, struct board *b, group_t g, int max)
+{
+	if (!gc)
+		return group_stone_count(b, g, max);
+	if (gc[g].stones < 0)
+		gc[g].stones = group_stone_count(b, g, CAPTURE_COUNTSTONES_MAX);
+	return gc[g].stones < max ? gc[g].stones : max;
+}
+
+static bool
+gcache_wladder(struct pattern_gcache *gc, struct board *b, group_t g, coord_t coord)
+{
+	coord_t lib = board_group_other_lib(b, g, coord);
+	if (!gc)
+		return wouldbe_ladder(b, g, lib, coord, board_at(b, g));
+	int i = board_group_info(b, g).lib[0] != coord;
+	if (gc[g].wladder[i] < 0)
+		gc[g].wladder[i] = wouldbe_ladder(b, g, lib, coord, board_at(b, g));
+	return gc[g].wladder[i];
+}
+
+
 static struct feature *
 pattern_match_capture(struct pattern_config *pc, pattern_spec ps,
                       struct pattern *p, struct feature *f,
-                      struct board *b, struct move *m)
+                      struct board *b, struct move *m, struct pattern_gcache *gc)
 {
 	f->id = FEAT_CAPTURE; f->payload = 0;
 #ifdef BOARD_TRAITS
 	if (!trait_at(b, m->coord, m->color).cap)
 		return f;
 	/* Capturable! */
-	if ((ps[FEAT_CAPTURE] & ~(1<<PF_CAPTURE_1STONE | 1<<PF_CAPTURE_TRAPPED | 1<<PF_CAPTURE_CONNECTION)) == 1<<PF_MATCH) {
+	if ((ps[FEAT_CAPTURE] & ~(1<<PF_CAPTURE_1STONE | TRAIT_PF(CAPTURE_TRAPPED) | 1<<PF_CAPTURE_CONNECTION)) == 1<<PF_MATCH) {
 		if (PS_PF(CAPTURE, 1STONE))
 			f->payload |= (trait_at(b, m->coord, m->color).cap1 == trait_at(b, m->coord, m->color).cap) << PF_CAPTURE_1STONE;
+#ifdef BOARD_TRAIT_SAFE
 		if (PS_PF(CAPTURE, TRAPPED))
 			f->payload |= (!trait_at(b, m->coord, stone_other(m->color)).safe) << PF_CAPTURE_TRAPPED;
+#endif
 		if (PS_PF(CAPTURE, CONNECTION))
 			f->payload |= (trait_at(b, m->coord, m->color).cap < neighbor_count_at(b, m->coord, stone_other(m->color))) << PF_CAPTURE_CONNECTION;
 		(f++, p->n++);
@@ -231,23 +330,12 @@ pattern_match_capture(struct pattern_config *pc, pattern_spec ps,
 		captures++;
 
 		if (PS_PF(CAPTURE, LADDER))
-			f->payload |= is_ladder(b, m->coord, g, true) << PF_CAPTURE_LADDER;
+			f->payload |= gcache_ladder(gc, b, m->coord, g) << PF_CAPTURE_LADDER;
 		/* TODO: is_ladder() is too conservative in some
 		 * very obvious situations, look at complete.gtp. */
 
 		if (PS_PF(CAPTURE, ATARIDEF))
-		foreach_in_group(b, g) {
-			foreach_neighbor(b, c, {
-				assert(board_at(b, c) != S_NONE || c == m->coord);
-				if (board_at(b, c) != m->color)
-					continue;
-				group_t g = group_at(b, c);
-				if (!g || board_group_info(b, g).libs != 1)
-					continue;
-				/* A neighboring group of ours is in atari. */
-				f->payload |= 1 << PF_CAPTURE_ATARIDEF;
-			});
-		} foreach_in_group_end;
+			f->payload |= gcache_atarinei(gc, b, g) << PF_CAPTURE_ATARIDEF;
 
 		if (PS_PF(CAPTURE, KO)
 		    && group_is_onestone(b, g)
@@ -257,7 +345,7 @@ pattern_match_capture(struct pattern_config *pc, pattern_spec ps,
 
 		if (PS_PF(CAPTURE, COUNTSTONES)
 		    && captured_stones < CAPTURE_COUNTSTONES_MAX)
-			captured_stones += group_stone_count(b, g, CAPTURE_COUNTSTONES_MAX - captured_stones);
+			captured_stones += gcache_stones(gc, b, g, CAPTURE_COUNTSTONES_MAX - captured_stones);
 
 		if (group_is_onestone(b, g))
 			onestone = true;
@@ -282,18 +370,20 @@ pattern_match_capture(struct pattern_config *pc, pattern_spec ps,
 static struct feature *
 pattern_match_aescape(struct pattern_config *pc, pattern_spec ps,
                       struct pattern *p, struct feature *f,
-		      struct board *b, struct move *m)
+		      struct board *b, struct move *m, struct pattern_gcache *gc)
 {
 	f->id = FEAT_AESCAPE; f->payload = 0;
 #ifdef BOARD_TRAITS
 	if (!trait_at(b, m->coord, stone_other(m->color)).cap)
 		return f;
 	/* Opponent can capture something! */
-	if ((ps[FEAT_AESCAPE] & ~(1<<PF_AESCAPE_1STONE | 1<<PF_AESCAPE_TRAPPED | 1<<PF_AESCAPE_CONNECTION)) == 1<<PF_MATCH) {
+	if ((ps[FEAT_AESCAPE] & ~(1<<PF_AESCAPE_1STONE | TRAIT_PF(AESCAPE_TRAPPED) | 1<<PF_AESCAPE_CONNECTION)) == 1<<PF_MATCH) {
 		if (PS_PF(AESCAPE, 1STONE))
 			f->payload |= (trait_at(b, m->coord, stone_other(m->color)).cap1 == trait_at(b, m->coord, stone_other(m->color)).cap) << PF_AESCAPE_1STONE;
+#ifdef BOARD_TRAIT_SAFE
 		if (PS_PF(AESCAPE, TRAPPED))
 			f->payload |= (!trait_at(b, m->coord, m->color).safe) << PF_AESCAPE_TRAPPED;
+#endif
 		if (PS_PF(AESCAPE, CONNECTION))
 			f->payload |= (trait_at(b, m->coord, stone_other(m->color)).cap < neighbor_count_at(b, m->coord, m->color)) << PF_AESCAPE_CONNECTION;
 		(f++, p->n++);
@@ -349,7 +439,7 @@ pattern_match_aescape(struct pattern_config *pc, pattern_spec ps,
 		in_atari = g;
 
 		if (PS_PF(AESCAPE, LADDER))
-			f->payload |= is_ladder(b, m->coord, g, true) << PF_AESCAPE_LADDER;
+			f->payload |= gcache_ladder(gc, b, m->coord, g) << PF_AESCAPE_LADDER;
 		/* TODO: is_ladder() is too conservative in some
 		 * very obvious situations, look at complete.gtp. */
 
@@ -374,7 +464,7 @@ pattern_match_aescape(struct pattern_config *pc, pattern_spec ps,
 static struct feature *
 pattern_match_atari(struct pattern_config *pc, pattern_spec ps,
                     struct pattern *p, struct feature *f,
-		    struct board *b, struct move *m)
+		    struct board *b, struct move *m, struct pattern_gcache *gc)
 {
 	foreach_neighbor(b, m->coord, {
 		if (board_at(b, c) != stone_other(m->color))
@@ -388,10 +478,9 @@ pattern_match_atari(struct pattern_config *pc, pattern_spec ps,
 
 		if (PS_PF(ATARI, LADDER)) {
 			/* Opponent will escape by the other lib. */
-			coord_t lib = board_group_other_lib(b, g, m->coord);
 			/* TODO: is_ladder() is too conservative in some
 			 * very obvious situations, look at complete.gtp. */
-			f->payload |= wouldbe_ladder(b, g, lib, m->coord, stone_other(m->color)) << PF_ATARI_LADDER;
+			f->payload |= gcache_wladder(gc, b, g, m->coord) << PF_ATARI_LADDER;
 		}
 
 		if (PS_PF(ATARI, KO) && !is_pass(b->ko.coord))
@@ -402,17 +491,13 @@ pattern_match_atari(struct pattern_config *pc, pattern_spec ps,
 	return f;
 }
 
-#ifndef BOARD_SPATHASH
-#undef BOARD_SPATHASH_MAXD
-#define BOARD_SPATHASH_MAXD 1
-#endif
-
 /* Match spatial features that are too distant to be pre-matched
- * incrementally. */
+ * incrementally (or all of them if incremental hashes are not
+ * available); @h is hash of circles up to @dmin - 1. */
 struct feature *
 pattern_match_spatial_outer(struct pattern_config *pc, pattern_spec ps,
                             struct pattern *p, struct feature *f,
-		            struct board *b, struct move *m, hash_t h)
+		            struct board *b, struct move *m, hash_t h, unsigned int dmin)
 {
 	/* We record all spatial patterns black-to-play; simply
 	 * reverse all colors if we are white-to-play. */
@@ -420,7 +505,7 @@ pattern_match_spatial_outer(struct pattern_config *pc, pattern_spec ps,
 	static enum stone bt_white[4] = { S_NONE, S_WHITE, S_BLACK, S_OFFBOARD };
 	enum stone (*bt)[4] = m->color == S_WHITE ? &bt_white : &bt_black;
 
-	for (unsigned int d = BOARD_SPATHASH_MAXD + 1; d <= pc->spat_max; d++) {
+	for (unsigned int d = dmin; d <= pc->spat_max; d++) {
 		/* Recompute missing outer circles:
 		 * Go through all points in given distance. */
 		for (unsigned int j = ptind[d]; j < ptind[d + 1]; j++) {
@@ -453,36 +538,38 @@ pattern_match_spatial(struct pattern_config *pc, pattern_spec ps,
 	f->id = -1;
 
 	hash_t h = pthashes[0][0][S_NONE];
+	unsigned int d = 2;
 #ifdef BOARD_SPATHASH
-	bool w_to_play = m->color == S_WHITE;
-	for (int d = 2; d <= BOARD_SPATHASH_MAXD; d++) {
-		/* Reuse all incrementally matched data. */
-		h ^= b->spathash[m->coord][d - 1][w_to_play];
-		if (d < pc->spat_min)
-			continue;
-		/* Record spatial feature, one per distance. */
-		unsigned int sid = spatial_dict_get(pc->spat_dict, d, h & spatial_hash_mask);
-		if (sid > 0) {
-			f->id = FEAT_SPATIAL;
-			f->payload = sid;
-			if (!pc->spat_largest)
-				(f++, p->n++);
-		} /* else not found, ignore */
+	if (b->spathash_on) {
+		bool w_to_play = m->color == S_WHITE;
+		unsigned int dmax = pc->spat_max < BOARD_SPATHASH_MAXD ? pc->spat_max : BOARD_SPATHASH_MAXD;
+		for (; d <= dmax; d++) {
+			/* Reuse all incrementally matched data. */
+			h ^= b->spathash[m->coord][d - 2][w_to_play];
+			if (d < pc->spat_min)
+				continue;
+			/* Record spatial feature, one per distance. */
+			unsigned int sid = spatial_dict_get(pc->spat_dict, d, h & spatial_hash_mask);
+			if (sid > 0) {
+				f->id = FEAT_SPATIAL;
+				f->payload = sid;
+				if (!pc->spat_largest)
+					(f++, p->n++);
+			} /* else not found, ignore */
+		}
 	}
-#else
-	assert(BOARD_SPATHASH_MAXD < 2);
 #endif
-	if (unlikely(pc->spat_max > BOARD_SPATHASH_MAXD))
-		f = pattern_match_spatial_outer(pc, ps, p, f, b, m, h);
+	if (pc->spat_max >= d)
+		f = pattern_match_spatial_outer(pc, ps, p, f, b, m, h, d);
 	if (pc->spat_largest && f->id == FEAT_SPATIAL)
 		(f++, p->n++);
 	return f;
 }
 
-
-void
-pattern_match(struct pattern_config *pc, pattern_spec ps,
-              struct pattern *p, struct board *b, struct move *m)
+static void
+pattern_match_f(struct pattern_config *pc, pattern_spec ps,
+                struct pattern *p, struct board *b, struct move *m,
+                struct pattern_gcache *gc, int tactics)
 {
 	p->n = 0;
 	struct feature *f = &p->f[0];
@@ -490,32 +577,30 @@ pattern_match(struct pattern_config *pc, pattern_spec ps,
 	/* TODO: We should match pretty much all of these features
 	 * incrementally. */
 
-	if (PS_ANY(CAPTURE)) {
-		f = pattern_match_capture(pc, ps, p, f, b, m);
+	if (PS_ANY(CAPTURE) && (tactics & PT_CAPTURE)) {
+		f = pattern_match_capture(pc, ps, p, f, b, m, gc);
 	}
 
-	if (PS_ANY(AESCAPE)) {
-		f = pattern_match_aescape(pc, ps, p, f, b, m);
+	if (PS_ANY(AESCAPE) && (tactics & PT_AESCAPE)) {
+		f = pattern_match_aescape(pc, ps, p, f, b, m, gc);
 	}
 
 	if (PS_ANY(SELFATARI)) {
 		bool simple = false;
 		if (PS_PF(SELFATARI, STUPID)) {
-#ifdef BOARD_TRAITS
-			if (!b->precise_selfatari)
-				simple = !trait_at(b, m->coord, m->color).safe;
-			else
-#endif
+#if BOARD_TRAIT_SAFE == 1
+			simple = !trait_at(b, m->coord, m->color).safe;
+#else
 			simple = !board_safe_to_play(b, m->coord, m->color);
+#endif
 		}
 		bool thorough = false;
 		if (PS_PF(SELFATARI, SMART)) {
-#ifdef BOARD_TRAITS
-			if (b->precise_selfatari)
-				thorough = !trait_at(b, m->coord, m->color).safe;
-			else
-#endif
+#if BOARD_TRAIT_SAFE == 2
+			thorough = !trait_at(b, m->coord, m->color).safe;
+#else
 			thorough = is_bad_selfatari(b, m->color, m->coord);
+#endif
 		}
 		if (simple || thorough) {
 			f->id = FEAT_SELFATARI;
@@ -525,8 +610,8 @@ pattern_match(struct pattern_config *pc, pattern_spec ps,
 		}
 	}
 
-	if (PS_ANY(ATARI)) {
-		f = pattern_match_atari(pc, ps, p, f, b, m);
+	if (PS_ANY(ATARI) && (tactics & PT_ATARI)) {
+		f = pattern_match_atari(pc, ps, p, f, b, m, gc);
 	}
 
 	if (PS_ANY(BORDER)) {
@@ -550,6 +635,49 @@ pattern_match(struct pattern_config *pc, pattern_spec ps,
 	}
 }
 
+void
+pattern_match(struct pattern_config *pc, pattern_spec ps,
+              struct pattern *p, struct board *b, struct move *m)
+{
+	pattern_match_f(pc, ps, p, b, m, NULL, PT_ALL);
+}
+
+void
+pattern_match_moves(struct pattern_config *pc, pattern_spec ps,
+                    struct pattern *pats, struct board *b, enum stone color,
+                    coord_t *moves, int nmoves)
+{
+	/* Tactical features (capture, atari escape, atari) can match
+	 * only at liberties of groups with at most two liberties, so we
+	 * first go through such groups and mark their liberties. */
+	struct pattern_gcache gc[board_size2(b)];
+	uint8_t tactics[board_size2(b)];
+	memset(tactics, 0, sizeof(tactics));
+
+	foreach_point(b) {
+		if (board_at(b, c) != S_BLACK && board_at(b, c) != S_WHITE)
+			continue;
+		group_t g = group_at(b, c);
+		if (g != c || board_group_info(b, g).libs > 2)
+			continue;
+		gc[g] = (struct pattern_gcache) { -1, -1, -1, { -1, -1 } };
+		bool ours = board_at(b, g) == color;
+		int libs = board_group_info(b, g).libs;
+		for (int i = 0; i < libs; i++) {
+			coord_t lib = board_group_info(b, g).lib[i];
+			if (libs == 1)
+				tactics[lib] |= ours ? PT_AESCAPE : PT_CAPTURE;
+			else if (!ours)
+				tactics[lib] |= PT_ATARI;
+		}
+	} foreach_point_end;
+
+	for (int i = 0; i < nmoves; i++) {
+		struct move m = { .coord = moves[i], .color = color };
+		pattern_match_f(pc, ps, &pats[i], b, &m, gc, tactics[m.coord]);
+	}
+}
+
 char *
 pattern2str(char *str, struct pattern *p)
 {
@@ -143,6 +143,9 @@ struct pattern_setup {
 };
 
 void patterns_init(struct pattern_setup *pat, char *arg, bool will_append, bool load_prob);
+/* Release the dictionaries; they are shared by all engines
+ * (see modeldata.h). */
+void patterns_done(struct pattern_setup *pat);
 
 
 /* Append feature to string. */
@@ -164,6 +167,11 @@ static bool pattern_eq(struct pattern *p1, struct pattern *p2);
 /* Initialize p and fill it with features matched by the
  * given board move. */
 void pattern_match(struct pattern_config *pc, pattern_spec ps, struct pattern *p, struct board *b, struct move *m);
+/* Like pattern_match(), but for all @moves[nmoves] of @color at once,
+ * filling pats[nmoves]. Information about groups is gathered only once
+ * and shared by the moves, so this is much faster when matching most
+ * of the board (e.g. when rating all moves). */
+void pattern_match_moves(struct pattern_config *pc, pattern_spec ps, struct pattern *pats, struct board *b, enum stone color, coord_t *moves, int nmoves);
 
 
 static inline bool
@@ -257,6 +257,9 @@ pattern3s_init(struct pattern3s *p, char src[][11], int src_n)
 }
 
 
+/* Zobrist hashes for the various 3x3 points. */
+hash_t p3hashes[8][2][S_MAX];
+
 static __attribute__((constructor)) void
 p3hashes_init(void)
 {
@@ -113,6 +113,13 @@ patternplay_state_init(char *arg)
 	return pp;
 }
 
+static void
+patternplay_done(struct engine *e)
+{
+	struct patternplay *pp = e->data;
+	patterns_done(&pp->pat);
+}
+
 struct engine *
 engine_patternplay_init(char *arg, struct board *b)
 {
@@ -122,6 +129,7 @@ engine_patternplay_init(char *arg, struct board *b)
 	e->comment = "I select moves blindly according to learned patterns. I won't pass as long as there is a place on the board where I can play. When we both pass, I will consider all the stones on the board alive.";
 	e->genmove = patternplay_genmove;
 	e->evaluate = patternplay_evaluate;
+	e->done = patternplay_done;
 	e->data = pp;
 
 	return e;
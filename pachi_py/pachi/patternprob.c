@@ -3,100 +3,362 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "board.h"
 #include "debug.h"
+#include "modeldata.h"
 #include "pattern.h"
 #include "patternsp.h"
 #include "patternprob.h"
 
 
-/* We try to avoid needlessly reloading probability dictionary
- * since it may take rather long time. */
-static struct pattern_pdict *cached_dict;
+/* Binary cache of the parsed table, in native byte order: header,
+ * offsets[nspatials + 2], keys[nprobs], probs[nprobs], longs[nlongs]
+ * and rehash[nrehash], each at an 8-byte aligned offset. rehash[] are
+ * the spatial ids in the order their hashes must be added to the
+ * spatial dictionary, see pdict_rehash(). Bump PDICT_CACHE_VERSION on
+ * any change of the layout or of pattern2key(). */
 
-struct pattern_pdict *
-pattern_pdict_init(char *filename, struct pattern_config *pc)
+#define PDICT_CACHE_MAGIC "PACHIPPD"
+#define PDICT_CACHE_VERSION 1
+#define PDICT_CACHE_BYTE_ORDER 0x01020304
+
+struct pdict_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t header_size;
+	uint32_t pattern_size;
+	uint32_t nspatials;
+	uint32_t nprobs;
+	uint32_t nlongs;
+	uint32_t nrehash;
+	uint64_t offsets_offset, keys_offset, probs_offset, longs_offset, rehash_offset;
+	uint64_t size;
+};
+
+static uint64_t
+align8(uint64_t x)
 {
-	if (cached_dict) {
-		cached_dict->pc = pc;
-		return cached_dict;
-	}
+	return (x + 7) & ~7ULL;
+}
 
-	if (!filename)
-		filename = "patterns.prob";
-	FILE *f = fopen(filename, "r");
+static void
+pdict_cache_layout(struct pdict_cache_header *h)
+{
+	h->offsets_offset = align8(sizeof(*h));
+	h->keys_offset = align8(h->offsets_offset + (uint64_t) (h->nspatials + 2) * sizeof(uint32_t));
+	h->probs_offset = align8(h->keys_offset + (uint64_t) h->nprobs * sizeof(uint64_t));
+	h->longs_offset = align8(h->probs_offset + (uint64_t) h->nprobs * sizeof(float));
+	h->rehash_offset = align8(h->longs_offset + (uint64_t) h->nlongs * sizeof(struct pattern));
+	h->size = h->rehash_offset + (uint64_t) h->nrehash * sizeof(uint32_t);
+}
+
+static bool
+write_at(FILE *f, uint64_t offset, void *data, size_t size)
+{
+	return !fseek(f, offset, SEEK_SET) && (!size || fwrite(data, size, 1, f) == 1);
+}
+
+static void
+pdict_cache_save(struct pattern_pdict *dict, uint32_t *rehash, unsigned int nrehash, char *cachename)
+{
+	struct pdict_cache_header h = {
+		.magic = PDICT_CACHE_MAGIC, .version = PDICT_CACHE_VERSION,
+		.byte_order = PDICT_CACHE_BYTE_ORDER, .header_size = sizeof(h),
+		.pattern_size = sizeof(struct pattern), .nspatials = dict->spat_dict->nspatials,
+		.nprobs = dict->nprobs, .nlongs = dict->nlongs, .nrehash = nrehash,
+	};
+	pdict_cache_layout(&h);
+
+	/* Write a new file and rename it over the old one,
+	 * which other processes may have mapped. */
+	char tmpname[1100];
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", cachename);
+	FILE *f = fopen(tmpname, "wb");
 	if (!f) {
-		if (DEBUGL(1))
-			fprintf(stderr, "No pattern probtable, will not use learned patterns.\n");
+		if (DEBUGL(2))
+			perror(tmpname);
+		return;
+	}
+	bool ok = write_at(f, 0, &h, sizeof(h))
+		  && write_at(f, h.offsets_offset, dict->offsets, (h.nspatials + 2) * sizeof(uint32_t))
+		  && write_at(f, h.keys_offset, dict->keys, h.nprobs * sizeof(uint64_t))
+		  && write_at(f, h.probs_offset, dict->probs, h.nprobs * sizeof(float))
+		  && write_at(f, h.longs_offset, dict->longs, h.nlongs * sizeof(struct pattern))
+		  && write_at(f, h.rehash_offset, rehash, nrehash * sizeof(uint32_t));
+	ok = !fclose(f) && ok;
+	if (!ok || rename(tmpname, cachename)) {
+		if (DEBUGL(2))
+			perror(tmpname);
+		remove(tmpname);
+	}
+}
+
+/* Load the cache if it is up to date. Returns NULL otherwise.
+ * The cache is only used together with the text file it was built
+ * from, so that removing patterns.prob disables the patterns. */
+static struct pattern_pdict *
+pdict_cache_load(char *cachename, char *filename, struct spatial_dict *sd,
+		 uint32_t **rehash, unsigned int *nrehash)
+{
+	if (access(filename, R_OK)
+	    || modeldata_file_older(cachename, filename) || modeldata_file_older(cachename, spatial_dict_filename))
+		return NULL;
+	size_t size;
+	void *map = modeldata_map(cachename, sizeof(struct pdict_cache_header), &size);
+	if (!map) return NULL;
+
+	struct pdict_cache_header *h = map, l = *h;
+	pdict_cache_layout(&l);
+	if (memcmp(h->magic, PDICT_CACHE_MAGIC, sizeof(h->magic)) || h->version != PDICT_CACHE_VERSION
+	    || h->byte_order != PDICT_CACHE_BYTE_ORDER || h->header_size != sizeof(*h)
+	    || h->pattern_size != sizeof(struct pattern) || h->nspatials != sd->nspatials
+	    || memcmp(h, &l, sizeof(l)) || h->size > size) {
+		if (DEBUGL(2))
+			fprintf(stderr, "%s: stale or invalid pattern probtable cache, ignored.\n", cachename);
+		modeldata_unmap(map, size);
 		return NULL;
 	}
 
 	struct pattern_pdict *dict = calloc2(1, sizeof(*dict));
-	dict->pc = pc;
-	dict->table = calloc2(pc->spat_dict->nspatials + 1, sizeof(*dict->table));
+	dict->spat_dict = sd;
+	dict->offsets = map + h->offsets_offset;
+	dict->keys = map + h->keys_offset;
+	dict->probs = map + h->probs_offset;
+	dict->nprobs = h->nprobs;
+	dict->longs = map + h->longs_offset;
+	dict->nlongs = h->nlongs;
+	dict->map = map;
+	dict->map_size = size;
+	*rehash = map + h->rehash_offset;
+	*nrehash = h->nrehash;
+	return dict;
+}
 
-	char *sphcachehit = calloc2(pc->spat_dict->nspatials, 1);
-	hash_t (*sphcache)[PTH__ROTATIONS] = malloc(pc->spat_dict->nspatials * sizeof(sphcache[0]));
+/* Parse the text file. Also returns the rehash order of spatials,
+ * to be freed by the caller. */
+static struct pattern_pdict *
+pdict_load_text(char *filename, struct spatial_dict *sd, uint32_t **rehash, unsigned int *nrehash)
+{
+	FILE *f = fopen(filename, "r");
+	if (!f)
+		return NULL;
+
+	struct pattern_pdict *dict = calloc2(1, sizeof(*dict));
+	dict->spat_dict = sd;
+
+	/* Patterns in the order of loading, and their spatial ids;
+	 * sorted into dict->keys[] in the end. */
+	unsigned int nloaded = 0, nalloc = 1024;
+	struct pattern *loaded = malloc2(nalloc * sizeof(*loaded));
+	float *loaded_prob = malloc2(nalloc * sizeof(*loaded_prob));
+	uint32_t *loaded_spi = malloc2(nalloc * sizeof(*loaded_spi));
 
-	int i = 0;
 	char sbuf[1024];
 	while (fgets(sbuf, sizeof(sbuf), f)) {
-		struct pattern_prob *pb = calloc2(1, sizeof(*pb));
 		int c, o;
 
 		char *buf = sbuf;
 		if (buf[0] == '#') continue;
+		if (nloaded == nalloc) {
+			nalloc *= 2;
+			loaded = realloc(loaded, nalloc * sizeof(*loaded));
+			loaded_prob = realloc(loaded_prob, nalloc * sizeof(*loaded_prob));
+			loaded_spi = realloc(loaded_spi, nalloc * sizeof(*loaded_spi));
+			if (!loaded || !loaded_prob || !loaded_spi) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		struct pattern *p = &loaded[nloaded];
 		while (isspace(*buf)) buf++;
 		while (!isspace(*buf)) buf++; // we recompute the probability
 		while (isspace(*buf)) buf++;
 		c = strtol(buf, &buf, 10);
 		while (isspace(*buf)) buf++;
 		o = strtol(buf, &buf, 10);
-		pb->prob = (floating_t) c / o;
+		loaded_prob[nloaded] = (floating_t) c / o;
 		while (isspace(*buf)) buf++;
-		str2pattern(buf, &pb->p);
-
-		uint32_t spi = pattern2spatial(dict, &pb->p);
-		pb->next = dict->table[spi];
-		dict->table[spi] = pb;
-
-		/* Some spatials may not have been loaded if they correspond
-		 * to a radius larger than supported. */
-		if (pc->spat_dict->spatials[spi].dist > 0) {
-			/* We rehash spatials in the order of loaded patterns. This way
-			 * we make sure that the most popular patterns will be hashed
-			 * last and therefore take priority. */
-			if (!sphcachehit[spi]) {
-				sphcachehit[spi] = 1;
-				for (unsigned int r = 0; r < PTH__ROTATIONS; r++)
-					sphcache[spi][r] = spatial_hash(r, &pc->spat_dict->spatials[spi]);
-			}
-			for (unsigned int r = 0; r < PTH__ROTATIONS; r++)
-				spatial_dict_addh(pc->spat_dict, sphcache[spi][r], spi);
+		str2pattern(buf, p);
+
+		uint32_t spi = pattern2spatial(dict, p);
+		if (spi > sd->nspatials) {
+			if (DEBUGL(1))
+				fprintf(stderr, "Pattern with unknown spatial %d ignored.\n", spi);
+			continue;
+		}
+		loaded_spi[nloaded++] = spi;
+	}
+	fclose(f);
+
+	/* We rehash spatials in the order of loaded patterns. This way
+	 * we make sure that the most popular patterns will be hashed
+	 * last and therefore take priority. Only the last pattern of
+	 * each spatial matters for that, so we keep the spatials in the
+	 * order of their last occurrence. Some spatials may not have been
+	 * loaded if they correspond to a radius larger than supported.
+	 * Patterns without a spatial feature have spi == nspatials. */
+	unsigned int nspi = sd->nspatials + 1;
+	char *seen = calloc2(nspi, 1);
+	*rehash = malloc2((nloaded ? nloaded : 1) * sizeof(**rehash));
+	*nrehash = 0;
+	for (unsigned int j = nloaded; j-- > 0; ) {
+		uint32_t spi = loaded_spi[j];
+		if (seen[spi] || spi == nspi - 1 || !sd->spatials[spi].dist)
+			continue;
+		seen[spi] = 1;
+		(*rehash)[(*nrehash)++] = spi;
+	}
+	for (unsigned int i = 0; i < *nrehash / 2; i++) {
+		uint32_t t = (*rehash)[i];
+		(*rehash)[i] = (*rehash)[*nrehash - 1 - i];
+		(*rehash)[*nrehash - 1 - i] = t;
+	}
+	free(seen);
+
+	/* Counting sort by spatial id; we go backwards so that the most
+	 * recently loaded duplicates take priority. */
+	dict->offsets = calloc2(nspi + 1, sizeof(*dict->offsets));
+	for (unsigned int j = 0; j < nloaded; j++)
+		dict->offsets[loaded_spi[j] + 1]++;
+	for (unsigned int spi = 0; spi < nspi; spi++)
+		dict->offsets[spi + 1] += dict->offsets[spi];
+	uint32_t *pos = malloc2(nspi * sizeof(*pos));
+	memcpy(pos, dict->offsets, nspi * sizeof(*pos));
+	dict->nprobs = nloaded;
+	dict->keys = malloc2((nloaded ? nloaded : 1) * sizeof(*dict->keys));
+	dict->probs = malloc2((nloaded ? nloaded : 1) * sizeof(*dict->probs));
+	dict->longs = malloc2(sizeof(*dict->longs));
+	for (unsigned int j = nloaded; j-- > 0; ) {
+		uint32_t i = pos[loaded_spi[j]]++;
+		dict->keys[i] = pattern2key(&loaded[j]);
+		dict->probs[i] = loaded_prob[j];
+		if (dict->keys[i] & PATTERN_KEY_LONG) {
+			dict->longs = realloc(dict->longs, (dict->nlongs + 1) * sizeof(*dict->longs));
+			dict->longs[dict->nlongs] = loaded[j];
+			dict->keys[i] = PATTERN_KEY_LONG | dict->nlongs++;
 		}
+	}
+	free(pos);
+	free(loaded_spi);
+	free(loaded_prob);
+	free(loaded);
+	return dict;
+}
 
-		i++;
+/* Add the hashes of spatials to the spatial dictionary in the given
+ * order, so that the latter ones take priority. A compiled dictionary
+ * was hashed this way when compiled. */
+static void
+pdict_rehash(struct spatial_dict *sd, uint32_t *rehash, unsigned int nrehash)
+{
+	if (sd->map)
+		return;
+	for (unsigned int i = 0; i < nrehash; i++) {
+		uint32_t spi = rehash[i];
+		if (spi >= sd->nspatials || !sd->spatials[spi].dist)
+			continue;
+		for (unsigned int r = 0; r < PTH__ROTATIONS; r++)
+			spatial_dict_addh(sd, spatial_hash(r, &sd->spatials[spi]), spi);
 	}
+}
+
+static void *
+pdict_load(const char *key, void *arg)
+{
+	char *filename = arg;
+	char cachename[1024];
+	snprintf(cachename, sizeof(cachename), "%s.cache", filename);
+
+	/* Each table has its own spatial dictionary, since the hash
+	 * priorities depend on the table. It is complete before the
+	 * table is shared, and never modified afterwards. The compiled
+	 * dictionary is hashed for patterns.prob. */
+	struct spatial_dict *sd = spatial_dict_init_unhashed(!strcmp(filename, "patterns.prob"));
+	if (!sd)
+		return NULL;
 
-	free(sphcache);
-	free(sphcachehit);
+	uint32_t *rehash;
+	unsigned int nrehash;
+	struct pattern_pdict *dict = pdict_cache_load(cachename, filename, sd, &rehash, &nrehash);
+	if (dict) {
+		pdict_rehash(sd, rehash, nrehash);
+	} else {
+		dict = pdict_load_text(filename, sd, &rehash, &nrehash);
+		if (!dict) {
+			if (DEBUGL(1))
+				fprintf(stderr, "No pattern probtable, will not use learned patterns.\n");
+			spatial_dict_done(sd);
+			return NULL;
+		}
+		pdict_rehash(sd, rehash, nrehash);
+		pdict_cache_save(dict, rehash, nrehash, cachename);
+		free(rehash);
+	}
 	if (DEBUGL(3))
-		spatial_dict_hashstats(pc->spat_dict);
+		spatial_dict_hashstats(sd);
 
-	fclose(f);
 	if (DEBUGL(1))
-		fprintf(stderr, "Loaded %d pattern-probability pairs.\n", i);
-	cached_dict = dict;
+		fprintf(stderr, "Loaded %d pattern-probability pairs%s (%d stored whole).\n",
+			dict->nprobs, dict->map ? " from cache" : "", dict->nlongs);
 	return dict;
 }
 
+static void
+pdict_free(void *data)
+{
+	struct pattern_pdict *dict = data;
+	if (dict->map) {
+		modeldata_unmap(dict->map, dict->map_size);
+	} else {
+		free(dict->offsets);
+		free(dict->keys);
+		free(dict->probs);
+		free(dict->longs);
+	}
+	spatial_dict_done(dict->spat_dict);
+	free(dict);
+}
+
+struct pattern_pdict *
+pattern_pdict_init(char *filename, struct pattern_config *pc)
+{
+	/* Feature ids must fit in 4 bits of pattern2key(). */
+	assert(FEAT_MAX < 16);
+	if (!filename)
+		filename = "patterns.prob";
+
+	/* We try to avoid needlessly reloading probability dictionary
+	 * since it may take rather long time, and share it with all
+	 * the engines. The spatial dictionary files are part of the
+	 * key, they may be changed between loads. */
+	char key[3200];
+	snprintf(key, sizeof(key), "pdict %s %s %s", filename, spatial_dict_filename,
+		 spatial_dict_binfilename ? spatial_dict_binfilename : "-");
+	struct pattern_pdict *dict = modeldata_get(key, pdict_load, filename, pdict_free);
+	if (dict)
+		pc->spat_dict = dict->spat_dict;
+	return dict;
+}
+
+void
+pattern_pdict_done(struct pattern_pdict *dict)
+{
+	modeldata_put(dict);
+}
+
 floating_t
 pattern_rate_moves(struct pattern_setup *pat,
                    struct board *b, enum stone color,
                    struct pattern *pats, floating_t *probs)
 {
-	double total = 0;
+	/* Gather valid moves first to match them all at once. */
+	coord_t moves[b->flen > 0 ? b->flen : 1];
+	int fi[b->flen > 0 ? b->flen : 1];
+	int nmoves = 0;
 	for (int f = 0; f < b->flen; f++) {
 		probs[f] = NAN;
 
@@ -105,8 +367,17 @@ pattern_rate_moves(struct pattern_setup *pat,
 			continue;
 		if (!board_is_valid_move(b, &mo))
 			continue;
+		moves[nmoves] = mo.coord;
+		fi[nmoves++] = f;
+	}
 
-		pattern_match(&pat->pc, pat->ps, &pats[f], b, &mo);
+	struct pattern mpats[nmoves > 0 ? nmoves : 1];
+	pattern_match_moves(&pat->pc, pat->ps, mpats, b, color, moves, nmoves);
+
+	double total = 0;
+	for (int i = 0; i < nmoves; i++) {
+		int f = fi[i];
+		pats[f] = mpats[i];
 		floating_t prob = pattern_prob(pat->pd, &pats[f]);
 		if (!isnan(prob)) {
 			probs[f] = prob;
@@ -114,7 +385,7 @@ pattern_rate_moves(struct pattern_setup *pat,
 		}
 		if (DEBUGL(5)) {
 			char buf[256]; pattern2str(buf, &pats[f]);
-			fprintf(stderr, "=> move %s pattern %s prob %.3f\n", coord2sstr(mo.coord, b), buf, prob);
+			fprintf(stderr, "=> move %s pattern %s prob %.3f\n", coord2sstr(moves[i], b), buf, prob);
 		}
 	}
 	return total;
@@ -8,6 +8,7 @@
 #include "board.h"
 #include "move.h"
 #include "pattern.h"
+#include "util.h"
 
 
 /* The pattern probability table considers each pattern as a whole
@@ -15,25 +16,50 @@
  * of the pattern being played. */
 
 /* The table primary key is the pattern spatial (most distinctive
- * feature); within a single primary key chain, the entries are
- * unsorted (for now). */
-
-struct pattern_prob {
-	struct pattern p;
-	floating_t prob;
-	struct pattern_prob *next;
-};
+ * feature); all entries are kept in flat arrays sorted by the spatial
+ * id, so that entries sharing a spatial are adjacent. Within a single
+ * spatial, the entries are unsorted (for now), the most recently loaded
+ * first. Instead of the whole struct pattern, each entry stores a 64-bit
+ * key encoding the features (see pattern2key()), so that a lookup scans
+ * a few consecutive keys, usually in one cache line. */
+
+/* pattern2key() packs up to PATTERN_KEY_FEATURES features with payload
+ * up to 255 in 12 bits each, in order; the spatial giving the primary
+ * key is packed with payload 0. Other patterns are stored whole in
+ * longs[] and their key is PATTERN_KEY_LONG | index. */
+#define PATTERN_KEY_FEATURES 5
+#define PATTERN_KEY_LONG (1ULL << 63)
 
 struct pattern_pdict {
-	struct pattern_config *pc;
-
-	struct pattern_prob **table; /* [pc->spat_dict->nspatials + 1] */
+	/* The spatial dictionary the table was loaded for, owned by
+	 * the table and hashed in the order of its patterns. */
+	struct spatial_dict *spat_dict;
+
+	uint64_t *keys; /* [nprobs] */
+	float *probs; /* [nprobs] */
+	unsigned int nprobs;
+	/* Entries with spatial id spi are keys[offsets[spi]]
+	 * .. keys[offsets[spi + 1] - 1]. */
+	uint32_t *offsets; /* [spat_dict->nspatials + 2] */
+	struct pattern *longs; /* [nlongs] */
+	unsigned int nlongs;
+
+	/* Set if loaded from the binary cache; the arrays are
+	 * in a read-only mapping of it. */
+	void *map;
+	size_t map_size;
 };
 
 /* Initialize the pdict data structure from a given file (pass NULL
  * to use default filename). Returns NULL if the file with patterns
- * has been found. */
+ * has been found. The parsed table is cached in a binary file next
+ * to it (filename.cache), loaded instead when up to date. Sets
+ * pc->spat_dict to the spatial dictionary of the table. */
 struct pattern_pdict *pattern_pdict_init(char *filename, struct pattern_config *pc);
+/* The table is shared read-only model data (see modeldata.h), loaded
+ * once for all engines; release it when done. Its spatial dictionary
+ * is released with it. */
+void pattern_pdict_done(struct pattern_pdict *dict);
 
 /* Return probability associated with given pattern. Returns NaN if
  * the pattern cannot be found. */
@@ -42,7 +68,8 @@ static floating_t pattern_prob(struct pattern_pdict *dict, struct pattern *p);
 /* Evaluate patterns for all available moves. Stores found patterns
  * to pats[b->flen] and NON-normalized probability of each pattern
  * (or NaN in case of no match) to probs[b->flen]. Returns the sum
- * of all probabilities that can be used for normalization. */
+ * of all probabilities that can be used for normalization. The moves
+ * are matched in a single pattern_match_moves() pass. */
 floating_t pattern_rate_moves(struct pattern_setup *pat,
                         struct board *b, enum stone color,
                         struct pattern *pats, floating_t *probs);
@@ -52,14 +79,26 @@ floating_t pattern_rate_moves(struct pattern_setup *pat,
  * plus one. */
 static uint32_t pattern2spatial(struct pattern_pdict *dict, struct pattern *p);
 
+/* Encode the features of a pattern, see above. */
+static uint64_t pattern2key(struct pattern *p);
+
 
 static inline floating_t
 pattern_prob(struct pattern_pdict *dict, struct pattern *p)
 {
 	uint32_t spi = pattern2spatial(dict, p);
-	for (struct pattern_prob *pb = dict->table[spi]; pb; pb = pb->next)
-		if (pattern_eq(p, &pb->p))
-			return pb->prob;
+	uint64_t key = pattern2key(p);
+	uint32_t i = dict->offsets[spi], end = dict->offsets[spi + 1];
+	if (likely(!(key & PATTERN_KEY_LONG))) {
+		for (; i < end; i++)
+			if (dict->keys[i] == key)
+				return dict->probs[i];
+	} else {
+		for (; i < end; i++)
+			if ((dict->keys[i] & PATTERN_KEY_LONG)
+			    && pattern_eq(p, &dict->longs[dict->keys[i] & ~PATTERN_KEY_LONG]))
+				return dict->probs[i];
+	}
 	return NAN; // XXX: We assume quiet NAN existence
 }
 
@@ -69,7 +108,27 @@ pattern2spatial(struct pattern_pdict *dict, struct pattern *p)
 	for (int i = 0; i < p->n; i++)
 		if (p->f[i].id == FEAT_SPATIAL)
 			return p->f[i].payload;
-	return dict->pc->spat_dict->nspatials;
+	return dict->spat_dict->nspatials;
+}
+
+static inline uint64_t
+pattern2key(struct pattern *p)
+{
+	if (p->n > PATTERN_KEY_FEATURES)
+		return PATTERN_KEY_LONG;
+	uint64_t key = 0;
+	bool spatial = false;
+	for (int i = 0; i < p->n; i++) {
+		unsigned int payload = p->f[i].payload;
+		if (p->f[i].id == FEAT_SPATIAL && !spatial) {
+			spatial = true;
+			payload = 0;
+		} else if (payload > 255) {
+			return PATTERN_KEY_LONG;
+		}
+		key = key << 12 | (uint64_t) (p->f[i].id + 1) << 8 | payload;
+	}
+	return key;
 }
 
 #endif
@@ -4,9 +4,11 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "board.h"
 #include "debug.h"
+#include "modeldata.h"
 #include "pattern.h"
 #include "patternsp.h"
 
@@ -228,16 +230,39 @@ spatial_dict_addc(struct spatial_dict *dict, struct spatial *s)
 	return dict->nspatials++;
 }
 
+/* Initial size of the hash index. */
+#define SPATIAL_HASH_MIN 1024
+
+static void
+spatial_dict_hash_alloc(struct spatial_dict *dict, unsigned int hsize)
+{
+	struct spatial_entry *old = dict->hash;
+	unsigned int old_size = dict->hsize;
+	dict->hash = calloc2(hsize, sizeof(*dict->hash));
+	dict->hsize = hsize;
+	for (unsigned int i = 0; i < old_size; i++)
+		if (old[i].id)
+			*spatial_dict_slot(dict, old[i].hash) = old[i];
+	free(old);
+}
+
 bool
 spatial_dict_addh(struct spatial_dict *dict, hash_t hash, unsigned int id)
 {
-	if (dict->hash[hash]) {
-		if (dict->hash[hash] != id)
+	assert(!dict->map);
+	struct spatial_entry *e = spatial_dict_slot(dict, hash);
+	if (e->id) {
+		if (e->id != id)
 			dict->collisions++;
 	} else {
+		if ((unsigned int) (dict->fills + 1) * 4 > dict->hsize * 3) {
+			spatial_dict_hash_alloc(dict, dict->hsize * 2);
+			e = spatial_dict_slot(dict, hash);
+		}
 		dict->fills++;
+		e->hash = hash;
 	}
-	dict->hash[hash] = id;
+	e->id = id;
 	return true;
 }
 
@@ -301,7 +326,7 @@ spatial_write(struct spatial_dict *dict, struct spatial *s, unsigned int id, FIL
 	fputs(spatial2str(s), f);
 	for (unsigned int r = 0; r < PTH__ROTATIONS; r++) {
 		hash_t rhash = spatial_hash(r, s);
-		unsigned int id2 = dict->hash[rhash];
+		unsigned int id2 = spatial_dict_slot(dict, rhash)->id;
 		if (id2 != id) {
 			/* This hash does not belong to us. Decide whether
 			 * we or the current owner is better owner. */
@@ -357,13 +382,18 @@ spatial_dict_hashstats(struct spatial_dict *dict)
 	 *
 	 * To verify, make sure to turn patternprob off (e.g. use
 	 * -e patternscan), since it will insert a pattern multiple times,
-	 * multiplying the reported number of collisions. */
+	 * multiplying the reported number of collisions.
+	 *
+	 * (These figures are for the former direct-mapped table of 2^26
+	 * buckets; collisions still count hashes of different spatials
+	 * equal in their spatial_hash_bits, the index itself being an
+	 * open addressing table sized after the number of hashes.) */
 
-	unsigned long buckets = (sizeof(dict->hash) / sizeof(dict->hash[0]));
-	fprintf(stderr, "\t(Spatial dictionary hash: %d collisions (incl. repetitions), %.2f%% (%d/%lu) fill rate).\n",
+	unsigned long buckets = dict->hsize;
+	fprintf(stderr, "\t(Spatial dictionary hash: %d collisions (incl. repetitions), %.2f%% (%d/%lu) fill rate, %lu KiB).\n",
 			dict->collisions,
 			(double) dict->fills * 100 / buckets,
-			dict->fills, buckets);
+			dict->fills, buckets, buckets * sizeof(*dict->hash) / 1024);
 }
 
 void
@@ -383,17 +413,126 @@ spatial_dict_writeinfo(struct spatial_dict *dict, FILE *f)
 	}
 }
 
-/* We try to avoid needlessly reloading spatial dictionary
- * since it may take rather long time. */
-static struct spatial_dict *cached_dict;
+/* Compiled spatial dictionary file format, in native byte order:
+ * header, spatials[nspatials] at spatials_offset and the hash
+ * index hash[hsize] at hash_offset. Bump SPATIAL_BIN_VERSION on
+ * any change of the layout or of the hash function. */
+
+#define SPATIAL_BIN_MAGIC "PACHISPD"
+#define SPATIAL_BIN_VERSION 1
+#define SPATIAL_BIN_BYTE_ORDER 0x01020304
+
+struct spatial_bin_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t header_size;
+	uint32_t spatial_size;
+	uint32_t max_dist;
+	uint32_t hash_bits;
+	uint32_t nspatials;
+	uint32_t hsize;
+	uint32_t fills;
+	uint32_t collisions;
+	uint64_t spatials_offset;
+	uint64_t hash_offset;
+	uint64_t size;
+};
+
+static uint64_t
+align8(uint64_t x)
+{
+	return (x + 7) & ~7ULL;
+}
 
-const char *spatial_dict_filename = "patterns.spat";
-struct spatial_dict *
-spatial_dict_init(bool will_append, bool hash)
+bool
+spatial_dict_save(struct spatial_dict *dict, const char *filename)
+{
+	struct spatial_bin_header h = {
+		.magic = SPATIAL_BIN_MAGIC, .version = SPATIAL_BIN_VERSION,
+		.byte_order = SPATIAL_BIN_BYTE_ORDER, .header_size = sizeof(h),
+		.spatial_size = sizeof(struct spatial), .max_dist = MAX_PATTERN_DIST,
+		.hash_bits = spatial_hash_bits, .nspatials = dict->nspatials,
+		.hsize = dict->hsize, .fills = dict->fills, .collisions = dict->collisions,
+	};
+	h.spatials_offset = align8(sizeof(h));
+	h.hash_offset = align8(h.spatials_offset + (uint64_t) dict->nspatials * sizeof(*dict->spatials));
+	h.size = h.hash_offset + (uint64_t) dict->hsize * sizeof(*dict->hash);
+
+	/* Write a new file and rename it over the old one,
+	 * which other processes may have mapped. */
+	char tmpname[1024];
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+	FILE *f = fopen(tmpname, "wb");
+	if (!f) {
+		perror(tmpname);
+		return false;
+	}
+	static const char zeros[8];
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1
+		  && fwrite(zeros, h.spatials_offset - sizeof(h), 1, f) <= 1
+		  && fwrite(dict->spatials, sizeof(*dict->spatials), dict->nspatials, f) == dict->nspatials
+		  && fwrite(zeros, h.hash_offset - h.spatials_offset - (uint64_t) dict->nspatials * sizeof(*dict->spatials), 1, f) <= 1
+		  && fwrite(dict->hash, sizeof(*dict->hash), dict->hsize, f) == dict->hsize;
+	ok = !fclose(f) && ok;
+	if (!ok || rename(tmpname, filename)) {
+		perror(tmpname);
+		remove(tmpname);
+		return false;
+	}
+	return true;
+}
+
+/* Map the compiled dictionary. Returns NULL if there is none or it
+ * cannot be used. */
+static struct spatial_dict *
+spatial_dict_map(const char *filename)
 {
-	if (cached_dict && !will_append)
-		return cached_dict;
+	if (modeldata_file_older(filename, spatial_dict_filename) || modeldata_file_older(filename, "patterns.prob")) {
+		if (DEBUGL(1))
+			fprintf(stderr, "%s is older than the text dictionary, ignored.\n", filename);
+		return NULL;
+	}
+	size_t size;
+	void *map = modeldata_map(filename, sizeof(struct spatial_bin_header), &size);
+	if (!map) return NULL;
+
+	struct spatial_bin_header *h = map;
+	if (memcmp(h->magic, SPATIAL_BIN_MAGIC, sizeof(h->magic)) || h->version != SPATIAL_BIN_VERSION
+	    || h->byte_order != SPATIAL_BIN_BYTE_ORDER || h->spatial_size != sizeof(struct spatial)
+	    || h->max_dist != MAX_PATTERN_DIST || h->hash_bits != spatial_hash_bits
+	    || h->size > size || !h->nspatials || !h->hsize || (h->hsize & (h->hsize - 1))
+	    || h->fills >= h->hsize /* lookups need an empty slot to stop at */
+	    || h->spatials_offset + (uint64_t) h->nspatials * sizeof(struct spatial) > h->hash_offset
+	    || h->hash_offset + (uint64_t) h->hsize * sizeof(struct spatial_entry) > h->size) {
+		if (DEBUGL(1))
+			fprintf(stderr, "%s: unsupported or invalid compiled dictionary, ignored.\n", filename);
+		modeldata_unmap(map, size);
+		return NULL;
+	}
 
+	struct spatial_dict *dict = calloc2(1, sizeof(*dict));
+	dict->nspatials = h->nspatials;
+	dict->spatials = map + h->spatials_offset;
+	dict->hsize = h->hsize;
+	dict->hash = map + h->hash_offset;
+	dict->fills = h->fills;
+	dict->collisions = h->collisions;
+	dict->map = map;
+	dict->map_size = size;
+	if (DEBUGL(1)) {
+		fprintf(stderr, "Loaded spatial dictionary of %d patterns from %s.\n", dict->nspatials, filename);
+		if (DEBUGL(3))
+			spatial_dict_hashstats(dict);
+	}
+	return dict;
+}
+
+/* Load the text dictionary; with will_append, create an empty
+ * one if there is none. */
+static struct spatial_dict *
+spatial_dict_create(bool will_append, bool hash)
+{
 	FILE *f = fopen(spatial_dict_filename, "r");
 	if (!f && !will_append) {
 		if (DEBUGL(1))
@@ -402,6 +541,7 @@ spatial_dict_init(bool will_append, bool hash)
 	}
 
 	struct spatial_dict *dict = calloc2(1, sizeof(*dict));
+	spatial_dict_hash_alloc(dict, SPATIAL_HASH_MIN);
 	/* We create a dummy record for index 0 that we will
 	 * never reference. This is so that hash value 0 can
 	 * represent "no value". */
@@ -414,17 +554,78 @@ spatial_dict_init(bool will_append, bool hash)
 	} else {
 		assert(will_append);
 	}
-
-	cached_dict = dict;
 	return dict;
 }
 
+static void *
+spatial_dict_load_shared(const char *key, void *arg)
+{
+	bool hash = *(bool *) arg;
+
+	/* The compiled dictionary has a complete index already. */
+	if (spatial_dict_binfilename) {
+		struct spatial_dict *dict = spatial_dict_map(spatial_dict_binfilename);
+		if (dict)
+			return dict;
+	}
+	return spatial_dict_create(false, hash);
+}
+
+static void
+spatial_dict_free(void *data)
+{
+	spatial_dict_done(data);
+}
+
+const char *spatial_dict_filename = "patterns.spat";
+const char *spatial_dict_binfilename = "patterns.spatbin";
+struct spatial_dict *
+spatial_dict_init(bool will_append, bool hash)
+{
+	/* A dictionary to be appended to is private. Otherwise, we
+	 * avoid needlessly reloading the dictionary since it may take
+	 * rather long time, and share it with all the engines. */
+	if (will_append)
+		return spatial_dict_create(true, hash);
+
+	char key[2100];
+	snprintf(key, sizeof(key), "spatial %s %s %s", spatial_dict_filename,
+		 spatial_dict_binfilename ? spatial_dict_binfilename : "-", hash ? "hashed" : "unhashed");
+	return modeldata_get(key, spatial_dict_load_shared, &hash, spatial_dict_free);
+}
+
+struct spatial_dict *
+spatial_dict_init_unhashed(bool compiled)
+{
+	if (compiled && spatial_dict_binfilename) {
+		struct spatial_dict *dict = spatial_dict_map(spatial_dict_binfilename);
+		if (dict)
+			return dict;
+	}
+	return spatial_dict_create(false, false);
+}
+
+void
+spatial_dict_done(struct spatial_dict *dict)
+{
+	if (!dict || modeldata_put(dict))
+		return;
+	if (dict->map) {
+		modeldata_unmap(dict->map, dict->map_size);
+	} else {
+		free(dict->spatials);
+		free(dict->hash);
+	}
+	free(dict);
+}
+
 unsigned int
 spatial_dict_put(struct spatial_dict *dict, struct spatial *s, hash_t h)
 {
 	/* We avoid spatial_dict_get() here, since we want to ignore radius
 	 * differences - we have custom collision detection. */
-	unsigned int id = dict->hash[h];
+	assert(!dict->map);
+	unsigned int id = spatial_dict_slot(dict, h)->id;
 	if (id > 0) {
 		/* Is this the same or isomorphous spatial? */
 		if (spatial_cmp(s, &dict->spatials[id]))
@@ -434,7 +635,7 @@ spatial_dict_put(struct spatial_dict *dict, struct spatial *s, hash_t h)
 		 * points at the correct spatial. */
 		for (unsigned int r = 0; r < PTH__ROTATIONS; r++) {
 			hash_t rhash = spatial_hash(r, s);
-			unsigned int rid = dict->hash[rhash];
+			unsigned int rid = spatial_dict_slot(dict, rhash)->id;
 			/* No match means we definitely aren't stored yet. */
 			if (!rid)
 				break;
@@ -74,13 +74,14 @@ char *spatial2str(struct spatial *s);
 
 /* Mapping from point sequence to coordinate offsets (to determine
  * coordinates relative to pattern center). */
-struct ptcoord { short x, y; } ptcoords[MAX_PATTERN_AREA];
+struct ptcoord { short x, y; };
+extern struct ptcoord ptcoords[MAX_PATTERN_AREA];
 /* For each radius, starting index in ptcoords[]. */
-unsigned int ptind[MAX_PATTERN_DIST + 2];
+extern unsigned int ptind[MAX_PATTERN_DIST + 2];
 
 /* Zobrist hashes used for points in patterns. */
 #define PTH__ROTATIONS	8
-hash_t pthashes[PTH__ROTATIONS][MAX_PATTERN_AREA][S_MAX];
+extern hash_t pthashes[PTH__ROTATIONS][MAX_PATTERN_AREA][S_MAX];
 
 #define ptcoords_at(x_, y_, c_, b_, j_) \
 	int x_ = coord_x((c_), (b_)) + ptcoords[j_].x; \
@@ -90,6 +91,12 @@ hash_t pthashes[PTH__ROTATIONS][MAX_PATTERN_AREA][S_MAX];
 
 /* Spatial dictionary - collection of stone configurations. */
 
+/* Entry of the spatial dictionary hash index. */
+struct spatial_entry {
+	uint32_t hash; /* Hash of the configuration (one rotation). */
+	uint32_t id; /* Index in spatials[], 0 marks an empty slot. */
+};
+
 /* Two ways of lookup: (i) by index (ii) by hash of the configuration. */
 struct spatial_dict {
 	/* Indexed base store */
@@ -98,26 +105,49 @@ struct spatial_dict {
 
 	/* Hashed access; all isomorphous configurations
 	 * are also hashed */
-#define spatial_hash_bits 26 // ~256mib array
+#define spatial_hash_bits 26
 #define spatial_hash_mask ((1 << spatial_hash_bits) - 1)
-	/* Maps to spatials[] indices. The hash function
-	 * used is zobrist hashing with fixed values. */
-	uint32_t hash[1 << spatial_hash_bits];
+	/* Maps to spatials[] indices. The hash function used is
+	 * zobrist hashing with fixed values, masked to spatial_hash_bits.
+	 * Open addressing with linear probing; the table grows to stay
+	 * at most 3/4 full, so its size follows the dictionary. */
+	struct spatial_entry *hash; /* [hsize] */
+	unsigned int hsize; /* Power of two. */
 	/* Auxiliary counters for statistics. */
 	int fills, collisions;
+
+	/* Set if loaded from a compiled dictionary: the records and the
+	 * index are in a read-only mapping of the file, shared by all
+	 * processes using it. Such a dictionary cannot be modified. */
+	void *map;
+	size_t map_size;
 };
 
 /* Initializes spatial dictionary, pre-loading existing records from
  * default filename if exists. If will_append is true, it will not
  * complain about non-existing file and initialize the dictionary anyway.
- * If hash is true, loaded spatials will be added to the hashtable;
- * use false if this is to be done later (e.g. by patternprob). */
+ * If hash is true, loaded spatials will be added to the hashtable.
+ * Unless will_append, the dictionary is shared read-only model data
+ * (see modeldata.h), loaded once for all engines of the process. */
 struct spatial_dict *spatial_dict_init(bool will_append, bool hash);
 
+/* Load a private dictionary with an empty hashtable, to be filled by
+ * the caller with spatial_dict_addh() (see patternprob.c). With
+ * compiled, the compiled dictionary is mapped instead if available;
+ * its hashtable is complete already. */
+struct spatial_dict *spatial_dict_init_unhashed(bool compiled);
+
+/* Release a shared dictionary, or free a private one. */
+void spatial_dict_done(struct spatial_dict *dict);
+
 /* Lookup specified spatial pattern in the dictionary; return index
  * of the pattern. If the pattern is not found, 0 will be returned. */
 static unsigned int spatial_dict_get(struct spatial_dict *dict, int dist, hash_t h);
 
+/* Return the hash index slot of given hash: either its entry, or the
+ * empty slot where it would be inserted. */
+static struct spatial_entry *spatial_dict_slot(struct spatial_dict *dict, hash_t h);
+
 /* Store specified spatial pattern in the dictionary if it is not known yet.
  * Returns pattern id. Note that the pattern is NOT written to the underlying
  * file automatically. */
@@ -139,6 +169,17 @@ void spatial_dict_hashstats(struct spatial_dict *dict);
 /* Default spatial dict filename to use. */
 extern const char *spatial_dict_filename;
 
+/* Compiled spatial dictionary, loaded instead of the text file when
+ * present and not older than spatial_dict_filename and patterns.prob.
+ * The index keeps the hash priorities set by pattern_pdict_init()
+ * for patterns.prob.
+ * Set to NULL to always load the text file. */
+extern const char *spatial_dict_binfilename;
+
+/* Write the dictionary, with its hash index, in the compiled format.
+ * Returns false on error. See tools/spatcompile.c. */
+bool spatial_dict_save(struct spatial_dict *dict, const char *filename);
+
 /* Write comment lines describing the dictionary (e.g. point order
  * in patterns) to given file. */
 void spatial_dict_writeinfo(struct spatial_dict *dict, FILE *f);
@@ -147,10 +188,20 @@ void spatial_dict_writeinfo(struct spatial_dict *dict, FILE *f);
 void spatial_write(struct spatial_dict *dict, struct spatial *s, unsigned int id, FILE *f);
 
 
+static inline struct spatial_entry *
+spatial_dict_slot(struct spatial_dict *dict, hash_t hash)
+{
+	unsigned int mask = dict->hsize - 1;
+	unsigned int i = hash & mask;
+	while (dict->hash[i].id && dict->hash[i].hash != hash)
+		i = (i + 1) & mask;
+	return &dict->hash[i];
+}
+
 static inline unsigned int
 spatial_dict_get(struct spatial_dict *dict, int dist, hash_t hash)
 {
-	unsigned int id = dict->hash[hash];
+	unsigned int id = spatial_dict_slot(dict, hash)->id;
 #ifdef DEBUG
 	if (id && dict->spatials[id].dist != dist) {
 		if (DEBUGL(6))
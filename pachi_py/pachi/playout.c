@@ -1,6 +1,7 @@
 #define DEBUG
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,6 +12,7 @@
 #include "move.h"
 #include "ownermap.h"
 #include "playout.h"
+#include "random.h"
 
 /* Whether to set global debug level to the same as the playout
  * has, in case it is different. This can make sure e.g. tactical
@@ -163,3 +165,86 @@ play_random_game(struct playout_setup *setup,
 
 	return result;
 }
+
+
+struct playout_ownermap_worker {
+	struct playout_setup *setup;
+	struct board *b;
+	enum stone color;
+	struct playout_policy *policy;
+	struct board_ownermap *ownermap;
+	int games;
+	unsigned long seed;
+};
+
+static void *
+playout_ownermap_thread(void *data)
+{
+	struct playout_ownermap_worker *w = data;
+	fast_srandom(w->seed);
+	for (int i = 0; i < w->games; i++) {
+		struct board b2;
+		board_copy(&b2, w->b);
+		play_random_game(w->setup, &b2, w->color, NULL, w->ownermap, w->policy);
+		board_done_noalloc(&b2);
+	}
+	return NULL;
+}
+
+/* The number of threads comes from the caller, e.g. from Python. */
+#define PLAYOUT_OWNERMAP_MAX_THREADS 256
+
+void
+playout_ownermap(struct playout_setup *setup,
+		 struct board *b, enum stone color,
+		 struct board_ownermap *ownermap,
+		 struct playout_policy *policy,
+		 int games, int threads)
+{
+	if (threads > games)
+		threads = games;
+	if (threads > PLAYOUT_OWNERMAP_MAX_THREADS)
+		threads = PLAYOUT_OWNERMAP_MAX_THREADS;
+	if (threads < 1)
+		threads = 1;
+	int bsize2 = board_size2(b);
+
+	/* The calling thread takes the first share itself, straight
+	 * into ownermap; the other threads fill their own. */
+	struct playout_ownermap_worker *w = malloc2(threads * sizeof(*w));
+	struct board_ownermap *maps = malloc2(threads * sizeof(*maps));
+	pthread_t *tid = malloc2(threads * sizeof(*tid));
+	w[0] = (struct playout_ownermap_worker) {
+		.setup = setup, .b = b, .color = color, .policy = policy,
+		.ownermap = ownermap, .games = games,
+		.seed = fast_irandom(1 << 30) + 1,
+	};
+	int started;
+	for (started = 1; started < threads; started++) {
+		int i = started;
+		w[i] = w[0];
+		w[i].ownermap = &maps[i];
+		w[i].games = games / threads + (i < games % threads);
+		w[i].seed = fast_irandom(1 << 30) + 1;
+		maps[i].playouts = 0;
+		maps[i].map = calloc2(bsize2, sizeof(maps[i].map[0]));
+		if (pthread_create(&tid[i], NULL, playout_ownermap_thread, &w[i])) {
+			/* Play the shares of the threads we cannot
+			 * create in the calling thread. */
+			if (DEBUGL(2))
+				perror("playout_ownermap: pthread_create");
+			free(maps[i].map);
+			break;
+		}
+		w[0].games -= w[i].games;
+	}
+	playout_ownermap_thread(&w[0]);
+	for (int i = 1; i < started; i++) {
+		pthread_join(tid[i], NULL);
+		board_ownermap_merge(bsize2, ownermap, &maps[i]);
+		free(maps[i].map);
+	}
+	free(tid);
+	free(maps);
+	free(w);
+}
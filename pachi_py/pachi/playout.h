@@ -111,4 +111,17 @@ coord_t play_random_move(struct playout_setup *setup,
 		         struct board *b, enum stone color,
 		         struct playout_policy *policy);
 
+/* Play the given number of random games from position b (color to
+ * play) and collect their final positions into ownermap (which must
+ * have its map allocated). The games are spread over threads (at
+ * most 256; the calling thread plays the share of any that cannot be
+ * created), each filling its own ownermap, merged to ownermap in the
+ * end; the policy is shared by the threads. The random seeds of the
+ * threads are derived from the seed of the calling thread. */
+void playout_ownermap(struct playout_setup *setup,
+		      struct board *b, enum stone color,
+		      struct board_ownermap *ownermap,
+		      struct playout_policy *policy,
+		      int games, int threads);
+
 #endif
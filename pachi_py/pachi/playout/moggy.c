@@ -245,8 +245,7 @@ joseki_check(struct playout_policy *p, struct board *b, enum stone to_play, stru
 		return;
 
 	for (int i = 0; i < 4; i++) {
-		hash_t h = b->qhash[i] & joseki_hash_mask;
-		coord_t *cc = pp->jdict->patterns[h].moves[to_play];
+		coord_t *cc = joseki_moves(pp->jdict, b->qhash[i], to_play);
 		if (!cc) continue;
 		for (; !is_pass(*cc); cc++) {
 			if (coord_quadrant(*cc, b) != i)
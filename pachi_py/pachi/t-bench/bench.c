@@ -0,0 +1,519 @@
+#include <assert.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "board.h"
+#include "debug.h"
+#include "engine.h"
+#include "move.h"
+#include "pattern.h"
+#include "patternsp.h"
+#include "playout.h"
+#include "playout/light.h"
+#include "playout/moggy.h"
+#include "random.h"
+#include "tactics/ladder.h"
+#include "t-unit/test.h"
+#include "timeinfo.h"
+#include "uct/uct.h"
+
+/* Benchmark of the board core hot paths. Each benchmark performs a fixed
+ * amount of work from a fixed random seed, so the number of operations is
+ * reproducible between builds and only the timing changes. Results are
+ * printed as tab-separated lines, one per benchmark and position:
+ *
+ *	bench <name> <position> <size> <ops> <seconds> <rate> <unit>
+ *
+ * Positions are empty boards of the standard sizes, plus the final
+ * positions of any SGF game records given on the command line (e.g.
+ * t-regress/games/).
+ *
+ * With -u UCT_ARGS, a full UCT search is also benchmarked for each
+ * given engine configuration, e.g. to compare thread and NUMA placement
+ * settings on the same machine. */
+
+/* Number of iterations of each benchmark per unit of scale. */
+#define BENCH_CLONES	200000
+#define BENCH_VALID	20000
+#define BENCH_GAMES	2000
+#define BENCH_LIGHT	2000
+#define BENCH_MOGGY	200
+#define BENCH_SPATIAL	200
+#define BENCH_MATCH	50
+#define BENCH_LADDER	20
+#define BENCH_UCT	20000
+#define BENCH_UCT_MAX	8
+
+
+struct bench_position {
+	char *name;
+	struct board *b;
+	/* Color to play next in the position. */
+	enum stone to_play;
+};
+
+struct bench_setup {
+	unsigned long seed;
+	double scale;
+	/* Spatial features matching setup; the dictionary is filled
+	 * with patterns of the benchmarked positions. */
+	struct pattern_config pc;
+	pattern_spec ps;
+	/* UCT engine configurations to benchmark. */
+	char *uct_args[BENCH_UCT_MAX];
+	int uct_count;
+};
+
+static volatile long bench_sink;
+
+
+static void
+bench_report(char *name, struct bench_position *pos, long ops, double elapsed, char *unit)
+{
+	printf("bench\t%s\t%s\t%d\t%ld\t%.6f\t%.1f\t%s\n",
+		name, pos->name, real_board_size(pos->b), ops, elapsed,
+		elapsed > 0 ? ops / elapsed : 0, unit);
+	fflush(stdout);
+}
+
+static int
+bench_iters(struct bench_setup *setup, int base)
+{
+	int n = base * setup->scale;
+	return n > 0 ? n : 1;
+}
+
+
+/* board_copy() + board_done_noalloc(), as done per playout and by
+ * PachiBoard::clone(). */
+static void
+bench_clone(struct bench_setup *setup, struct bench_position *pos)
+{
+	int n = bench_iters(setup, BENCH_CLONES);
+	double start = time_now();
+	for (int i = 0; i < n; i++) {
+		struct board b2;
+		board_copy(&b2, pos->b);
+		board_done_noalloc(&b2);
+	}
+	bench_report("clone", pos, n, time_now() - start, "clones/s");
+}
+
+/* board_is_valid_play() on all free points for both colors. */
+static void
+bench_valid(struct bench_setup *setup, struct bench_position *pos)
+{
+	int n = bench_iters(setup, BENCH_VALID);
+	long ops = 0, valid = 0;
+	double start = time_now();
+	for (int i = 0; i < n; i++) {
+		/* Keep the compiler from hoisting the queries out of the loop. */
+		__asm__ __volatile__("" ::: "memory");
+		foreach_free_point(pos->b) {
+			valid += board_is_valid_play(pos->b, S_BLACK, c);
+			valid += board_is_valid_play(pos->b, S_WHITE, c);
+			ops += 2;
+		} foreach_free_point_end;
+	}
+	double elapsed = time_now() - start;
+	/* ...and from optimizing them away altogether. */
+	bench_sink = valid;
+	bench_report("valid", pos, ops, elapsed, "queries/s");
+}
+
+/* Play random game until two passes or MAX_GAMELEN moves using
+ * board_play_random(); returns number of moves played. */
+static int
+bench_random_game(struct board *b, enum stone color, coord_t *game)
+{
+	int moves = 0, passes = 0;
+	while (passes < 2 && moves < MAX_GAMELEN) {
+		coord_t coord;
+		board_play_random(b, color, &coord, NULL, NULL);
+		passes = is_pass(coord) ? passes + 1 : 0;
+		if (game) game[moves] = coord;
+		moves++;
+		color = stone_other(color);
+	}
+	return moves;
+}
+
+/* board_play_random() random games. */
+static void
+bench_play_random(struct bench_setup *setup, struct bench_position *pos)
+{
+	int n = bench_iters(setup, BENCH_GAMES);
+	long moves = 0;
+	fast_srandom(setup->seed);
+	double start = time_now();
+	for (int i = 0; i < n; i++) {
+		struct board b2;
+		board_copy(&b2, pos->b);
+		moves += bench_random_game(&b2, pos->to_play, NULL);
+		board_done_noalloc(&b2);
+	}
+	bench_report("play_random", pos, moves, time_now() - start, "moves/s");
+}
+
+/* board_play_random() in the late game only: each random game is played
+ * untimed until at most a quarter of the board is free, the rest of it
+ * is timed. This is where most picks are eyes or suicides. */
+static void
+bench_play_random_late(struct bench_setup *setup, struct bench_position *pos)
+{
+	int n = bench_iters(setup, BENCH_GAMES);
+	int late = real_board_size(pos->b) * real_board_size(pos->b) / 4;
+	long moves = 0;
+	double elapsed = 0;
+	fast_srandom(setup->seed);
+	for (int i = 0; i < n; i++) {
+		struct board b2;
+		board_copy(&b2, pos->b);
+		enum stone color = pos->to_play;
+		int passes = 0, gamelen = 0;
+		coord_t coord;
+		while (b2.flen > late && passes < 2 && gamelen < MAX_GAMELEN) {
+			board_play_random(&b2, color, &coord, NULL, NULL);
+			passes = is_pass(coord) ? passes + 1 : 0;
+			gamelen++;
+			color = stone_other(color);
+		}
+		double start = time_now();
+		while (passes < 2 && gamelen < MAX_GAMELEN) {
+			board_play_random(&b2, color, &coord, NULL, NULL);
+			passes = is_pass(coord) ? passes + 1 : 0;
+			gamelen++;
+			moves++;
+			color = stone_other(color);
+		}
+		elapsed += time_now() - start;
+		board_done_noalloc(&b2);
+	}
+	bench_report("play_random_late", pos, moves, elapsed, "moves/s");
+}
+
+/* board_play() replaying pre-generated random games, so that move
+ * selection does not count in; optionally with incremental spatial
+ * hashes maintained. */
+static void
+bench_play(struct bench_setup *setup, struct bench_position *pos, bool spathash)
+{
+#define BENCH_PLAY_GAMES 16
+	coord_t games[BENCH_PLAY_GAMES][MAX_GAMELEN];
+	int gamelen[BENCH_PLAY_GAMES];
+	fast_srandom(setup->seed);
+	for (int g = 0; g < BENCH_PLAY_GAMES; g++) {
+		struct board b2;
+		board_copy(&b2, pos->b);
+		gamelen[g] = bench_random_game(&b2, pos->to_play, games[g]);
+		board_done_noalloc(&b2);
+	}
+
+	struct board b0;
+	board_copy(&b0, pos->b);
+	if (spathash)
+		board_spathash_enable(&b0);
+
+	int n = bench_iters(setup, spathash ? BENCH_GAMES / 10 : BENCH_GAMES);
+	long moves = 0;
+	double start = time_now();
+	for (int i = 0; i < n; i++) {
+		int g = i % BENCH_PLAY_GAMES;
+		struct board b2;
+		board_copy(&b2, &b0);
+		enum stone color = pos->to_play;
+		for (int j = 0; j < gamelen[g]; j++) {
+			struct move m = { games[g][j], color };
+			int res = board_play(&b2, &m);
+			assert(res >= 0);
+			color = stone_other(color);
+		}
+		moves += gamelen[g];
+		board_done_noalloc(&b2);
+	}
+	bench_report(spathash ? "play_spathash" : "play", pos, moves, time_now() - start, "moves/s");
+	board_done_noalloc(&b0);
+#undef BENCH_PLAY_GAMES
+}
+
+/* Spatial features matching of all free points, as done by pattern
+ * priors at node expansion; without and with incremental hashes. */
+static void
+bench_spatial(struct bench_setup *setup, struct bench_position *pos)
+{
+	struct pattern_config pc = setup->pc;
+	struct board b2;
+	board_copy(&b2, pos->b);
+
+	/* Make sure the patterns are found in the dictionary. */
+	foreach_free_point(&b2) {
+		struct move m = { c, pos->to_play };
+		for (pc.spat_max = pc.spat_min; pc.spat_max <= setup->pc.spat_max; pc.spat_max++) {
+			struct spatial s;
+			spatial_from_board(&pc, &s, &b2, &m);
+			spatial_dict_put(pc.spat_dict, &s, spatial_hash(0, &s));
+		}
+	} foreach_free_point_end;
+	pc = setup->pc;
+
+	int n = bench_iters(setup, BENCH_SPATIAL);
+	struct pattern p[2][b2.flen];
+	for (int incr = 0; incr < 2; incr++) {
+		if (incr)
+			board_spathash_enable(&b2);
+		long ops = 0;
+		double start = time_now();
+		for (int i = 0; i < n; i++) {
+			for (int f = 0; f < b2.flen; f++) {
+				struct move m = { b2.f[f], pos->to_play };
+				pattern_match(&pc, setup->ps, &p[incr][f], &b2, &m);
+			}
+			ops += b2.flen;
+		}
+		bench_report(incr ? "spatial_spathash" : "spatial", pos, ops, time_now() - start, "moves/s");
+	}
+	for (int f = 0; f < b2.flen; f++)
+		if (!pattern_eq(&p[0][f], &p[1][f])) {
+			fprintf(stderr, "spatial mismatch at %s\n", coord2sstr(b2.f[f], &b2));
+			exit(1);
+		}
+	board_done_noalloc(&b2);
+}
+
+/* Matching all features of all valid moves, as done by pattern
+ * priors at node expansion (i.e. with incremental spatial hashes);
+ * move by move and in a single pass. */
+static void
+bench_match(struct bench_setup *setup, struct bench_position *pos)
+{
+	struct board b2;
+	board_copy(&b2, pos->b);
+	board_spathash_enable(&b2);
+	struct board *b = &b2;
+	coord_t moves[b->flen];
+	int nmoves = 0;
+	foreach_free_point(b) {
+		if (board_is_valid_play(b, pos->to_play, c))
+			moves[nmoves++] = c;
+	} foreach_free_point_end;
+
+	int n = bench_iters(setup, BENCH_MATCH);
+	struct pattern p[2][nmoves > 0 ? nmoves : 1];
+	for (int batch = 0; batch < 2; batch++) {
+		double start = time_now();
+		for (int i = 0; i < n; i++) {
+			if (batch) {
+				pattern_match_moves(&setup->pc, PATTERN_SPEC_MATCH_DEFAULT, p[1], b, pos->to_play, moves, nmoves);
+				continue;
+			}
+			for (int j = 0; j < nmoves; j++) {
+				struct move m = { moves[j], pos->to_play };
+				pattern_match(&setup->pc, PATTERN_SPEC_MATCH_DEFAULT, &p[0][j], b, &m);
+			}
+		}
+		bench_report(batch ? "match_moves" : "match", pos, (long) n * nmoves, time_now() - start, "moves/s");
+	}
+	for (int j = 0; j < nmoves; j++)
+		if (!pattern_eq(&p[0][j], &p[1][j])) {
+			char s0[256], s1[256];
+			pattern2str(s0, &p[0][j]); pattern2str(s1, &p[1][j]);
+			fprintf(stderr, "match mismatch at %s: %s vs %s\n", coord2sstr(moves[j], b), s0, s1);
+			exit(1);
+		}
+	board_done_noalloc(&b2);
+}
+
+/* Middle and would-be ladder reading without the cache, on the local
+ * model and on board copies, of all the queries the model can tell
+ * along board_play_random() games; the readers must agree. */
+static void
+bench_ladder(struct bench_setup *setup, struct bench_position *pos)
+{
+	int n = bench_iters(setup, BENCH_LADDER);
+	int size2 = board_size2(pos->b);
+	group_t groups[2 * size2];
+	coord_t chaselibs[2 * size2];
+	int res[2 * size2];
+	long ops = 0;
+	double elapsed[2] = { 0, 0 };
+	fast_srandom(setup->seed);
+	for (int i = 0; i < n; i++) {
+		struct board b2;
+		board_copy(&b2, pos->b);
+		enum stone color = pos->to_play;
+		for (int moves = 0, passes = 0; passes < 2 && moves < MAX_GAMELEN; moves++) {
+			coord_t coord;
+			board_play_random(&b2, color, &coord, NULL, NULL);
+			passes = is_pass(coord) ? passes + 1 : 0;
+			color = stone_other(color);
+
+			int nq = ladder_queries(&b2, groups, chaselibs), nread = 0;
+			double start = time_now();
+			for (int q = 0; q < nq; q++) {
+				int l = ladder_read(&b2, groups[q], chaselibs[q], board_at(&b2, groups[q]), true);
+				if (l < 0) continue;
+				groups[nread] = groups[q]; chaselibs[nread] = chaselibs[q];
+				res[nread++] = l;
+			}
+			double middle = time_now();
+			for (int q = 0; q < nread; q++)
+				if (ladder_read(&b2, groups[q], chaselibs[q], board_at(&b2, groups[q]), false) != res[q]) {
+					fprintf(stderr, "ladder mismatch at %s\n", coord2sstr(groups[q], &b2));
+					exit(1);
+				}
+			elapsed[0] += middle - start;
+			elapsed[1] += time_now() - middle;
+			ops += nread;
+		}
+		board_done_noalloc(&b2);
+	}
+	bench_report("ladder_model", pos, ops, elapsed[0], "reads/s");
+	bench_report("ladder_copy", pos, ops, elapsed[1], "reads/s");
+}
+
+/* play_random_game() with given playout policy. */
+static void
+bench_playout(struct bench_setup *setup, struct bench_position *pos,
+              char *name, struct playout_policy *policy, int base)
+{
+	struct playout_setup ps = { .gamelen = MAX_GAMELEN };
+	int n = bench_iters(setup, base);
+	fast_srandom(setup->seed);
+	double start = time_now();
+	for (int i = 0; i < n; i++) {
+		struct board b2;
+		board_copy(&b2, pos->b);
+		play_random_game(&ps, &b2, pos->to_play, NULL, NULL, policy);
+		board_done_noalloc(&b2);
+	}
+	bench_report(name, pos, n, time_now() - start, "playouts/s");
+
+	if (policy->done) policy->done(policy);
+	if (policy->data) free(policy->data);
+	free(policy);
+}
+
+/* One UCT genmove of a fixed number of playouts, on a fresh engine. */
+static void
+bench_uct(struct bench_setup *setup, struct bench_position *pos, char *args)
+{
+	int n = bench_iters(setup, BENCH_UCT);
+	char name[256];
+	snprintf(name, sizeof(name), "uct[%s]", args);
+
+	struct board b2;
+	board_copy(&b2, pos->b);
+	char *arg = strdup(args);
+	struct engine *e = engine_uct_init(arg, &b2);
+	free(arg);
+
+	struct time_info ti = { .period = TT_MOVE, .dim = TD_GAMES, .len = { .games = n } };
+	fast_srandom(setup->seed);
+	double start = time_now();
+	coord_t *c = e->genmove(e, &b2, &ti, pos->to_play, false);
+	bench_report(name, pos, n, time_now() - start, "playouts/s");
+	coord_done(c);
+
+	if (e->done) e->done(e);
+	if (e->data) free(e->data);
+	free(e);
+	board_done_noalloc(&b2);
+}
+
+static void
+bench_run(struct bench_setup *setup, struct bench_position *pos)
+{
+	bench_clone(setup, pos);
+	bench_valid(setup, pos);
+	bench_play(setup, pos, false);
+	bench_play(setup, pos, true);
+	bench_play_random(setup, pos);
+	bench_play_random_late(setup, pos);
+	bench_playout(setup, pos, "playout_light", playout_light_init(NULL, pos->b), BENCH_LIGHT);
+	bench_playout(setup, pos, "playout_moggy", playout_moggy_init(NULL, pos->b, NULL), BENCH_MOGGY);
+	bench_spatial(setup, pos);
+	bench_match(setup, pos);
+	bench_ladder(setup, pos);
+	for (int i = 0; i < setup->uct_count; i++)
+		bench_uct(setup, pos, setup->uct_args[i]);
+}
+
+
+static void
+usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-s RANDOM_SEED] [-n SCALE] [-b BOARD_SIZE] [-u UCT_ARGS]... [SGF_FILE...]\n", name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench_setup setup = { .seed = 1, .scale = 1 };
+	int sizes[BOARD_MAX_SIZE + 1] = { 0 };
+	bool custom_sizes = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "b:n:s:u:")) != -1) {
+		switch (opt) {
+			case 'b': {
+				int size = atoi(optarg);
+				if (size < 2 || size > BOARD_MAX_SIZE) {
+					fprintf(stderr, "%s: Invalid board size %s\n", argv[0], optarg);
+					exit(1);
+				}
+				sizes[size] = custom_sizes = true;
+				break;
+			}
+			case 'n':
+				setup.scale = atof(optarg);
+				break;
+			case 's':
+				setup.seed = strtoul(optarg, NULL, 10);
+				break;
+			case 'u':
+				if (setup.uct_count == BENCH_UCT_MAX) {
+					fprintf(stderr, "%s: Too many -u options\n", argv[0]);
+					exit(1);
+				}
+				setup.uct_args[setup.uct_count++] = optarg;
+				break;
+			default: /* '?' */
+				usage(argv[0]);
+				exit(1);
+		}
+	}
+	if (!custom_sizes)
+		sizes[9] = sizes[13] = sizes[19] = true;
+
+	setup.pc = DEFAULT_PATTERN_CONFIG;
+	setup.pc.spat_dict = spatial_dict_init(true, true);
+	setup.ps[FEAT_SPATIAL] = ~0;
+
+	printf("# pachi-bench seed=%lu scale=%g\n", setup.seed, setup.scale);
+	printf("# bench\tname\tposition\tsize\tops\tseconds\trate\tunit\n");
+
+	for (int size = 2; size <= BOARD_MAX_SIZE; size++) {
+		if (!sizes[size]) continue;
+		struct bench_position pos = { .name = "empty", .b = board_init(NULL), .to_play = S_BLACK };
+		board_resize(pos.b, size);
+		board_clear(pos.b);
+		bench_run(&setup, &pos);
+		board_done(pos.b);
+	}
+
+	int ret = 0;
+	for (int i = optind; i < argc; i++) {
+		struct bench_position pos = { .name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i] };
+		pos.b = sgf_load(argv[i], &pos.to_play, NULL, NULL);
+		if (!pos.b) {
+			ret = 1;
+			continue;
+		}
+		bench_run(&setup, &pos);
+		board_done(pos.b);
+	}
+	return ret;
+}
@@ -0,0 +1,533 @@
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "board.h"
+#include "debug.h"
+#include "engine.h"
+#include "gtp.h"
+#include "move.h"
+#include "random.h"
+#include "timeinfo.h"
+#include "distributed/distributed.h"
+#include "distributed/merge.h"
+#include "distributed/protocol.h"
+#include "distributed/wire.h"
+
+/* Load test of the distributed engine. A real master runs in this
+ * process and plays a game against itself, while M simulated slaves
+ * connect to it over loopback as threads. A simulated slave keeps a
+ * board in sync with the master and answers pachi-genmoves with
+ * synthetic but well-formed replies: a few root children and a set
+ * of random incremental stats, after a configurable latency. It may
+ * also drop its connection instead of replying, then reconnect as a
+ * restarted slave would. Results are printed as tab-separated lines:
+ *
+ *	distsim <metric> <value> <unit>
+ */
+
+struct sim_config {
+	int slaves;
+	/* Incremental stats nodes sent with each reply. */
+	int nodes;
+	/* Depth of the tree paths of the stats. */
+	int levels;
+	/* Reply latency and uniform jitter, in seconds. */
+	double latency;
+	double jitter;
+	/* Probability to drop the connection instead of replying. */
+	double drop;
+	/* Simulated playouts per second of each slave. */
+	double rate;
+	char *port;
+	unsigned long seed;
+};
+
+struct sim_slave {
+	int index;
+	struct sim_config *config;
+	pthread_t thread;
+	unsigned int rand;
+	struct board *b;
+
+	/* Start of the search of the current move. */
+	int search_move;
+	double search_start;
+
+	void *args_buf;
+	int args_buf_size;
+	struct incr_stats *stats;
+	void *wire_buf;
+	void *wire_scratch;
+
+	/* Counters, read racily by the main thread for the report. */
+	long replies;
+	long drops;
+	long out_of_sync;
+	long bad_args;
+	long args_nodes;
+	long bytes_in;
+	long bytes_out;
+};
+
+static volatile bool sim_done;
+
+
+static void
+die(char *msg)
+{
+	perror(msg);
+	exit(42);
+}
+
+static double
+sim_random(struct sim_slave *s)
+{
+	return (double)rand_r(&s->rand) / ((double)RAND_MAX + 1);
+}
+
+static void
+sim_sleep(double seconds)
+{
+	if (seconds <= 0) return;
+	struct timespec ts = { .tv_sec = seconds, .tv_nsec = (seconds - (long)seconds) * 1e9 };
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+/* Connect to the master, retrying until it listens. */
+static int
+sim_connect(char *port)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(atoi(port)) };
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	while (!sim_done) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0) die("socket");
+		if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+			int one = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			return fd;
+		}
+		close(fd);
+		sim_sleep(0.01);
+	}
+	return -1;
+}
+
+/* Pick a free point, favouring the first ones so that the slaves
+ * mostly agree on the same nodes, as real slaves do. */
+static coord_t
+sim_coord(struct sim_slave *s, struct board *b)
+{
+	if (!b->flen) return pass;
+	double u = sim_random(s);
+	return b->f[(int)(u * u * b->flen)];
+}
+
+static int
+cmp_stats(const void *p1, const void *p2)
+{
+	path_t a = ((struct incr_stats *)p1)->coord_path;
+	path_t b = ((struct incr_stats *)p2)->coord_path;
+	return a < b ? -1 : a > b;
+}
+
+/* Fill s->stats with random nodes of the top levels of the tree,
+ * sorted by increasing path and without duplicates, as sent by
+ * report_incr_stats(). Return the number of nodes. */
+static int
+sim_stats(struct sim_slave *s)
+{
+	struct board *b = s->b;
+	struct sim_config *config = s->config;
+	if (!b->flen) return 0;
+
+	for (int n = 0; n < config->nodes; n++) {
+		/* Half of the nodes at level 1, a quarter at level 2... */
+		int depth = 1;
+		while (depth < config->levels && sim_random(s) < 0.5)
+			depth++;
+		path_t path = 0;
+		for (int d = 0; d < depth; d++)
+			path = append_child(path, sim_coord(s, b), b);
+		s->stats[n].coord_path = path;
+		s->stats[n].incr.playouts = 1 + rand_r(&s->rand) % 64;
+		s->stats[n].incr.value = sim_random(s);
+	}
+	qsort(s->stats, config->nodes, sizeof(*s->stats), cmp_stats);
+	int nodes = 0;
+	for (int n = 0; n < config->nodes; n++) {
+		if (nodes && s->stats[nodes - 1].coord_path == s->stats[n].coord_path)
+			continue;
+		s->stats[nodes++] = s->stats[n];
+	}
+	return nodes;
+}
+
+/* Read the binary arguments of a command, and check the master stats
+ * they carry. Return false if the connection is lost. */
+static bool
+sim_read_args(struct sim_slave *s, FILE *in, int size, int version)
+{
+	if (!size) return true;
+	if (size > s->args_buf_size) {
+		free(s->args_buf);
+		s->args_buf = malloc2(size);
+		s->args_buf_size = size;
+	}
+	if (fread(s->args_buf, 1, size, in) != (size_t)size) return false;
+	s->bytes_in += size;
+
+	int nodes = size / sizeof(struct incr_stats);
+	if (version) {
+		nodes = stats_wire_nodes(s->args_buf, size);
+		if (nodes < 0 || nodes > s->config->nodes * 4) {
+			s->bad_args++;
+			return true;
+		}
+		struct incr_stats *stats = malloc2(nodes * sizeof(*stats) + 1);
+		void *scratch = malloc2(stats_wire_max(nodes));
+		if (stats_decode(s->args_buf, size, stats, nodes, scratch) != nodes)
+			s->bad_args++;
+		free(stats);
+		free(scratch);
+	}
+	s->args_nodes += nodes;
+	return true;
+}
+
+/* Write the reply to pachi-genmoves, in the format of report_stats(). */
+static void
+sim_genmoves_reply(struct sim_slave *s, FILE *out, int id, enum stone color,
+		   int version, bool compress)
+{
+	struct board *b = s->b;
+	if (s->search_move != b->moves) {
+		s->search_move = b->moves;
+		s->search_start = time_now();
+	}
+	int played = (time_now() - s->search_start) * s->config->rate + 1;
+
+	int nodes = sim_stats(s);
+	void *bin = s->stats;
+	int bin_size = nodes * sizeof(struct incr_stats);
+	if (version && nodes) {
+		bin_size = stats_encode(s->stats, nodes, s->wire_buf, s->wire_scratch, compress);
+		bin = s->wire_buf;
+	}
+
+	char tag[64];
+	wire_tag(tag, sizeof(tag), bin_size, version, false);
+	fprintf(out, "=%d %d %d 1 1 %s", id, played, played, tag);
+
+	/* A few root children, the same for all slaves at each move,
+	 * the first one preferred. */
+	unsigned int move_rand = s->config->seed + b->moves;
+	int children = b->flen < 5 ? b->flen : 5;
+	for (int i = 0; i < children; i++) {
+		coord_t c = b->f[rand_r(&move_rand) % b->flen];
+		if (!board_is_valid_play(b, color, c)) continue;
+		char buf[4];
+		fprintf(out, "\n%s %d %.16f", coord2bstr(buf, c, b),
+			played / (i + 1) + 1, 0.3 + 0.4 * sim_random(s));
+	}
+	fprintf(out, "\n\n");
+	if (bin_size) fwrite(bin, 1, bin_size, out);
+	fflush(out);
+	s->replies++;
+	s->bytes_out += bin_size;
+}
+
+/* Serve one connection. Return when it is lost or dropped. */
+static void
+sim_serve(struct sim_slave *s, int fd)
+{
+	FILE *in = fdopen(fd, "r");
+	FILE *out = fdopen(dup(fd), "w");
+	struct board *b = s->b;
+	char line[4096];
+
+	/* A new connection gets the whole game history. */
+	board_clear(b);
+	s->search_move = -1;
+
+	while (!sim_done && fgets(line, sizeof(line), in)) {
+		char *p = line;
+		int id = -1;
+		if (isdigit(*p)) id = strtol(p, &p, 10);
+		p += strspn(p, " \t");
+		char *cmd = p;
+		p += strcspn(p, " \t\n");
+		if (*p) *p++ = '\0';
+		char *args = p;
+		if (!*cmd) continue;
+
+		int version;
+		bool compress;
+		int size = wire_size(args, &version, &compress);
+		if (!sim_read_args(s, in, size, version)) break;
+
+		/* Same check as uct_notify(). */
+		if (id >= 0 && !reply_disabled(id) && move_number(id) != b->moves && !is_reset(cmd)) {
+			s->out_of_sync++;
+			fprintf(out, "?%d Out of sync\n\n", id);
+			fflush(out);
+			continue;
+		}
+
+		if (!strcasecmp(cmd, "boardsize")) {
+			board_resize(b, atoi(args));
+			board_clear(b);
+		} else if (!strcasecmp(cmd, "clear_board")) {
+			board_clear(b);
+		} else if (!strcasecmp(cmd, "komi")) {
+			b->komi = atof(args);
+		} else if (!strcasecmp(cmd, "play")) {
+			char color[16], coord[16];
+			if (sscanf(args, "%15s %15s", color, coord) == 2) {
+				coord_t *c = str2coord(coord, board_size(b));
+				struct move m = { .coord = *c, .color = str2stone(color) };
+				coord_done(c);
+				if (board_play(b, &m) < 0)
+					fprintf(stderr, "distsim: slave %d, illegal move %s %s\n",
+						s->index, color, coord);
+			}
+		} else if (!strncasecmp(cmd, "pachi-genmoves", 14) && !reply_disabled(id)) {
+			double delay = s->config->latency + s->config->jitter * sim_random(s);
+			sim_sleep(delay);
+			if (sim_random(s) < s->config->drop) {
+				s->drops++;
+				break;
+			}
+			sim_genmoves_reply(s, out, id, str2stone(args), version, compress);
+			continue;
+		}
+
+		if (id < 0) {
+			fprintf(out, "= %s\n\n", !strcasecmp(cmd, "name") ? "Pachi distsim" : "");
+		} else if (!reply_disabled(id)) {
+			fprintf(out, "=%d\n\n", id);
+		} else {
+			continue;
+		}
+		fflush(out);
+	}
+	fclose(in);
+	fclose(out);
+}
+
+static void *
+sim_slave_thread(void *arg)
+{
+	struct sim_slave *s = arg;
+	while (!sim_done) {
+		int fd = sim_connect(s->config->port);
+		if (fd < 0) break;
+		sim_serve(s, fd);
+		/* Give the master time to notice, like a restarting slave. */
+		sim_sleep(0.1);
+	}
+	return NULL;
+}
+
+static void
+sim_slave_init(struct sim_slave *s, int index, struct sim_config *config)
+{
+	memset(s, 0, sizeof(*s));
+	s->index = index;
+	s->config = config;
+	s->rand = config->seed * 1000 + index;
+	s->b = board_init(NULL);
+	board_resize(s->b, 19);
+	s->stats = malloc2(config->nodes * sizeof(*s->stats) + 1);
+	s->wire_buf = malloc2(stats_wire_max(config->nodes));
+	s->wire_scratch = malloc2(stats_wire_max(config->nodes));
+}
+
+
+/* Return a free local port for the master. */
+static char *
+free_port(void)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	    || getsockname(fd, (struct sockaddr *)&addr, &len) < 0)
+		die("free_port");
+	close(fd);
+	static char port[16];
+	snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+	return port;
+}
+
+static void
+report(char *metric, double value, char *unit)
+{
+	printf("distsim\t%s\t%.3f\t%s\n", metric, value, unit);
+}
+
+static void
+usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-s SLAVES] [-n NODES] [-L LEVELS] [-l LATENCY_MS] [-j JITTER_MS]\n"
+		"\t[-d DROP] [-r PLAYOUTS_PER_S] [-t MOVE_MS] [-g GAMES] [-m MOVES] [-b SIZE]\n"
+		"\t[-p PORT] [-x SEED] [-D DEBUG_LEVEL] [-e MASTER_ARGS]\n", name);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sim_config config = {
+		.slaves = 8, .nodes = 2000, .levels = 3,
+		.latency = 0.02, .jitter = 0.01, .drop = 0,
+		.rate = 20000, .seed = 1,
+	};
+	/* Each move is searched for move_time (a hard deadline), or
+	 * until games if only -g is given: a fixed number of games is
+	 * over before any stats are shared on a fast enough machine. */
+	int games = 0, moves = 10, size = 19;
+	double move_time = -1;
+	char *master_args = "";
+	debug_level = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "s:n:L:l:j:d:r:t:g:m:b:p:x:D:e:h")) != -1) {
+		switch (opt) {
+			case 's': config.slaves = atoi(optarg); break;
+			case 'n': config.nodes = atoi(optarg); break;
+			case 'L': config.levels = atoi(optarg); break;
+			case 'l': config.latency = atof(optarg) / 1000; break;
+			case 'j': config.jitter = atof(optarg) / 1000; break;
+			case 'd': config.drop = atof(optarg); break;
+			case 'r': config.rate = atof(optarg); break;
+			case 't': move_time = atof(optarg) / 1000; break;
+			case 'g': games = atoi(optarg); break;
+			case 'm': moves = atoi(optarg); break;
+			case 'b': size = atoi(optarg); break;
+			case 'p': config.port = strdup(optarg); break;
+			case 'x': config.seed = atol(optarg); break;
+			case 'D': debug_level = atoi(optarg); break;
+			case 'e': master_args = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (move_time < 0) move_time = games ? 0 : 0.5;
+	if (config.slaves < 1 || config.nodes < 1 || config.levels < 1 || moves < 1
+	    || (!games && !move_time))
+		usage(argv[0]);
+	if (!config.port) config.port = free_port();
+	fast_srandom(config.seed);
+
+	struct board *b = board_init(NULL);
+	board_resize(b, size);
+	board_clear(b);
+
+	char arg[1024];
+	snprintf(arg, sizeof(arg), "slave_port=%s,max_slaves=%d,shared_nodes=%d%s%s",
+		 config.port, config.slaves, config.nodes, *master_args ? "," : "", master_args);
+	struct engine *e = engine_distributed_init(arg, b);
+
+	struct sim_slave *slaves = calloc2(config.slaves, sizeof(*slaves));
+	for (int i = 0; i < config.slaves; i++) {
+		sim_slave_init(&slaves[i], i, &config);
+		pthread_create(&slaves[i].thread, NULL, sim_slave_thread, &slaves[i]);
+	}
+	for (double start = time_now(); active_slaves < config.slaves; sim_sleep(0.01)) {
+		if (time_now() - start > 10) {
+			fprintf(stderr, "distsim: only %d of %d slaves connected\n",
+				active_slaves, config.slaves);
+			exit(1);
+		}
+	}
+
+	char boardsize[16], *reply;
+	snprintf(boardsize, sizeof(boardsize), "%d\n", size);
+	e->notify(e, b, -1, "boardsize", boardsize, &reply);
+	e->notify(e, b, -1, "clear_board", "\n", &reply);
+
+	printf("distsim\tconfig\tslaves=%d nodes=%d levels=%d latency=%.1fms jitter=%.1fms"
+	       " drop=%.3f rate=%.0f move_time=%.0fms games=%d size=%d\n",
+	       config.slaves, config.nodes, config.levels, config.latency * 1000,
+	       config.jitter * 1000, config.drop, config.rate, move_time * 1000, games, size);
+
+	double merge_time0;
+	long merges0;
+	merge_time_stats(&merge_time0, &merges0);
+	double start = time_now();
+	double max_latency = 0;
+	int played = 0;
+	enum stone color = S_BLACK;
+	for (; played < moves; played++, color = stone_other(color)) {
+		double move_start = time_now();
+		struct time_info ti = { .period = TT_MOVE, .dim = TD_GAMES,
+					.len.games = games ? games : INT_MAX,
+					.deadline = move_time ? move_start + move_time : 0 };
+		coord_t *c = e->genmove(e, b, &ti, color, false);
+		double latency = time_now() - move_start;
+		if (latency > max_latency) max_latency = latency;
+
+		struct move m = { .coord = *c, .color = color };
+		coord_done(c);
+		if (is_resign(m.coord)) break;
+		if (board_play(b, &m) < 0) {
+			fprintf(stderr, "distsim: master played an illegal move\n");
+			break;
+		}
+	}
+	double elapsed = time_now() - start;
+
+	double merge_time;
+	long merges;
+	merge_time_stats(&merge_time, &merges);
+	merge_time -= merge_time0;
+	merges -= merges0;
+
+	long replies = 0, drops = 0, out_of_sync = 0, bad_args = 0;
+	long args_nodes = 0, bytes_in = 0, bytes_out = 0;
+	for (int i = 0; i < config.slaves; i++) {
+		replies += slaves[i].replies;
+		drops += slaves[i].drops;
+		out_of_sync += slaves[i].out_of_sync;
+		bad_args += slaves[i].bad_args;
+		args_nodes += slaves[i].args_nodes;
+		bytes_in += slaves[i].bytes_in;
+		bytes_out += slaves[i].bytes_out;
+	}
+
+	report("moves", played, "moves");
+	report("elapsed", elapsed, "s");
+	report("move_latency_avg", played ? elapsed / played * 1000 : 0, "ms");
+	report("move_latency_max", max_latency * 1000, "ms");
+	report("replies", replies / elapsed, "replies/s");
+	report("stats_in", bytes_out / elapsed / 1024, "KiB/s");
+	report("stats_out", bytes_in / elapsed / 1024, "KiB/s");
+	report("shared_nodes", replies ? (double)args_nodes / replies : 0, "nodes/reply");
+	report("merges", merges / elapsed, "merges/s");
+	report("merge_time_avg", merges ? merge_time / merges * 1000 : 0, "ms");
+	report("merge_time_share", merge_time / elapsed * 100, "%");
+	report("drops", drops, "connections");
+	report("out_of_sync", out_of_sync, "replies");
+	report("bad_args", bad_args, "commands");
+	fflush(stdout);
+
+	/* Without merges the run measured nothing of the stats sharing. */
+	if (!merges)
+		fprintf(stderr, "distsim: no stats merged, search longer (-t or -g)\n");
+
+	/* The master and slave threads are still running. */
+	sim_done = true;
+	_exit(bad_args || !merges ? 1 : 0);
+}
@@ -0,0 +1,62 @@
+% Ladder to the edge
+boardsize 9
+.........
+.........
+.........
+.........
+.........
+...O.....
+.OXO.....
+..O......
+.........
+ladder b c3 1
+
+% Ladder across the board
+boardsize 9
+.........
+.........
+.........
+.........
+.........
+.O.......
+.OXO.....
+..O......
+.........
+ladder b c3 1
+
+% Ladder breaker on the way
+boardsize 9
+.........
+.........
+......X..
+.........
+.........
+.O.......
+.OXO.....
+..O......
+.........
+ladder b c3 0
+
+% Local model reader against the copying reader, in random games
+ladder_model 200
+boardsize 19
+...................
+...................
+...................
+...................
+...................
+...................
+...................
+...................
+...................
+...................
+...................
+...................
+...................
+...................
+...................
+...................
+...................
+...................
+...................
+ladder_model 100
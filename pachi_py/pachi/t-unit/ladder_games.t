@@ -0,0 +1,11 @@
+% Ladders along the regression games with ladder issues (t-regress/by-ladder)
+ladder_model_sgf t-regress/by-ladder/2011-01-11-llopl-pachi2.sgf
+ladder_model_sgf t-regress/by-ladder/2011-06-06-tyzef-pachi30s.sgf
+ladder_model_sgf t-regress/by-ladder/2011-06-13-pachi30s-Jep.sgf
+ladder_model_sgf t-regress/by-ladder/2011-07-28-pachi2-pkunzip-2.sgf
+ladder_model_sgf t-regress/by-ladder/2011-08-08-Dallas-pachi2-2.sgf
+ladder_model_sgf t-regress/by-ladder/2011-08-09-pachi2-BlueSpark.sgf
+ladder_model_sgf t-regress/by-ladder/2011-08-09-somrak-pachi2-2.sgf
+ladder_model_sgf t-regress/by-ladder/2011-08-24-StoneGrid-pachi2.sgf
+ladder_model_sgf t-regress/by-ladder/2011-09-04-pachi2-stv.sgf
+ladder_model_sgf t-regress/by-ladder/2012-03-16-IMC-pachi2.sgf
@@ -1,4 +1,5 @@
 #define DEBUG
+#include <assert.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,8 +7,11 @@
 
 #include "board.h"
 #include "debug.h"
+#include "tactics/ladder.h"
 #include "tactics/selfatari.h"
+#include "playout.h"
 #include "random.h"
+#include "t-unit/test.h"
 
 static bool board_printed;
 
@@ -81,6 +85,245 @@ test_sar(struct board *b, char *arg)
 	return rres == eres;
 }
 
+bool
+test_ladder(struct board *b, char *arg)
+{
+	enum stone color = str2stone(arg);
+	arg += 2;
+	coord_t *cc = str2coord(arg, board_size(b));
+	coord_t c = *cc; coord_done(cc);
+	arg += strcspn(arg, " ") + 1;
+	int eres = atoi(arg);
+	if (DEBUGL(1))
+		printf("ladder %s %s %d...\t", stone2str(color), coord2sstr(c, b), eres);
+
+	/* The group at c is in atari; does escaping play out a ladder? */
+	group_t group = group_at(b, c);
+	assert(group && board_at(b, c) == color);
+	assert(board_group_info(b, group).libs == 1);
+	int rres = is_ladder(b, board_group_info(b, group).lib[0], group, true);
+
+	if (rres == eres) {
+		if (DEBUGL(1))
+			printf("OK\n");
+	} else {
+		if (debug_level <= 2) {
+			if (DEBUGL(0) && !board_printed) {
+				board_print(b, stderr);
+				board_printed = true;
+			}
+			printf("ladder %s %s %d...\t", stone2str(color), coord2sstr(c, b), eres);
+		}
+		printf("FAILED (%d)\n", rres);
+	}
+	return rres == eres;
+}
+
+/* Read the ladder with both readers; count the reads the local model
+ * can tell and the mismatches of these with the copying reader. */
+static void
+ladder_model_compare(struct board *b, group_t group, coord_t chaselib, enum stone lcolor,
+		     int *reads, int *mismatches)
+{
+	int mres = ladder_read(b, group, chaselib, lcolor, true);
+	if (mres < 0)
+		return;
+	(*reads)++;
+	int cres = ladder_read(b, group, chaselib, lcolor, false);
+	if (mres == cres)
+		return;
+	/* Show the first one, or all of them with more debugging. */
+	if (++*mismatches == 1 || DEBUGL(2)) {
+		board_print(b, stderr);
+		fprintf(stderr, "ladder model mismatch: %s %s chase %s, model %d, copying %d\n",
+			stone2str(lcolor), coord2sstr(group, b), coord2sstr(chaselib, b), mres, cres);
+	}
+}
+
+/* Check all the middle and would-be ladder queries of the position. */
+static void
+ladder_model_position(struct board *b, int *queries, int *reads, int *mismatches)
+{
+	group_t groups[2 * board_size2(b)];
+	coord_t chaselibs[2 * board_size2(b)];
+	int n = ladder_queries(b, groups, chaselibs);
+	for (int i = 0; i < n; i++)
+		ladder_model_compare(b, groups[i], chaselibs[i], board_at(b, groups[i]), reads, mismatches);
+	*queries += n;
+}
+
+/* Validate the local model ladder reader against the copying reader,
+ * in the position and along the given number of random games from it. */
+bool
+test_ladder_model(struct board *b, char *arg)
+{
+	int games = atoi(arg);
+	if (DEBUGL(1))
+		printf("ladder_model %d...\t", games);
+
+	int queries = 0, reads = 0, mismatches = 0;
+	ladder_model_position(b, &queries, &reads, &mismatches);
+	fast_srandom(games);
+	for (int i = 0; i < games; i++) {
+		struct board b2;
+		board_copy(&b2, b);
+		enum stone color = S_BLACK;
+		for (int moves = 0, passes = 0; passes < 2 && moves < MAX_GAMELEN; moves++) {
+			coord_t coord;
+			board_play_random(&b2, color, &coord, NULL, NULL);
+			passes = is_pass(coord) ? passes + 1 : 0;
+			color = stone_other(color);
+			ladder_model_position(&b2, &queries, &reads, &mismatches);
+		}
+		board_done_noalloc(&b2);
+	}
+
+	if (!mismatches) {
+		if (DEBUGL(1))
+			printf("OK (%d queries, %d read on the model)\n", queries, reads);
+	} else {
+		if (debug_level <= 2)
+			printf("ladder_model %d...\t", games);
+		printf("FAILED (%d mismatches of %d reads)\n", mismatches, reads);
+	}
+	return !mismatches;
+}
+
+struct board *
+sgf_load(char *filename, enum stone *to_play, void (*each)(struct board *b, void *data), void *data)
+{
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		perror(filename);
+		return NULL;
+	}
+	char *buf = NULL; size_t buflen = 0, len = 0;
+	for (;;) {
+		if (len + 4096 > buflen) {
+			buflen = (buflen + 4096) * 2;
+			buf = realloc(buf, buflen);
+		}
+		size_t r = fread(buf + len, 1, buflen - len - 1, f);
+		if (!r) break;
+		len += r;
+	}
+	buf[len] = 0;
+	fclose(f);
+
+	struct board *b = board_init(NULL);
+	int size = 19;
+	bool board_ready = false;
+	*to_play = S_BLACK;
+
+	char propname[8] = "";
+	char *s = buf;
+	while (*s && *s != ')') {
+		if (isupper(*s)) {
+			int i = 0;
+			while (isupper(*s)) {
+				if (i < (int) sizeof(propname) - 1)
+					propname[i++] = *s;
+				s++;
+			}
+			propname[i] = 0;
+			continue;
+		}
+		if (*s != '[') {
+			s++;
+			continue;
+		}
+
+		/* Property value. */
+		char *val = ++s;
+		while (*s && *s != ']') {
+			if (*s == '\\' && s[1]) s++;
+			s++;
+		}
+		if (!*s) break;
+		*s++ = 0;
+
+		if (!strcmp(propname, "SZ")) {
+			size = atoi(val);
+			if (size < 2 || size > BOARD_MAX_SIZE) {
+				fprintf(stderr, "%s: unsupported board size %d\n", filename, size);
+				goto error;
+			}
+			continue;
+		}
+		enum stone color = S_NONE;
+		if (!strcmp(propname, "B") || !strcmp(propname, "AB"))
+			color = S_BLACK;
+		else if (!strcmp(propname, "W") || !strcmp(propname, "AW"))
+			color = S_WHITE;
+		if (color == S_NONE)
+			continue;
+
+		if (!board_ready) {
+			board_resize(b, size);
+			board_clear(b);
+			board_ready = true;
+		}
+		struct move m = { pass, color };
+		if (strlen(val) >= 2 && !(size <= 19 && !strcmp(val, "tt")))
+			m.coord = coord_xy(b, val[0] - 'a' + 1, size - (val[1] - 'a'));
+		if (board_play(b, &m) < 0) {
+			fprintf(stderr, "%s: illegal move %s %s\n", filename, stone2str(color), val);
+			goto error;
+		}
+		if (propname[0] != 'A')
+			*to_play = stone_other(color);
+		if (each)
+			each(b, data);
+	}
+
+	if (!board_ready) {
+		board_resize(b, size);
+		board_clear(b);
+	}
+	free(buf);
+	return b;
+
+error:
+	free(buf);
+	board_done(b);
+	return NULL;
+}
+
+/* Check the ladders of every position of the game record (main line)
+ * like ladder_model does. */
+static void
+ladder_model_sgf_position(struct board *b, void *data)
+{
+	int *counts = data;
+	ladder_model_position(b, &counts[0], &counts[1], &counts[2]);
+}
+
+bool
+test_ladder_model_sgf(struct board *b, char *arg)
+{
+	if (DEBUGL(1))
+		printf("ladder_model_sgf %s...\t", arg);
+
+	int counts[3] = { 0 }; /* queries, reads, mismatches */
+	enum stone to_play;
+	struct board *b2 = sgf_load(arg, &to_play, ladder_model_sgf_position, counts);
+	if (!b2) {
+		printf("ladder_model_sgf %s...\tFAILED (cannot load)\n", arg);
+		return false;
+	}
+	board_done(b2);
+
+	if (!counts[2]) {
+		if (DEBUGL(1))
+			printf("OK (%d queries, %d read on the model)\n", counts[0], counts[1]);
+	} else {
+		if (debug_level <= 2)
+			printf("ladder_model_sgf %s...\t", arg);
+		printf("FAILED (%d mismatches of %d reads)\n", counts[2], counts[1]);
+	}
+	return !counts[2];
+}
+
 void
 unittest(char *filename)
 {
@@ -106,6 +349,12 @@ unittest(char *filename)
 			board_load(b, f, atoi(line + 10));
 		} else if (!strncmp(line, "sar ", 4)) {
 			passed = test_sar(b, line + 4) && passed; 
+		} else if (!strncmp(line, "ladder ", 7)) {
+			passed = test_ladder(b, line + 7) && passed;
+		} else if (!strncmp(line, "ladder_model ", 13)) {
+			passed = test_ladder_model(b, line + 13) && passed;
+		} else if (!strncmp(line, "ladder_model_sgf ", 17)) {
+			passed = test_ladder_model_sgf(b, line + 17) && passed;
 		} else {
 			fprintf(stderr, "Syntax error: %s\n", line);
 			exit(EXIT_FAILURE);
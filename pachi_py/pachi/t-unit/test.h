@@ -1,6 +1,13 @@
 #ifndef PACHI_T_UNIT_TEST_H
 #define PACHI_T_UNIT_TEST_H
 
+#include "board.h"
+
 void unittest(char *filename);
 
+/* Minimal SGF reader; we follow the main line only and understand just
+ * the SZ, AB, AW, B and W properties. Returns the final position, or
+ * NULL on error. If each is given, it is called after every move. */
+struct board *sgf_load(char *filename, enum stone *to_play, void (*each)(struct board *b, void *data), void *data);
+
 #endif
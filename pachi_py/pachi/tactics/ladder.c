@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -10,6 +11,76 @@
 #include "tactics/ladder.h"
 
 
+/* Ladder readout cache: direct-mapped, one per thread (so there is no
+ * locking and no sharing of cache lines). Each entry is the key of
+ * the readout with the result in its lowest bit. The key is the board
+ * hash mixed with the query; it covers the whole position since the
+ * ladder may run across the board. */
+
+#define LADDER_CACHE_BITS 12
+
+#ifndef NO_THREAD_LOCAL
+
+static __thread hash_t ladder_cache[1 << LADDER_CACHE_BITS];
+static __thread unsigned int ladder_cache_lookups, ladder_cache_hits;
+static unsigned long ladder_cache_total_lookups, ladder_cache_total_hits;
+
+static hash_t
+ladder_cache_key(struct board *b, int kind, coord_t c1, coord_t c2, coord_t c3, enum stone lcolor)
+{
+	uint64_t k = kind | lcolor << 2
+		| (uint64_t) (c1 & 0x3ff) << 4 | (uint64_t) (c2 & 0x3ff) << 14
+		| (uint64_t) (c3 & 0x3ff) << 24 | (uint64_t) (b->ko.coord & 0x3ff) << 34
+		| (uint64_t) b->ko.color << 44 | (uint64_t) board_size(b) << 46;
+	k *= 0x9e3779b97f4a7c15ULL;
+	k ^= k >> 29;
+	return (b->hash ^ k) & ~1ULL;
+}
+
+/* Return 0 or 1 for a cached readout of key, or -1. */
+static int
+ladder_cache_get(hash_t key)
+{
+	if (++ladder_cache_lookups == 4096) {
+		/* Flush the counters now and then. */
+		__sync_fetch_and_add(&ladder_cache_total_lookups, ladder_cache_lookups);
+		__sync_fetch_and_add(&ladder_cache_total_hits, ladder_cache_hits);
+		ladder_cache_lookups = ladder_cache_hits = 0;
+	}
+	hash_t e = ladder_cache[(key >> 1) & ((1 << LADDER_CACHE_BITS) - 1)];
+	if ((e & ~1ULL) != key)
+		return -1;
+	ladder_cache_hits++;
+	if (DEBUGL(6))
+		fprintf(stderr, "ladder cache hit: %d\n", (int) (e & 1));
+	return e & 1;
+}
+
+static bool
+ladder_cache_put(hash_t key, bool is_ladder)
+{
+	ladder_cache[(key >> 1) & ((1 << LADDER_CACHE_BITS) - 1)] = key | is_ladder;
+	return is_ladder;
+}
+
+#else
+
+/* No cheap thread local storage, no cache. */
+static unsigned long ladder_cache_total_lookups, ladder_cache_total_hits;
+#define ladder_cache_key(b, kind, c1, c2, c3, lcolor) 0
+#define ladder_cache_get(key) ((void) (key), -1)
+#define ladder_cache_put(key, is_ladder) ((void) (key), (is_ladder))
+
+#endif
+
+void
+ladder_cache_stats(unsigned long *lookups, unsigned long *hits)
+{
+	*lookups = ladder_cache_total_lookups;
+	*hits = ladder_cache_total_hits;
+}
+
+
 bool
 is_border_ladder(struct board *b, coord_t coord, enum stone lcolor)
 {
@@ -151,6 +222,264 @@ middle_ladder_walk(struct board *b, struct board *bset, group_t laddered, coord_
 	return is_ladder;
 }
 
+
+/* The same reading, but copy-free: the chase is played on a tiny
+ * local model of the board instead of board copies. The model is the
+ * untouched board plus bitmaps of the stones played in the chase, which
+ * are set and cleared as the reading goes on; liberties of the chains
+ * involved are counted by a flood fill. Captures are not modelled - if
+ * either side captures something, we give up and the copying reader
+ * above takes over. Ladders with captures are rare, and most of them
+ * are decided by the countercapture checks before the reading. */
+
+#define LADDER_MODEL_WORDS (((BOARD_MAX_SIZE + 2) * (BOARD_MAX_SIZE + 2) + 63) / 64)
+
+struct ladder_model {
+	struct board *b;
+	/* Stones played in the chase, for S_BLACK-1 and S_WHITE-1. */
+	uint64_t played[2][LADDER_MODEL_WORDS];
+};
+
+#define lm_bit(bitmap, c) (((bitmap)[(c) >> 6] >> ((c) & 63)) & 1)
+
+static inline enum stone
+lm_at(struct ladder_model *m, coord_t c)
+{
+	enum stone s = board_at(m->b, c);
+	if (s != S_NONE)
+		return s;
+	if (lm_bit(m->played[0], c))
+		return S_BLACK;
+	if (lm_bit(m->played[1], c))
+		return S_WHITE;
+	return S_NONE;
+}
+
+static inline void
+lm_play(struct ladder_model *m, coord_t c, enum stone color)
+{
+	m->played[color - 1][c >> 6] |= 1ULL << (c & 63);
+}
+
+static inline void
+lm_undo(struct ladder_model *m, coord_t c, enum stone color)
+{
+	m->played[color - 1][c >> 6] &= ~(1ULL << (c & 63));
+}
+
+static int
+lm_immediate_libs(struct ladder_model *m, coord_t coord)
+{
+	int libs = 0;
+	foreach_neighbor(m->b, coord, {
+		libs += lm_at(m, c) == S_NONE;
+	});
+	return libs;
+}
+
+/* Count liberties of the chain at coord, up to 3, storing the first
+ * two to lib[]. */
+static int
+lm_chain_libs(struct ladder_model *m, coord_t coord, coord_t lib[2])
+{
+	enum stone color = lm_at(m, coord);
+	uint64_t seen[LADDER_MODEL_WORDS] = { 0 };
+	coord_t stack[BOARD_MAX_MOVES];
+	int sp = 0, libs = 0;
+	seen[coord >> 6] |= 1ULL << (coord & 63);
+	stack[sp++] = coord;
+	while (sp > 0) {
+		coord_t s = stack[--sp];
+		foreach_neighbor(m->b, s, {
+			if (lm_bit(seen, c))
+				continue;
+			enum stone sc = lm_at(m, c);
+			if (sc == color) {
+				seen[c >> 6] |= 1ULL << (c & 63);
+				stack[sp++] = c;
+			} else if (sc == S_NONE) {
+				seen[c >> 6] |= 1ULL << (c & 63);
+				if (libs < 2)
+					lib[libs] = c;
+				if (++libs > 2)
+					return libs;
+			}
+		});
+	}
+	return libs;
+}
+
+/* Would a stone just played at coord capture any neighbor chain
+ * of given color? */
+static bool
+lm_captures(struct ladder_model *m, coord_t coord, enum stone color)
+{
+	coord_t lib[2];
+	foreach_neighbor(m->b, coord, {
+		if (lm_at(m, c) == color && !lm_chain_libs(m, c, lib))
+			return true;
+	});
+	return false;
+}
+
+/* Like middle_ladder_walk(), on the model; returns -1 if the model
+ * cannot read the ladder. */
+static int ladder_model_walk(struct ladder_model *m, coord_t laddered, coord_t nextmove, enum stone lcolor);
+
+static int
+ladder_model_escaped(struct ladder_model *m, coord_t laddered, coord_t nextmove, enum stone lcolor)
+{
+	enum stone ccolor = stone_other(lcolor);
+	coord_t lib[2];
+
+	bool catch = false;
+	foreach_neighbor(m->b, nextmove, {
+		if (lm_at(m, c) != ccolor)
+			continue;
+		int libs = lm_chain_libs(m, c, lib);
+		if (!libs)
+			return -1;
+		catch |= libs == 1;
+	});
+
+	int libs = lm_chain_libs(m, laddered, lib);
+	if (libs == 0)
+		return -1;
+	if (libs == 1) {
+		if (DEBUGL(6))
+			fprintf(stderr, "* we can capture now\n");
+		return 1;
+	}
+	if (libs > 2) {
+		if (DEBUGL(6))
+			fprintf(stderr, "* we are free now\n");
+		return 0;
+	}
+	if (catch) {
+		/* We can capture one of the ladder stones
+		 * anytime later. */
+		if (DEBUGL(6))
+			fprintf(stderr, "* can capture chaser\n");
+		return 0;
+	}
+
+	/* Now, consider alternatives. */
+	bool consider[2];
+	for (int i = 0; i < 2; i++) {
+		coord_t ataristone = lib[i];
+		coord_t escape = lib[1 - i];
+		/* Too much free space, ignore. */
+		consider[i] = lm_immediate_libs(m, escape) <= 2 + coord_is_adjecent(ataristone, escape, m->b);
+	}
+
+	/* Try out the alternatives. */
+	for (int i = 0; i < 2; i++) {
+		if (!consider[i])
+			continue;
+		coord_t ataristone = lib[i];
+		coord_t escape = lib[1 - i];
+		lm_play(m, ataristone, ccolor);
+		int res = 0;
+		coord_t alib[2];
+		if (lm_captures(m, ataristone, lcolor)) {
+			res = -1;
+		} else if (lm_chain_libs(m, ataristone, alib) > 1) {
+			/* Unless we just played self-atari, chase on. */
+			res = ladder_model_walk(m, laddered, escape, lcolor);
+		}
+		lm_undo(m, ataristone, ccolor);
+		if (res)
+			return res;
+	}
+	return 0;
+}
+
+static int
+ladder_model_walk(struct ladder_model *m, coord_t laddered, coord_t nextmove, enum stone lcolor)
+{
+	if (DEBUGL(6))
+		fprintf(stderr, "  ladder escape %s\n", coord2sstr(nextmove, m->b));
+	lm_play(m, nextmove, lcolor);
+	int res = ladder_model_escaped(m, laddered, nextmove, lcolor);
+	lm_undo(m, nextmove, lcolor);
+	if (DEBUGL(6))
+		fprintf(stderr, "propagating %d\n", res);
+	return res;
+}
+
+/* Read the ladder of the chain at laddered on the model: after the
+ * chaser plays chaselib (unless pass), the chain must be in atari and
+ * escapes at its liberty. Returns -1 if the model cannot tell. */
+static int
+ladder_model_read(struct board *b, coord_t laddered, coord_t chaselib, enum stone lcolor)
+{
+	struct ladder_model m = { .b = b };
+	int res = -1;
+	if (!is_pass(chaselib)) {
+		lm_play(&m, chaselib, stone_other(lcolor));
+		coord_t lib[2];
+		if (lm_captures(&m, chaselib, lcolor))
+			res = -1;
+		else if (!lm_chain_libs(&m, chaselib, lib))
+			res = 0; // suicide
+		else if (lm_chain_libs(&m, laddered, lib) == 1)
+			res = ladder_model_walk(&m, laddered, lib[0], lcolor);
+		lm_undo(&m, chaselib, stone_other(lcolor));
+		return res;
+	}
+	coord_t lib[2];
+	if (lm_chain_libs(&m, laddered, lib) == 1)
+		res = ladder_model_walk(&m, laddered, lib[0], lcolor);
+	return res;
+}
+
+/* Read the middle ladder of laddered in atari on board copies, trying
+ * the countercaptures in ccq first. */
+static bool
+middle_ladder_copy(struct board *b, group_t laddered, struct move_queue *ccq, enum stone lcolor)
+{
+	struct board *bset = malloc2(BOARD_MAX_SIZE * 2 * sizeof(struct board));
+	/* We could escape by countercapturing a group.
+	 * Investigate. */
+	for (unsigned int i = 0; i < ccq->moves; i++) {
+		struct board b2;
+		board_copy(&b2, b);
+		bool is_ladder = middle_ladder_walk(&b2, bset, laddered, ccq->move[i], lcolor);
+		board_done_noalloc(&b2);
+		if (!is_ladder) {
+			free(bset);
+			return false;
+		}
+	}
+
+	struct board b2;
+	board_copy(&b2, b);
+	bool is_ladder = middle_ladder_walk(&b2, bset, laddered, board_group_info(&b2, laddered).lib[0], lcolor);
+	board_done_noalloc(&b2);
+	free(bset);
+	return is_ladder;
+}
+
+/* Read the would-be ladder of the 2-lib group after chaselib on board
+ * copies. */
+static bool
+wouldbe_ladder_copy(struct board *b, group_t group, coord_t chaselib, enum stone lcolor)
+{
+	bool is_ladder = false;
+	struct board *bset = malloc2(BOARD_MAX_SIZE * 2 * sizeof(struct board));
+	struct board b2;
+	board_copy(&b2, b);
+
+	struct move m = { chaselib, stone_other(lcolor) };
+	int res = board_play(&b2, &m);
+	if (res >= 0)
+		is_ladder = middle_ladder_walk(&b2, bset, group, board_group_info(&b2, group).lib[0], lcolor);
+
+	board_done_noalloc(&b2);
+	free(bset);
+	return is_ladder;
+}
+
 bool
 is_middle_ladder(struct board *b, coord_t coord, group_t laddered, enum stone lcolor)
 {
@@ -168,34 +497,22 @@ is_middle_ladder(struct board *b, coord_t coord, group_t laddered, enum stone lc
 	}
 
 	/* A fair chance for a ladder. Group in atari, with some but limited
-	 * space to escape. Time for the expensive stuff - set up a temporary
-	 * board and start selective 2-liberty search. */
-
-	struct board *bset = malloc2(BOARD_MAX_SIZE * 2 * sizeof(struct board));
+	 * space to escape. Time for the expensive stuff - selective 2-liberty
+	 * search, on the local model if it can tell, else on temporary
+	 * boards; unless we have read this one already. */
+	hash_t key = ladder_cache_key(b, 1, coord, laddered, pass, lcolor);
+	int cached = ladder_cache_get(key);
+	if (cached >= 0)
+		return cached;
 
 	struct move_queue ccq = { .moves = 0 };
-	if (can_countercapture(b, lcolor, laddered, lcolor, &ccq, 0)) {
-		/* We could escape by countercapturing a group.
-		 * Investigate. */
-		assert(ccq.moves > 0);
-		for (unsigned int i = 0; i < ccq.moves; i++) {
-			struct board b2;
-			board_copy(&b2, b);
-			bool is_ladder = middle_ladder_walk(&b2, bset, laddered, ccq.move[i], lcolor);
-			board_done_noalloc(&b2);
-			if (!is_ladder) {
-				free(bset);
-				return false;
-			}
-		}
+	bool countercapture = can_countercapture(b, lcolor, laddered, lcolor, &ccq, 0);
+	if (!countercapture) {
+		int l = ladder_model_read(b, laddered, pass, lcolor);
+		if (l >= 0)
+			return ladder_cache_put(key, l);
 	}
-
-	struct board b2;
-	board_copy(&b2, b);
-	bool is_ladder = middle_ladder_walk(&b2, bset, laddered, board_group_info(&b2, laddered).lib[0], lcolor);
-	board_done_noalloc(&b2);
-	free(bset);
-	return is_ladder;
+	return ladder_cache_put(key, middle_ladder_copy(b, laddered, &ccq, lcolor));
 }
 
 bool
@@ -220,17 +537,56 @@ wouldbe_ladder(struct board *b, group_t group, coord_t escapelib, coord_t chasel
 		return false;
 	}
 
-	bool is_ladder = false;
-	struct board *bset = malloc2(BOARD_MAX_SIZE * 2 * sizeof(struct board));
-	struct board b2;
-	board_copy(&b2, b);
+	hash_t key = ladder_cache_key(b, 2, group, escapelib, chaselib, lcolor);
+	int cached = ladder_cache_get(key);
+	if (cached >= 0)
+		return cached;
 
-	struct move m = { chaselib, stone_other(lcolor) };
-	int res = board_play(&b2, &m);
-	if (res >= 0)
-		is_ladder = middle_ladder_walk(&b2, bset, group, board_group_info(&b2, group).lib[0], lcolor);
+	int l = ladder_model_read(b, group, chaselib, lcolor);
+	if (l >= 0)
+		return ladder_cache_put(key, l);
+	return ladder_cache_put(key, wouldbe_ladder_copy(b, group, chaselib, lcolor));
+}
 
-	board_done_noalloc(&b2);
-	free(bset);
-	return is_ladder;
+int
+ladder_queries(struct board *b, group_t *groups, coord_t *chaselibs)
+{
+	int n = 0;
+	foreach_point(b) {
+		group_t group = group_at(b, c);
+		if (!group || group != c)
+			continue;
+		enum stone lcolor = board_at(b, group);
+		struct group *gi = &board_group_info(b, group);
+		if (gi->libs == 1) {
+			if (immediate_liberty_count(b, gi->lib[0]) != 2)
+				continue;
+			groups[n] = group; chaselibs[n++] = pass;
+		} else if (gi->libs == 2) {
+			for (int i = 0; i < 2; i++) {
+				coord_t escapelib = gi->lib[i], chaselib = gi->lib[1 - i];
+				if (!coord_is_8adjecent(escapelib, chaselib, b)
+				    || neighbor_count_at(b, chaselib, lcolor) != 1
+				    || immediate_liberty_count(b, chaselib) != 2)
+					continue;
+				groups[n] = group; chaselibs[n++] = chaselib;
+			}
+		}
+	} foreach_point_end;
+	return n;
+}
+
+int
+ladder_read(struct board *b, group_t group, coord_t chaselib, enum stone lcolor, bool model)
+{
+	if (is_pass(chaselib)) {
+		struct move_queue ccq = { .moves = 0 };
+		bool countercapture = can_countercapture(b, lcolor, group, lcolor, &ccq, 0);
+		if (model)
+			return countercapture ? -1 : ladder_model_read(b, group, pass, lcolor);
+		return middle_ladder_copy(b, group, &ccq, lcolor);
+	}
+	if (model)
+		return ladder_model_read(b, group, chaselib, lcolor);
+	return wouldbe_ladder_copy(b, group, chaselib, lcolor);
 }
@@ -19,6 +19,23 @@ bool wouldbe_ladder(struct board *b, group_t group, coord_t escapelib, coord_t c
 
 bool is_border_ladder(struct board *b, coord_t coord, enum stone lcolor);
 bool is_middle_ladder(struct board *b, coord_t coord, group_t group, enum stone lcolor);
+
+/* Read the middle ladder of a group in atari (chaselib is pass) or the
+ * would-be ladder of a 2-lib group after chaselib, bypassing the cache
+ * and the cheap checks, with one reader: on the local model if model
+ * (returns -1 if it cannot tell), else on board copies. For checking
+ * the readers against each other (t-unit) and benchmarking (t-bench). */
+int ladder_read(struct board *b, group_t group, coord_t chaselib, enum stone lcolor, bool model);
+/* List the ladder_read() queries about all groups of b that
+ * is_middle_ladder() and wouldbe_ladder() would read; returns their
+ * number. The arrays need room for 2 * board_size2(b) queries. */
+int ladder_queries(struct board *b, group_t *groups, coord_t *chaselibs);
+
+/* Middle and would-be ladder readouts are remembered in a small
+ * per-thread cache keyed by the board hash, as the playouts keep
+ * asking about the same ladders. Get the number of lookups and hits
+ * of all threads so far (counted in batches, so a bit behind). */
+void ladder_cache_stats(unsigned long *lookups, unsigned long *hits);
 static inline bool
 is_ladder(struct board *b, coord_t coord, group_t laddered, bool test_middle)
 {
@@ -55,6 +55,13 @@ struct time_info {
 			double timer_start;
 		} t;
 	} len;
+	/* Absolute time (see time_now()) by which the engine must return
+	 * its move, 0 if none. Unlike the settings above, this is a hard
+	 * limit: the search is cut short to meet it, and the engine reserves
+	 * time before it for stopping the search and choosing the move. It
+	 * applies with any period and dimension; with TT_NULL, the search
+	 * runs until the deadline. */
+	double deadline;
 	/* If true, this time info is independent from GTP time_left updates,
 	 * which will be ignored. This is the case if the time settings were
 	 * forced on the command line. */
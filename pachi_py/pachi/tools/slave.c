@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "board.h"
+#include "debug.h"
+#include "engine.h"
+#include "gtp.h"
+#include "network.h"
+#include "random.h"
+#include "timeinfo.h"
+#include "uct/uct.h"
+
+/* Distributed engine slave, the equivalent of
+ * `pachi -e uct -g HOST:PORT slave,UCT_ARGS` for builds of the pachi
+ * library without the main binary. The python bindings spawn it for
+ * their local slaves (LocalSlaves in goutil.cpp), since a forked copy
+ * of the interpreter and its threads cannot safely run an engine. */
+
+static void
+usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-d DEBUG_LEVEL] HOST:PORT [UCT_ARGS]\n", name);
+}
+
+static struct engine *
+init_slave_engine(char *arg, struct board *b)
+{
+	char *tmp_arg = strdup(arg);
+	struct engine *e = engine_uct_init(tmp_arg, b);
+	free(tmp_arg);
+	return e;
+}
+
+static void
+done_engine(struct engine *e)
+{
+	if (e->done) e->done(e);
+	if (e->data) free(e->data);
+	free(e);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "d:")) != -1) {
+		switch (opt) {
+			case 'd': debug_level = atoi(optarg); break;
+			default: /* '?' */
+				usage(argv[0]);
+				exit(1);
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		exit(1);
+	}
+	char *master = argv[optind];
+	char e_arg[4096] = "slave";
+	if (optind + 1 < argc && *argv[optind + 1])
+		snprintf(e_arg, sizeof(e_arg), "%s,slave", argv[optind + 1]);
+
+	fast_srandom(time(NULL) ^ getpid());
+
+	int sock = -1;
+	open_gtp_connection(&sock, master);
+
+	struct board *b = board_init(NULL);
+	struct engine *e = init_slave_engine(e_arg, b);
+	struct time_info ti[S_MAX] = {};
+	char buf[4096];
+	while (fgets(buf, sizeof(buf), stdin)) {
+		if (gtp_parse(b, e, ti, buf) == P_ENGINE_RESET) {
+			memset(ti, 0, sizeof(ti));
+			if (!e->keep_on_clear) {
+				b->es = NULL;
+				done_engine(e);
+				e = init_slave_engine(e_arg, b);
+			}
+		}
+	}
+	done_engine(e);
+	board_done(b);
+	return 0;
+}
@@ -0,0 +1,62 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "pattern.h"
+#include "patternsp.h"
+#include "patternprob.h"
+
+/* Compiler of the spatial dictionary. Loads patterns.spat the way the
+ * engine does (hashing spatials in the order of patterns.prob when it
+ * is present, so that the most popular patterns take priority) and
+ * writes the dictionary with its hash index to patterns.spatbin, which
+ * spatial_dict_init() then maps directly instead of parsing the text
+ * file. Rerun it whenever patterns.spat or patterns.prob change; an
+ * out of date compiled dictionary is ignored. */
+
+static void
+usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-s patterns.spat] [-p patterns.prob] [-o patterns.spatbin]\n", name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *spatfile = "patterns.spat", *probfile = "patterns.prob", *outfile = "patterns.spatbin";
+
+	int opt;
+	while ((opt = getopt(argc, argv, "s:p:o:")) != -1) {
+		switch (opt) {
+			case 's': spatfile = optarg; break;
+			case 'p': probfile = optarg; break;
+			case 'o': outfile = optarg; break;
+			default: /* '?' */
+				usage(argv[0]);
+				exit(1);
+		}
+	}
+
+	debug_level = 1;
+	spatial_dict_filename = spatfile;
+	spatial_dict_binfilename = NULL;
+
+	bool prob = !access(probfile, R_OK);
+	struct pattern_config pc = DEFAULT_PATTERN_CONFIG;
+	/* The probtable hashes its own spatial dictionary. */
+	if (prob)
+		pattern_pdict_init(probfile, &pc);
+	else
+		pc.spat_dict = spatial_dict_init(false, true);
+	if (!pc.spat_dict)
+		exit(1);
+
+	if (!spatial_dict_save(pc.spat_dict, outfile))
+		exit(1);
+	fprintf(stderr, "Wrote %s: %u spatials, %u hash slots%s.\n", outfile,
+		pc.spat_dict->nspatials, pc.spat_dict->hsize,
+		prob ? ", hashed in patterns.prob order" : "");
+	return 0;
+}
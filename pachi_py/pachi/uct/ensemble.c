@@ -0,0 +1,459 @@
+/* Ensemble of independent UCT engines within one process. Each member
+ * is a full uct engine with its own tree and search threads, optionally
+ * pinned to its own NUMA node, so that threads of different members
+ * never write to the same nodes. The ensemble periodically merges the
+ * stats of the root and near-root nodes of all trees, like the
+ * distributed engine does between machines but in shared memory, and
+ * picks the move from the merged root of the first member. */
+
+/* Like for the distributed slaves, each node remembers in its "pu"
+ * field its stats as of the last merge. At each merge, the increment
+ * of a node since then is added to the matching nodes (same coord
+ * path) of all other trees. Nodes which do not exist yet in a tree
+ * miss the increments of the other trees. */
+
+/* Pass me arguments like a=b,c=d,...
+ * Ensemble specific arguments, all other arguments are passed to
+ * every uct member (e.g. threads=N for the threads of each member):
+ *  members=K               number of uct engines, default one per NUMA
+ *                          node, at least 2
+ *  pin[=0|1]               pin the threads of member k to NUMA node k,
+ *                          default only with several NUMA nodes
+ *  shared_levels=LEVELS    merge nodes up to this depth, default 2
+ *  merge_interval=MS       time between merges, default 20ms
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG
+
+#include "debug.h"
+#include "board.h"
+#include "engine.h"
+#include "move.h"
+#include "numa.h"
+#include "random.h"
+#include "stats.h"
+#include "timeinfo.h"
+#include "uct/ensemble.h"
+#include "uct/internal.h"
+#include "uct/search.h"
+#include "uct/tree.h"
+#include "uct/uct.h"
+#include "uct/walk.h"
+
+#define DEFAULT_SHARED_LEVELS 2
+#define DEFAULT_MERGE_INTERVAL 0.02
+
+struct ensemble {
+	int members;
+	struct engine **engines;
+	bool pin;
+	int shared_levels;
+	double merge_interval;
+
+	/* Board copies of the members during a search, and the node
+	 * groups of each level for the merge, indexed by coord + 1. */
+	struct board *boards;
+	struct tree_node **groups;
+	int groups_size2;
+
+	/* Merge statistics since the last genmove. */
+	long merges;
+	double merge_time;
+};
+
+struct ensemble_thread {
+	struct uct_thread_ctx ctx;
+	int node;
+	bool pin;
+};
+
+#define member_uct(ens, k) ((struct uct *)(ens)->engines[k]->data)
+
+
+/* Merge the stats of nodes[0..members-1], the nodes of the same coord
+ * path in each tree (or NULL), then recurse to their children. */
+static void
+merge_nodes(struct ensemble *ens, struct tree_node **nodes, int level, int size2)
+{
+	int members = ens->members;
+	struct move_stats delta[members];
+	struct move_stats total = { .playouts = 0, .value = 0 };
+	for (int k = 0; k < members; k++) {
+		delta[k].playouts = 0;
+		if (!nodes[k]) continue;
+		/* A descent with virtual loss is still going through the
+		 * node, and its result may be half recorded. Leave the
+		 * increment for a later merge, pu is not advanced. */
+		if (nodes[k]->descents > 0) continue;
+		struct move_stats d = nodes[k]->u;
+		stats_rm_result(&d, nodes[k]->pu.value, nodes[k]->pu.playouts);
+		if (d.playouts <= 0) continue;
+		delta[k] = d;
+		stats_merge(&total, &d);
+	}
+	if (!total.playouts) return;
+
+	for (int k = 0; k < members; k++) {
+		struct tree_node *n = nodes[k];
+		if (!n) continue;
+		/* node_total += others_incr, last_total += own_incr + others_incr */
+		struct move_stats others = total;
+		stats_rm_result(&others, delta[k].value, delta[k].playouts);
+		if (others.playouts > 0) {
+			stats_add_result(&n->u, others.value, others.playouts);
+			stats_merge(&n->pu, &others);
+		}
+		stats_merge(&n->pu, &delta[k]);
+	}
+	if (level >= ens->shared_levels) return;
+
+	/* Group the children by coord. The children field is set only
+	 * after all children are created so we can traverse the trees
+	 * while they are searched. */
+	struct tree_node **groups = ens->groups + level * (size2 + 1) * members;
+	coord_t coords[size2 + 1];
+	int ncoords = 0;
+	for (int k = 0; k < members; k++) {
+		if (!nodes[k]) continue;
+		for (struct tree_node *ni = nodes[k]->children; ni; ni = ni->sibling) {
+			struct tree_node **group = groups + (node_coord(ni) + 1) * members;
+			bool empty = true;
+			for (int j = 0; j < k; j++) empty &= !group[j];
+			if (empty) coords[ncoords++] = node_coord(ni);
+			group[k] = ni;
+		}
+	}
+	for (int i = 0; i < ncoords; i++) {
+		struct tree_node **group = groups + (coords[i] + 1) * members;
+		merge_nodes(ens, group, level + 1, size2);
+		memset(group, 0, members * sizeof(*group));
+	}
+}
+
+static void
+ensemble_merge(struct ensemble *ens, struct board *b)
+{
+	double start = time_now();
+	struct tree_node *roots[ens->members];
+	for (int k = 0; k < ens->members; k++)
+		roots[k] = member_uct(ens, k)->t->root;
+	merge_nodes(ens, roots, 0, board_size2(b));
+	ens->merges++;
+	ens->merge_time += time_now() - start;
+}
+
+
+static void *
+ensemble_worker(void *ctx_)
+{
+	struct ensemble_thread *th = ctx_;
+	struct uct_thread_ctx *ctx = &th->ctx;
+	if (th->pin && !numa_pin_thread(th->node) && DEBUGL(2))
+		fprintf(stderr, "ensemble: cannot pin thread to node %d\n", th->node);
+	fast_srandom(ctx->seed);
+	ctx->games = uct_playouts(ctx->u, ctx->b, ctx->color, ctx->t, ctx->ti, ctx->tid);
+	return ctx;
+}
+
+/* Forward a move to all members. */
+static void
+members_play(struct ensemble *ens, struct board *b, struct move *m)
+{
+	void *es = b->es;
+	for (int k = 0; k < ens->members; k++) {
+		struct engine *e = ens->engines[k];
+		e->notify_play(e, b, m, NULL);
+	}
+	b->es = es;
+}
+
+static char *
+ensemble_notify_play(struct engine *e, struct board *b, struct move *m, char *enginearg)
+{
+	members_play(e->data, b, m);
+	return NULL;
+}
+
+static coord_t *
+ensemble_genmove(struct engine *e, struct board *b, struct time_info *ti, enum stone color, bool pass_all_alive)
+{
+	struct ensemble *ens = e->data;
+	int members = ens->members;
+	double start_time = time_now();
+
+	/* Each member searches on its own copy of the board, which
+	 * uct_genmove_setup() may tweak. */
+	int size2 = board_size2(b);
+	if (size2 > ens->groups_size2) {
+		free(ens->groups);
+		ens->groups = calloc2((ens->shared_levels + 1) * (size2 + 1) * members, sizeof(*ens->groups));
+		ens->groups_size2 = size2;
+	}
+	struct uct_search_state s[members];
+	struct uct_thread_ctx mctx[members];
+	int threads = 0;
+	for (int k = 0; k < members; k++) {
+		struct uct *u = member_uct(ens, k);
+		struct board *mb = &ens->boards[k];
+		board_copy(mb, b);
+		mb->es = u;
+#ifdef BOARD_SPATHASH
+		/* Pattern priors are matched on copies of mb. */
+		if (u->spathash && u->pat.pd && !mb->spathash_on)
+			board_spathash_enable(mb);
+#endif
+		u->pass_all_alive |= pass_all_alive;
+		uct_pondering_stop(u);
+		uct_genmove_setup(u, mb, color);
+
+		mctx[k] = (struct uct_thread_ctx) { .u = u, .b = mb, .color = color, .t = u->t, .ti = ti };
+		s[k].ctx = &mctx[k];
+		uct_search_setup(u, mb, color, u->t, ti, &s[k]);
+		/* Only the first member prints progress. */
+		if (k) s[k].print_interval = INT_MAX;
+		threads += u->threads;
+	}
+
+	/* Start the search threads of all members. A member whose threads
+	 * cannot all be created searches on those it got. */
+	uct_halt = 0;
+	struct ensemble_thread *th = calloc2(threads, sizeof(*th));
+	pthread_t *tids = calloc2(threads, sizeof(*tids));
+	int started = 0;
+	for (int k = 0, i = 0; k < members; k++) {
+		struct uct *u = member_uct(ens, k);
+		for (int j = 0; j < u->threads; j++, i++) {
+			struct ensemble_thread *t = &th[started];
+			t->ctx = mctx[k];
+			t->ctx.tid = j;
+			t->ctx.seed = fast_random(65536) + i;
+			t->node = k;
+			t->pin = ens->pin;
+			pthread_attr_t a;
+			pthread_attr_init(&a);
+			pthread_attr_setstacksize(&a, 1048576);
+			int err = pthread_create(&tids[started], &a, ensemble_worker, t);
+			pthread_attr_destroy(&a);
+			if (err) {
+				if (DEBUGL(2))
+					fprintf(stderr, "ensemble: cannot create thread %d of member %d: %s\n", j, k, strerror(err));
+				continue;
+			}
+			started++;
+		}
+	}
+	if (!started) {
+		/* Nobody to search; give up the move rather than wait
+		 * forever for playouts. */
+		fprintf(stderr, "ensemble: no search thread could be created, passing\n");
+		free(tids);
+		free(th);
+		for (int k = 0; k < members; k++)
+			board_done_noalloc(&ens->boards[k]);
+		return coord_copy(pass);
+	}
+
+	/* Merge the trees periodically, and stop when the merged
+	 * root of the first member says so. */
+	struct uct *u0 = member_uct(ens, 0);
+	struct board *b0 = &ens->boards[0];
+	ens->merges = 0;
+	ens->merge_time = 0;
+	while (1) {
+		uct_search_sleep(&s[0], ens->merge_interval);
+		ensemble_merge(ens, b);
+		for (int k = 0; k < members; k++) {
+			struct uct *u = member_uct(ens, k);
+			uct_search_progress(u, &ens->boards[k], color, u->t, ti, &s[k],
+					    uct_search_games(&s[k]));
+		}
+		int i = uct_search_games(&s[0]);
+		if (uct_search_check_stop(u0, b0, color, u0->t, ti, &s[0], i))
+			break;
+	}
+	uct_halt = 1;
+	int played_games = 0;
+	for (int i = 0; i < started; i++) {
+		pthread_join(tids[i], NULL);
+		played_games += th[i].ctx.games;
+	}
+	uct_halt = 0;
+	free(tids);
+	free(th);
+	ensemble_merge(ens, b);
+
+	coord_t best_coord;
+	uct_search_result(u0, b0, color, u0->pass_all_alive, played_games, s[0].base_playouts, &best_coord);
+
+	if (DEBUGL(2)) {
+		double time = time_now() - start_time + 0.000001; /* avoid divide by zero */
+		fprintf(stderr, "genmove in %0.2fs (%d games/s, %d games/s/thread), %d members, %ld merges in %.3fms\n",
+			time, (int)(played_games/time), (int)(played_games/time/started),
+			members, ens->merges, ens->merge_time * 1000);
+	}
+	uct_progress_status(u0, u0->t, color, played_games, &best_coord);
+
+	/* Let every member promote its tree to the chosen move. */
+	for (int k = 0; k < members; k++) {
+		struct engine *me = ens->engines[k];
+		struct move m = { .coord = best_coord, .color = color };
+		me->notify_play(me, &ens->boards[k], &m, NULL);
+		board_done_noalloc(&ens->boards[k]);
+	}
+	return coord_copy(best_coord);
+}
+
+static char *
+ensemble_undo(struct engine *e, struct board *b)
+{
+	struct ensemble *ens = e->data;
+	for (int k = 0; k < ens->members; k++)
+		ens->engines[k]->undo(ens->engines[k], b);
+	return NULL;
+}
+
+static char *
+ensemble_result(struct engine *e, struct board *b)
+{
+	struct ensemble *ens = e->data;
+	return ens->engines[0]->result(ens->engines[0], b);
+}
+
+static char *
+ensemble_chat(struct engine *e, struct board *b, bool opponent, char *from, char *cmd)
+{
+	struct ensemble *ens = e->data;
+	return ens->engines[0]->chat(ens->engines[0], b, opponent, from, cmd);
+}
+
+static void
+ensemble_dead_group_list(struct engine *e, struct board *b, struct move_queue *mq)
+{
+	struct ensemble *ens = e->data;
+	void *es = b->es;
+	ens->engines[0]->dead_group_list(ens->engines[0], b, mq);
+	b->es = es;
+}
+
+static float
+ensemble_owner_map(struct engine *e, struct board *b, coord_t c)
+{
+	struct ensemble *ens = e->data;
+	return board_ownermap_estimate_point(uct_ownermap(member_uct(ens, 0)), c);
+}
+
+static void
+ensemble_stop(struct engine *e)
+{
+	struct ensemble *ens = e->data;
+	for (int k = 0; k < ens->members; k++)
+		ens->engines[k]->stop(ens->engines[k]);
+}
+
+static void
+ensemble_done(struct engine *e)
+{
+	struct ensemble *ens = e->data;
+	for (int k = 0; k < ens->members; k++) {
+		struct engine *me = ens->engines[k];
+		me->done(me);
+		free(me->data);
+		free(me);
+	}
+	free(ens->engines);
+	free(ens->boards);
+	free(ens->groups);
+}
+
+
+static struct ensemble *
+ensemble_state_init(char *arg, struct board *b)
+{
+	struct ensemble *ens = calloc2(1, sizeof(struct ensemble));
+	int nodes = numa_node_count();
+	ens->members = nodes > 1 ? nodes : 2;
+	ens->pin = nodes > 1;
+	ens->shared_levels = DEFAULT_SHARED_LEVELS;
+	ens->merge_interval = DEFAULT_MERGE_INTERVAL;
+
+	/* Arguments for the members, pondering is not supported. */
+	char *member_arg = malloc2((arg ? strlen(arg) : 0) + 16);
+	strcpy(member_arg, "pondering=0");
+	if (arg) {
+		char *optspec, *next = arg;
+		while (*next) {
+			optspec = next;
+			next += strcspn(next, ",");
+			if (*next) { *next++ = 0; } else { *next = 0; }
+
+			char *optname = optspec;
+			char *optval = strchr(optspec, '=');
+			if (optval) *optval++ = 0;
+
+			if (!strcasecmp(optname, "members") && optval) {
+				ens->members = atoi(optval);
+			} else if (!strcasecmp(optname, "pin")) {
+				ens->pin = !optval || atoi(optval);
+			} else if (!strcasecmp(optname, "shared_levels") && optval) {
+				/* Merge nodes of level <= shared_levels. */
+				ens->shared_levels = atoi(optval);
+			} else if (!strcasecmp(optname, "merge_interval") && optval) {
+				ens->merge_interval = atof(optval) / 1000;
+			} else if (*optname) {
+				/* Leave everything else to the uct members. */
+				strcat(member_arg, ",");
+				strcat(member_arg, optname);
+				if (optval) {
+					strcat(member_arg, "=");
+					strcat(member_arg, optval);
+				}
+			}
+		}
+	}
+	if (ens->members < 1 || ens->shared_levels < 0 || ens->merge_interval <= 0) {
+		fprintf(stderr, "ensemble: Invalid members, shared_levels or merge_interval\n");
+		exit(1);
+	}
+
+	ens->engines = calloc2(ens->members, sizeof(*ens->engines));
+	for (int k = 0; k < ens->members; k++) {
+		/* engine_uct_init() cuts its argument in pieces. */
+		char *a = strdup(member_arg);
+		ens->engines[k] = engine_uct_init(a, b);
+		free(a);
+		if (member_uct(ens, k)->slave) {
+			fprintf(stderr, "ensemble: members cannot be distributed slaves\n");
+			exit(1);
+		}
+	}
+	free(member_arg);
+	ens->boards = calloc2(ens->members, sizeof(*ens->boards));
+	return ens;
+}
+
+struct engine *
+engine_ensemble_init(char *arg, struct board *b)
+{
+	struct ensemble *ens = ensemble_state_init(arg, b);
+	struct engine *e = calloc2(1, sizeof(struct engine));
+	e->name = "UCT Ensemble";
+	e->comment = ens->engines[0]->comment;
+	e->notify_play = ensemble_notify_play;
+	e->genmove = ensemble_genmove;
+	e->undo = ensemble_undo;
+	e->result = ensemble_result;
+	e->chat = ensemble_chat;
+	e->dead_group_list = ensemble_dead_group_list;
+	e->owner_map = ensemble_owner_map;
+	e->stop = ensemble_stop;
+	e->done = ensemble_done;
+	e->data = ens;
+	return e;
+}
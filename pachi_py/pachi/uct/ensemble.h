@@ -0,0 +1,10 @@
+#ifndef PACHI_UCT_ENSEMBLE_H
+#define PACHI_UCT_ENSEMBLE_H
+
+#include "engine.h"
+
+struct board;
+
+struct engine *engine_ensemble_init(char *arg, struct board *b);
+
+#endif
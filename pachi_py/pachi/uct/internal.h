@@ -11,6 +11,7 @@
 #include "patternprob.h"
 #include "playout.h"
 #include "stats.h"
+#include "uct/tree.h"
 
 struct tree;
 struct tree_node;
@@ -63,6 +64,13 @@ struct uct {
 		TM_TREEVL, /* Tree parallelization with virtual loss. */
 	} thread_model;
 	int virtual_loss;
+	enum uct_pin {
+		UCT_PIN_NONE,
+		UCT_PIN_CORES, /* Each thread on its own cpu. */
+		UCT_PIN_NODES, /* Threads spread evenly over NUMA nodes. */
+	} pin;
+	enum tree_numa numa_mem;
+	enum tree_hugepages hugepages;
 	bool pondering_opt; /* User wants pondering */
 	bool pondering; /* Actually pondering now */
 	bool slave; /* Act as slave in distributed engine. */
@@ -118,9 +126,18 @@ struct uct {
 	/* Various modules (prior, policy, ...) set this if they want pattern
 	 * database to be loaded. */
 	bool want_pat;
+	/* Maintain incremental spatial hashes on the tree descent boards
+	 * (speeds up pattern matching at node expansion). */
+	bool spathash;
 
-	/* Used within frame of single genmove. */
+	/* Used within frame of single genmove. The search threads fill
+	 * their own shards; read ownermap through uct_ownermap(). */
 	struct board_ownermap ownermap;
+	struct board_ownermap_shards ownermap_shards; // [threads]
+	/* Time from stopping the search to returning the move, reserved
+	 * before a hard deadline: the recent maximum, decaying slowly. */
+	double teardown_time;
+	double search_stopped; // when the last search was (due to be) stopped
 	/* Used for coordination among slaves of the distributed engine. */
 	int stats_hbits;
 	int shared_nodes;
@@ -137,6 +154,10 @@ struct uct {
 
 bool uct_pass_is_safe(struct uct *u, struct board *b, enum stone color, bool pass_all_alive);
 
+/* The ownermap of the current search, merged from the shards of
+ * the search threads if they played since the last call. */
+struct board_ownermap *uct_ownermap(struct uct *u);
+
 void uct_prepare_move(struct uct *u, struct board *b, enum stone color);
 void uct_genmove_setup(struct uct *u, struct board *b, enum stone color);
 void uct_pondering_stop(struct uct *u);
@@ -13,6 +13,7 @@
 #include "debug.h"
 #include "distributed/distributed.h"
 #include "move.h"
+#include "numa.h"
 #include "random.h"
 #include "timeinfo.h"
 #include "uct/dynkomi.h"
@@ -84,6 +85,13 @@ volatile sig_atomic_t uct_halt = 0;
 static pthread_t thread_manager;
 bool thread_manager_running;
 
+#ifdef BOARD_SPATHASH
+/* The board we search on when it needs spatial hashes the caller's
+ * board does not maintain, see uct_search_start(). */
+static struct board search_board;
+static struct board *search_caller_board;
+#endif
+
 static pthread_mutex_t finish_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t finish_cond = PTHREAD_COND_INITIALIZER;
 static volatile int finish_thread;
@@ -93,10 +101,18 @@ static void *
 spawn_worker(void *ctx_)
 {
 	struct uct_thread_ctx *ctx = ctx_;
+	struct uct *u = ctx->u;
 	/* Setup */
 	fast_srandom(ctx->seed);
+	bool pinned = true;
+	if (u->pin == UCT_PIN_CORES)
+		pinned = numa_pin_cpu(ctx->tid);
+	else if (u->pin == UCT_PIN_NODES)
+		pinned = numa_pin_thread(ctx->tid * numa_node_count() / u->threads);
+	if (!pinned && UDEBUGL(2))
+		fprintf(stderr, "Cannot pin worker %d\n", ctx->tid);
 	/* Run */
-	ctx->games = uct_playouts(ctx->u, ctx->b, ctx->color, ctx->t, ctx->ti);
+	ctx->games = uct_playouts(ctx->u, ctx->b, ctx->color, ctx->t, ctx->ti, ctx->tid);
 	/* Finish */
 	pthread_mutex_lock(&finish_serializer);
 	pthread_mutex_lock(&finish_mutex);
@@ -194,7 +210,7 @@ uct_search_games(struct uct_search_state *s)
 }
 
 void
-uct_search_start(struct uct *u, struct board *b, enum stone color,
+uct_search_setup(struct uct *u, struct board *b, enum stone color,
 		 struct tree *t, struct time_info *ti,
 		 struct uct_search_state *s)
 {
@@ -202,18 +218,44 @@ uct_search_start(struct uct *u, struct board *b, enum stone color,
 	s->base_playouts = s->last_dynkomi = s->last_print = t->root->u.playouts;
 	s->print_interval = u->reportfreq * u->threads;
 	s->fullmem = false;
+	s->stop_at = 0;
 
 	if (ti) {
+		double deadline = ti->deadline;
 		if (ti->period == TT_NULL) {
-			if (u->slave) {
+			/* With just a deadline, search until it. */
+			if (u->slave || deadline) {
 				*ti = unlimited_ti;
 			} else {
 				*ti = default_ti;
 				time_start_timer(ti);
 			}
+			ti->deadline = deadline;
 		}
 		time_stop_conditions(ti, b, u->fuseki_end, u->yose_start, u->max_maintime_ratio, &s->stop);
+		if (deadline)
+			s->stop_at = deadline - u->teardown_time;
+	}
+}
+
+void
+uct_search_start(struct uct *u, struct board *b, enum stone color,
+		 struct tree *t, struct time_info *ti,
+		 struct uct_search_state *s)
+{
+	uct_search_setup(u, b, color, t, ti, s);
+
+#ifdef BOARD_SPATHASH
+	/* Pattern priors are matched on the tree descent boards, which
+	 * are copies of the one we search on; keep the incremental
+	 * spatial hashes on our own copy, not on the caller's board. */
+	if (u->spathash && u->pat.pd && !b->spathash_on) {
+		board_copy(&search_board, b);
+		board_spathash_enable(&search_board);
+		search_caller_board = b;
+		b = &search_board;
 	}
+#endif
 
 	/* Fire up the tree search thread manager, which will in turn
 	 * spawn the searching threads. */
@@ -233,6 +275,10 @@ uct_search_stop(void)
 {
 	assert(thread_manager_running);
 
+	/* Tell the workers to wrap up right away rather than when
+	 * the thread manager gets to run; they still cannot terminate
+	 * before it is stopped (see spawn_thread_manager()). */
+	uct_halt = 1;
 	/* Signal thread manager to stop the workers. */
 	pthread_mutex_lock(&finish_mutex);
 	finish_thread = -1;
@@ -243,9 +289,27 @@ uct_search_stop(void)
 	struct uct_thread_ctx *pctx;
 	thread_manager_running = false;
 	pthread_join(thread_manager, (void **) &pctx);
+
+#ifdef BOARD_SPATHASH
+	if (pctx->b == &search_board) {
+		pctx->b = search_caller_board;
+		board_done_noalloc(&search_board);
+	}
+#endif
 	return pctx;
 }
 
+void
+uct_search_sleep(struct uct_search_state *s, double interval)
+{
+	if (s->stop_at) {
+		double left = s->stop_at - time_now();
+		if (left < interval)
+			interval = left > DEADLINE_POLL_MIN ? left : DEADLINE_POLL_MIN;
+	}
+	time_sleep(interval);
+}
+
 
 void
 uct_search_progress(struct uct *u, struct board *b, enum stone color,
@@ -409,6 +473,11 @@ uct_search_check_stop(struct uct *u, struct board *b, enum stone color,
 {
 	struct uct_thread_ctx *ctx = s->ctx;
 
+	/* The hard deadline overrides everything else; we only need
+	 * the root expanded to have some move to choose. */
+	if (s->stop_at && time_now() >= s->stop_at && ctx->t->root->children)
+		return true;
+
 	/* Never consider stopping if we played too few simulations.
 	 * Maybe we risk losing on time when playing in super-extreme
 	 * time pressure but the tree is going to be just too messed
@@ -515,7 +584,7 @@ uct_search_result(struct uct *u, struct board *b, enum stone color,
 		} else {
 			if (UDEBUGL(3))
 				fprintf(stderr, "Refusing to pass, unsafe; pass_all_alive %d, ownermap #playouts %d, raw score %f\n",
-				        pass_all_alive, u->ownermap.playouts,
+				        pass_all_alive, uct_ownermap(u)->playouts,
 					board_official_score(b, NULL) / 2);
 		}
 	}
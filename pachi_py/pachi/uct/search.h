@@ -25,6 +25,12 @@ struct tree_node;
 /* How often to inspect the tree from the main thread to check for playout
  * stop, progress reports, etc. (in seconds) */
 #define TREE_BUSYWAIT_INTERVAL 0.1 /* 100ms */
+/* With a hard deadline, we poll when the search must stop instead,
+ * but no more often than this. */
+#define DEADLINE_POLL_MIN 0.001 /* 1ms */
+/* Time reserved before a hard deadline for stopping the search and
+ * returning the move, until we have measured it. */
+#define DEADLINE_TEARDOWN_DEFAULT 0.01 /* 10ms */
 
 
 /* Thread manager state */
@@ -58,6 +64,9 @@ struct uct_search_state {
 	int print_interval;
 	/* Printed notification about full memory? */
 	bool fullmem;
+	/* Absolute time at which to stop the search to meet the hard
+	 * deadline of the time info, 0 if none. */
+	double stop_at;
 
 	struct time_stop stop;
 	struct uct_thread_ctx *ctx;
@@ -65,8 +74,12 @@ struct uct_search_state {
 
 int uct_search_games(struct uct_search_state *s);
 
+/* Set up the search state and time limits, without starting the search. */
+void uct_search_setup(struct uct *u, struct board *b, enum stone color, struct tree *t, struct time_info *ti, struct uct_search_state *s);
 void uct_search_start(struct uct *u, struct board *b, enum stone color, struct tree *t, struct time_info *ti, struct uct_search_state *s);
 struct uct_thread_ctx *uct_search_stop(void);
+/* Sleep until the next poll of the search, at most interval. */
+void uct_search_sleep(struct uct_search_state *s, double interval);
 
 void uct_search_progress(struct uct *u, struct board *b, enum stone color, struct tree *t, struct time_info *ti, struct uct_search_state *s, int i);
 
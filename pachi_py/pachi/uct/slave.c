@@ -5,7 +5,8 @@
  * tree node to update. When sending stats we remember in the tree
  * what was previously sent so that only the incremental part has to
  * be sent.  The incremental part is smaller and can be compressed.
- * The compression is not yet done in this version. */
+ * It is sent in the compact format of distributed/wire.c when the
+ * master asks for it. */
 
 /* Similarly the master only sends stats increments.
  * They include only contributions from other slaves. */
@@ -23,11 +24,12 @@
  * and distributed.c for the port arguments) :
  *  slave                   required to indicate slave mode
  *  max_nodes=MAX_NODES     default 80K
- *  stats_hbits=STATS_HBITS default 24. 2^stats_bits = hash table size
+ *  stats_hbits=STATS_HBITS default 18. 2^stats_hbits = maximum hash table size
  */
 
 #include <assert.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,45 +47,198 @@
 #include "uct/search.h"
 #include "uct/slave.h"
 #include "uct/tree.h"
+#include "distributed/wire.h"
 
 
 /* UCT infrastructure for a distributed engine slave. */
 
 /* For debugging only. */
-static struct hash_counts h_counts;
 static long parent_not_found = 0;
 static long parent_leaf = 0;
 static long node_not_found = 0;
 
-/* Hash table entry mapping path to node. */
+/* Hash table entry mapping path to node. An entry is in use only if
+ * its generation is the current one of the table, so the table is
+ * emptied at each move by bumping the generation instead of clearing
+ * it. An entry being written has the HTABLE_BUSY bit set. */
 struct tree_hash {
 	path_t coord_path;
 	struct tree_node *node;
+	unsigned int generation;
+};
+
+#define HTABLE_BUSY 0x80000000U
+#define HTABLE_MIN_BITS 12
+/* Probe lengths histogram: 1, 2, 3-4, 5-8, ... 33-64, more. */
+#define PROBE_BUCKETS 8
+
+/* Open addressed table with linear probing. Lookups and inserts
+ * are lock-free: an insert claims a free entry with a CAS on its
+ * generation, and publishes it once filled. The table grows in
+ * htable_reserve(), which must not run concurrently with inserts. */
+struct tree_htable {
+	struct tree_hash *table;
+	int hbits;
+	int max_hbits;
+	unsigned int generation;
+	/* Entries of the current generation. */
+	int count;
+
+	/* Statistics since the last reset, for debugging only. */
+	long lookups;
+	long inserts;
+	long full;
+	long probes[PROBE_BUCKETS];
 };
 
 void *
 uct_htable_alloc(int hbits)
 {
-	return calloc2(1 << hbits, sizeof(struct tree_hash));
+	struct tree_htable *h = calloc2(1, sizeof(*h));
+	h->max_hbits = hbits;
+	h->hbits = hbits < HTABLE_MIN_BITS ? hbits : HTABLE_MIN_BITS;
+	h->table = calloc2(1 << h->hbits, sizeof(*h->table));
+	h->generation = 1;
+	return h;
 }
 
-/* Clear the hash table. Used only when running as slave for the distributed engine. */
-void uct_htable_reset(struct tree *t)
+void
+uct_htable_done(struct tree_htable *h)
+{
+	free(h->table);
+	free(h);
+}
+
+static inline int
+hash_path(path_t path, int hbits)
+{
+	return ((uint64_t)path * 0x9e3779b97f4a7c15ULL) >> (64 - hbits);
+}
+
+static inline void
+count_probes(struct tree_htable *h, int probes)
+{
+	int bucket = probes <= 1 ? 0 : 32 - __builtin_clz(probes - 1);
+	h->probes[bucket < PROBE_BUCKETS ? bucket : PROBE_BUCKETS - 1]++;
+}
+
+/* Return the generation of entry e, waiting if it is being written. */
+static inline unsigned int
+entry_generation(struct tree_hash *e, unsigned int generation)
+{
+	unsigned int g;
+	while ((g = __atomic_load_n(&e->generation, __ATOMIC_ACQUIRE)) == (generation | HTABLE_BUSY))
+		;
+	return g;
+}
+
+/* Return the entry of path, or NULL if not in the table. */
+static struct tree_hash *
+htable_find(struct tree_htable *h, path_t path)
+{
+	int mask = hash_mask(h->hbits);
+	unsigned int generation = h->generation;
+	if (DEBUG_MODE) h->lookups++;
+	for (int i = hash_path(path, h->hbits), probes = 1; probes <= mask + 1; i = (i + 1) & mask, probes++) {
+		struct tree_hash *e = &h->table[i];
+		if (entry_generation(e, generation) != generation) {
+			if (DEBUG_MODE) count_probes(h, probes);
+			return NULL;
+		}
+		if (e->coord_path == path) {
+			if (DEBUG_MODE) count_probes(h, probes);
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/* Insert path mapped to node, unless already there. Return the entry,
+ * or NULL if the table is full. */
+static struct tree_hash *
+htable_insert(struct tree_htable *h, path_t path, struct tree_node *node)
+{
+	int mask = hash_mask(h->hbits);
+	unsigned int generation = h->generation;
+	for (int i = hash_path(path, h->hbits), probes = 1; probes <= mask + 1; ) {
+		struct tree_hash *e = &h->table[i];
+		unsigned int g = entry_generation(e, generation);
+		if (g == generation) {
+			if (e->coord_path == path) return e;
+			i = (i + 1) & mask, probes++;
+			continue;
+		}
+		/* Free entry: claim it, or look again if another insert did. */
+		if (!__sync_bool_compare_and_swap(&e->generation, g, generation | HTABLE_BUSY))
+			continue;
+		e->coord_path = path;
+		e->node = node;
+		__atomic_store_n(&e->generation, generation, __ATOMIC_RELEASE);
+		__sync_fetch_and_add(&h->count, 1);
+		if (DEBUG_MODE) h->inserts++;
+		return e;
+	}
+	if (DEBUG_MODE) h->full++;
+	return NULL;
+}
+
+/* Make room for nodes more entries, keeping the load factor below
+ * 1/2 if the maximum size allows it. */
+static void
+htable_reserve(struct tree_htable *h, int nodes)
 {
-	if (!t->htable) return;
+	long needed = 2 * ((long)h->count + nodes);
+	int hbits = h->hbits;
+	while (hbits < h->max_hbits && (1L << hbits) < needed) hbits++;
+	if (hbits == h->hbits) return;
+
 	double start = time_now();
-	memset(t->htable, 0, (1 << t->hbits) * sizeof(t->htable[0]));
+	struct tree_hash *table = calloc2(1 << hbits, sizeof(*table));
+	int mask = hash_mask(hbits);
+	for (int i = 0; i < (1 << h->hbits); i++) {
+		struct tree_hash *e = &h->table[i];
+		if (e->generation != h->generation) continue;
+		int j = hash_path(e->coord_path, hbits);
+		while (table[j].generation == h->generation) j = (j + 1) & mask;
+		table[j] = *e;
+	}
+	free(h->table);
+	h->table = table;
 	if (DEBUGL(3))
-		fprintf(stderr, "tree occupied %ld %.1f%% inserts %ld collisions %ld/%ld %.1f%% clear %.3fms\n"
+		fprintf(stderr, "htable grown to %d entries in %.3fms\n",
+			1 << hbits, (time_now() - start)*1000);
+	h->hbits = hbits;
+}
+
+/* Empty the hash table. Used only when running as slave for the distributed engine. */
+void uct_htable_reset(struct tree *t)
+{
+	struct tree_htable *h = t->htable;
+	if (!h) return;
+	if (DEBUGL(3)) {
+		long probes = 0;
+		for (int i = 0; i < PROBE_BUCKETS; i++) probes += h->probes[i];
+		fprintf(stderr, "htable %d/%d entries load %.1f%% lookups %ld inserts %ld full %ld\n"
+			"probes 1:%.1f%% 2:%.1f%% 3-4:%.1f%% 5-8:%.1f%% 9-16:%.1f%% 17-32:%.1f%% 33-64:%.1f%% more:%.1f%%\n"
 			"parent_not_found %.1f%% parent_leaf %.1f%% node_not_found %.1f%%\n",
-			h_counts.occupied, h_counts.occupied * 100.0 / (1 << t->hbits),
-			h_counts.inserts, h_counts.collisions, h_counts.lookups,
-			h_counts.collisions * 100.0 / (h_counts.lookups + 1),
-			(time_now() - start)*1000,
-			parent_not_found * 100.0 / (h_counts.lookups + 1),
-			parent_leaf * 100.0 / (h_counts.lookups + 1),
-			node_not_found * 100.0 / (h_counts.lookups + 1));
-	if (DEBUG_MODE) h_counts.occupied = 0;
+			h->count, 1 << h->hbits, h->count * 100.0 / (1 << h->hbits),
+			h->lookups, h->inserts, h->full,
+			h->probes[0] * 100.0 / (probes + 1), h->probes[1] * 100.0 / (probes + 1),
+			h->probes[2] * 100.0 / (probes + 1), h->probes[3] * 100.0 / (probes + 1),
+			h->probes[4] * 100.0 / (probes + 1), h->probes[5] * 100.0 / (probes + 1),
+			h->probes[6] * 100.0 / (probes + 1), h->probes[7] * 100.0 / (probes + 1),
+			parent_not_found * 100.0 / (h->lookups + 1),
+			parent_leaf * 100.0 / (h->lookups + 1),
+			node_not_found * 100.0 / (h->lookups + 1));
+	}
+	h->lookups = h->inserts = h->full = 0;
+	memset(h->probes, 0, sizeof(h->probes));
+	h->count = 0;
+	/* Clear the table only when the generation wraps around. */
+	if (++h->generation == HTABLE_BUSY) {
+		memset(h->table, 0, (1 << h->hbits) * sizeof(h->table[0]));
+		h->generation = 1;
+	}
 }
 
 /* Find a node given its coord path from root. Insert it in the
@@ -101,26 +256,22 @@ tree_find_node(struct tree *t, struct incr_stats *is, struct tree_node *prev)
 	/* pass and resign must never be inserted in the hash table. */
 	assert(path > 0);
 
-	int hash, parent_hash;
-	bool found;
-	find_hash(hash, t->htable, t->hbits, path, found, h_counts);
-	struct tree_hash *hnode = &t->htable[hash];
+	struct tree_hash *hnode = htable_find(t->htable, path);
 
 	if (DEBUGVV(7))
 		fprintf(stderr,
-			"find_node %"PRIpath" %s found %d hash %d playouts %d node %p\n", path,
-			path2sstr(path, t->board), found, hash, is->incr.playouts, hnode->node);
+			"find_node %"PRIpath" %s found %d playouts %d node %p\n", path,
+			path2sstr(path, t->board), !!hnode, is->incr.playouts, hnode ? hnode->node : NULL);
 
-	if (found) return hnode->node;
+	if (hnode) return hnode->node;
 
 	/* The master sends parents before children so the parent should
 	 * already be in the hash table. */
 	path_t parent_p = parent_path(path, t->board);
 	struct tree_node *parent;
 	if (parent_p) {
-		find_hash(parent_hash, t->htable, t->hbits,
-			  parent_p, found, h_counts);
-		parent = t->htable[parent_hash].node;
+		struct tree_hash *parent_hnode = htable_find(t->htable, parent_p);
+		parent = parent_hnode ? parent_hnode->node : NULL;
 	} else {
 		parent = t->root;
 	}
@@ -139,16 +290,14 @@ tree_find_node(struct tree *t, struct incr_stats *is, struct tree_node *prev)
 				path, path2sstr(path, t->board));
 	}
 
-	/* Insert the node in the hash table. */
-	hnode->node = node;
-	if (DEBUG_MODE) h_counts.inserts++, h_counts.occupied++;
+	/* Insert the node in the hash table. If the table is full,
+	 * the node is just looked up again next time. */
+	htable_insert(t->htable, path, node);
 	if (DEBUGVV(7))
-		fprintf(stderr, "insert path %"PRIpath" %s hash %d playouts %d node %p\n",
-			path, path2sstr(path, t->board), hash, is->incr.playouts, node);
+		fprintf(stderr, "insert path %"PRIpath" %s playouts %d node %p\n",
+			path, path2sstr(path, t->board), is->incr.playouts, node);
 
 	if (DEBUG_MODE && !node) node_not_found++;
-
-	hnode->coord_path = path;
 	return node;
 }
 
@@ -201,47 +350,77 @@ uct_notify(struct engine *e, struct board *b, int id, char *cmd, char *args, cha
 }
 
 
+/* Grow a static buffer to hold at least size bytes. */
+static void *
+grow_buf(void **buf, int *buf_size, int size)
+{
+	if (size > *buf_size) {
+		free(*buf);
+		*buf = malloc2(size);
+		*buf_size = size;
+	}
+	return *buf;
+}
+
 /* Read the move stats sent by the master, as a binary array of
- * incr_stats structs. The stats come sorted by increasing coord path.
- * To simplify the code, we assume that master and slave have the same
+ * incr_stats structs or in the compact wire format of the given
+ * version. The stats come sorted by increasing coord path.
+ * For the raw array we assume that master and slave have the same
  * architecture (store values identically).
  * Keep this code in sync with distributed/merge.c:output_stats()
  * Return true if ok, false if error. */
 static bool
-receive_stats(struct uct *u, int size)
+receive_stats(struct uct *u, int size, int version)
 {
-	if (size % sizeof(struct incr_stats)) return false;
-	int nodes = size / sizeof(struct incr_stats);
-	if (nodes > (1 << u->stats_hbits)) return false;
+	static void *stats_buf = NULL, *wire_buf = NULL, *scratch = NULL;
+	static int stats_buf_size = 0, wire_buf_size = 0, scratch_size = 0;
+
+	int nodes;
+	struct incr_stats *stats;
+	if (version) {
+		void *in = grow_buf(&wire_buf, &wire_buf_size, size);
+		if (fread(in, 1, size, stdin) != (size_t)size) return false;
+		nodes = stats_wire_nodes(in, size);
+		if (nodes < 0 || nodes > (1 << u->stats_hbits)) return false;
+		stats = grow_buf(&stats_buf, &stats_buf_size, nodes * sizeof(*stats));
+		grow_buf(&scratch, &scratch_size, stats_wire_max(nodes));
+		if (stats_decode(in, size, stats, nodes, scratch) != nodes) return false;
+	} else {
+		if (size % sizeof(struct incr_stats)) return false;
+		nodes = size / sizeof(struct incr_stats);
+		if (nodes > (1 << u->stats_hbits)) return false;
+		stats = grow_buf(&stats_buf, &stats_buf_size, size);
+		if (fread(stats, sizeof(*stats), nodes, stdin) != (size_t)nodes)
+			return false;
+	}
 
 	struct tree *t = u->t;
-	assert(nodes && t->htable);
+	assert(t->htable);
+	htable_reserve(t->htable, nodes);
 	struct tree_node *prev = NULL;
 	double start_time = time_now();
 
 	for (int n = 0; n < nodes; n++) {
-		struct incr_stats is;
-		if (fread(&is, sizeof(struct incr_stats), 1, stdin) != 1)
-			return false;
+		struct incr_stats *is = &stats[n];
 
 		if (UDEBUGL(7))
 			fprintf(stderr, "read %5d/%d %6d %.3f %"PRIpath" %s\n", n, nodes,
-				is.incr.playouts, is.incr.value, is.coord_path,
-				path2sstr(is.coord_path, t->board));
+				is->incr.playouts, is->incr.value, is->coord_path,
+				path2sstr(is->coord_path, t->board));
 
-		struct tree_node *node = tree_find_node(t, &is, prev);
+		struct tree_node *node = tree_find_node(t, is, prev);
 		if (!node) continue;
 
 		/* node_total += others_incr */
-		stats_add_result(&node->u, is.incr.value, is.incr.playouts);
+		stats_add_result(&node->u, is->incr.value, is->incr.playouts);
 
 		/* last_total += others_incr */
-		stats_add_result(&node->pu, is.incr.value, is.incr.playouts);
+		stats_add_result(&node->pu, is->incr.value, is->incr.playouts);
 
 		prev = node;
 	}
 	if (DEBUGVV(2))
-		fprintf(stderr, "read args for %d nodes in %.4fms\n", nodes,
+		fprintf(stderr, "read args for %d nodes, %d bytes in %.4fms\n", nodes, size,
 			(time_now() - start_time)*1000);
 	return true;
 }
@@ -367,11 +546,14 @@ select_best_stats(struct stats_candidate *stats_queue, int stats_count,
 /* Get incremental stats updates for the distributed engine.
  * Return a binary array of incr_stats structs in coordinate order
  * (increasing levels and increasing coordinates within a level).
+ * If *version is set, encode the stats in this version of the compact
+ * wire format, compressed if compress is set, unless the raw array is
+ * smaller; reset *version to 0 in the latter case.
  * This function is called only by the main thread, but may be
  * called while the tree is updated by the worker threads. Keep this
  * code in sync with distributed/merge.c:merge_new_stats(). */
 static void *
-report_incr_stats(struct uct *u, int *stats_size)
+report_incr_stats(struct uct *u, int *stats_size, int *version, bool compress)
 {
 	double start_time = time_now();
 
@@ -408,19 +590,35 @@ report_incr_stats(struct uct *u, int *stats_size)
 				   max_parent_path(u, b), min_increment, b);
 
 	void *buf = select_best_stats(stats_queue, stats_count, u->shared_nodes, stats_size);
+	int nodes = *stats_size / sizeof(struct incr_stats);
+
+	if (*version && nodes) {
+		static void *wire_buf = NULL, *scratch = NULL;
+		if (!wire_buf) {
+			wire_buf = malloc2(stats_wire_max(u->shared_nodes));
+			scratch = malloc2(stats_wire_max(u->shared_nodes));
+		}
+		int size = stats_encode(buf, nodes, wire_buf, scratch, compress);
+		if (size < *stats_size) {
+			buf = wire_buf;
+			*stats_size = size;
+		} else {
+			*version = 0;
+		}
+	}
 
 	if (DEBUGVV(2))
 		fprintf(stderr,
-			"min_incr %d games %d stats_queue %d/%d sending %d/%d in %.3fms\n",
+			"min_incr %d games %d stats_queue %d/%d sending %d/%d (%d bytes) in %.3fms\n",
 			min_increment, root->u.playouts - root->pu.playouts, stats_count,
-			max_nodes, *stats_size / (int)sizeof(struct incr_stats), u->shared_nodes,
+			max_nodes, nodes, u->shared_nodes, *stats_size,
 			(time_now() - start_time)*1000);
 	root->pu = root->u;
 	return buf;
 }
 
 /* Get stats for the distributed engine. Return a buffer with one
- * line "played_own root_playouts threads keep_looking @size", then
+ * line "played_own root_playouts threads keep_looking @size[:version]", then
  * a list of lines "coord playouts value" with absolute counts for
  * children of the root node (including contributions from other
  * slaves). The last line must not end with \n.
@@ -430,14 +628,15 @@ report_incr_stats(struct uct *u, int *stats_size)
  * code in sync with distributed/distributed.c:select_best_move(). */
 static char *
 report_stats(struct uct *u, struct board *b, coord_t c,
-	     bool keep_looking, int bin_size)
+	     bool keep_looking, int bin_size, int version)
 {
 	static char reply[10240];
 	char *r = reply;
 	char *end = reply + sizeof(reply);
 	struct tree_node *root = u->t->root;
-	r += snprintf(r, end - r, "%d %d %d %d @%d", u->played_own, root->u.playouts,
-		      u->threads, keep_looking, bin_size);
+	r += snprintf(r, end - r, "%d %d %d %d ", u->played_own, root->u.playouts,
+		      u->threads, keep_looking);
+	r += wire_tag(r, end - r, bin_size, version, false);
 	int min_playouts = root->u.playouts / 100;
 	if (min_playouts < GJ_MINGAMES)
 		min_playouts = GJ_MINGAMES;
@@ -480,7 +679,7 @@ report_stats(struct uct *u, struct board *b, coord_t c,
  * returns. It is stopped by receiving a play GTP command, triggering
  * uct_pondering_stop(). */
 /* genmoves gets in the args parameter
- * "played_games nodes main_time byoyomi_time byoyomi_periods byoyomi_stones @size"
+ * "played_games nodes main_time byoyomi_time byoyomi_periods byoyomi_stones @size[:version]"
  * and reads a binary array of coord, playouts, value to get stats of other slaves,
  * except possibly for the first call at a given move number.
  * See report_stats() for the description of the return value. */
@@ -518,13 +717,20 @@ uct_genmoves(struct engine *e, struct board *b, struct time_info *ti, enum stone
 	}
 
 	/* Read binary incremental stats if present, otherwise
-	 * wait a bit to populate the statistics. */
-	int size = 0;
-	char *sizep = strchr(args, '@');
-	if (sizep) size = atoi(sizep+1);
+	 * wait a bit to populate the statistics. We reply in the
+	 * wire format of the stats received, skipping stats in
+	 * a format more recent than ours. */
+	int version;
+	bool compress;
+	int size = wire_size(args, &version, &compress);
+	if (version > STATS_WIRE_VERSION) {
+		discard_bin_args(args);
+		version = 0;
+		size = 0;
+	}
 	if (!size) {
 		time_sleep(u->stats_delay);
-	} else if (!receive_stats(u, size)) {
+	} else if (!receive_stats(u, size, version)) {
 		return NULL;
 	}
 
@@ -546,9 +752,9 @@ uct_genmoves(struct engine *e, struct board *b, struct time_info *ti, enum stone
 		if (best_coord > 0) best_coord = 0; 
 
 		if (u->shared_levels) {
-			*stats_buf = report_incr_stats(u, stats_size);
+			*stats_buf = report_incr_stats(u, stats_size, &version, compress);
 		}
 	}
-	char *reply = report_stats(u, b, best_coord, keep_looking, *stats_size);
+	char *reply = report_stats(u, b, best_coord, keep_looking, *stats_size, version);
 	return reply;
 }
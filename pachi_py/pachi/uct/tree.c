@@ -5,12 +5,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #define DEBUG
 #include "board.h"
 #include "debug.h"
 #include "engine.h"
 #include "move.h"
+#include "numa.h"
 #include "playout.h"
 #include "tactics/util.h"
 #include "timeinfo.h"
@@ -20,6 +25,25 @@
 #include "uct/slave.h"
 
 
+/* Take nsize bytes of the fast_alloc buffer, from the slice of the
+ * calling thread's node if the buffer is partitioned. */
+static void *
+tree_alloc_fast(struct tree *t, unsigned long old_size, size_t nsize)
+{
+	if (!t->slices)
+		return t->nodes + old_size;
+	/* Our slice may be full while others still have room. */
+	int node = numa_thread_node();
+	for (int i = 0; i < t->slices; i++) {
+		int s = (node + i) % t->slices;
+		if (t->slice_used[s] + nsize > t->slice_size) continue;
+		unsigned long used = __sync_fetch_and_add(&t->slice_used[s], nsize);
+		if (used + nsize <= t->slice_size)
+			return t->nodes + s * t->slice_size + used;
+	}
+	return NULL;
+}
+
 /* Allocate tree node(s). The returned nodes are initialized with zeroes.
  * Returns NULL if not enough memory.
  * This function may be called by multiple threads in parallel. */
@@ -34,7 +58,8 @@ tree_alloc_node(struct tree *t, int count, bool fast_alloc)
 		if (old_size + nsize > t->max_tree_size)
 			return NULL;
 		assert(t->nodes != NULL);
-		n = (struct tree_node *)(t->nodes + old_size);
+		n = tree_alloc_fast(t, old_size, nsize);
+		if (!n) return NULL;
 		memset(n, 0, nsize);
 	} else {
 		n = calloc2(count, sizeof(*n));
@@ -71,22 +96,191 @@ tree_init_node(struct tree *t, coord_t coord, int depth, bool fast_alloc)
 	return n;
 }
 
+/* Size of transparent huge pages; 2 MiB with 4 KiB base pages. */
+#define THP_SIZE (2UL << 20)
+
+#ifndef _WIN32
+static unsigned long
+round_up(unsigned long size, unsigned long page)
+{
+	return (size + page - 1) / page * page;
+}
+
+/* Map the buffer with hugetlbfs pages of 1 << shift bytes. These must
+ * be reserved by the administrator (vm.nr_hugepages), mmap() fails
+ * if there are not enough of them. */
+static bool
+tree_map_hugetlb(struct tree *t, int shift)
+{
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+	unsigned long page = 1UL << shift;
+	unsigned long size = round_up(t->max_tree_size, page);
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+	if (p == MAP_FAILED) return false;
+	t->nodes = p;
+	t->mapped_size = size;
+	t->page_size = page;
+	return true;
+#else
+	return false;
+#endif
+}
+
+/* Map the buffer aligned on THP_SIZE and ask for transparent huge pages,
+ * which the kernel gives when it can (transparent_hugepage must be
+ * "always" or "madvise"). */
+static bool
+tree_map_thp(struct tree *t)
+{
+#ifdef MADV_HUGEPAGE
+	unsigned long size = round_up(t->max_tree_size, THP_SIZE);
+	char *p = mmap(NULL, size + THP_SIZE, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return false;
+	char *start = (char *)round_up((unsigned long)p, THP_SIZE);
+	if (start > p) munmap(p, start - p);
+	munmap(start + size, p + THP_SIZE - start);
+	t->nodes = start;
+	t->mapped_size = size;
+	if (!madvise(start, size, MADV_HUGEPAGE))
+		t->page_size = THP_SIZE;
+	return true;
+#else
+	return false;
+#endif
+}
+#endif
+
+/* Allocate the fast_alloc nodes buffer, with huge pages if asked for,
+ * and set its NUMA placement. The buffer is mapped directly so that no
+ * page is touched before its policy is set. */
+static void
+tree_alloc_buffer(struct tree *t, enum tree_numa numa, enum tree_hugepages huge)
+{
+#ifdef _WIN32
+	t->nodes = malloc2(t->max_tree_size);
+	t->mapped_size = t->max_tree_size;
+	t->page_size = 4096;
+#else
+	unsigned long base_page = sysconf(_SC_PAGESIZE);
+	t->page_size = base_page;
+	/* Fall back from hugetlbfs pages to transparent huge pages
+	 * to base pages. */
+	bool mapped = false;
+	if (huge == TREE_HUGEPAGES_1G || huge == TREE_HUGEPAGES_2M) {
+		mapped = tree_map_hugetlb(t, huge == TREE_HUGEPAGES_1G ? 30 : 21);
+		if (!mapped && DEBUGL(2))
+			fprintf(stderr, "tree_init: no %s hugetlbfs pages, trying transparent huge pages\n",
+				huge == TREE_HUGEPAGES_1G ? "1G" : "2M");
+	}
+	if (!mapped && huge != TREE_HUGEPAGES_NONE) {
+		mapped = tree_map_thp(t);
+		if (mapped && t->page_size == base_page && DEBUGL(2))
+			fprintf(stderr, "tree_init: transparent huge pages not available\n");
+	}
+	if (!mapped) {
+		t->mapped_size = t->max_tree_size;
+		t->nodes = mmap(NULL, t->mapped_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (t->nodes == MAP_FAILED) {
+			fprintf(stderr, "tree_init: OUT OF MEMORY mmap(%lu)\n", t->max_tree_size);
+			exit(1);
+		}
+	}
+#endif
+	/* The nodes buffer doesn't need initialization. This is currently
+	 * done by tree_init_node to spread the load. Doing a memset for the
+	 * entire buffer here would be too slow for large trees (>10 GB). */
+
+	int nodes = numa_node_count();
+	/* Slices are made of whole (huge) pages. */
+	unsigned long slice_size = t->mapped_size / nodes / t->page_size * t->page_size;
+	if (numa == TREE_NUMA_INTERLEAVE && !numa_interleave(t->nodes, t->mapped_size)) {
+		if (DEBUGL(2) && nodes > 1)
+			fprintf(stderr, "tree_init: cannot interleave nodes buffer\n");
+	} else if (numa == TREE_NUMA_PARTITION && nodes > 1 && slice_size > 0) {
+		t->slices = nodes;
+		t->slice_size = slice_size;
+		t->slice_used = calloc2(nodes, sizeof(*t->slice_used));
+		for (int i = 0; i < nodes; i++)
+			if (!numa_prefer(t->nodes + i * t->slice_size, t->slice_size, i) && DEBUGL(2))
+				fprintf(stderr, "tree_init: cannot place slice %d of nodes buffer\n", i);
+	}
+}
+
+static void
+tree_free_buffer(struct tree *t)
+{
+#ifdef _WIN32
+	free(t->nodes);
+#else
+	munmap(t->nodes, t->mapped_size);
+#endif
+	free((void *)t->slice_used);
+}
+
+void
+tree_mem_stats(struct tree *t, struct tree_mem_stats *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->used = t->nodes_size;
+	s->page_size = t->page_size;
+	if (!t->nodes) return;
+	s->resident = s->used < t->mapped_size ? s->used : t->mapped_size;
+	if (t->page_size > 4096) s->huge = s->resident;
+
+#ifdef __linux__
+	/* Ask the kernel what really backs the buffer: transparent huge
+	 * pages are only given when available, and hugetlbfs pages are
+	 * accounted separately from the Rss. */
+	FILE *f = fopen("/proc/self/smaps", "r");
+	if (f) {
+		char line[256];
+		bool found = false;
+		unsigned long rss = 0, huge = 0;
+		while (fgets(line, sizeof(line), f)) {
+			unsigned long start, end, kb;
+			char field[64];
+			if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+				/* Header line of the next mapping. */
+				if (found) break;
+				found = start <= (unsigned long)t->nodes && (unsigned long)t->nodes < end;
+			} else if (found && sscanf(line, "%63s %lu kB", field, &kb) == 2) {
+				if (!strcmp(field, "Rss:"))
+					rss += kb * 1024;
+				else if (!strcmp(field, "AnonHugePages:") || !strcmp(field, "Private_Hugetlb:"))
+					huge += kb * 1024;
+				if (!strcmp(field, "Private_Hugetlb:"))
+					rss += kb * 1024;
+			}
+		}
+		fclose(f);
+		if (found) {
+			/* The mapping may have been merged with neighbours. */
+			s->resident = rss < t->mapped_size ? rss : t->mapped_size;
+			s->huge = huge < s->resident ? huge : s->resident;
+		}
+	}
+#endif
+	unsigned long huge_page = t->page_size > 4096 ? t->page_size : THP_SIZE;
+	s->tlb_pages = (s->huge + huge_page - 1) / huge_page
+		+ (s->resident - s->huge + 4095) / 4096;
+}
+
 /* Create a tree structure. Pre-allocate all nodes if max_tree_size is > 0. */
 struct tree *
 tree_init(struct board *board, enum stone color, unsigned long max_tree_size,
-	  unsigned long max_pruned_size, unsigned long pruning_threshold, floating_t ltree_aging, int hbits)
+	  unsigned long max_pruned_size, unsigned long pruning_threshold, floating_t ltree_aging, int hbits,
+	  enum tree_numa numa, enum tree_hugepages huge)
 {
 	struct tree *t = calloc2(1, sizeof(*t));
 	t->board = board;
 	t->max_tree_size = max_tree_size;
 	t->max_pruned_size = max_pruned_size;
 	t->pruning_threshold = pruning_threshold;
-	if (max_tree_size != 0) {
-		t->nodes = malloc2(max_tree_size);
-		/* The nodes buffer doesn't need initialization. This is currently
-		 * done by tree_init_node to spread the load. Doing a memset for the
-		 * entire buffer here would be too slow for large trees (>10 GB). */
-	}
+	if (max_tree_size != 0)
+		tree_alloc_buffer(t, numa, huge);
 	/* The root PASS move is only virtual, we never play it. */
 	t->root = tree_init_node(t, pass, 0, t->nodes);
 	t->root_symmetry = board->symmetry;
@@ -96,7 +290,6 @@ tree_init(struct board *board, enum stone color, unsigned long max_tree_size,
 	t->ltree_white = tree_init_node(t, pass, 0, false);
 	t->ltree_aging = ltree_aging;
 
-	t->hbits = hbits;
 	if (hbits) t->htable = uct_htable_alloc(hbits);
 	return t;
 }
@@ -170,9 +363,9 @@ tree_done(struct tree *t)
 	tree_done_node(t, t->ltree_black);
 	tree_done_node(t, t->ltree_white);
 
-	if (t->htable) free(t->htable);
+	if (t->htable) uct_htable_done(t->htable);
 	if (t->nodes) {
-		free(t->nodes);
+		tree_free_buffer(t);
 		free(t);
 	} else if (!tree_done_node(t, t->root)) {
 		free(t);
@@ -249,47 +442,248 @@ tree_book_name(struct board *b)
 	return buf;
 }
 
+/* Opening tbook file format. The tree is stored as a flat array of
+ * fixed-size records in native byte order, following a header. The
+ * children of each node are consecutive records and are referenced by
+ * index, so the file is position-independent and can be mapped
+ * directly; the page cache then shares it between all the processes
+ * loading it. Bump TBOOK_VERSION on any change of the records. */
+
+#define TBOOK_MAGIC "PACHITBK"
+#define TBOOK_VERSION 1
+#define TBOOK_BYTE_ORDER 0x01020304
+
+struct tbook_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t header_size;
+	uint32_t record_size;
+	uint32_t board_size;
+	uint32_t handicap;
+	float komi;
+	uint32_t reserved;
+	uint64_t nodes; // number of records, the root is record 0
+};
+
+struct tbook_stats {
+	float value;
+	int32_t playouts;
+};
+
+struct tbook_node {
+	struct tbook_stats u, prior, amaf, winner_owner, black_owner;
+	uint32_t first_child; // record index, 0 if no children were saved
+	uint16_t children;
+	int16_t coord;
+	uint16_t depth;
+	uint8_t d;
+	uint8_t hints;
+};
+
 static void
-tree_node_save(FILE *f, struct tree_node *node, int thres)
+tbook_stats_save(struct tbook_stats *r, struct move_stats *s)
 {
-	bool save_children = node->u.playouts >= thres;
-
-	if (!save_children)
-		node->is_expanded = 0;
+	r->value = s->value;
+	r->playouts = s->playouts;
+}
 
-	fputc(1, f);
-	fwrite(((void *) node) + offsetof(struct tree_node, u),
-	       sizeof(struct tree_node) - offsetof(struct tree_node, u),
-	       1, f);
+static void
+tbook_stats_load(struct move_stats *s, struct tbook_stats *r)
+{
+	/* Keep values in sane scale, otherwise we start overflowing. */
+#define MAX_PLAYOUTS	10000000
+	s->value = r->value;
+	s->playouts = r->playouts > MAX_PLAYOUTS ? MAX_PLAYOUTS : r->playouts;
+}
 
-	if (save_children) {
+/* Count the records needed to save the subtree of node. Children
+ * are saved only for nodes with at least thres playouts. */
+static uint64_t
+tbook_count(struct tree_node *node, int thres)
+{
+	uint64_t count = 1;
+	if (node->u.playouts >= thres)
 		for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
-			tree_node_save(f, ni, thres);
-	} else {
-		if (node->children)
-			node->is_expanded = 1;
-	}
+			count += tbook_count(ni, thres);
+	return count;
+}
+
+/* Fill record i with node, and the records of its subtree from
+ * *next on. */
+static void
+tbook_fill(struct tbook_node *recs, uint64_t *next, uint64_t i, struct tree_node *node, int thres)
+{
+	struct tbook_node *r = &recs[i];
+	tbook_stats_save(&r->u, &node->u);
+	tbook_stats_save(&r->prior, &node->prior);
+	tbook_stats_save(&r->amaf, &node->amaf);
+	tbook_stats_save(&r->winner_owner, &node->winner_owner);
+	tbook_stats_save(&r->black_owner, &node->black_owner);
+	r->coord = node->coord;
+	r->depth = node->depth;
+	r->d = node->d;
+	r->hints = node->hints;
+	if (node->u.playouts < thres || !node->children)
+		return;
 
-	fputc(0, f);
+	int children = 0;
+	for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
+		children++;
+	r->first_child = *next;
+	r->children = children;
+	*next += children;
+	uint64_t j = r->first_child;
+	for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
+		tbook_fill(recs, next, j++, ni, thres);
 }
 
 void
 tree_save(struct tree *tree, struct board *b, int thres)
 {
 	char *filename = tree_book_name(b);
-	FILE *f = fopen(filename, "wb");
+	uint64_t nodes = tbook_count(tree->root, thres);
+	struct tbook_node *recs = calloc2(nodes, sizeof(*recs));
+	uint64_t next = 1;
+	tbook_fill(recs, &next, 0, tree->root, thres);
+	assert(next == nodes);
+
+	struct tbook_header h = {
+		.magic = TBOOK_MAGIC, .version = TBOOK_VERSION, .byte_order = TBOOK_BYTE_ORDER,
+		.header_size = sizeof(h), .record_size = sizeof(*recs),
+		.board_size = real_board_size(b), .handicap = b->handicap, .komi = b->komi,
+		.nodes = nodes,
+	};
+
+	/* Write a new file and rename it over the old one, which
+	 * other processes may have mapped. */
+	char tmpname[300];
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+	FILE *f = fopen(tmpname, "wb");
 	if (!f) {
 		perror("fopen");
+		free(recs);
 		return;
 	}
-	tree_node_save(f, tree->root, thres);
-	fputc(0, f);
-	fclose(f);
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1
+		  && fwrite(recs, sizeof(*recs), nodes, f) == nodes;
+	ok = !fclose(f) && ok;
+	if (!ok || rename(tmpname, filename)) {
+		perror(tmpname);
+		remove(tmpname);
+	}
+	free(recs);
 }
 
 
-void
-tree_node_load(FILE *f, struct tree_node *node, int *num)
+/* Load the children of node from record r. Siblings are allocated
+ * together, as a single block in fast_alloc mode. */
+static void
+tbook_load_children(struct tree *t, struct tree_node *node, struct tbook_node *recs,
+		    struct tbook_node *r, uint64_t nodes, int *num)
+{
+	if (!r->children || r->first_child + r->children > nodes || r->first_child <= r - recs)
+		return; // leaf, or corrupted file
+	struct tree_node *children = NULL;
+	if (t->nodes) {
+		children = tree_alloc_node(t, r->children, true);
+		if (!children) return; // the tree is full, keep node a leaf
+	}
+
+	struct tree_node *prev = NULL;
+	for (int i = 0; i < r->children; i++) {
+		struct tbook_node *rc = &recs[r->first_child + i];
+		struct tree_node *ni = t->nodes ? &children[i] : tree_alloc_node(t, 1, false);
+		tree_setup_node(t, ni, rc->coord, rc->depth);
+		tbook_stats_load(&ni->u, &rc->u);
+		tbook_stats_load(&ni->prior, &rc->prior);
+		tbook_stats_load(&ni->amaf, &rc->amaf);
+		tbook_stats_load(&ni->winner_owner, &rc->winner_owner);
+		tbook_stats_load(&ni->black_owner, &rc->black_owner);
+		ni->pu = ni->u;
+		ni->d = rc->d;
+		ni->hints = rc->hints;
+		ni->parent = node;
+		if (prev) prev->sibling = ni;
+		else node->children = ni;
+		prev = ni;
+		(*num)++;
+		tbook_load_children(t, ni, recs, rc, nodes, num);
+	}
+	node->is_expanded = true;
+}
+
+/* Map the whole file f of given size read-only, or read it
+ * where mmap() is not available. */
+static void *
+tbook_map(FILE *f, size_t size)
+{
+#ifndef _WIN32
+	void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(f), 0);
+	if (p == MAP_FAILED) return NULL;
+	madvise(p, size, MADV_SEQUENTIAL);
+	return p;
+#else
+	void *p = malloc2(size);
+	rewind(f);
+	if (fread(p, size, 1, f) != 1) {
+		free(p);
+		return NULL;
+	}
+	return p;
+#endif
+}
+
+static void
+tbook_unmap(void *p, size_t size)
+{
+#ifndef _WIN32
+	munmap(p, size);
+#else
+	free(p);
+#endif
+}
+
+/* Load a tbook in the format above. Returns the number of nodes
+ * loaded, or -1 if the file is not valid. */
+static int
+tbook_load(struct tree *t, struct board *b, FILE *f)
+{
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	if (size < (long)sizeof(struct tbook_header))
+		return -1;
+	struct tbook_header *h = tbook_map(f, size);
+	if (!h) return -1;
+
+	int num = -1;
+	struct tbook_node *recs = (void *)h + h->header_size;
+	if (h->version != TBOOK_VERSION || h->byte_order != TBOOK_BYTE_ORDER
+	    || h->record_size != sizeof(*recs) || h->header_size < sizeof(*h)) {
+		fprintf(stderr, "tbook: unsupported version %u (record size %u)\n",
+			h->version, h->record_size);
+	} else if (h->board_size != (uint32_t)real_board_size(b) || !h->nodes
+		   || h->header_size + h->nodes * sizeof(*recs) > (uint64_t)size) {
+		fprintf(stderr, "tbook: invalid or truncated file\n");
+	} else {
+		struct tree_node *root = t->root;
+		tbook_stats_load(&root->u, &recs[0].u);
+		tbook_stats_load(&root->prior, &recs[0].prior);
+		tbook_stats_load(&root->amaf, &recs[0].amaf);
+		tbook_stats_load(&root->winner_owner, &recs[0].winner_owner);
+		tbook_stats_load(&root->black_owner, &recs[0].black_owner);
+		root->pu = root->u;
+		num = 1;
+		tbook_load_children(t, root, recs, &recs[0], h->nodes, &num);
+	}
+	tbook_unmap(h, size);
+	return num;
+}
+
+/* Loader of the original tbook format, a recursive dump of the tail
+ * of struct tree_node, which only works with the same build. */
+static void
+tree_node_load_legacy(FILE *f, struct tree_node *node, int *num)
 {
 	(*num)++;
 
@@ -297,8 +691,6 @@ tree_node_load(FILE *f, struct tree_node *node, int *num)
 	      sizeof(struct tree_node) - offsetof(struct tree_node, u),
 	      1, f);
 
-	/* Keep values in sane scale, otherwise we start overflowing. */
-#define MAX_PLAYOUTS	10000000
 	if (node->u.playouts > MAX_PLAYOUTS) {
 		node->u.playouts = MAX_PLAYOUTS;
 	}
@@ -315,7 +707,7 @@ tree_node_load(FILE *f, struct tree_node *node, int *num)
 		else
 			ni_prev->sibling = ni;
 		ni->parent = node;
-		tree_node_load(f, ni, num);
+		tree_node_load_legacy(f, ni, num);
 	}
 }
 
@@ -330,9 +722,16 @@ tree_load(struct tree *tree, struct board *b)
 	fprintf(stderr, "Loading opening tbook %s...\n", filename);
 
 	int num = 0;
-	if (fgetc(f))
-		tree_node_load(f, tree->root, &num);
-	fprintf(stderr, "Loaded %d nodes.\n", num);
+	char magic[sizeof(TBOOK_MAGIC) - 1];
+	if (fread(magic, sizeof(magic), 1, f) == 1 && !memcmp(magic, TBOOK_MAGIC, sizeof(magic))) {
+		num = tbook_load(tree, b, f);
+	} else {
+		rewind(f);
+		if (fgetc(f))
+			tree_node_load_legacy(f, tree->root, &num);
+	}
+	if (num >= 0)
+		fprintf(stderr, "Loaded %d nodes.\n", num);
 
 	fclose(f);
 }
@@ -419,7 +818,8 @@ tree_garbage_collect(struct tree *tree, struct tree_node *node)
 	unsigned long orig_size = tree->nodes_size;
 
 	struct tree *temp_tree = tree_init(tree->board,  tree->root_color,
-					   tree->max_pruned_size, 0, 0, tree->ltree_aging, 0);
+					   tree->max_pruned_size, 0, 0, tree->ltree_aging, 0,
+					   TREE_NUMA_DEFAULT, TREE_HUGEPAGES_NONE);
 	temp_tree->nodes_size = 0; // We do not want the dummy pass node
         struct tree_node *temp_node;
 
@@ -449,6 +849,8 @@ tree_garbage_collect(struct tree *tree, struct tree_node *node)
 
 	/* Now copy back to original tree. */
 	tree->nodes_size = 0;
+	for (int i = 0; i < tree->slices; i++)
+		tree->slice_used[i] = 0;
 	tree->max_depth = 0;
 	struct tree_node *new_node = tree_prune(tree, temp_tree, temp_node, 0, temp_tree->max_depth);
 
@@ -23,7 +23,12 @@
  *   Then the temporary buffer is copied back to the original
  *   buffer, which has now plenty of space.
  *   Once the fast_alloc mode is proven reliable, the
- *   calloc/free method will be removed. */
+ *   calloc/free method will be removed.
+ *
+ * On NUMA machines the fast_alloc buffer can have its pages interleaved
+ * over all nodes, or be partitioned in one slice per node with each
+ * thread allocating in the slice of its own node (see enum tree_numa).
+ * It can also be backed by huge pages (see enum tree_hugepages). */
 
 #include <stdbool.h>
 #include <pthread.h>
@@ -58,7 +63,7 @@ struct tree_node {
 	hash_t hash;
 	struct tree_node *parent, *sibling, *children;
 
-	/*** From here on, struct is saved/loaded from opening tbook */
+	/*** From here on, struct was saved/loaded from legacy opening tbooks */
 
 	struct move_stats u;
 	struct move_stats prior;
@@ -97,7 +102,32 @@ struct tree_node {
 	bool is_expanded;
 };
 
-struct tree_hash;
+struct tree_htable;
+
+/* Placement of the fast_alloc nodes buffer on NUMA machines. */
+enum tree_numa {
+	TREE_NUMA_DEFAULT, /* First touch by the allocating thread. */
+	TREE_NUMA_INTERLEAVE, /* Pages spread round-robin over all nodes. */
+	TREE_NUMA_PARTITION, /* One slice per node, threads allocate locally. */
+};
+
+/* Pages backing the fast_alloc nodes buffer. Huge pages cut the TLB
+ * misses of the random accesses of tree descent in large trees. */
+enum tree_hugepages {
+	TREE_HUGEPAGES_NONE,
+	TREE_HUGEPAGES_THP, /* Transparent huge pages, madvise(MADV_HUGEPAGE). */
+	TREE_HUGEPAGES_2M, /* hugetlbfs pages, falling back to THP. */
+	TREE_HUGEPAGES_1G,
+};
+
+/* Memory layout of the nodes buffer, to judge its TLB friendliness. */
+struct tree_mem_stats {
+	unsigned long used; // byte size of allocated nodes
+	unsigned long resident; // bytes of the buffer backed by memory
+	unsigned long huge; // of which in huge pages
+	unsigned long page_size; // page size asked for
+	unsigned long tlb_pages; // pages (TLB entries) covering resident bytes
+};
 
 struct tree {
 	struct board *board;
@@ -136,9 +166,8 @@ struct tree {
 	floating_t ltree_aging;
 
 	/* Hash table used when working as slave for the distributed engine.
-	 * Maps coordinate path to tree node. */
-	struct tree_hash *htable;
-	int hbits;
+	 * Maps coordinate path to tree node, see uct/slave.c. */
+	struct tree_htable *htable;
 
 	// Statistics
 	int max_depth;
@@ -147,12 +176,22 @@ struct tree {
 	unsigned long max_pruned_size;
 	unsigned long pruning_threshold;
 	void *nodes; // nodes buffer, only for fast_alloc
+	unsigned long mapped_size; // byte size of the nodes buffer mapping
+	unsigned long page_size; // (huge) page size of the nodes buffer
+	/* TREE_NUMA_PARTITION: the nodes buffer is split in slices,
+	 * slice_used[i] is the byte size allocated in slice i. */
+	int slices;
+	unsigned long slice_size;
+	volatile unsigned long *slice_used;
 };
 
 /* Warning: all functions below except tree_expand_node & tree_leaf_node are THREAD-UNSAFE! */
 struct tree *tree_init(struct board *board, enum stone color, unsigned long max_tree_size,
-		       unsigned long max_pruned_size, unsigned long pruning_threshold, floating_t ltree_aging, int hbits);
+		       unsigned long max_pruned_size, unsigned long pruning_threshold, floating_t ltree_aging, int hbits,
+		       enum tree_numa numa, enum tree_hugepages huge);
 void tree_done(struct tree *tree);
+/* Only meaningful for fast_alloc trees; reads /proc on Linux. */
+void tree_mem_stats(struct tree *tree, struct tree_mem_stats *s);
 void tree_dump(struct tree *tree, double thres);
 void tree_save(struct tree *tree, struct board *b, int thres);
 void tree_load(struct tree *tree, struct board *b);
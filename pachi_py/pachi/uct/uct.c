@@ -18,6 +18,7 @@
 #include "playout.h"
 #include "playout/moggy.h"
 #include "playout/light.h"
+#include "tactics/ladder.h"
 #include "tactics/util.h"
 #include "timeinfo.h"
 #include "uct/dynkomi.h"
@@ -42,7 +43,7 @@ static void
 setup_state(struct uct *u, struct board *b, enum stone color)
 {
 	u->t = tree_init(b, color, u->fast_alloc ? u->max_tree_size : 0,
-			 u->max_pruned_size, u->pruning_threshold, u->local_tree_aging, u->stats_hbits);
+			 u->max_pruned_size, u->pruning_threshold, u->local_tree_aging, u->stats_hbits, u->numa_mem, u->hugepages);
 	if (u->initial_extra_komi)
 		u->t->extra_komi = u->initial_extra_komi;
 	if (u->force_seed)
@@ -96,15 +97,33 @@ uct_prepare_move(struct uct *u, struct board *b, enum stone color)
 
 	u->ownermap.playouts = 0;
 	memset(u->ownermap.map, 0, board_size2(b) * sizeof(u->ownermap.map[0]));
+	board_ownermap_shards_clear(&u->ownermap_shards);
 	u->played_own = u->played_all = 0;
 }
 
+struct board_ownermap *
+uct_ownermap(struct uct *u)
+{
+	board_ownermap_shards_merge(&u->ownermap_shards, &u->ownermap);
+	return &u->ownermap;
+}
+
+/* Play single-threaded playouts until the ownermap has enough
+ * of them to judge group status. */
+static void
+uct_ownermap_seed(struct uct *u, struct board *b, enum stone color)
+{
+	struct board_ownermap *ownermap = &u->ownermap_shards.shard[0].ownermap;
+	while (board_ownermap_shards_playouts(&u->ownermap_shards) < GJ_MINGAMES)
+		uct_playout(u, b, color, u->t, ownermap);
+}
+
 static void
 dead_group_list(struct uct *u, struct board *b, struct move_queue *mq)
 {
 	enum gj_state gs_array[board_size2(b)];
 	struct group_judgement gj = { .thres = GJ_THRES, .gs = gs_array };
-	board_ownermap_judge_groups(b, &u->ownermap, &gj);
+	board_ownermap_judge_groups(b, uct_ownermap(u), &gj);
 	groups_of_status(b, &gj, GS_DEAD, mq);
 }
 
@@ -112,8 +131,7 @@ bool
 uct_pass_is_safe(struct uct *u, struct board *b, enum stone color, bool pass_all_alive)
 {
 	/* Make sure enough playouts are simulated to get a reasonable dead group list. */
-	while (u->ownermap.playouts < GJ_MINGAMES)
-		uct_playout(u, b, color, u->t);
+	uct_ownermap_seed(u, b, color);
 
 	struct move_queue mq = { .moves = 0 };
 	dead_group_list(u, b, &mq);
@@ -129,7 +147,7 @@ uct_pass_is_safe(struct uct *u, struct board *b, enum stone color, bool pass_all
 		foreach_point(b) {
 			if (board_at(b, c) == S_OFFBOARD)
 				continue;
-			if (board_ownermap_judge_point(&u->ownermap, c, GJ_THRES) == PJ_UNKNOWN) {
+			if (board_ownermap_judge_point(uct_ownermap(u), c, GJ_THRES) == PJ_UNKNOWN) {
 				if (UDEBUGL(3))
 					fprintf(stderr, "uct_pass_is_safe fails at %s[%d]\n", coord2sstr(c, b), c);
 				return false; // Unclear point, clarify first.
@@ -150,9 +168,10 @@ uct_printhook_ownermap(struct board *board, coord_t c, char *s, char *end)
 	}
 	const char chr[] = ":XO,"; // dame, black, white, unclear
 	const char chm[] = ":xo,";
-	char ch = chr[board_ownermap_judge_point(&u->ownermap, c, GJ_THRES)];
+	struct board_ownermap *ownermap = uct_ownermap(u);
+	char ch = chr[board_ownermap_judge_point(ownermap, c, GJ_THRES)];
 	if (ch == ',') { // less precise estimate then?
-		ch = chm[board_ownermap_judge_point(&u->ownermap, c, 0.67)];
+		ch = chm[board_ownermap_judge_point(ownermap, c, 0.67)];
 	}
 	s += snprintf(s, end - s, "%c ", ch);
 	return s;
@@ -162,7 +181,7 @@ static float
 uct_owner_map(struct engine *e, struct board *b, coord_t c)
 {
 	struct uct *u = b->es;
-	return board_ownermap_estimate_point(&u->ownermap, c);
+	return board_ownermap_estimate_point(uct_ownermap(u), c);
 }
 
 static char *
@@ -278,8 +297,7 @@ uct_dead_group_list(struct engine *e, struct board *b, struct move_queue *mq)
 		mock_state = true;
 	}
 	/* Make sure the ownermap is well-seeded. */
-	while (u->ownermap.playouts < GJ_MINGAMES)
-		uct_playout(u, b, S_BLACK, u->t);
+	uct_ownermap_seed(u, b, S_BLACK);
 	/* Show the ownermap: */
 	if (DEBUGL(2))
 		board_print_custom(b, stderr, uct_printhook_ownermap);
@@ -324,12 +342,14 @@ uct_done(struct engine *e)
 	if (u->t) reset_state(u);
 	if (u->dynkomi) u->dynkomi->done(u->dynkomi);
 	free(u->ownermap.map);
+	board_ownermap_shards_done(&u->ownermap_shards);
 
 	if (u->policy) u->policy->done(u->policy);
 	if (u->random_policy) u->random_policy->done(u->random_policy);
 	playout_policy_done(u->playout);
 	uct_prior_done(u->prior);
 	joseki_done(u->jdict);
+	patterns_done(&u->pat);
 	pluginset_done(u->plugins);
 }
 
@@ -352,10 +372,11 @@ uct_search(struct uct *u, struct board *b, struct time_info *ti, enum stone colo
 	/* Note that in case of TD_GAMES, threads will not wait for
 	 * the uct_search_check_stop() signalization. */
 	while (1) {
-		time_sleep(TREE_BUSYWAIT_INTERVAL);
+		uct_search_sleep(&s, TREE_BUSYWAIT_INTERVAL);
 		/* TREE_BUSYWAIT_INTERVAL should never be less than desired time, or the
 		 * time control is broken. But if it happens to be less, we still search
-		 * at least 100ms otherwise the move is completely random. */
+		 * at least 100ms otherwise the move is completely random. (Unless
+		 * there is a hard deadline, which we poll for specifically.) */
 
 		int i = uct_search_games(&s);
 		/* Print notifications etc. */
@@ -365,6 +386,11 @@ uct_search(struct uct *u, struct board *b, struct time_info *ti, enum stone colo
 			break;
 	}
 
+	/* Count the delay of our wakeup at the deadline stop in the
+	 * teardown, so that its time is reserved as well. */
+	u->search_stopped = time_now();
+	if (s.stop_at && s.stop_at < u->search_stopped)
+		u->search_stopped = s.stop_at;
 	struct uct_thread_ctx *ctx = uct_search_stop();
 	if (UDEBUGL(2)) tree_dump(t, u->dumpthres);
 	if (UDEBUGL(2))
@@ -394,7 +420,7 @@ uct_search(struct uct *u, struct board *b, struct time_info *ti, enum stone colo
 		u->playout->debug_level = u->debug_after.level;
 		uct_halt = false;
 
-		uct_playouts(u, b, color, t, &debug_ti);
+		uct_playouts(u, b, color, t, &debug_ti, 0);
 		tree_dump(t, u->dumpthres);
 
 		uct_halt = true;
@@ -499,6 +525,25 @@ uct_live_gfx_hook(struct engine *e)
 	u->reportfreq = 1000;
 }
 
+/* Print the tree memory and ladder cache stats of the last search. */
+static void
+uct_search_stats_print(struct uct *u)
+{
+	if (!UDEBUGL(3))
+		return;
+	if (u->t->nodes) {
+		struct tree_mem_stats ms;
+		tree_mem_stats(u->t, &ms);
+		fprintf(stderr, "tree memory: %lu MiB used, %lu MiB resident, %lu%% in huge pages (%lu KiB), %lu TLB pages\n",
+			ms.used >> 20, ms.resident >> 20, ms.resident ? ms.huge * 100 / ms.resident : 0,
+			ms.page_size >> 10, ms.tlb_pages);
+	}
+	unsigned long lookups, hits;
+	ladder_cache_stats(&lookups, &hits);
+	if (lookups)
+		fprintf(stderr, "ladder cache: %lu lookups, %lu%% hits\n", lookups, hits * 100 / lookups);
+}
+
 /* Kindof like uct_genmove() but just find the best candidates */
 static void
 uct_best_moves(struct engine *e, struct board *b, enum stone color)
@@ -523,11 +568,33 @@ uct_best_moves(struct engine *e, struct board *b, enum stone color)
 		fprintf(stderr, "genmove in %0.2fs (%d games/s, %d games/s/thread)\n",
 			time, (int)(played_games/time), (int)(played_games/time/u->threads));
 	}
+	uct_search_stats_print(u);
 
 	uct_progress_status(u, u->t, color, played_games, &best_coord);
 	reset_state(u);
 }
 
+/* Update the teardown time estimate from the genmove just finished,
+ * and report how it did against the hard deadline, if any (at debug
+ * level 3, i.e. -d 3: UDEBUGL(n) holds above level n). */
+static void
+uct_genmove_done(struct uct *u, struct time_info *ti, double start_time, double search_start)
+{
+	double now = time_now();
+	double teardown = now - u->search_stopped;
+	/* Follow increases at once but forget them slowly, to keep
+	 * reserving time for occasional slow teardowns (tree pruning). */
+	if (teardown > u->teardown_time)
+		u->teardown_time = teardown;
+	else
+		u->teardown_time = u->teardown_time * 0.98 + teardown * 0.02;
+
+	if (ti->deadline && UDEBUGL(2))
+		fprintf(stderr, "deadline %+0.1fms (setup %0.1fms, search %0.1fms, teardown %0.1fms)\n",
+			(now - ti->deadline) * 1000, (search_start - start_time) * 1000,
+			(u->search_stopped - search_start) * 1000, teardown * 1000);
+}
+
 static coord_t *
 uct_genmove(struct engine *e, struct board *b, struct time_info *ti, enum stone color, bool pass_all_alive)
 {
@@ -548,6 +615,7 @@ uct_genmove(struct engine *e, struct board *b, struct time_info *ti, enum stone
 	uct_genmove_setup(u, b, color);
 
         /* Start the Monte Carlo Tree Search! */
+	double search_start = time_now();
 	int base_playouts = u->t->root->u.playouts;
 	int played_games = uct_search(u, b, ti, color, u->t, false);
 
@@ -560,6 +628,7 @@ uct_genmove(struct engine *e, struct board *b, struct time_info *ti, enum stone
 		fprintf(stderr, "genmove in %0.2fs (%d games/s, %d games/s/thread)\n",
 			time, (int)(played_games/time), (int)(played_games/time/u->threads));
 	}
+	uct_search_stats_print(u);
 
 	uct_progress_status(u, u->t, color, played_games, &best_coord);
 
@@ -568,6 +637,7 @@ uct_genmove(struct engine *e, struct board *b, struct time_info *ti, enum stone
 		if (is_pass(best_coord))
 			u->initial_extra_komi = u->t->extra_komi;
 		reset_state(u);
+		uct_genmove_done(u, ti, start_time, search_start);
 		return coord_copy(best_coord);
 	}
 
@@ -588,6 +658,7 @@ uct_genmove(struct engine *e, struct board *b, struct time_info *ti, enum stone
 	if (u->pondering_opt && u->t && !is_pass(node_coord(best))) {
 		uct_pondering_start(u, b, u->t, stone_other(color));
 	}
+	uct_genmove_done(u, ti, start_time, search_start);
 	return coord_copy(best_coord);
 }
 
@@ -616,7 +687,7 @@ uct_dumptbook(struct engine *e, struct board *b, enum stone color)
 {
 	struct uct *u = e->data;
 	struct tree *t = tree_init(b, color, u->fast_alloc ? u->max_tree_size : 0,
-			 u->max_pruned_size, u->pruning_threshold, u->local_tree_aging, 0);
+			 u->max_pruned_size, u->pruning_threshold, u->local_tree_aging, 0, u->numa_mem, u->hugepages);
 	tree_load(t, b);
 	tree_dump(t, 0);
 	tree_done(t);
@@ -690,8 +761,10 @@ uct_state_init(char *arg, struct board *b)
 	u->threads = 1;
 	u->thread_model = TM_TREEVL;
 	u->virtual_loss = 1;
+	u->teardown_time = DEADLINE_TEARDOWN_DEFAULT;
 
 	u->pondering_opt = true;
+	u->spathash = true;
 
 	u->fuseki_end = 20; // max time at 361*20% = 72 moves (our 36th move, still 99 to play)
 	u->yose_start = 40; // (100-40-25)*361/100/2 = 63 moves still to play by us then
@@ -964,6 +1037,38 @@ uct_state_init(char *arg, struct board *b)
 			} else if (!strcasecmp(optname, "virtual_loss") && optval) {
 				/* Number of virtual losses added before evaluating a node. */
 				u->virtual_loss = atoi(optval);
+			} else if (!strcasecmp(optname, "pin") && optval) {
+				/* Pin the search threads to cpus (one thread
+				 * per cpu) or to NUMA nodes (threads spread
+				 * evenly over the nodes, free to move within
+				 * their node). Default is no pinning. */
+				if (!strcasecmp(optval, "cores")) {
+					u->pin = UCT_PIN_CORES;
+				} else if (!strcasecmp(optval, "nodes")) {
+					u->pin = UCT_PIN_NODES;
+				} else if (!strcasecmp(optval, "none")) {
+					u->pin = UCT_PIN_NONE;
+				} else {
+					fprintf(stderr, "UCT: Invalid pin mode %s\n", optval);
+					exit(1);
+				}
+			} else if (!strcasecmp(optname, "numa_mem") && optval) {
+				/* Placement of the fast_alloc tree on NUMA machines:
+				 * interleave spreads its pages over all nodes,
+				 * partition gives each node its own slice where
+				 * the threads of that node allocate (use with
+				 * pin). Default is pages on the node that touches
+				 * them first. */
+				if (!strcasecmp(optval, "interleave")) {
+					u->numa_mem = TREE_NUMA_INTERLEAVE;
+				} else if (!strcasecmp(optval, "partition")) {
+					u->numa_mem = TREE_NUMA_PARTITION;
+				} else if (!strcasecmp(optval, "default")) {
+					u->numa_mem = TREE_NUMA_DEFAULT;
+				} else {
+					fprintf(stderr, "UCT: Invalid numa_mem mode %s\n", optval);
+					exit(1);
+				}
 			} else if (!strcasecmp(optname, "pondering")) {
 				/* Keep searching even during opponent's turn. */
 				u->pondering_opt = !optval || atoi(optval);
@@ -974,6 +1079,25 @@ uct_state_init(char *arg, struct board *b)
 				u->max_tree_size = atol(optval) * 1048576;
 			} else if (!strcasecmp(optname, "fast_alloc")) {
 				u->fast_alloc = !optval || atoi(optval);
+			} else if (!strcasecmp(optname, "hugepages")) {
+				/* Back the fast_alloc tree with huge pages to
+				 * save TLB misses in large trees: thp (the
+				 * default with no value) asks for transparent
+				 * huge pages, 2M and 1G for hugetlbfs pages
+				 * (vm.nr_hugepages must be set), falling back
+				 * to transparent huge pages. */
+				if (!optval || !strcasecmp(optval, "thp") || !strcmp(optval, "1")) {
+					u->hugepages = TREE_HUGEPAGES_THP;
+				} else if (!strcasecmp(optval, "2M")) {
+					u->hugepages = TREE_HUGEPAGES_2M;
+				} else if (!strcasecmp(optval, "1G")) {
+					u->hugepages = TREE_HUGEPAGES_1G;
+				} else if (!strcmp(optval, "0")) {
+					u->hugepages = TREE_HUGEPAGES_NONE;
+				} else {
+					fprintf(stderr, "UCT: Invalid hugepages mode %s\n", optval);
+					exit(1);
+				}
 			} else if (!strcasecmp(optname, "pruning_threshold") && optval) {
 				/* Force pruning at beginning of a move if the tree consumes
 				 * more than this [MiB]. Default is 10% of max_tree_size.
@@ -1173,6 +1297,12 @@ uct_state_init(char *arg, struct board *b)
 				 * parameters. */
 				patterns_init(&u->pat, optval, false, true);
 				u->want_pat = pat_setup = true;
+			} else if (!strcasecmp(optname, "spathash")) {
+				/* Incrementally maintain spatial pattern hashes
+				 * during tree descent if patterns are loaded
+				 * (see board.h:BOARD_SPATHASH). Default is on;
+				 * this is a switch for comparison. */
+				u->spathash = !optval || atoi(optval);
 			} else if (!strcasecmp(optname, "significant_threshold") && optval) {
 				/* Some heuristics (XXX: none in mainline) rely
 				 * on the knowledge of the last "significant"
@@ -1291,6 +1421,7 @@ uct_state_init(char *arg, struct board *b)
 	dcnn_init();
 
 	u->ownermap.map = malloc2(board_size2(b) * sizeof(u->ownermap.map[0]));
+	board_ownermap_shards_init(&u->ownermap_shards, board_size2(b), u->threads);
 
 	if (u->slave) {
 		if (!u->stats_hbits) u->stats_hbits = DEFAULT_STATS_HBITS;
@@ -263,10 +263,11 @@ uct_progress_json(struct uct *u, struct tree *t, enum stone color, int playouts,
 		 * Normally, white rate is 1000-value; exception are possible
 		 * seki points, but these should be rare. */
 		fprintf(stderr, ", \"territory\": [");
+		struct board_ownermap *ownermap = uct_ownermap(u);
 		f = 0;
 		foreach_point(t->board) {
 			if (board_at(t->board, c) == S_OFFBOARD) continue;
-			int rate = u->ownermap.map[c][S_BLACK] * 1000 / u->ownermap.playouts;
+			int rate = ownermap->map[c][S_BLACK] * 1000 / ownermap->playouts;
 			fprintf(stderr, "%s%d", f++ > 0 ? "," : "", rate);
 		} foreach_point_end;
 		fprintf(stderr, "]");
@@ -349,7 +350,7 @@ uct_leaf_node(struct uct *u, struct board *b, enum stone player_color,
 	      struct uct_descent *descent, int *dlen,
 	      struct tree_node *significant[2],
               struct tree *t, struct tree_node *n, enum stone node_color,
-	      char *spaces)
+	      char *spaces, struct board_ownermap *ownermap)
 {
 	enum stone next_color = stone_other(node_color);
 	int parity = (next_color == player_color ? 1 : -1);
@@ -376,7 +377,7 @@ uct_leaf_node(struct uct *u, struct board *b, enum stone player_color,
 	};
 	int result = play_random_game(&ps, b, next_color,
 	                              u->playout_amaf ? amaf : NULL,
-				      &u->ownermap, u->playout);
+				      ownermap, u->playout);
 	if (next_color == S_WHITE) {
 		/* We need the result from black's perspective. */
 		result = - result;
@@ -519,7 +520,7 @@ record_local_sequence(struct uct *u, struct tree *t, struct board *endb,
 
 
 int
-uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree *t)
+uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree *t, struct board_ownermap *ownermap)
 {
 	struct board b2;
 	board_copy(&b2, b);
@@ -647,6 +648,10 @@ uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree
 	}
 
 	amaf.game_baselen = amaf.gamelen;
+#ifdef BOARD_SPATHASH
+	/* No more pattern matching from here on. */
+	board_spathash_disable(&b2);
+#endif
 
 	if (t->use_extra_komi && u->dynkomi->persim) {
 		b2.komi += round(u->dynkomi->persim(u->dynkomi, &b2, t, n));
@@ -672,12 +677,12 @@ uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree
 		if (UDEBUGL(6))
 			board_print(&b2, stderr);
 
-		board_ownermap_fill(&u->ownermap, &b2);
+		board_ownermap_fill(ownermap, &b2);
 
 	} else { // assert(tree_leaf_node(n));
 		/* In case of parallel tree search, the assertion might
 		 * not hold if two threads chew on the same node. */
-		result = uct_leaf_node(u, &b2, player_color, &amaf, descent, &dlen, significant, t, n, node_color, spaces);
+		result = uct_leaf_node(u, &b2, player_color, &amaf, descent, &dlen, significant, t, n, node_color, spaces, ownermap);
 	}
 
 	if (u->policy->wants_amaf && u->playout_amaf_cutoff) {
@@ -741,15 +746,16 @@ end:
 }
 
 int
-uct_playouts(struct uct *u, struct board *b, enum stone color, struct tree *t, struct time_info *ti)
+uct_playouts(struct uct *u, struct board *b, enum stone color, struct tree *t, struct time_info *ti, int tid)
 {
+	struct board_ownermap *ownermap = &u->ownermap_shards.shard[tid].ownermap;
 	int i;
 	if (ti && ti->dim == TD_GAMES) {
 		for (i = 0; t->root->u.playouts <= ti->len.games && !uct_halt; i++)
-			uct_playout(u, b, color, t);
+			uct_playout(u, b, color, t, ownermap);
 	} else {
 		for (i = 0; !uct_halt; i++)
-			uct_playout(u, b, color, t);
+			uct_playout(u, b, color, t, ownermap);
 	}
 	return i;
 }
@@ -6,10 +6,14 @@
 struct tree;
 struct uct;
 struct board;
+struct board_ownermap;
 
 void uct_progress_status(struct uct *u, struct tree *t, enum stone color, int playouts, coord_t *final);
 
-int uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree *t);
-int uct_playouts(struct uct *u, struct board *b, enum stone color, struct tree *t, struct time_info *ti);
+/* Play a single playout from the tree, collecting the final position
+ * to ownermap (normally the playing thread's shard of u->ownermap). */
+int uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree *t, struct board_ownermap *ownermap);
+/* Play playouts as search thread tid until halted or done. */
+int uct_playouts(struct uct *u, struct board *b, enum stone color, struct tree *t, struct time_info *ti, int tid);
 
 #endif
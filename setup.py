@@ -1,5 +1,6 @@
 from setuptools.command.build_ext import build_ext as _build_ext
 from setuptools import setup, Extension
+import os
 import subprocess
 
 # For building Pachi as a library
@@ -7,6 +8,8 @@ class BuildLibPachi(_build_ext):
     def run(self):
         try:
             subprocess.check_call("cd pachi_py; mkdir -p build && cd build && cmake ../pachi && make -j4", shell=True)
+            # Local distributed slaves are spawned from this binary (see goutil.hpp)
+            subprocess.check_call("cp pachi_py/build/bin/pachi-slave pachi_py/", shell=True)
         except subprocess.CalledProcessError as e:
             print("Could not build pachi-py: %s" % e)
             raise
@@ -15,6 +18,8 @@ class BuildLibPachi(_build_ext):
         import numpy
         self.include_dirs.append(numpy.get_include())
         _build_ext.run(self)
+        if not self.inplace:
+            self.copy_file("pachi_py/pachi-slave", os.path.join(self.build_lib, "pachi_py"))
 
 # Cython recommands checking in the Cython-generated C files
 # (cf. http://stackoverflow.com/a/19138055).
@@ -30,6 +35,9 @@ ext = Extension(
     libraries=["pachi"],
     library_dirs=["pachi_py/build/lib"], # this is the output dir of BuildLibPachi
     extra_compile_args=["-std=c++11"],
+    # exceptions.hpp declares the public exception objects extern "C",
+    # which Cython 3 no longer does by default in C++ mode
+    define_macros=[("CYTHON_EXTERN_C", 'extern "C"')],
 )
 
 setup(name='pachi-py',
@@ -39,6 +47,7 @@ setup(name='pachi-py',
       author='OpenAI',
       author_email='info@openai.com',
       packages=['pachi_py'],
+      package_data={'pachi_py': ['pachi-slave']},
       cmdclass={'build_ext': BuildLibPachi},
       setup_requires=['numpy'],
       install_requires=['numpy'],
@@ -1,3 +1,4 @@
+import pytest
 import pachi_py
 import numpy as np
 
@@ -28,3 +29,103 @@ def test_illegal_move():
     except pachi_py.IllegalMove:
         return
     assert False, 'IllegalMove exception should have been raised'
+
+def test_rate_moves(tmpdir):
+    # Minimal pattern tables: no spatials, border distance only
+    tmpdir.join('patterns.spat').write('')
+    tmpdir.join('patterns.prob').write('0.400 4 10 (border:0)\n0.100 1 10 (border:1)\n')
+    with tmpdir.as_cwd():
+        b = pachi_py.CreateBoard(9)
+        coords, probs = b.rate_moves(pachi_py.BLACK)
+    # 32 first line and 24 second line points
+    assert len(coords) == len(probs) == 32 + 24
+    assert abs(probs.sum() - 1) < 1e-5
+    assert all(b.coord_to_ij(c)[0] in (0, 8) or b.coord_to_ij(c)[1] in (0, 8) for c in coords[:32])
+
+def test_official_score_playouts():
+    # Black owns the left side and white the right side, with a black
+    # stone in atari left inside it: dead, but alive in the position alone.
+    b = pachi_py.CreateBoard(9)
+    for i in range(9):
+        b = b.play(b.ij_to_coord(i, 3), pachi_py.BLACK)
+        b = b.play(b.ij_to_coord(i, 5), pachi_py.WHITE)
+    b = b.play(b.ij_to_coord(4, 7), pachi_py.BLACK)
+    for i, j in [(4, 6), (4, 8), (5, 7)]:
+        b = b.play(b.ij_to_coord(i, j), pachi_py.WHITE)
+    assert b.official_score_mc(playouts=500, threads=2) > b.official_score
+    # The thread count is clamped, not trusted.
+    assert b.official_score_mc(playouts=500, threads=1 << 30) > b.official_score
+
+def test_score_boards():
+    boards = [make_random_board(9) for _ in range(8)]
+    scores = pachi_py.score_boards(boards, official=False, threads=4)
+    assert list(scores) == [np.float32(b.fast_score) for b in boards]
+    scores, owners = pachi_py.score_boards(boards, threads=4, ownership=True)
+    assert list(scores) == [np.float32(b.official_score) for b in boards]
+    assert owners.shape == (8, 9, 9)
+    assert all((owners[k][b.black_stones[:,0], b.black_stones[:,1]] == 1).all() for k, b in enumerate(boards))
+
+def test_ownership():
+    b = make_random_board(9)
+    est = pachi_py.PyOwnershipEstimator(b)
+    est.add_playouts(100, threads=2)
+    est.add_playouts(100)
+    assert est.playouts == 200
+    assert est.counts.shape == (11, 11, 4)
+    assert (est.counts[1:10, 1:10].sum(axis=2) == 200).all()
+    owners = est.ownership()
+    assert owners.shape == (9, 9) and owners.dtype == np.float32
+    assert (abs(owners) <= 1).all()
+    assert not est.counts.flags.writeable
+    with pytest.raises(ValueError):
+        est.ownership(np.empty((9, 8), dtype=np.float32))
+    assert (abs(b.ownership(playouts=50)) <= 1).all()
+
+    b = pachi_py.CreateBoard(9)
+    engine = pachi_py.PyPachiEngine(b, b'uct', b'')
+    engine.genmove(pachi_py.BLACK, b'=1000')
+    owners = engine.ownership()
+    assert owners.shape == (9, 9) and (abs(owners) <= 1).all()
+
+def test_genmove_deadline():
+    import time
+    b = pachi_py.CreateBoard(9)
+    engine = pachi_py.PyPachiEngine(b, b'uct', b'threads=2')
+    c = pachi_py.BLACK
+    # The timing depends on the load of the machine; the bounds are
+    # generous, to catch only a deadline that is not kept at all.
+    budget = 0.2
+    misses = 0
+    for _ in range(3):
+        move = engine.genmove(c, deadline=time.time() + budget)
+        misses += engine.last_overshoot > 0
+        assert engine.last_overshoot < 0.5
+        b.play_inplace(move, c)
+        engine.notify(move, c)
+        c = pachi_py.stone_other(c)
+    assert engine.deadline_misses == misses
+    counts, edges = engine.latency_histogram()
+    assert counts.sum() == 3 and len(edges) == len(counts) + 1
+    assert counts[edges[1:] <= 0.01].sum() == 0
+    assert 0.01 < engine.latency_percentile(99) < budget + 0.5
+    engine.clear_latency()
+    assert engine.latency_histogram()[0].sum() == 0
+
+def test_distributed_local_slaves():
+    import socket
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = str(s.getsockname()[1]).encode()
+    s.close()
+    b = pachi_py.CreateBoard(9)
+    engine = pachi_py.PyPachiEngine(b, b'distributed', b'slave_port=' + port + b',max_slaves=2')
+    slaves = pachi_py.PyLocalSlaves(port, 2, b'threads=1')
+    try:
+        c = pachi_py.BLACK
+        for _ in range(3):
+            move = engine.genmove(c, b'=4000')
+            assert move in b.get_legal_coords(c)
+            b.play_inplace(move, c)
+            c = pachi_py.stone_other(c)
+    finally:
+        slaves.stop()